@@ -0,0 +1,49 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+// Allocates memory that starts on a multiple of alignment, which must be a power of two
+// and a multiple of sizeof(void*). Returns nullptr when out of memory.
+inline void* AlignedAlloc(size_t size, size_t alignment)
+{
+#if defined(_MSC_VER)
+    return _aligned_malloc(size, alignment);
+#else
+    void* memory = nullptr;
+
+    return posix_memalign(&memory, alignment, size) == 0 ? memory : nullptr;
+#endif
+}
+
+inline void AlignedFree(void* memory)
+{
+#if defined(_MSC_VER)
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
@@ -0,0 +1,220 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "ChunkPipeline.h"
+#include <new>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // Up to ChunkCount chunks are read ahead of the chunk that is being processed.
+    const size_t ChunkSize = 64 * 1024;
+    const int ChunkCount = 4;
+
+    struct ChunkRing
+    {
+        std::mutex mutex;
+        std::condition_variable changed;
+        unsigned char* buffers;
+        size_t sizes[ChunkCount];
+        int readIndex;
+        int writeIndex;
+        int filledCount;
+        bool readFailed;
+        bool stopped; // the consumer does not need any more chunks
+    };
+
+    void ConsumeChunks(ChunkRing& ring, const ChunkConsumeProc& consume)
+    {
+        for (;;)
+        {
+            std::unique_lock<std::mutex> lock(ring.mutex);
+            ring.changed.wait(lock, [&ring] { return ring.filledCount > 0 || ring.readFailed; });
+
+            if (ring.filledCount == 0)
+            {
+                break; // the read failed
+            }
+
+            const int index = ring.readIndex;
+            const size_t size = ring.sizes[index];
+
+            lock.unlock();
+
+            const bool more = consume(ring.buffers + (index * ChunkSize), size) && size > 0;
+
+            lock.lock();
+
+            ring.readIndex = (index + 1) % ChunkCount;
+            ring.filledCount--;
+            ring.stopped = !more;
+
+            lock.unlock();
+            ring.changed.notify_all();
+
+            if (!more)
+            {
+                break;
+            }
+        }
+    }
+
+    bool ProduceChunks(ChunkRing& ring, const ChunkReadProc& read)
+    {
+        for (;;)
+        {
+            std::unique_lock<std::mutex> lock(ring.mutex);
+            ring.changed.wait(lock, [&ring] { return ring.filledCount < ChunkCount || ring.stopped; });
+
+            if (ring.stopped)
+            {
+                return true;
+            }
+
+            const int index = ring.writeIndex;
+
+            lock.unlock();
+
+            size_t bytesRead = 0;
+            const bool succeeded = read(ring.buffers + (index * ChunkSize), ChunkSize, &bytesRead);
+
+            lock.lock();
+
+            if (succeeded)
+            {
+                ring.sizes[index] = bytesRead;
+                ring.writeIndex = (index + 1) % ChunkCount;
+                ring.filledCount++;
+            }
+            else
+            {
+                ring.readFailed = true;
+            }
+
+            lock.unlock();
+            ring.changed.notify_all();
+
+            if (!succeeded)
+            {
+                return false;
+            }
+
+            if (bytesRead == 0)
+            {
+                return true;
+            }
+        }
+    }
+
+    bool RunChunksInTurn(unsigned char* buffer, size_t bufferSize, const ChunkReadProc& read, const ChunkConsumeProc& consume)
+    {
+        for (;;)
+        {
+            size_t bytesRead = 0;
+
+            if (!read(buffer, bufferSize, &bytesRead))
+            {
+                return false;
+            }
+
+            if (!consume(buffer, bytesRead) || bytesRead == 0)
+            {
+                return true;
+            }
+        }
+    }
+}
+
+bool RunChunkPipeline(const ChunkReadProc& read, const ChunkConsumeProc& consume)
+{
+    ChunkRing ring;
+    ring.buffers = new (std::nothrow) unsigned char[ChunkSize * ChunkCount];
+    ring.readIndex = 0;
+    ring.writeIndex = 0;
+    ring.filledCount = 0;
+    ring.readFailed = false;
+    ring.stopped = false;
+
+    if (ring.buffers == nullptr)
+    {
+        unsigned char buffer[16 * 1024];
+
+        return RunChunksInTurn(buffer, sizeof(buffer), read, consume);
+    }
+
+    std::thread worker;
+
+    try
+    {
+        worker = std::thread(ConsumeChunks, std::ref(ring), std::cref(consume));
+    }
+    catch (...)
+    {
+        // The chunks are processed on this thread.
+    }
+
+    bool result;
+
+    if (worker.joinable())
+    {
+        result = ProduceChunks(ring, read);
+        worker.join();
+    }
+    else
+    {
+        result = RunChunksInTurn(ring.buffers, ChunkSize, read, consume);
+    }
+
+    delete[] ring.buffers;
+
+    return result;
+}
+
+#ifndef _WIN32
+ChunkReadProc CreateFileDescriptorReadProc(int fd)
+{
+    return [fd](unsigned char* buffer, size_t size, size_t* bytesRead) -> bool
+    {
+        for (;;)
+        {
+            const ssize_t count = read(fd, buffer, size);
+
+            if (count >= 0)
+            {
+                *bytesRead = static_cast<size_t>(count);
+                return true;
+            }
+            else if (errno != EINTR)
+            {
+                *bytesRead = 0;
+                return false;
+            }
+        }
+    };
+}
+#endif
@@ -0,0 +1,47 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <functional>
+
+// Reads up to size bytes into buffer and sets bytesRead to 0 at the end of the data.
+// Returns false when the read fails.
+typedef std::function<bool(unsigned char* buffer, size_t size, size_t* bytesRead)> ChunkReadProc;
+
+// Processes the next chunk of the data, size is 0 at the end of the data.
+// Returns false when no more data is needed.
+typedef std::function<bool(const unsigned char* data, size_t size)> ChunkConsumeProc;
+
+// Reads the data in chunks and passes them to consume in order, with the reads overlapped
+// with the processing of the chunks that were already read.
+// read is called on the calling thread because the data may come from an IStream that must
+// only be used from the caller's apartment, consume is called on a worker thread.
+// The chunks are processed in turn on the calling thread when the worker thread or the
+// buffers cannot be created.
+// Returns false if a read failed, consume is not called for the end of the data in that case.
+bool RunChunkPipeline(const ChunkReadProc& read, const ChunkConsumeProc& consume);
+
+#ifndef _WIN32
+// Returns a ChunkReadProc that reads from a POSIX file descriptor from its current position,
+// the descriptor must stay open while the proc is used.
+ChunkReadProc CreateFileDescriptorReadProc(int fd);
+#endif
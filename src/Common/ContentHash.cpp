@@ -0,0 +1,176 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "ContentHash.h"
+#include <string.h>
+
+namespace
+{
+    const unsigned long long Prime1 = 0x9E3779B185EBCA87ULL;
+    const unsigned long long Prime2 = 0xC2B2AE3D27D4EB4FULL;
+    const unsigned long long Prime3 = 0x165667B19E3779F9ULL;
+    const unsigned long long Prime4 = 0x85EBCA77C2B2AE63ULL;
+    const unsigned long long Prime5 = 0x27D4EB2F165667C5ULL;
+
+    inline unsigned long long RotateLeft(unsigned long long value, int count)
+    {
+        return (value << count) | (value >> (64 - count));
+    }
+
+    // The hash is defined for little-endian data, which is the byte order of every target.
+    inline unsigned long long Read64(const unsigned char* p)
+    {
+        unsigned long long value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline unsigned long long Read32(const unsigned char* p)
+    {
+        unsigned int value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline unsigned long long Round(unsigned long long accumulator, unsigned long long input)
+    {
+        accumulator += input * Prime2;
+        accumulator = RotateLeft(accumulator, 31);
+        return accumulator * Prime1;
+    }
+
+    inline unsigned long long MergeRound(unsigned long long hash, unsigned long long accumulator)
+    {
+        hash ^= Round(0, accumulator);
+        return hash * Prime1 + Prime4;
+    }
+}
+
+unsigned long long HashBytes64(const void* data, size_t size, unsigned long long seed)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    unsigned long long hash;
+
+    if (size >= 32)
+    {
+        const unsigned char* limit = end - 32;
+        unsigned long long v1 = seed + Prime1 + Prime2;
+        unsigned long long v2 = seed + Prime2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - Prime1;
+
+        do
+        {
+            v1 = Round(v1, Read64(p));
+            v2 = Round(v2, Read64(p + 8));
+            v3 = Round(v3, Read64(p + 16));
+            v4 = Round(v4, Read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        hash = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+        hash = MergeRound(hash, v1);
+        hash = MergeRound(hash, v2);
+        hash = MergeRound(hash, v3);
+        hash = MergeRound(hash, v4);
+    }
+    else
+    {
+        hash = seed + Prime5;
+    }
+
+    hash += static_cast<unsigned long long>(size);
+
+    while (end - p >= 8)
+    {
+        hash ^= Round(0, Read64(p));
+        hash = RotateLeft(hash, 27) * Prime1 + Prime4;
+        p += 8;
+    }
+
+    if (end - p >= 4)
+    {
+        hash ^= Read32(p) * Prime1;
+        hash = RotateLeft(hash, 23) * Prime2 + Prime3;
+        p += 4;
+    }
+
+    while (p < end)
+    {
+        hash ^= *p * Prime5;
+        hash = RotateLeft(hash, 11) * Prime1;
+        p++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+ContentHasher::ContentHasher() : hash(0), totalSize(0), bufferedSize(0)
+{
+}
+
+void ContentHasher::Add(const void* data, size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+
+    totalSize += size;
+
+    while (size > 0)
+    {
+        if (bufferedSize == 0 && size >= BlockSize)
+        {
+            hash = HashBytes64(p, BlockSize, hash);
+            p += BlockSize;
+            size -= BlockSize;
+        }
+        else
+        {
+            const size_t count = size < BlockSize - bufferedSize ? size : BlockSize - bufferedSize;
+
+            memcpy(buffer + bufferedSize, p, count);
+            bufferedSize += count;
+            p += count;
+            size -= count;
+
+            if (bufferedSize == BlockSize)
+            {
+                hash = HashBytes64(buffer, BlockSize, hash);
+                bufferedSize = 0;
+            }
+        }
+    }
+}
+
+unsigned long long ContentHasher::GetHash() const
+{
+    return HashBytes64(buffer, bufferedSize, hash ^ totalSize);
+}
+
+unsigned long long ContentHasher::GetSize() const
+{
+    return totalSize;
+}
@@ -0,0 +1,55 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+// A 64-bit hash of a block of memory that is used to find the images that were already
+// decoded, this is XXH64 so it reads 32 bytes per step and it is much faster than the decoders.
+// It is not a cryptographic hash. The hash of a larger block can be computed in parts by
+// passing the previous result as the seed.
+unsigned long long HashBytes64(const void* data, size_t size, unsigned long long seed);
+
+// Hashes data that arrives in pieces, e.g. a file that is read in chunks. The result does not
+// depend on how the data is split because it is hashed in blocks of BlockSize bytes that are
+// chained through the seed.
+class ContentHasher
+{
+public:
+    enum { BlockSize = 4096 };
+
+    ContentHasher();
+
+    void Add(const void* data, size_t size);
+
+    // The hash of all of the data that was added.
+    unsigned long long GetHash() const;
+    unsigned long long GetSize() const;
+
+private:
+    ContentHasher(const ContentHasher&) = delete;
+    ContentHasher& operator=(const ContentHasher&) = delete;
+
+    unsigned long long hash;
+    unsigned long long totalSize;
+    size_t bufferedSize;
+    unsigned char buffer[BlockSize];
+};
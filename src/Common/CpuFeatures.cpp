@@ -0,0 +1,134 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "CpuFeatures.h"
+#include <atomic>
+
+#if FSH_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+struct CpuFeatureSet
+{
+    bool sse2;
+    bool ssse3;
+    bool avx2;
+};
+
+#if FSH_X86
+static void CpuId(int leaf, int subLeaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, leaf, subLeaf);
+
+    for (int i = 0; i < 4; i++)
+    {
+        regs[i] = static_cast<unsigned int>(info[i]);
+    }
+#else
+    __cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long ReadXCR0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+    return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+}
+#endif
+
+static CpuFeatureSet DetectCpuFeatures()
+{
+    CpuFeatureSet features = {};
+
+#if FSH_X86
+    unsigned int regs[4];
+
+    CpuId(0, 0, regs);
+    const unsigned int maxLeaf = regs[0];
+
+    if (maxLeaf >= 1)
+    {
+        CpuId(1, 0, regs);
+
+        features.sse2 = (regs[3] & (1U << 26)) != 0;
+        features.ssse3 = (regs[2] & (1U << 9)) != 0;
+
+        // AVX2 also requires the OS to save the YMM registers on a context switch.
+        const bool osxsave = (regs[2] & (1U << 27)) != 0;
+        const bool avx = (regs[2] & (1U << 28)) != 0;
+
+        if (osxsave && avx && (ReadXCR0() & 6) == 6 && maxLeaf >= 7)
+        {
+            CpuId(7, 0, regs);
+
+            features.avx2 = (regs[1] & (1U << 5)) != 0;
+        }
+    }
+#endif
+
+    return features;
+}
+
+static const CpuFeatureSet& GetCpuFeatureSet()
+{
+    static const CpuFeatureSet features = DetectCpuFeatures();
+
+    return features;
+}
+
+static std::atomic<int> maxFeatureLevel(CpuFeatureLevelAVX2);
+
+static bool IsLevelAllowed(CpuFeatureLevel level)
+{
+    return level <= maxFeatureLevel.load(std::memory_order_relaxed);
+}
+
+bool CpuHasSSE2()
+{
+    return GetCpuFeatureSet().sse2 && IsLevelAllowed(CpuFeatureLevelSSE2);
+}
+
+bool CpuHasSSSE3()
+{
+    return GetCpuFeatureSet().ssse3 && IsLevelAllowed(CpuFeatureLevelSSSE3);
+}
+
+bool CpuHasAVX2()
+{
+    return GetCpuFeatureSet().avx2 && IsLevelAllowed(CpuFeatureLevelAVX2);
+}
+
+void SetCpuFeatureLevel(CpuFeatureLevel maxLevel)
+{
+    maxFeatureLevel.store(maxLevel, std::memory_order_relaxed);
+}
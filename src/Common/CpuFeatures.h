@@ -0,0 +1,58 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define FSH_X86 1
+#else
+#define FSH_X86 0
+#endif
+
+// MSVC allows any intrinsic to be used in any function, GCC and Clang require
+// the functions that use them to be compiled for the matching instruction set.
+#if FSH_X86 && (defined(__GNUC__) || defined(__clang__))
+#define FSH_TARGET_SSE2 __attribute__((target("sse2")))
+#define FSH_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define FSH_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define FSH_TARGET_SSE2
+#define FSH_TARGET_SSSE3
+#define FSH_TARGET_AVX2
+#endif
+
+// These are queried once using CPUID and cached for the lifetime of the process.
+bool CpuHasSSE2();
+bool CpuHasSSSE3();
+bool CpuHasAVX2();
+
+enum CpuFeatureLevel
+{
+    CpuFeatureLevelScalar,
+    CpuFeatureLevelSSE2,
+    CpuFeatureLevelSSSE3,
+    CpuFeatureLevelAVX2
+};
+
+// Limits the instruction sets that the functions above report, so the tests and benchmarks
+// can compare the SIMD kernels with the scalar code. The kernels are selected each time an
+// image is decoded, the limit applies to the images that are decoded after it is set.
+// It is not changed by the shell handlers.
+void SetCpuFeatureLevel(CpuFeatureLevel maxLevel);
@@ -0,0 +1,1036 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+// This code has been adapted from libsquish
+/*
+* Copyright (c) 2006 Simon Brown                          si@sjbrown.co.uk
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to	deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "DXT.h"
+#include "CpuFeatures.h"
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if FSH_X86
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <immintrin.h>
+#endif
+
+static int Unpack565(const unsigned char* packed, ChannelOrder order, unsigned char* colors)
+{
+    int value = packed[0] | (packed[1] << 8);
+
+    int red = (value >> 11) & 0x1f;
+    int green = (value >> 5) & 0x3f;
+    int blue = (value & 0x1f);
+
+    const int redIndex = order == ChannelOrderBGRA ? 2 : 0;
+
+    colors[redIndex] = ((red << 3) | (red >> 2));
+    colors[1] = ((green << 2) | (green >> 4));
+    colors[2 - redIndex] = ((blue << 3) | (blue >> 2));
+    colors[3] = 255;
+
+    return value;
+}
+
+// Builds the 4 entry color table for the block in the requested channel order.
+// This is shared by all of the decoders so that their output is identical.
+static void UnpackColorCodes(const unsigned char* block, bool isDxt1, ChannelOrder order, unsigned char* codes)
+{
+    int a = Unpack565(block, order, codes);
+    int b = Unpack565(block + 2, order, codes + 4);
+
+    // Both sets of midpoints are computed so that the compiler can select between them
+    // without a branch, the endpoint order is effectively random in most textures.
+    const bool fourColor = a > b;
+    const bool transparent = isDxt1 && !fourColor; // dxt1 alpha is a special case
+
+    // unpack the midpoints
+    for (int i = 0; i < 3; i++)
+    {
+        int c = codes[i];
+        int d = codes[4 + i];
+
+        // handle the other mask cases from FSHTool.
+        int half = ((c + d) / 2);
+        int third = ((2 * c + d) / 3);
+        int twoThirds = ((c + 2 * d) / 3);
+
+        codes[8 + i] = fourColor ? third : half;
+        codes[12 + i] = fourColor ? twoThirds : (transparent ? 0 : half);
+    }
+
+    // fill in alpha for the intermediate values
+    codes[8 + 3] = 255;
+    codes[12 + 3] = transparent ? 0 : 255;
+}
+
+static void DecompressColor(unsigned char* rgba, const unsigned char* block, bool isDxt1, ChannelOrder order)
+{
+    unsigned char codes[16];
+
+    UnpackColorCodes(block, isDxt1, order, codes);
+
+    unsigned char indices[16];
+
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned char* index = indices + 4 * i;
+        unsigned char packed = block[4 + i];
+
+        index[0] = (packed & 3);
+        index[1] = ((packed >> 2) & 3);
+        index[2] = ((packed >> 4) & 3);
+        index[3] = ((packed >> 6) & 3);
+    }
+    // store out the colors
+    for (int i = 0; i < 16; i++)
+    {
+        int offset = 4 * indices[i];
+        int index = 4 * i;
+        for (int j = 0; j < 4; j++)
+        {
+            rgba[index + j] = codes[offset + j];
+        }
+    }
+}
+
+static void DecompressDXT3Alpha(unsigned char* rgba, const unsigned char* block)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        unsigned char quant = block[i];
+
+        // extract the values
+        int lo = quant & 0x0f;
+        int hi = quant & 0xf0;
+        int index = 8 * i;
+        // convert back up to unsigned chars
+        rgba[index + 3] = (lo | (lo << 4));
+        rgba[index + 7] = (hi | (hi >> 4));
+    }
+}
+
+static void Decompress(unsigned char* rgba, const unsigned char* block, bool dxt1, ChannelOrder order)
+{
+    const unsigned char* colorBlock = block;
+    const unsigned char* alphaBlock = block;
+
+    if (dxt1)
+    {
+        DecompressColor(rgba, colorBlock, true, order);
+    }
+    else
+    {
+        colorBlock = block + 8;
+        DecompressColor(rgba, colorBlock, false, order);
+        DecompressDXT3Alpha(rgba, alphaBlock);
+    }
+}
+
+// Decodes a block that is clipped by the right or bottom edge of the image.
+static void DecompressPartialBlock(unsigned char* rgba, size_t stride, int width, int height, int x, int y, const unsigned char* block, bool dxt1, ChannelOrder order)
+{
+    unsigned char targetRGBA[4 * 16];
+
+    Decompress(targetRGBA, block, dxt1, order);
+
+    const unsigned char* sourcePixel = targetRGBA;
+
+    for (int py = 0; py < 4; py++)
+    {
+        int sy = y + py;
+
+        for (int px = 0; px < 4; px++)
+        {
+            // get the target location
+            int sx = x + px;
+
+            if (sx < width && sy < height)
+            {
+                unsigned char* targetPixel = rgba + (stride * sy) + (4 * sx);
+
+                for (int p = 0; p < 4; p++)
+                {
+                    *targetPixel++ = *sourcePixel++; // copy the target value
+                }
+            }
+            else
+            {
+                // skip the pixel as its outside the range
+                sourcePixel += 4;
+            }
+        }
+    }
+}
+
+// Decodes a run of horizontally adjacent blocks that are entirely inside the image.
+// The first block is written to the 4 rows starting at rgba.
+typedef void (*DecompressBlocksProc)(unsigned char* rgba, size_t stride, const unsigned char* blocks, int blockCount, bool dxt1, ChannelOrder order);
+
+static void DecompressBlocksScalar(unsigned char* rgba, size_t stride, const unsigned char* blocks, int blockCount, bool dxt1, ChannelOrder order)
+{
+    unsigned char targetRGBA[4 * 16];
+
+    const int bytesPerBlock = dxt1 ? 8 : 16;
+
+    for (int i = 0; i < blockCount; i++)
+    {
+        Decompress(targetRGBA, blocks, dxt1, order);
+
+        for (int py = 0; py < 4; py++)
+        {
+            memcpy(rgba + (stride * py), targetRGBA + (16 * py), 16);
+        }
+
+        rgba += 16;
+        blocks += bytesPerBlock;
+    }
+}
+
+#if FSH_X86
+
+static FSH_TARGET_SSE2 __m128i LoadColorCodes(const unsigned char* colorBlock, bool isDxt1, ChannelOrder order)
+{
+    unsigned char codes[16];
+
+    UnpackColorCodes(colorBlock, isDxt1, order, codes);
+
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes));
+}
+
+// Expands the 4-bit DXT3 alpha values, byte N of the result is the alpha of pixel N.
+static FSH_TARGET_SSE2 __m128i ExpandDXT3Alpha(const unsigned char* alphaBlock)
+{
+    const __m128i nibbleMask = _mm_set1_epi8(0x0f);
+
+    const __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(alphaBlock));
+    const __m128i lo = _mm_and_si128(packed, nibbleMask);
+    const __m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), nibbleMask);
+    const __m128i alpha = _mm_unpacklo_epi8(lo, hi);
+
+    return _mm_or_si128(alpha, _mm_slli_epi16(alpha, 4));
+}
+
+static FSH_TARGET_SSE2 __m128i Select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static FSH_TARGET_SSE2 void DecompressBlocksSSE2(unsigned char* rgba, size_t stride, const unsigned char* blocks, int blockCount, bool dxt1, ChannelOrder order)
+{
+    const int bytesPerBlock = dxt1 ? 8 : 16;
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i two = _mm_set1_epi32(2);
+    const __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+
+    for (int i = 0; i < blockCount; i++)
+    {
+        const unsigned char* colorBlock = dxt1 ? blocks : blocks + 8;
+
+        const __m128i codes = LoadColorCodes(colorBlock, dxt1, order);
+        const __m128i c0 = _mm_shuffle_epi32(codes, 0x00);
+        const __m128i c1 = _mm_shuffle_epi32(codes, 0x55);
+        const __m128i c2 = _mm_shuffle_epi32(codes, 0xaa);
+        const __m128i c3 = _mm_shuffle_epi32(codes, 0xff);
+
+        __m128i rows[4];
+
+        for (int py = 0; py < 4; py++)
+        {
+            const int packed = colorBlock[4 + py];
+            const __m128i indices = _mm_setr_epi32(packed & 3, (packed >> 2) & 3, (packed >> 4) & 3, (packed >> 6) & 3);
+
+            const __m128i bit0 = _mm_cmpeq_epi32(_mm_and_si128(indices, one), one);
+            const __m128i bit1 = _mm_cmpeq_epi32(_mm_and_si128(indices, two), two);
+
+            rows[py] = Select(bit1, Select(bit0, c3, c2), Select(bit0, c1, c0));
+        }
+
+        if (!dxt1)
+        {
+            // Move each alpha value into the high byte of its pixel.
+            const __m128i alpha = ExpandDXT3Alpha(blocks);
+            const __m128i alphaLo = _mm_unpacklo_epi8(zero, alpha);
+            const __m128i alphaHi = _mm_unpackhi_epi8(zero, alpha);
+
+            rows[0] = _mm_or_si128(_mm_and_si128(rows[0], rgbMask), _mm_unpacklo_epi16(zero, alphaLo));
+            rows[1] = _mm_or_si128(_mm_and_si128(rows[1], rgbMask), _mm_unpackhi_epi16(zero, alphaLo));
+            rows[2] = _mm_or_si128(_mm_and_si128(rows[2], rgbMask), _mm_unpacklo_epi16(zero, alphaHi));
+            rows[3] = _mm_or_si128(_mm_and_si128(rows[3], rgbMask), _mm_unpackhi_epi16(zero, alphaHi));
+        }
+
+        for (int py = 0; py < 4; py++)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + (stride * py)), rows[py]);
+        }
+
+        rgba += 16;
+        blocks += bytesPerBlock;
+    }
+}
+
+// The SSSE3 and AVX2 decoders use a byte shuffle to look up the colors of a block row,
+// this table maps each packed row of 4 indices to the matching shuffle control.
+struct ColorShuffleTable
+{
+    unsigned char masks[256][16];
+
+    ColorShuffleTable()
+    {
+        for (int packed = 0; packed < 256; packed++)
+        {
+            for (int px = 0; px < 4; px++)
+            {
+                const int index = (packed >> (2 * px)) & 3;
+
+                for (int p = 0; p < 4; p++)
+                {
+                    masks[packed][(4 * px) + p] = static_cast<unsigned char>((4 * index) + p);
+                }
+            }
+        }
+    }
+};
+
+static const ColorShuffleTable colorShuffleTable;
+
+static FSH_TARGET_SSSE3 __m128i LoadColorShuffle(unsigned char packed)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(colorShuffleTable.masks[packed]));
+}
+
+// Moves the alpha values for block row N into the high byte of each pixel.
+static FSH_TARGET_SSSE3 __m128i GetAlphaShuffle(int row)
+{
+    const char z = static_cast<char>(0x80);
+    const char i = static_cast<char>(4 * row);
+
+    return _mm_setr_epi8(z, z, z, i, z, z, z, i + 1, z, z, z, i + 2, z, z, z, i + 3);
+}
+
+static FSH_TARGET_SSSE3 void DecompressBlocksSSSE3(unsigned char* rgba, size_t stride, const unsigned char* blocks, int blockCount, bool dxt1, ChannelOrder order)
+{
+    const int bytesPerBlock = dxt1 ? 8 : 16;
+
+    const __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+    const __m128i alphaShuffle[4] =
+    {
+        GetAlphaShuffle(0),
+        GetAlphaShuffle(1),
+        GetAlphaShuffle(2),
+        GetAlphaShuffle(3)
+    };
+
+    for (int i = 0; i < blockCount; i++)
+    {
+        const unsigned char* colorBlock = dxt1 ? blocks : blocks + 8;
+
+        const __m128i codes = LoadColorCodes(colorBlock, dxt1, order);
+
+        if (dxt1)
+        {
+            for (int py = 0; py < 4; py++)
+            {
+                const __m128i row = _mm_shuffle_epi8(codes, LoadColorShuffle(colorBlock[4 + py]));
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + (stride * py)), row);
+            }
+        }
+        else
+        {
+            const __m128i alpha = ExpandDXT3Alpha(blocks);
+
+            for (int py = 0; py < 4; py++)
+            {
+                __m128i row = _mm_shuffle_epi8(codes, LoadColorShuffle(colorBlock[4 + py]));
+                row = _mm_or_si128(_mm_and_si128(row, rgbMask), _mm_shuffle_epi8(alpha, alphaShuffle[py]));
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + (stride * py)), row);
+            }
+        }
+
+        rgba += 16;
+        blocks += bytesPerBlock;
+    }
+}
+
+static FSH_TARGET_AVX2 __m256i Combine(__m128i lo, __m128i hi)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+// Decodes 2 blocks per iteration, vpshufb works on each 128-bit lane independently
+// so every lane holds the color table of its own block.
+static FSH_TARGET_AVX2 void DecompressBlocksAVX2(unsigned char* rgba, size_t stride, const unsigned char* blocks, int blockCount, bool dxt1, ChannelOrder order)
+{
+    const int bytesPerBlock = dxt1 ? 8 : 16;
+
+    const __m256i rgbMask = _mm256_set1_epi32(0x00ffffff);
+    const __m256i alphaShuffle[4] =
+    {
+        Combine(GetAlphaShuffle(0), GetAlphaShuffle(0)),
+        Combine(GetAlphaShuffle(1), GetAlphaShuffle(1)),
+        Combine(GetAlphaShuffle(2), GetAlphaShuffle(2)),
+        Combine(GetAlphaShuffle(3), GetAlphaShuffle(3))
+    };
+
+    int i = 0;
+
+    for (; (i + 2) <= blockCount; i += 2)
+    {
+        const unsigned char* first = blocks;
+        const unsigned char* second = blocks + bytesPerBlock;
+        const unsigned char* firstColor = dxt1 ? first : first + 8;
+        const unsigned char* secondColor = dxt1 ? second : second + 8;
+
+        const __m256i codes = Combine(LoadColorCodes(firstColor, dxt1, order), LoadColorCodes(secondColor, dxt1, order));
+
+        if (dxt1)
+        {
+            for (int py = 0; py < 4; py++)
+            {
+                const __m256i shuffle = Combine(LoadColorShuffle(firstColor[4 + py]), LoadColorShuffle(secondColor[4 + py]));
+                const __m256i row = _mm256_shuffle_epi8(codes, shuffle);
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(rgba + (stride * py)), row);
+            }
+        }
+        else
+        {
+            const __m256i alpha = Combine(ExpandDXT3Alpha(first), ExpandDXT3Alpha(second));
+
+            for (int py = 0; py < 4; py++)
+            {
+                const __m256i shuffle = Combine(LoadColorShuffle(firstColor[4 + py]), LoadColorShuffle(secondColor[4 + py]));
+                __m256i row = _mm256_shuffle_epi8(codes, shuffle);
+                row = _mm256_or_si256(_mm256_and_si256(row, rgbMask), _mm256_shuffle_epi8(alpha, alphaShuffle[py]));
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(rgba + (stride * py)), row);
+            }
+        }
+
+        rgba += 32;
+        blocks += 2 * bytesPerBlock;
+    }
+
+    if (i < blockCount)
+    {
+        DecompressBlocksSSSE3(rgba, stride, blocks, blockCount - i, dxt1, order);
+    }
+}
+
+#endif // FSH_X86
+
+// The kernel is selected for each image, so SetCpuFeatureLevel applies to the next one.
+static DecompressBlocksProc GetDecompressBlocksProc()
+{
+#if FSH_X86
+    if (CpuHasAVX2())
+    {
+        return DecompressBlocksAVX2;
+    }
+    else if (CpuHasSSSE3())
+    {
+        return DecompressBlocksSSSE3;
+    }
+    else if (CpuHasSSE2())
+    {
+        return DecompressBlocksSSE2;
+    }
+#endif
+
+    return DecompressBlocksScalar;
+}
+
+
+// The decode parameters shared by the threads that decode an image.
+struct DecodeJob
+{
+    unsigned char* dest;
+    size_t stride;
+    int width;
+    int height;
+    const unsigned char* blocks;
+    bool dxt1;
+    ChannelOrder order;
+    int scaleShift;
+};
+
+// Decodes the block rows in the [firstRow, lastRow) range.
+static void DecompressBlockRows(const DecodeJob& job, int firstRow, int lastRow)
+{
+    const DecompressBlocksProc decompressBlocks = GetDecompressBlocksProc();
+
+    const int width = job.width;
+    const int height = job.height;
+    const int bytesPerBlock = job.dxt1 ? 8 : 16;
+    const int blocksPerRow = (width + 3) / 4;
+    const int wholeBlocksPerRow = width / 4;
+    const size_t stride = job.stride;
+
+    const unsigned char* block = job.blocks + (static_cast<size_t>(firstRow) * blocksPerRow * bytesPerBlock);
+
+    for (int y = firstRow * 4; y < height && y < (lastRow * 4); y += 4)
+    {
+        unsigned char* row = job.dest + (stride * y);
+        int blockX = 0;
+
+        if ((y + 4) <= height)
+        {
+            decompressBlocks(row, stride, block, wholeBlocksPerRow, job.dxt1, job.order);
+
+            block += wholeBlocksPerRow * bytesPerBlock;
+            blockX = wholeBlocksPerRow;
+        }
+
+        // the blocks on the right and bottom edges may only be partially inside the image
+        for (; blockX < blocksPerRow; blockX++)
+        {
+            DecompressPartialBlock(job.dest, stride, width, height, blockX * 4, y, block, job.dxt1, job.order);
+
+            block += bytesPerBlock;
+        }
+    }
+}
+
+// The reduced size decoder works on strips of at most ReducedChunkBlocks blocks,
+// the strip is decoded with the block decoder into a buffer that stays in the L1 cache
+// and each output pixel is the average of the strip pixels that it covers.
+static const int ReducedChunkBlocks = 32;
+static const size_t ReducedStripStride = ReducedChunkBlocks * 16;
+
+static int Min(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+static int GetBlockRowsPerStrip(int scaleShift)
+{
+    return scaleShift > 2 ? 2 : 1;
+}
+
+// Averages the [x0, x1) and [y0, y1) region of the strip, used for the regions that
+// are clipped by the image edges, the cells that are not opaque and on processors without SSE2.
+// The colors are weighted by their alpha as the thumbnail scaler does, so the color of a
+// transparent pixel does not bleed into its neighbors.
+static void AverageRegion(const unsigned char* strip, int x0, int y0, int x1, int y1, unsigned char* rgba)
+{
+    unsigned int colorSums[3] = { 0, 0, 0 };
+    unsigned int alphaSum = 0;
+
+    for (int y = y0; y < y1; y++)
+    {
+        const unsigned char* src = strip + (ReducedStripStride * y) + (4 * x0);
+
+        for (int x = x0; x < x1; x++)
+        {
+            const unsigned int alpha = src[3];
+
+            for (int c = 0; c < 3; c++)
+            {
+                colorSums[c] += src[c] * alpha;
+            }
+
+            alphaSum += alpha;
+            src += 4;
+        }
+    }
+
+    const unsigned int count = (x1 - x0) * (y1 - y0);
+
+    for (int c = 0; c < 3; c++)
+    {
+        rgba[c] = static_cast<unsigned char>(alphaSum > 0 ? (colorSums[c] + (alphaSum / 2)) / alphaSum : 0);
+    }
+
+    rgba[3] = static_cast<unsigned char>((alphaSum + (count / 2)) / count);
+}
+
+static void AverageCellsScalar(const unsigned char* strip, int cellCount, int scaleShift, unsigned char* rgba)
+{
+    const int scale = 1 << scaleShift;
+
+    for (int i = 0; i < cellCount; i++)
+    {
+        AverageRegion(strip, i * scale, 0, (i + 1) * scale, scale, rgba);
+
+        rgba += 4;
+    }
+}
+
+#if FSH_X86
+
+// Averages a row of 2x2, 4x4 or 8x8 cells that start at the top of the strip.
+// The plain average of an opaque cell is the same as the alpha weighted one, the cells that
+// have transparent pixels are passed to AverageRegion.
+static FSH_TARGET_SSE2 void AverageCellsSSE2(const unsigned char* strip, int cellCount, int scaleShift, unsigned char* rgba)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaMask = _mm_set1_epi32(static_cast<int>(0xff000000));
+    const int scale = 1 << scaleShift;
+    const __m128i rounding = _mm_set1_epi16(static_cast<short>((scale * scale) / 2));
+    const __m128i countShift = _mm_cvtsi32_si128(2 * scaleShift);
+
+    int i = 0;
+
+    if (scaleShift == 1)
+    {
+        // 2 cells per iteration
+        for (; (i + 2) <= cellCount; i += 2)
+        {
+            const __m128i row0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(strip));
+            const __m128i row1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(strip + ReducedStripStride));
+            const __m128i opaque = _mm_cmpeq_epi32(_mm_and_si128(_mm_and_si128(row0, row1), alphaMask), alphaMask);
+
+            if (_mm_movemask_epi8(opaque) != 0xffff)
+            {
+                AverageCellsScalar(strip, 2, scaleShift, rgba);
+
+                strip += 16;
+                rgba += 8;
+                continue;
+            }
+
+            __m128i left = _mm_add_epi16(_mm_unpacklo_epi8(row0, zero), _mm_unpacklo_epi8(row1, zero));
+            __m128i right = _mm_add_epi16(_mm_unpackhi_epi8(row0, zero), _mm_unpackhi_epi8(row1, zero));
+            left = _mm_add_epi16(left, _mm_srli_si128(left, 8));
+            right = _mm_add_epi16(right, _mm_srli_si128(right, 8));
+
+            __m128i sum = _mm_unpacklo_epi64(left, right);
+            sum = _mm_srl_epi16(_mm_add_epi16(sum, rounding), countShift);
+
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(rgba), _mm_packus_epi16(sum, sum));
+
+            strip += 16;
+            rgba += 8;
+        }
+    }
+    else
+    {
+        // 1 cell per iteration, each cell is 1 or 2 registers wide
+        const int registersPerRow = scale / 4;
+
+        for (; i < cellCount; i++)
+        {
+            __m128i sum = zero;
+            __m128i alpha = alphaMask;
+
+            for (int y = 0; y < scale; y++)
+            {
+                for (int r = 0; r < registersPerRow; r++)
+                {
+                    const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(strip + (ReducedStripStride * y) + (16 * r)));
+
+                    sum = _mm_add_epi16(sum, _mm_unpacklo_epi8(pixels, zero));
+                    sum = _mm_add_epi16(sum, _mm_unpackhi_epi8(pixels, zero));
+                    alpha = _mm_and_si128(alpha, pixels);
+                }
+            }
+
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alphaMask)) != 0xffff)
+            {
+                AverageRegion(strip, 0, 0, scale, scale, rgba);
+
+                strip += 4 * scale;
+                rgba += 4;
+                continue;
+            }
+
+            sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+            sum = _mm_srl_epi16(_mm_add_epi16(sum, rounding), countShift);
+
+            const int pixel = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+            memcpy(rgba, &pixel, 4);
+
+            strip += 4 * scale;
+            rgba += 4;
+        }
+    }
+
+    AverageCellsScalar(strip, cellCount - i, scaleShift, rgba);
+}
+
+#endif // FSH_X86
+
+typedef void (*AverageCellsProc)(const unsigned char* strip, int cellCount, int scaleShift, unsigned char* rgba);
+
+static AverageCellsProc GetAverageCellsProc()
+{
+#if FSH_X86
+    if (CpuHasSSE2())
+    {
+        return AverageCellsSSE2;
+    }
+#endif
+
+    return AverageCellsScalar;
+}
+
+int GetReducedDecodeShift(int width, int height, int maxEdgeLength)
+{
+    const int longEdge = width > height ? width : height;
+
+    if (maxEdgeLength <= 0 || (maxEdgeLength * 4) > longEdge)
+    {
+        return 0;
+    }
+
+    // Use the largest reduction that is still at least as large as the requested size,
+    // the thumbnail scaler handles the remainder.
+    int scaleShift = 2;
+
+    while (scaleShift < 3 && (longEdge >> (scaleShift + 1)) >= maxEdgeLength)
+    {
+        scaleShift++;
+    }
+
+    return scaleShift;
+}
+
+int GetReducedDecodeSize(int size, int scaleShift)
+{
+    return (size + (1 << scaleShift) - 1) >> scaleShift;
+}
+
+// Decodes the strips in the [firstStrip, lastStrip) range, a strip is 1 block row
+// for the 1/2 and 1/4 sizes and 2 block rows for the 1/8 size.
+static void DecompressReducedStrips(const DecodeJob& job, int firstStrip, int lastStrip)
+{
+    const DecompressBlocksProc decompressBlocks = GetDecompressBlocksProc();
+    const AverageCellsProc averageCells = GetAverageCellsProc();
+
+    const int width = job.width;
+    const int height = job.height;
+    const int scaleShift = job.scaleShift;
+    const int scale = 1 << scaleShift;
+    const int bytesPerBlock = job.dxt1 ? 8 : 16;
+    const int blocksPerRow = (width + 3) / 4;
+    const int blocksPerColumn = (height + 3) / 4;
+    const int blockRowsPerStrip = GetBlockRowsPerStrip(scaleShift);
+    const size_t stride = job.stride;
+
+    // 2 block rows for the 8x8 cells
+    unsigned char strip[8 * ReducedStripStride];
+
+    const int lastBlockRow = Min(lastStrip * blockRowsPerStrip, blocksPerColumn);
+
+    for (int by = firstStrip * blockRowsPerStrip; by < lastBlockRow; by += blockRowsPerStrip)
+    {
+        const int y = by * 4;
+        const int stripBlockRows = Min(blockRowsPerStrip, blocksPerColumn - by);
+        const int stripHeight = Min(stripBlockRows * 4, height - y);
+        const int cellRows = (stripHeight + scale - 1) >> scaleShift;
+
+        for (int bx = 0; bx < blocksPerRow; bx += ReducedChunkBlocks)
+        {
+            const int x = bx * 4;
+            const int chunkBlocks = Min(ReducedChunkBlocks, blocksPerRow - bx);
+            const int chunkWidth = Min(chunkBlocks * 4, width - x);
+
+            // The blocks on the image edges are decoded in full, only the pixels
+            // inside the image are used.
+            for (int r = 0; r < stripBlockRows; r++)
+            {
+                const unsigned char* block = job.blocks + ((static_cast<size_t>(by + r) * blocksPerRow) + bx) * bytesPerBlock;
+
+                decompressBlocks(strip + (ReducedStripStride * 4 * r), ReducedStripStride, block, chunkBlocks, job.dxt1, job.order);
+            }
+
+            const int wholeCells = chunkWidth >> scaleShift;
+            const int cells = (chunkWidth + scale - 1) >> scaleShift;
+
+            for (int cy = 0; cy < cellRows; cy++)
+            {
+                const int y0 = cy * scale;
+                const int y1 = Min(y0 + scale, stripHeight);
+                const unsigned char* stripRow = strip + (ReducedStripStride * y0);
+                unsigned char* dst = job.dest + (stride * ((y >> scaleShift) + cy)) + (4 * (x >> scaleShift));
+
+                if ((y1 - y0) == scale)
+                {
+                    averageCells(stripRow, wholeCells, scaleShift, dst);
+
+                    if (cells > wholeCells)
+                    {
+                        AverageRegion(strip, wholeCells * scale, y0, chunkWidth, y1, dst + (4 * wholeCells));
+                    }
+                }
+                else
+                {
+                    for (int cx = 0; cx < cells; cx++)
+                    {
+                        const int x0 = cx * scale;
+
+                        AverageRegion(strip, x0, y0, Min(x0 + scale, chunkWidth), y1, dst + (4 * cx));
+                    }
+                }
+            }
+        }
+    }
+}
+
+typedef void (*DecodeRowsProc)(const DecodeJob& job, int firstRow, int lastRow);
+
+// Images with fewer pixels than this are decoded on the calling thread, the cost of
+// starting the threads is larger than the time saved for the smaller images.
+static const long long ParallelDecodeMinPixels = 1024 * 1024;
+
+// The most rows that a thread takes from the shared counter at a time, the rows of a strip
+// are handed out in smaller tasks so each thread gets a part of it.
+static const int ParallelDecodeRowsPerTask = 8;
+
+static int GetDecodeThreadCount(int width, int height, int maxThreads)
+{
+    if (maxThreads <= 1 || (static_cast<long long>(width) * height) < ParallelDecodeMinPixels)
+    {
+        return 1;
+    }
+
+    const int blockRows = (height + 3) / 4;
+    int threadCount = Min(maxThreads, (blockRows + ParallelDecodeRowsPerTask - 1) / ParallelDecodeRowsPerTask);
+
+    const unsigned int processorCount = std::thread::hardware_concurrency();
+    if (processorCount > 0)
+    {
+        threadCount = Min(threadCount, static_cast<int>(processorCount));
+    }
+
+    return threadCount;
+}
+
+// The worker threads wait for the generation to change, the job that they run is only
+// written while every worker is waiting.
+struct DxtDecodeThreadState
+{
+    DxtDecodeThreadState() : decodeRows(nullptr), rowCount(0), rowsPerTask(1), nextRow(0), generation(0), busyThreads(0), stopping(false)
+    {
+    }
+
+    std::mutex mutex;
+    std::condition_variable started;
+    std::condition_variable finished;
+    std::vector<std::thread> threads;
+    DecodeRowsProc decodeRows;
+    DecodeJob job;
+    int rowCount;
+    int rowsPerTask;
+    std::atomic<int> nextRow;
+    unsigned int generation;
+    int busyThreads; // the workers that have not finished the current job
+    bool stopping;
+};
+
+// The rows are handed out in small tasks from a shared counter, so a thread that is
+// delayed by the other extractions running in the shell host does not hold up the rest.
+static void DecodeTasks(DxtDecodeThreadState& state)
+{
+    for (;;)
+    {
+        const int firstRow = state.nextRow.fetch_add(state.rowsPerTask, std::memory_order_relaxed);
+        if (firstRow >= state.rowCount)
+        {
+            break;
+        }
+
+        state.decodeRows(state.job, firstRow, Min(firstRow + state.rowsPerTask, state.rowCount));
+    }
+}
+
+static void DecodeWorker(DxtDecodeThreadState& state)
+{
+    unsigned int generation = 0;
+    std::unique_lock<std::mutex> lock(state.mutex);
+
+    for (;;)
+    {
+        state.started.wait(lock, [&]() { return state.stopping || state.generation != generation; });
+
+        if (state.stopping)
+        {
+            return;
+        }
+
+        generation = state.generation;
+        lock.unlock();
+
+        DecodeTasks(state);
+
+        lock.lock();
+        if (--state.busyThreads == 0)
+        {
+            state.finished.notify_one();
+        }
+    }
+}
+
+DxtDecodeThreads::DxtDecodeThreads(int width, int height, int maxThreads) : state(nullptr)
+{
+    const int threadCount = GetDecodeThreadCount(width, height, maxThreads);
+
+    if (threadCount <= 1)
+    {
+        return;
+    }
+
+    state = new (std::nothrow) DxtDecodeThreadState();
+
+    if (state == nullptr)
+    {
+        return;
+    }
+
+    try
+    {
+        state->threads.reserve(threadCount - 1);
+
+        for (int i = 1; i < threadCount; i++)
+        {
+            state->threads.emplace_back(DecodeWorker, std::ref(*state));
+        }
+    }
+    catch (...)
+    {
+        // The threads that could not be started leave their rows to the other threads.
+    }
+
+    if (state->threads.empty())
+    {
+        delete state;
+        state = nullptr;
+    }
+}
+
+DxtDecodeThreads::~DxtDecodeThreads()
+{
+    if (state != nullptr)
+    {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->stopping = true;
+        }
+
+        state->started.notify_all();
+
+        for (size_t i = 0; i < state->threads.size(); i++)
+        {
+            state->threads[i].join();
+        }
+
+        delete state;
+    }
+}
+
+int DxtDecodeThreads::GetThreadCount() const
+{
+    return state != nullptr ? static_cast<int>(state->threads.size()) + 1 : 1;
+}
+
+// Splits the rows between the calling thread and the waiting worker threads, and returns
+// when all of the rows are decoded.
+static void RunDecodeJob(DecodeRowsProc decodeRows, const DecodeJob& job, int rowCount, DxtDecodeThreadState* state)
+{
+    if (state == nullptr || rowCount <= 1)
+    {
+        decodeRows(job, 0, rowCount);
+        return;
+    }
+
+    const int threadCount = static_cast<int>(state->threads.size()) + 1;
+
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        state->decodeRows = decodeRows;
+        state->job = job;
+        state->rowCount = rowCount;
+        state->rowsPerTask = Min(ParallelDecodeRowsPerTask, rowCount > threadCount * 2 ? rowCount / (threadCount * 2) : 1);
+        state->nextRow.store(0, std::memory_order_relaxed);
+        state->busyThreads = threadCount - 1;
+        state->generation++;
+    }
+
+    state->started.notify_all();
+
+    DecodeTasks(*state);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&]() { return state->busyThreads == 0; });
+}
+
+void DecompressImage(unsigned char* dest, size_t stride, int width, int height, const unsigned char* blocks, bool dxt1, ChannelOrder order, int maxThreads)
+{
+    DxtDecodeThreads threads(width, height, maxThreads);
+
+    DecompressImageReduced(dest, stride, width, height, blocks, dxt1, 0, order, &threads);
+}
+
+void DecompressImageReduced(unsigned char* dest, size_t stride, int width, int height, const unsigned char* blocks, bool dxt1, int scaleShift, ChannelOrder order, int maxThreads)
+{
+    DxtDecodeThreads threads(width, height, maxThreads);
+
+    DecompressImageReduced(dest, stride, width, height, blocks, dxt1, scaleShift, order, &threads);
+}
+
+void DecompressImageReduced(unsigned char* dest, size_t stride, int width, int height, const unsigned char* blocks, bool dxt1, int scaleShift, ChannelOrder order, DxtDecodeThreads* threads)
+{
+    DxtDecodeThreadState* state = threads != nullptr ? threads->state : nullptr;
+
+    if (scaleShift <= 0)
+    {
+        const DecodeJob job = { dest, stride, width, height, blocks, dxt1, order, 0 };
+
+        RunDecodeJob(DecompressBlockRows, job, (height + 3) / 4, state);
+        return;
+    }
+
+    const DecodeJob job = { dest, stride, width, height, blocks, dxt1, order, scaleShift };
+    const int blockRowsPerStrip = GetBlockRowsPerStrip(scaleShift);
+    const int strips = (((height + 3) / 4) + blockRowsPerStrip - 1) / blockRowsPerStrip;
+
+    RunDecodeJob(DecompressReducedStrips, job, strips, state);
+}
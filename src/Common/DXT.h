@@ -0,0 +1,76 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+// The order of the color channels in the decoded pixels, alpha is always the last channel.
+enum ChannelOrder
+{
+    ChannelOrderRGBA,
+    ChannelOrderBGRA
+};
+
+struct DxtDecodeThreadState;
+
+// Worker threads that decode the strips of one image. The threads are started once when the
+// image is opened and wait for the next strip, so an image that is decoded in many strips does
+// not start and join threads for each of them.
+class DxtDecodeThreads
+{
+public:
+    // Uses up to maxThreads threads, including the calling thread, for a width by height image.
+    // Images that are smaller than 1024x1024 pixels are decoded on the calling thread, as are all
+    // images when the threads cannot be started.
+    DxtDecodeThreads(int width, int height, int maxThreads);
+    ~DxtDecodeThreads();
+
+    int GetThreadCount() const;
+
+private:
+    DxtDecodeThreads(const DxtDecodeThreads&) = delete;
+    DxtDecodeThreads& operator=(const DxtDecodeThreads&) = delete;
+
+    friend void DecompressImageReduced(unsigned char* dest, size_t stride, int width, int height, const unsigned char* blocks, bool dxt1, int scaleShift, ChannelOrder order, DxtDecodeThreads* threads);
+
+    DxtDecodeThreadState* state;
+};
+
+// The decoders write the pixels to the rows of dest that are stride bytes apart,
+// this allows the image to be decoded directly into a locked bitmap.
+// The decoders split the block rows of images that are 1024x1024 pixels or larger
+// between up to maxThreads threads, the smaller images are decoded on the calling thread.
+void DecompressImage(unsigned char* dest, size_t stride, int width, int height, const unsigned char* blocks, bool dxt1, ChannelOrder order, int maxThreads);
+
+// Returns the power of two reduction (0 to 3) that DecompressImageReduced should use
+// when the image will be shown with a long edge of maxEdgeLength pixels.
+// The image is only reduced when maxEdgeLength is 1/4 of the long edge or smaller.
+int GetReducedDecodeShift(int width, int height, int maxEdgeLength);
+int GetReducedDecodeSize(int size, int scaleShift);
+
+// Decodes the image at 1/2, 1/4 or 1/8 of its original size, each output pixel is the
+// average of the source pixels it covers. The output is GetReducedDecodeSize(width, scaleShift)
+// by GetReducedDecodeSize(height, scaleShift) pixels.
+void DecompressImageReduced(unsigned char* dest, size_t stride, int width, int height, const unsigned char* blocks, bool dxt1, int scaleShift, ChannelOrder order, int maxThreads);
+
+// Decodes the image with the threads of a DxtDecodeThreads, which can be opened for a larger
+// image that is decoded a strip at a time. A scaleShift of 0 decodes the image at its original size.
+void DecompressImageReduced(unsigned char* dest, size_t stride, int width, int height, const unsigned char* blocks, bool dxt1, int scaleShift, ChannelOrder order, DxtDecodeThreads* threads);
@@ -0,0 +1,310 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "FshImageDecoder.h"
+#include "DXT.h"
+#include "FshHeaders.h"
+#include "ImageScaler.h"
+#include "PixelConversion.h"
+#include <string.h>
+#include <new>
+
+static const int PaletteSize = 256;
+
+// The rows of the uncompressed formats that are converted at a time.
+static const int StripRows = 4;
+
+// The decoded size of a DXT strip that is split between threads, the decoder threads write
+// the strip and the scaler reads it back while it is still in the L2 cache.
+static const size_t ParallelStripBytes = 512 * 1024;
+
+bool ReadFshPalette(const unsigned char* entry, size_t entrySize, unsigned int* colors)
+{
+    memset(colors, 0, PaletteSize * sizeof(unsigned int));
+
+    if (entrySize < sizeof(FshEntryHeader))
+    {
+        return false;
+    }
+
+    FshEntryHeader header;
+    memcpy(&header, entry, sizeof(header));
+
+    const int code = header.code & 0xff;
+
+    size_t bytesPerColor = 4;
+    if (code == 0x22 || code == 0x24)
+    {
+        bytesPerColor = 3;
+    }
+    else if (code == 0x29 || code == 0x2d)
+    {
+        bytesPerColor = 2;
+    }
+    else if (code != 0x2a)
+    {
+        return false;
+    }
+
+    // Only the colors that are inside the palette entry are read.
+    const size_t maxColors = (entrySize - sizeof(FshEntryHeader)) / bytesPerColor;
+
+    int colorCount = header.width;
+    if (static_cast<size_t>(colorCount) > maxColors)
+    {
+        colorCount = static_cast<int>(maxColors);
+    }
+    if (colorCount > PaletteSize)
+    {
+        colorCount = PaletteSize;
+    }
+
+    const unsigned char* p = entry + sizeof(FshEntryHeader);
+
+    const unsigned int OpaqueAlphaMask = 0xFF000000;
+
+    for (int i = 0; i < colorCount; i++)
+    {
+        const unsigned int value16 = p[0] | (p[1] << 8);
+
+        switch (code)
+        {
+        case 0x22: // 24-bit DOS palette RGB (8:8:8)
+            colors[i] = (((p[0] << 16) + (p[1] << 8) + p[2]) << 2) | OpaqueAlphaMask;
+            break;
+        case 0x24: // 24-bit palette RGB (8:8:8)
+            colors[i] = ((p[0] << 16) + (p[1] << 8) + p[2]) | OpaqueAlphaMask;
+            break;
+        case 0x29: // 16-bit NFS5 palette RGAB (5:5:1:5)
+            colors[i] = (((value16 & 0x1f) + (((value16 >> 5) & 0x3f) << 7) + (((value16 >> 11) & 0x1f) << 16)) << 3);
+
+            if ((value16 & 0x20) > 0)
+            {
+                colors[i] |= OpaqueAlphaMask;
+            }
+            break;
+        case 0x2a: // 32-bit palette ARGB (8:8:8:8)
+            colors[i] = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned int>(p[3]) << 24);
+            break;
+        case 0x2d: // 16-bit palette ARGB (1:5:5:5)
+            colors[i] = (((value16 & 0x1f) + (((value16 >> 5) & 0x3f) << 8) + (((value16 >> 10) & 0x1f) << 16)) << 3);
+
+            if ((value16 & 0x8000) > 0)
+            {
+                colors[i] |= OpaqueAlphaMask;
+            }
+            break;
+        }
+
+        p += bytesPerColor;
+    }
+
+    return true;
+}
+
+void GetFshThumbnailSize(int width, int height, int maxEdgeLength, int* thumbWidth, int* thumbHeight)
+{
+    if (width <= 0 || height <= 0)
+    {
+        *thumbWidth = 1;
+        *thumbHeight = 1;
+    }
+    else if (maxEdgeLength <= 0)
+    {
+        *thumbWidth = width;
+        *thumbHeight = height;
+    }
+    else if (width >= height)
+    {
+        const int longSide = width < maxEdgeLength ? width : maxEdgeLength;
+        const int shortSide = static_cast<int>((static_cast<long long>(height) * longSide) / width);
+
+        *thumbWidth = longSide;
+        *thumbHeight = shortSide > 1 ? shortSide : 1;
+    }
+    else
+    {
+        const int longSide = height < maxEdgeLength ? height : maxEdgeLength;
+        const int shortSide = static_cast<int>((static_cast<long long>(width) * longSide) / height);
+
+        *thumbWidth = shortSide > 1 ? shortSide : 1;
+        *thumbHeight = longSide;
+    }
+}
+
+static bool IsDxtCode(int code)
+{
+    return code == 0x60 || code == 0x61;
+}
+
+// Returns the number of source rows that are decoded at a time, for DXT images this is
+// the block rows that make up one strip of the reduced size image. The DXT images that
+// use more than one thread get strips of about ParallelStripBytes that give each thread some rows.
+static int GetStripRows(const FshImageSource& source, int scaleShift, int threadCount)
+{
+    if (!IsDxtCode(source.code))
+    {
+        return StripRows;
+    }
+
+    // A strip is a whole number of the block rows or reduced strips that the DXT decoder uses.
+    const int rowMultiple = scaleShift > 2 ? 1 << scaleShift : StripRows;
+
+    if (threadCount > 1)
+    {
+        const size_t decodedRowBytes = static_cast<size_t>(GetReducedDecodeSize(source.width, scaleShift)) * 4;
+        long long rows = static_cast<long long>(ParallelStripBytes / decodedRowBytes) << scaleShift;
+
+        if (rows < static_cast<long long>(threadCount) * rowMultiple)
+        {
+            rows = static_cast<long long>(threadCount) * rowMultiple;
+        }
+
+        rows = ((rows + rowMultiple - 1) / rowMultiple) * rowMultiple;
+
+        return rows < source.height ? static_cast<int>(rows) : source.height;
+    }
+
+    return rowMultiple;
+}
+
+// Decodes rowCount rows starting at row y to BGRA.
+static void DecodeStrip(const FshImageSource& source, int y, int rowCount, int scaleShift, DxtDecodeThreads* threads, unsigned char* dst, size_t dstStride)
+{
+    const int width = source.width;
+
+    switch (source.code)
+    {
+    case 0x60: // DXT1
+    case 0x61: // DXT3
+    {
+        const size_t blockSize = source.code == 0x60 ? 8 : 16;
+        const size_t blockRowSize = static_cast<size_t>((width + 3) / 4) * blockSize;
+        const unsigned char* blocks = source.data + (blockRowSize * (y / 4));
+
+        DecompressImageReduced(dst, dstStride, width, rowCount, blocks, source.code == 0x60, scaleShift, ChannelOrderBGRA, threads);
+        break;
+    }
+    case 0x7b: // 8-bit indexed
+        ConvertIndexed8ToBGRA(source.data + (static_cast<size_t>(width) * y), width, dst, dstStride, width, rowCount, source.palette);
+        break;
+    case 0x7d: // 32-bit A8R8G8B8
+        for (int i = 0; i < rowCount; i++)
+        {
+            memcpy(dst + (dstStride * i), source.data + (static_cast<size_t>(width) * 4 * (y + i)), static_cast<size_t>(width) * 4);
+        }
+        break;
+    case 0x7f: // 24-bit A0R8G8B8
+        ConvertR8G8B8ToBGRA(source.data + (static_cast<size_t>(width) * 3 * y), static_cast<size_t>(width) * 3, dst, dstStride, width, rowCount);
+        break;
+    case 0x7e: // 16-bit A1R5G5B5
+        ConvertA1R5G5B5ToBGRA(source.data + (static_cast<size_t>(width) * 2 * y), static_cast<size_t>(width) * 2, dst, dstStride, width, rowCount);
+        break;
+    case 0x78: // 16-bit R5G6B5
+        ConvertR5G6B5ToBGRA(source.data + (static_cast<size_t>(width) * 2 * y), static_cast<size_t>(width) * 2, dst, dstStride, width, rowCount);
+        break;
+    case 0x6d: // 16-bit A4R4G4B4
+        ConvertA4R4G4B4ToBGRA(source.data + (static_cast<size_t>(width) * 2 * y), static_cast<size_t>(width) * 2, dst, dstStride, width, rowCount);
+        break;
+    }
+}
+
+bool DecodeFshImage(const FshImageSource& source, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight, int maxThreads)
+{
+    const int code = source.code;
+
+    if (code != 0x60 && code != 0x61 && code != 0x7b && code != 0x7d && code != 0x7e && code != 0x78 && code != 0x6d && code != 0x7f)
+    {
+        return false;
+    }
+
+    if (source.width <= 0 || source.height <= 0 || (code == 0x7b && source.palette == nullptr))
+    {
+        return false;
+    }
+
+    // Large DXT images are decoded at a reduced size when the destination is much smaller.
+    int scaleShift = 0;
+    if (IsDxtCode(code))
+    {
+        scaleShift = GetReducedDecodeShift(source.width, source.height, dstWidth > dstHeight ? dstWidth : dstHeight);
+    }
+
+    const int decodedWidth = GetReducedDecodeSize(source.width, scaleShift);
+    const int decodedHeight = GetReducedDecodeSize(source.height, scaleShift);
+
+    // The DXT threads are started once for the image and reused by every strip.
+    DxtDecodeThreads threads(source.width, source.height, IsDxtCode(code) ? maxThreads : 1);
+
+    if (decodedWidth == dstWidth && decodedHeight == dstHeight)
+    {
+        if (IsDxtCode(code))
+        {
+            // The image is decoded in place, so the threads share one job for the whole image.
+            DecodeStrip(source, 0, source.height, scaleShift, &threads, dst, dstStride);
+            return true;
+        }
+
+        for (int y = 0; y < source.height; y += StripRows)
+        {
+            const int rowCount = source.height - y < StripRows ? source.height - y : StripRows;
+
+            DecodeStrip(source, y, rowCount, scaleShift, &threads, dst + (dstStride * y), dstStride);
+        }
+
+        return true;
+    }
+
+    const int stripRows = GetStripRows(source, scaleShift, threads.GetThreadCount());
+
+    ImageScaler scaler;
+
+    if (!scaler.Initialize(decodedWidth, decodedHeight, dst, dstStride, dstWidth, dstHeight))
+    {
+        return false;
+    }
+
+    if (code == 0x7d)
+    {
+        // The pixels are already BGRA.
+        scaler.AddRows(source.data, static_cast<size_t>(source.width) * 4, source.height);
+        return true;
+    }
+
+    const size_t stripStride = static_cast<size_t>(decodedWidth) * 4;
+    unsigned char* strip = new (std::nothrow) unsigned char[stripStride * GetReducedDecodeSize(stripRows, scaleShift)];
+
+    if (strip == nullptr)
+    {
+        return false;
+    }
+
+    for (int y = 0; y < source.height; y += stripRows)
+    {
+        const int rowCount = source.height - y < stripRows ? source.height - y : stripRows;
+
+        DecodeStrip(source, y, rowCount, scaleShift, &threads, strip, stripStride);
+        scaler.AddRows(strip, stripStride, GetReducedDecodeSize(rowCount, scaleShift));
+    }
+
+    delete[] strip;
+
+    return true;
+}
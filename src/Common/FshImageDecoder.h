@@ -0,0 +1,51 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+// The pixel data of one FSH image or mipmap.
+struct FshImageSource
+{
+    int code;                    // the image format without the compression flag
+    int width;
+    int height;
+    const unsigned char* data;   // at least GetFshImageDataSize bytes
+    const unsigned int* palette; // the 256 colors of an 8-bit image in the 0xAARRGGBB format
+};
+
+// Reads the colors of a palette entry, entry points to the entry header and entrySize is the
+// number of bytes up to the end of the entry. The colors that are not in the entry are
+// transparent black. Returns false if the entry is not a palette.
+bool ReadFshPalette(const unsigned char* entry, size_t entrySize, unsigned int* colors);
+
+// Returns the size of a thumbnail that fits in a maxEdgeLength square and keeps the aspect
+// ratio of the image, a maxEdgeLength of 0 or less returns the size of the image.
+void GetFshThumbnailSize(int width, int height, int maxEdgeLength, int* thumbWidth, int* thumbHeight);
+
+// Decodes the image to dstWidth by dstHeight BGRA pixels.
+// The image is decoded in strips of a few rows, one block row for DXT, that are passed
+// straight to the scaler so the whole image is never stored in memory. When the destination
+// is the size of the image the strips are decoded directly into it.
+// DXT images of 1024x1024 pixels or larger are decoded in larger strips that are split between
+// up to maxThreads threads.
+// Returns false if the format is not supported or the buffers could not be allocated.
+bool DecodeFshImage(const FshImageSource& source, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight, int maxThreads = 1);
@@ -0,0 +1,184 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "FshMipmaps.h"
+
+unsigned long long GetFshImageDataSize(int code, int width, int height)
+{
+    const unsigned long long pixels = static_cast<unsigned long long>(width) * height;
+    const unsigned long long blocks = static_cast<unsigned long long>((width + 3) / 4) * ((height + 3) / 4);
+
+    switch (code & 0x7f)
+    {
+    case 0x7d: // 32-bit A8R8G8B8
+        return pixels * 4;
+    case 0x7f: // 24-bit R8G8B8
+        return pixels * 3;
+    case 0x7e: // 16-bit A1R5G5B5
+    case 0x78: // 16-bit R5G6B5
+    case 0x6d: // 16-bit A4R4G4B4
+        return pixels * 2;
+    case 0x7b: // 8-bit indexed
+        return pixels;
+    case 0x60: // DXT1, 8 bytes per 4x4 block
+        return blocks * 8;
+    case 0x61: // DXT3, 16 bytes per 4x4 block
+        return blocks * 16;
+    default:
+        return 0;
+    }
+}
+
+int GetFshMipmapCount(const FshEntryHeader& header)
+{
+    return (header.misc[3] >> 12) & 0x0f;
+}
+
+static int GetMipmapSize(int size, int level)
+{
+    size >>= level;
+
+    return size > 0 ? size : 1;
+}
+
+static int GetLongEdge(int width, int height)
+{
+    return width > height ? width : height;
+}
+
+// Replaces best with the level when it is a better match for the thumbnail size.
+static void ConsiderLevel(const FshImageLevel& level, int maxEdgeLength, FshImageLevel* best)
+{
+    const int edge = GetLongEdge(level.width, level.height);
+    const int bestEdge = GetLongEdge(best->width, best->height);
+
+    if (bestEdge < maxEdgeLength)
+    {
+        // Nothing large enough has been found, any larger level is better.
+        if (edge > bestEdge)
+        {
+            *best = level;
+        }
+    }
+    else if (edge >= maxEdgeLength && edge < bestEdge)
+    {
+        *best = level;
+    }
+}
+
+// Adds the full size image of an entry and its mipmaps.
+static void ConsiderEntryLevels(const FshView& view, int index, int maxEdgeLength, FshImageLevel* best)
+{
+    const FshViewEntry& entry = view.GetEntry(index);
+    const FshEntryHeader header = view.GetEntryHeader(entry.offset);
+    const int width = header.width;
+    const int height = header.height;
+
+    // The count is only used when every level is at least one pixel.
+    int mipmapCount = GetFshMipmapCount(header);
+    if ((GetLongEdge(width, height) >> mipmapCount) == 0)
+    {
+        mipmapCount = 0;
+    }
+
+    // The levels of an uncompressed entry must be inside the entry, the data of a compressed
+    // entry can only be checked after it is decompressed.
+    const bool compressed = (header.code & 0x80) != 0;
+    const unsigned long long entryDataSize = entry.end - entry.offset - sizeof(FshEntryHeader);
+
+    FshImageLevel level;
+    level.entryIndex = index;
+    level.dataOffset = 0;
+
+    for (int i = 0; i <= mipmapCount; i++)
+    {
+        level.width = GetMipmapSize(width, i);
+        level.height = GetMipmapSize(height, i);
+
+        const unsigned long long levelSize = GetFshImageDataSize(header.code, level.width, level.height);
+
+        if (!compressed && (level.dataOffset + levelSize) > entryDataSize)
+        {
+            break;
+        }
+
+        ConsiderLevel(level, maxEdgeLength, best);
+
+        level.dataOffset += static_cast<size_t>(levelSize);
+    }
+}
+
+// Returns true if the entry is an image with the same name as the first one and a power of two reduction of its size.
+static bool IsReducedSibling(const FshView& view, int firstIndex, int index)
+{
+    const FshViewEntry& first = view.GetEntry(firstIndex);
+    const FshViewEntry& entry = view.GetEntry(index);
+
+    if (memcmp(first.name, entry.name, sizeof(first.name)) != 0 || !view.IsAvailable(entry.offset, sizeof(FshEntryHeader)))
+    {
+        return false;
+    }
+
+    const FshEntryHeader firstHeader = view.GetEntryHeader(first.offset);
+    const FshEntryHeader header = view.GetEntryHeader(entry.offset);
+
+    if (!FshView::IsImageCode(header.code))
+    {
+        return false;
+    }
+
+    for (int level = 1; (GetLongEdge(firstHeader.width, firstHeader.height) >> level) > 0; level++)
+    {
+        if (header.width == GetMipmapSize(firstHeader.width, level) && header.height == GetMipmapSize(firstHeader.height, level))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+FshImageLevel SelectFshImageLevel(const FshView& view, int index, int maxEdgeLength)
+{
+    const FshEntryHeader header = view.GetEntryHeader(view.GetEntry(index).offset);
+
+    FshImageLevel best;
+    best.entryIndex = index;
+    best.width = header.width;
+    best.height = header.height;
+    best.dataOffset = 0;
+
+    if (maxEdgeLength <= 0)
+    {
+        return best;
+    }
+
+    ConsiderEntryLevels(view, index, maxEdgeLength, &best);
+
+    for (int i = 0; i < view.GetEntryCount(); i++)
+    {
+        if (i != index && IsReducedSibling(view, index, i))
+        {
+            ConsiderEntryLevels(view, i, maxEdgeLength, &best);
+        }
+    }
+
+    return best;
+}
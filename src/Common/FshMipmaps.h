@@ -0,0 +1,48 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include "FshView.h"
+
+// An image stored in an FSH entry, either the full size image or one of its mipmaps.
+struct FshImageLevel
+{
+    int entryIndex;
+    int width;
+    int height;
+    size_t dataOffset; // the offset of the level from the start of the entry's image data
+};
+
+// Returns the size of the image data for an image code, or 0 if the code is not an image.
+unsigned long long GetFshImageDataSize(int code, int width, int height);
+
+// Returns the number of mipmaps that follow the image data of an entry, the count is stored
+// in the high 4 bits of the last misc field.
+int GetFshMipmapCount(const FshEntryHeader& header);
+
+// Selects the smallest image whose long edge is at least maxEdgeLength, or the largest image when
+// none are that large. The candidates are the image in the entry at index and its mipmaps, and the
+// entries with the same name whose size is a power of two reduction of that image, as used by some
+// texture sets for each zoom level.
+// The mipmap offsets are computed from the image sizes. Levels that are not inside an uncompressed
+// entry are skipped, for a compressed entry the caller must check the level against the decompressed data.
+FshImageLevel SelectFshImageLevel(const FshView& view, int index, int maxEdgeLength);
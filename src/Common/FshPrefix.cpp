@@ -0,0 +1,120 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "FshPrefix.h"
+#include "FshView.h"
+#include "FshMipmaps.h"
+#include <string.h>
+
+// Returns the length that covers the headers of the entries with the same name as the first
+// image and the entry of the level that is loaded, the headers are read to select the level.
+static size_t GetSelectedLevelLength(const FshView& view, int imageIndex, size_t available, size_t length, int maxEdgeLength)
+{
+    const FshViewEntry& image = view.GetEntry(imageIndex);
+
+    for (int i = 0; i < view.GetEntryCount(); i++)
+    {
+        const FshViewEntry& entry = view.GetEntry(i);
+        const size_t headerEnd = entry.offset + sizeof(FshEntryHeader);
+
+        if (memcmp(entry.name, image.name, sizeof(image.name)) == 0 && headerEnd > length)
+        {
+            length = headerEnd;
+        }
+    }
+
+    if (available < length)
+    {
+        return length;
+    }
+
+    const FshImageLevel level = SelectFshImageLevel(view, imageIndex, maxEdgeLength);
+    const size_t levelEnd = view.GetEntry(level.entryIndex).end;
+
+    return levelEnd > length ? levelEnd : length;
+}
+
+size_t GetFshPrefixLength(const unsigned char* data, size_t available, size_t fileSize, int maxEdgeLength)
+{
+    if (available < sizeof(FshHeader))
+    {
+        return sizeof(FshHeader);
+    }
+
+    FshHeader header;
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.SHPI, "SHPI", 4) != 0 || header.numBmps <= 0 ||
+        static_cast<size_t>(header.numBmps) > ((fileSize - sizeof(FshHeader)) / sizeof(FshDirEntry)))
+    {
+        return 0;
+    }
+
+    const size_t directoryEnd = sizeof(FshHeader) + (header.numBmps * sizeof(FshDirEntry));
+
+    if (available < directoryEnd)
+    {
+        return directoryEnd;
+    }
+
+    FshView view;
+
+    if (!view.Open(data, available, fileSize))
+    {
+        return 0;
+    }
+
+    const int count = view.GetEntryCount();
+    size_t length = directoryEnd;
+
+    // The global palette can be anywhere in the file, its name is in the directory.
+    const int paletteIndex = view.FindEntry("!pal");
+
+    if (paletteIndex >= 0 && view.GetEntry(paletteIndex).end > length)
+    {
+        length = view.GetEntry(paletteIndex).end;
+    }
+
+    // The first image in directory order is the one that is loaded, the entry headers
+    // before it are read to find it.
+    for (int i = 0; i < count; i++)
+    {
+        const FshViewEntry& entry = view.GetEntry(i);
+        const size_t headerEnd = entry.offset + sizeof(FshEntryHeader);
+
+        if (available < headerEnd)
+        {
+            return headerEnd > length ? headerEnd : length;
+        }
+
+        if (FshView::IsImageCode(view.GetEntryHeader(entry.offset).code))
+        {
+            // The palettes and other attachments are stored after the image in the same entry.
+            if (entry.end > length)
+            {
+                length = entry.end;
+            }
+
+            return GetSelectedLevelLength(view, i, available, length, maxEdgeLength);
+        }
+    }
+
+    return length;
+}
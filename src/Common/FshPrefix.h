@@ -0,0 +1,33 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+// Returns the number of bytes from the start of the FSH file that are needed to load the first
+// image entry, the entries attached to it and the global palette.
+// When the image has smaller entries with the same name their headers are included, along with
+// the entry that SelectFshImageLevel picks for maxEdgeLength.
+// The length is computed from the first available bytes of the file, when it is larger than
+// available the function should be called again once that many bytes are available.
+// Returns 0 when the header or directory is not valid, the prefix cannot be bounded then and
+// the file cannot be loaded.
+size_t GetFshPrefixLength(const unsigned char* data, size_t available, size_t fileSize, int maxEdgeLength);
@@ -0,0 +1,286 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "FshPrefixReader.h"
+#include "FshHeaders.h"
+#include "FshPrefix.h"
+#include "QfsDecompressor.h"
+#include "FshRangeReader.h"
+#include <string.h>
+
+namespace
+{
+    // The prefix buffers grow in steps of this size, the entry headers that are found one after
+    // another then do not each copy the buffer.
+    const size_t PrefixGrowSize = 64 * 1024;
+
+    // Moves the first used bytes of the buffer to a new one from the arena that holds at least
+    // length bytes and at most fileSize bytes. The old buffer is released with the arena.
+    // Returns nullptr when out of memory.
+    unsigned char* GrowPrefixBuffer(ThumbnailArena* arena, const unsigned char* buffer, size_t used, size_t length, size_t fileSize, size_t* capacity)
+    {
+        const size_t newCapacity = (fileSize - length) > PrefixGrowSize ? ((length / PrefixGrowSize) + 1) * PrefixGrowSize : fileSize;
+        unsigned char* newBuffer = arena->AllocateArray<unsigned char>(newCapacity);
+
+        if (newBuffer != nullptr)
+        {
+            if (used > 0)
+            {
+                memcpy(newBuffer, buffer, used);
+            }
+
+            *capacity = newCapacity;
+        }
+
+        return newBuffer;
+    }
+
+    // Decompresses the pieces of the compressed file in order until the prefix is available.
+    class PrefixDecompressor
+    {
+    public:
+        PrefixDecompressor(int maxEdgeLength, ThumbnailArena* arena) : decompressor(true), qfsStatus(QfsStatusNeedInput),
+            status(FshLoadInvalidData), maxEdgeLength(maxEdgeLength), arena(arena), output(nullptr), outputCapacity(0), outputSize(0),
+            prefixLength(0)
+        {
+        }
+
+        // A ChunkConsumeProc, size is 0 at the end of the file.
+        // Returns false when no more data is needed.
+        bool Consume(const unsigned char* data, size_t size)
+        {
+            if (size == 0)
+            {
+                status = FshLoadInvalidData; // the file ended before the end of the compressed data
+                return false;
+            }
+
+            size_t dataIndex = 0;
+
+            while (qfsStatus != QfsStatusNeedInput || dataIndex < size)
+            {
+                const size_t total = static_cast<size_t>(decompressor.GetTotalOutput());
+                size_t inputUsed = 0;
+                size_t outputWritten = 0;
+
+                qfsStatus = decompressor.Decompress(data + dataIndex, size - dataIndex, &inputUsed,
+                    output != nullptr ? output + total : nullptr, prefixLength - total, &outputWritten);
+                dataIndex += inputUsed;
+
+                if (qfsStatus == QfsStatusInvalidData || qfsStatus == QfsStatusOutOfMemory)
+                {
+                    status = qfsStatus == QfsStatusOutOfMemory ? FshLoadOutOfMemory : FshLoadInvalidData;
+                    return false;
+                }
+                else if (output == nullptr && decompressor.HasHeader())
+                {
+                    if (!AllocateOutput())
+                    {
+                        return false;
+                    }
+                }
+                else if (output != nullptr && decompressor.GetTotalOutput() == prefixLength)
+                {
+                    const size_t length = GetFshPrefixLength(output, prefixLength, outputSize, maxEdgeLength);
+
+                    if (length == 0)
+                    {
+                        status = FshLoadInvalidData; // the header or directory is not valid
+                        return false;
+                    }
+
+                    prefixLength = length < outputSize ? length : outputSize;
+
+                    if (prefixLength <= decompressor.GetTotalOutput())
+                    {
+                        Finish();
+                        return false;
+                    }
+                    else if (!ReserveOutput())
+                    {
+                        return false;
+                    }
+                }
+
+                if (qfsStatus == QfsStatusDone)
+                {
+                    Finish();
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        FshLoadStatus GetStatus() const
+        {
+            return status;
+        }
+
+        FshFilePrefix GetPrefix() const
+        {
+            FshFilePrefix prefix;
+            prefix.data = output;
+            prefix.length = static_cast<size_t>(decompressor.GetTotalOutput());
+            prefix.size = outputSize;
+
+            return prefix;
+        }
+
+    private:
+        PrefixDecompressor(const PrefixDecompressor&) = delete;
+        PrefixDecompressor& operator=(const PrefixDecompressor&) = delete;
+
+        bool AllocateOutput()
+        {
+            const unsigned long long decompressedSize = decompressor.GetDecompressedSize();
+
+            if (decompressedSize < sizeof(FshHeader))
+            {
+                status = FshLoadInvalidData;
+                return false;
+            }
+            else if (decompressedSize > static_cast<size_t>(-1))
+            {
+                status = FshLoadOutOfMemory; // the file does not fit in the address space
+                return false;
+            }
+
+            outputSize = static_cast<size_t>(decompressedSize);
+            prefixLength = sizeof(FshHeader);
+
+            return ReserveOutput();
+        }
+
+        // Grows the output when the prefix does not fit in it.
+        bool ReserveOutput()
+        {
+            if (prefixLength > outputCapacity)
+            {
+                output = GrowPrefixBuffer(arena, output, static_cast<size_t>(decompressor.GetTotalOutput()), prefixLength, outputSize, &outputCapacity);
+
+                if (output == nullptr)
+                {
+                    status = FshLoadOutOfMemory;
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        void Finish()
+        {
+            status = FshLoadOk;
+        }
+
+        QfsDecompressor decompressor;
+        QfsStatus qfsStatus;
+        FshLoadStatus status;
+        int maxEdgeLength;
+        ThumbnailArena* arena;
+        unsigned char* output;
+        size_t outputCapacity;
+        size_t outputSize;   // the size of the decompressed file
+        size_t prefixLength;
+    };
+}
+
+FshLoadStatus DecompressFshPrefix(const ChunkReadProc& read, int maxEdgeLength, ThumbnailArena* arena, FshFilePrefix* prefix)
+{
+    PrefixDecompressor decompressor(maxEdgeLength, arena);
+
+    // The consume proc runs on the pipeline's worker thread while the next chunks are read.
+    auto consume = [&decompressor](const unsigned char* data, size_t size) -> bool
+    {
+        return decompressor.Consume(data, size);
+    };
+
+    if (!RunChunkPipeline(read, consume))
+    {
+        return FshLoadReadFailed;
+    }
+
+    *prefix = decompressor.GetPrefix();
+
+    return decompressor.GetStatus();
+}
+
+FshLoadStatus DecompressFshPrefix(const unsigned char* data, size_t size, int maxEdgeLength, ThumbnailArena* arena, FshFilePrefix* prefix)
+{
+    PrefixDecompressor decompressor(maxEdgeLength, arena);
+
+    if (decompressor.Consume(data, size))
+    {
+        decompressor.Consume(data + size, 0);
+    }
+
+    *prefix = decompressor.GetPrefix();
+
+    return decompressor.GetStatus();
+}
+
+FshLoadStatus ReadFshPrefix(const FshRangeReadProc& read, size_t fileSize, int maxEdgeLength, ThumbnailArena* arena, FshFilePrefix* prefix)
+{
+    FshRangeReader reader(nullptr, fileSize, maxEdgeLength);
+    unsigned char* buffer = nullptr;
+    size_t capacity = 0;
+    size_t length = 0; // the end of the last range in the file
+    size_t offset;
+    size_t count;
+
+    while (reader.GetNextRange(&offset, &count))
+    {
+        const size_t end = offset + count;
+
+        if (end > capacity)
+        {
+            buffer = GrowPrefixBuffer(arena, buffer, length, end, fileSize, &capacity);
+
+            if (buffer == nullptr)
+            {
+                return FshLoadOutOfMemory;
+            }
+
+            reader.SetData(buffer);
+        }
+
+        if (!read(offset, buffer + offset, count))
+        {
+            return FshLoadReadFailed;
+        }
+
+        if (end > length)
+        {
+            length = end;
+        }
+    }
+
+    if (!reader.HasImage())
+    {
+        return FshLoadInvalidData; // the header or directory is not valid, or there is no image
+    }
+
+    prefix->data = buffer;
+    prefix->length = length;
+    prefix->size = fileSize;
+
+    return FshLoadOk;
+}
@@ -0,0 +1,59 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <functional>
+#include "ChunkPipeline.h"
+#include "FshThumbnailLoader.h"
+#include "ThumbnailArena.h"
+
+// The part of an FSH file that the loader uses, the buffer only covers the file up to the end of
+// that part so a large file never needs a buffer of its full size.
+struct FshFilePrefix
+{
+    const unsigned char* data;
+    size_t length; // the number of bytes at data that cover the part of the file that was read
+    size_t size;   // the size of the file, after it is decompressed
+};
+
+// Reads size bytes at offset in the file into buffer, returns false if the read fails.
+typedef std::function<bool(size_t offset, unsigned char* buffer, size_t size)> FshRangeReadProc;
+
+// Reads the parts of an uncompressed FSH file that FshRangeReader asks for into a buffer from the
+// arena, the buffer grows as the ranges are found. The data between the ranges is not read.
+// Returns FshLoadInvalidData without reading the rest of the file when the header or directory
+// is not valid, and FshLoadReadFailed when read fails.
+FshLoadStatus ReadFshPrefix(const FshRangeReadProc& read, size_t fileSize, int maxEdgeLength, ThumbnailArena* arena, FshFilePrefix* prefix);
+
+// Decompresses a QFS compressed FSH file in pieces as read returns them, the next pieces are
+// read by RunChunkPipeline while the current one is decompressed. The back references are read
+// from the output, which is allocated from the arena, so only the decompressed data is kept
+// in memory. The decompression stops once the part of the file that the loader uses is available,
+// the data after it is not written so the prefix is opened with the FshThumbnailLoader::Open
+// overload that takes the available length. The output grows with the prefix that
+// GetFshPrefixLength asks for, and the decompression fails when the prefix cannot be bounded.
+// Returns FshLoadReadFailed when read fails.
+FshLoadStatus DecompressFshPrefix(const ChunkReadProc& read, int maxEdgeLength, ThumbnailArena* arena, FshFilePrefix* prefix);
+
+// Decompresses a QFS compressed FSH file that is in memory.
+FshLoadStatus DecompressFshPrefix(const unsigned char* data, size_t size, int maxEdgeLength, ThumbnailArena* arena, FshFilePrefix* prefix);
@@ -0,0 +1,313 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "FshRangeReader.h"
+#include <string.h>
+
+// The first read covers the header and the directory of most files.
+static const size_t ProbeSize = 4096;
+
+FshRangeReader::FshRangeReader(const unsigned char* data, size_t fileSize, int maxEdgeLength) : data(data), fileSize(fileSize),
+    maxEdgeLength(maxEdgeLength), stage(StageProbe), entryCount(0), entryIndex(0), imageFound(false), siblingIndex(-1),
+    paletteIndex(-1), attachmentOffset(0)
+{
+    level.entryIndex = 0;
+    level.width = 0;
+    level.height = 0;
+    level.dataOffset = 0;
+}
+
+void FshRangeReader::GetStageRange(size_t* start, size_t* end) const
+{
+    *start = 0;
+    *end = 0;
+
+    switch (stage)
+    {
+    case StageProbe:
+        *end = fileSize < ProbeSize ? fileSize : ProbeSize;
+        break;
+    case StageDirectory:
+        *start = sizeof(FshHeader);
+        *end = sizeof(FshHeader) + (entryCount * sizeof(FshDirEntry));
+        break;
+    case StagePalette:
+        if (paletteIndex >= 0)
+        {
+            *start = view.GetEntry(paletteIndex).offset;
+            *end = view.GetEntry(paletteIndex).end;
+        }
+        break;
+    case StageEntryHeader:
+        *start = view.GetEntry(entryIndex).offset;
+        *end = *start + sizeof(FshEntryHeader);
+        break;
+    case StageSiblingHeader:
+        if (siblingIndex >= 0)
+        {
+            *start = view.GetEntry(siblingIndex).offset;
+            *end = *start + sizeof(FshEntryHeader);
+        }
+        break;
+    case StageImageData:
+    {
+        const FshViewEntry& entry = view.GetEntry(level.entryIndex);
+        const FshEntryHeader header = view.GetEntryHeader(entry.offset);
+
+        *start = entry.offset;
+        *end = entry.end;
+
+        // A compressed entry is read whole, otherwise only the header and the selected level are needed.
+        if ((header.code & 0x80) == 0)
+        {
+            const size_t levelStart = entry.offset + sizeof(FshEntryHeader) + level.dataOffset;
+            const size_t levelEnd = levelStart + static_cast<size_t>(GetFshImageDataSize(header.code, level.width, level.height));
+
+            if (levelEnd <= entry.end)
+            {
+                *start = levelStart;
+                *end = levelEnd;
+            }
+        }
+        break;
+    }
+    case StageAttachmentHeader:
+        *start = attachmentOffset;
+        *end = attachmentOffset + sizeof(FshEntryHeader);
+        break;
+    case StageAttachmentData:
+    {
+        // A palette attachment ends at the next attachment or at the end of the entry.
+        const size_t next = view.GetNextAttachment(level.entryIndex, attachmentOffset);
+
+        *start = attachmentOffset;
+        *end = next != 0 ? next : view.GetEntry(level.entryIndex).end;
+        break;
+    }
+    case StageDone:
+        break;
+    }
+}
+
+// Moves siblingIndex to the next entry that has the same name as the first image, or -1.
+void FshRangeReader::FindNextSibling()
+{
+    const FshViewEntry& first = view.GetEntry(entryIndex);
+
+    for (siblingIndex++; siblingIndex < entryCount; siblingIndex++)
+    {
+        if (siblingIndex != entryIndex && memcmp(view.GetEntry(siblingIndex).name, first.name, sizeof(first.name)) == 0)
+        {
+            return;
+        }
+    }
+
+    siblingIndex = -1;
+}
+
+// Moves to the next stage once the data of the current stage has been read.
+void FshRangeReader::AdvanceStage()
+{
+    switch (stage)
+    {
+    case StageProbe:
+    {
+        if (fileSize < sizeof(FshHeader))
+        {
+            stage = StageDone;
+            break;
+        }
+
+        FshHeader header;
+        memcpy(&header, data, sizeof(header));
+
+        if (header.numBmps <= 0 || static_cast<size_t>(header.numBmps) > ((fileSize - sizeof(FshHeader)) / sizeof(FshDirEntry)))
+        {
+            stage = StageDone;
+            break;
+        }
+
+        entryCount = header.numBmps;
+        stage = StageDirectory;
+        break;
+    }
+    case StageDirectory:
+        if (!view.Open(data, fileSize))
+        {
+            stage = StageDone;
+            break;
+        }
+
+        // LoadFSH uses the first entry named !pal as the global palette.
+        paletteIndex = view.FindEntry("!pal");
+        stage = StagePalette;
+        break;
+    case StagePalette:
+        entryIndex = 0;
+        stage = StageEntryHeader;
+        break;
+    case StageEntryHeader:
+    {
+        const FshEntryHeader entry = view.GetEntryHeader(view.GetEntry(entryIndex).offset);
+
+        // The first image in directory order is the one that is loaded.
+        if (FshView::IsImageCode(entry.code))
+        {
+            siblingIndex = -1;
+            FindNextSibling();
+
+            stage = StageSiblingHeader;
+        }
+        else if (++entryIndex == entryCount)
+        {
+            stage = StageDone;
+        }
+        break;
+    }
+    case StageSiblingHeader:
+        if (siblingIndex >= 0)
+        {
+            FindNextSibling();
+        }
+
+        if (siblingIndex < 0)
+        {
+            level = SelectFshImageLevel(view, entryIndex, maxEdgeLength);
+            imageFound = true;
+            stage = StageImageData;
+        }
+        break;
+    case StageImageData:
+    {
+        const FshViewEntry& entry = view.GetEntry(level.entryIndex);
+
+        // LoadFSH only looks for a local palette in the attachments of an 8-bit image.
+        attachmentOffset = 0;
+        if ((view.GetEntryHeader(entry.offset).code & 0x7f) == 0x7b)
+        {
+            attachmentOffset = view.GetNextAttachment(level.entryIndex, entry.offset);
+        }
+
+        stage = attachmentOffset != 0 ? StageAttachmentHeader : StageDone;
+        break;
+    }
+    case StageAttachmentHeader:
+        if (FshView::IsPaletteCode(view.GetEntryHeader(attachmentOffset).code))
+        {
+            stage = StageAttachmentData;
+        }
+        else
+        {
+            attachmentOffset = view.GetNextAttachment(level.entryIndex, attachmentOffset);
+            stage = attachmentOffset != 0 ? StageAttachmentHeader : StageDone;
+        }
+        break;
+    case StageAttachmentData:
+        attachmentOffset = view.GetNextAttachment(level.entryIndex, attachmentOffset);
+        stage = attachmentOffset != 0 ? StageAttachmentHeader : StageDone;
+        break;
+    case StageDone:
+        break;
+    }
+}
+
+// Finds the first part of [start, end) that has not been read.
+bool FshRangeReader::FindUnreadRange(size_t start, size_t end, size_t* offset, size_t* length) const
+{
+    for (size_t i = 0; i < readRanges.size() && start < end; i++)
+    {
+        const FileRange& range = readRanges[i];
+
+        if (range.start > start)
+        {
+            if (range.start < end)
+            {
+                end = range.start;
+            }
+            break;
+        }
+        else if (range.end > start)
+        {
+            start = range.end;
+        }
+    }
+
+    if (start >= end)
+    {
+        return false;
+    }
+
+    *offset = start;
+    *length = end - start;
+
+    return true;
+}
+
+void FshRangeReader::AddReadRange(size_t start, size_t end)
+{
+    size_t i = 0;
+
+    while (i < readRanges.size() && readRanges[i].end < start)
+    {
+        i++;
+    }
+
+    // Merge the ranges that overlap or touch the new one.
+    while (i < readRanges.size() && readRanges[i].start <= end)
+    {
+        start = std::min(start, readRanges[i].start);
+        end = std::max(end, readRanges[i].end);
+        readRanges.erase(readRanges.begin() + i);
+    }
+
+    const FileRange range = { start, end };
+    readRanges.insert(readRanges.begin() + i, range);
+}
+
+bool FshRangeReader::GetNextRange(size_t* offset, size_t* length)
+{
+    while (stage != StageDone)
+    {
+        size_t start;
+        size_t end;
+        GetStageRange(&start, &end);
+
+        if (FindUnreadRange(start, end, offset, length))
+        {
+            AddReadRange(*offset, *offset + *length);
+            return true;
+        }
+
+        AdvanceStage();
+    }
+
+    return false;
+}
+
+void FshRangeReader::SetData(const unsigned char* newData)
+{
+    data = newData;
+    view.SetData(newData);
+}
+
+bool FshRangeReader::HasImage() const
+{
+    return imageFound;
+}
@@ -0,0 +1,91 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include "FshView.h"
+#include "FshMipmaps.h"
+
+// Finds the parts of an uncompressed FSH file that are needed to load the first image entry,
+// the entries attached to it and the global palette, so that only those parts are read.
+// The header and directory are read first and the entry extents are computed from the sorted
+// directory offsets. Nothing more is read when the header or directory is not valid.
+// When the image has mipmaps or smaller entries with the same name only the image level that
+// SelectFshImageLevel picks for maxEdgeLength is read.
+class FshRangeReader
+{
+public:
+    // data is the buffer that the caller reads the file into, it must hold the file up to the
+    // end of every range that was returned. It can be null until the first range is read.
+    FshRangeReader(const unsigned char* data, size_t fileSize, int maxEdgeLength);
+
+    // Returns false when all of the needed data has been read, otherwise the caller must read
+    // length bytes from offset into the data buffer before calling this again.
+    bool GetNextRange(size_t* offset, size_t* length);
+
+    // Moves the reader to a copy of the data buffer, e.g. after the caller grew it.
+    void SetData(const unsigned char* newData);
+
+    // Returns true once the image entry has been found, the file is not valid when
+    // GetNextRange finishes before that.
+    bool HasImage() const;
+
+private:
+    enum Stage
+    {
+        StageProbe,
+        StageDirectory,
+        StagePalette,
+        StageEntryHeader,
+        StageSiblingHeader,
+        StageImageData,
+        StageAttachmentHeader,
+        StageAttachmentData,
+        StageDone
+    };
+
+    struct FileRange
+    {
+        size_t start;
+        size_t end;
+    };
+
+    void GetStageRange(size_t* start, size_t* end) const;
+    void AdvanceStage();
+    void FindNextSibling();
+    bool FindUnreadRange(size_t start, size_t end, size_t* offset, size_t* length) const;
+    void AddReadRange(size_t start, size_t end);
+
+    const unsigned char* data;
+    size_t fileSize;
+    int maxEdgeLength;
+    Stage stage;
+    FshView view;
+    int entryCount;
+    int entryIndex;   // the first image entry once it is found
+    bool imageFound;
+    int siblingIndex;
+    int paletteIndex;
+    FshImageLevel level;
+    size_t attachmentOffset;
+    std::vector<FileRange> readRanges; // sorted and not overlapping
+};
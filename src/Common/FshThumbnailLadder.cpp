@@ -0,0 +1,130 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "FshThumbnailLadder.h"
+#include "ImageScaler.h"
+#include <string.h>
+#include <new>
+
+FshThumbnailLadder::FshThumbnailLadder() : count(0)
+{
+    memset(levels, 0, sizeof(levels));
+}
+
+FshThumbnailLadder::~FshThumbnailLadder()
+{
+    Free();
+}
+
+void FshThumbnailLadder::Free()
+{
+    for (int i = 0; i < count; i++)
+    {
+        delete[] levels[i].pixels;
+    }
+
+    memset(levels, 0, sizeof(levels));
+    count = 0;
+}
+
+static long long GetPixelCount(const FshThumbnailLevel& level)
+{
+    return static_cast<long long>(level.width) * level.height;
+}
+
+bool FshThumbnailLadder::Create(const FshImageSource& source, const int* maxEdgeLengths, int levelCount)
+{
+    Free();
+
+    if (levelCount <= 0 || levelCount > MaxLevels)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < levelCount; i++)
+    {
+        FshThumbnailLevel& level = levels[i];
+
+        level.maxEdgeLength = maxEdgeLengths[i];
+        GetFshThumbnailSize(source.width, source.height, level.maxEdgeLength, &level.width, &level.height);
+        level.pixels = new (std::nothrow) unsigned char[static_cast<size_t>(level.width) * level.height * 4];
+
+        count++;
+
+        if (level.pixels == nullptr)
+        {
+            Free();
+            return false;
+        }
+    }
+
+    // The thumbnails are created from the largest to the smallest.
+    int order[MaxLevels];
+
+    for (int i = 0; i < levelCount; i++)
+    {
+        int j = i;
+
+        while (j > 0 && GetPixelCount(levels[order[j - 1]]) < GetPixelCount(levels[i]))
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+
+        order[j] = i;
+    }
+
+    const FshThumbnailLevel& largest = levels[order[0]];
+
+    if (!DecodeFshImage(source, largest.pixels, static_cast<size_t>(largest.width) * 4, largest.width, largest.height))
+    {
+        Free();
+        return false;
+    }
+
+    for (int i = 1; i < count; i++)
+    {
+        const FshThumbnailLevel& previous = levels[order[i - 1]];
+        const FshThumbnailLevel& level = levels[order[i]];
+
+        if (level.width == previous.width && level.height == previous.height)
+        {
+            memcpy(level.pixels, previous.pixels, static_cast<size_t>(level.width) * level.height * 4);
+        }
+        else if (!ScaleImageBGRA(previous.pixels, static_cast<size_t>(previous.width) * 4, previous.width, previous.height,
+                                 level.pixels, static_cast<size_t>(level.width) * 4, level.width, level.height))
+        {
+            Free();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int FshThumbnailLadder::GetCount() const
+{
+    return count;
+}
+
+const FshThumbnailLevel& FshThumbnailLadder::GetLevel(int index) const
+{
+    return levels[index];
+}
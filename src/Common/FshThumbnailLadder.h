@@ -0,0 +1,61 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include "FshImageDecoder.h"
+
+// The size and BGRA pixels of one thumbnail, the rows are width * 4 bytes apart.
+struct FshThumbnailLevel
+{
+    int maxEdgeLength;
+    int width;
+    int height;
+    unsigned char* pixels;
+};
+
+// Creates the thumbnails for several sizes from one decode of the image.
+// The largest thumbnail is decoded from the image data and each smaller one is scaled from
+// the next larger thumbnail, so a set of sizes costs little more than the largest one.
+class FshThumbnailLadder
+{
+public:
+    enum { MaxLevels = 8 };
+
+    FshThumbnailLadder();
+    ~FshThumbnailLadder();
+
+    // The thumbnails are returned in the order of maxEdgeLengths, a length of 0 or less
+    // is the size of the image. Returns false if the image could not be decoded or the
+    // thumbnails could not be allocated.
+    bool Create(const FshImageSource& source, const int* maxEdgeLengths, int levelCount);
+
+    int GetCount() const;
+    const FshThumbnailLevel& GetLevel(int index) const;
+
+private:
+    FshThumbnailLadder(const FshThumbnailLadder&) = delete;
+    FshThumbnailLadder& operator=(const FshThumbnailLadder&) = delete;
+
+    void Free();
+
+    FshThumbnailLevel levels[MaxLevels];
+    int count;
+};
@@ -0,0 +1,270 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "FshThumbnailLoader.h"
+#include "FshHeaders.h"
+#include "FshMipmaps.h"
+#include "FshView.h"
+#include "QfsDecompressor.h"
+#include <string.h>
+
+static bool HasFshSignature(const unsigned char* data)
+{
+    return memcmp(data, "SHPI", 4) == 0;
+}
+
+FshThumbnailLoader::FshThumbnailLoader(ThumbnailArena* arena) : arena(arena), width(0), height(0)
+{
+    memset(&source, 0, sizeof(source));
+}
+
+FshLoadStatus FshThumbnailLoader::Open(const unsigned char* data, size_t size, int maxEdgeLength)
+{
+    return Open(data, size, size, maxEdgeLength);
+}
+
+FshLoadStatus FshThumbnailLoader::Open(const unsigned char* data, size_t available, size_t fileSize, int maxEdgeLength)
+{
+    memset(&source, 0, sizeof(source));
+    width = 0;
+    height = 0;
+
+    FshView view;
+    if (!view.Open(data, available, fileSize) || !HasFshSignature(data))
+    {
+        return FshLoadInvalidData;
+    }
+
+    size_t palOffset = 0;
+    size_t palEnd = 0;
+
+    // The first entry named !pal is the global palette.
+    const int palIndex = view.FindEntry("!pal");
+    if (palIndex >= 0)
+    {
+        const FshViewEntry& palEntry = view.GetEntry(palIndex);
+
+        if (view.IsAvailable(palEntry.offset, palEntry.end - palEntry.offset) && FshView::IsPaletteCode(view.GetEntryHeader(palEntry.offset).code))
+        {
+            palOffset = palEntry.offset;
+            palEnd = palEntry.end;
+        }
+    }
+
+    int imageIndex = -1;
+
+    for (int i = 0; i < view.GetEntryCount(); i++)
+    {
+        const size_t offset = view.GetEntry(i).offset;
+
+        if (!view.IsAvailable(offset, sizeof(FshEntryHeader)))
+        {
+            return FshLoadInvalidData;
+        }
+
+        if (FshView::IsImageCode(view.GetEntryHeader(offset).code))
+        {
+            imageIndex = i; // only the first image is loaded
+            break;
+        }
+    }
+
+    if (imageIndex < 0)
+    {
+        return FshLoadInvalidData;
+    }
+
+    // Decode the smallest mipmap or same named entry that is at least as large as the thumbnail.
+    FshImageLevel level = SelectFshImageLevel(view, imageIndex, maxEdgeLength);
+
+    const FshViewEntry& dir = view.GetEntry(level.entryIndex);
+    const FshEntryHeader entry = view.GetEntryHeader(dir.offset);
+
+    const bool compressed = (entry.code & 0x80) != 0;
+    const int code = entry.code & 0x7f;
+    int imageWidth = level.width;
+    int imageHeight = level.height;
+
+    if (code == 0x7b)
+    {
+        for (size_t auxOffset = view.GetNextAttachment(level.entryIndex, dir.offset);
+            auxOffset != 0 && view.IsAvailable(auxOffset, sizeof(FshEntryHeader));
+            auxOffset = view.GetNextAttachment(level.entryIndex, auxOffset))
+        {
+            if (FshView::IsPaletteCode(view.GetEntryHeader(auxOffset).code))
+            {
+                // Use the local palette if found, it ends at the next attachment or the end of the entry.
+                const size_t next = view.GetNextAttachment(level.entryIndex, auxOffset);
+
+                palOffset = auxOffset;
+                palEnd = next != 0 ? next : dir.end;
+            }
+        }
+    }
+
+    const size_t bmpStart = dir.offset + sizeof(FshEntryHeader);
+    const unsigned char* bmpData = data + bmpStart;
+    size_t bmpDataSize = dir.end - bmpStart;
+
+    if (compressed)
+    {
+        // The compressed data ends at the first attachment or at the end of the entry.
+        const size_t sectionLength = static_cast<unsigned int>(entry.code) >> 8;
+        if (sectionLength > 0 && sectionLength < bmpDataSize)
+        {
+            bmpDataSize = sectionLength;
+        }
+
+        if (!view.IsAvailable(bmpStart, bmpDataSize))
+        {
+            return FshLoadInvalidData; // the entry is after the part of the file that was read
+        }
+
+        if (bmpDataSize < 2 || ((bmpData[0] & 0x7e) != 0x10 && bmpData[1] == 0xfb))
+        {
+            return FshLoadInvalidData; // EaGraph and FshEd allow 16-bit and 32-bit data to be compressed with DXTn compression abort in that case.
+        }
+
+        const FshLoadStatus status = DecompressEntry(bmpData, bmpDataSize, &bmpData, &bmpDataSize);
+        if (status != FshLoadOk)
+        {
+            return status;
+        }
+
+        if (level.dataOffset > 0 && (level.dataOffset + GetFshImageDataSize(code, imageWidth, imageHeight)) > bmpDataSize)
+        {
+            // The decompressed data does not have all of the mipmaps, use the full size image.
+            level.dataOffset = 0;
+            imageWidth = entry.width;
+            imageHeight = entry.height;
+        }
+    }
+
+    if (level.dataOffset > bmpDataSize || imageWidth <= 0 || imageHeight <= 0 ||
+        GetFshImageDataSize(code, imageWidth, imageHeight) > (bmpDataSize - level.dataOffset))
+    {
+        return FshLoadInvalidData; // the image data is truncated
+    }
+
+    if (!compressed && !view.IsAvailable(bmpStart + level.dataOffset, static_cast<size_t>(GetFshImageDataSize(code, imageWidth, imageHeight))))
+    {
+        return FshLoadInvalidData; // the image is after the part of the file that was read
+    }
+
+    source.code = code;
+    source.width = imageWidth;
+    source.height = imageHeight;
+    source.data = bmpData + level.dataOffset;
+
+    if (code == 0x7b)
+    {
+        if (palOffset == 0 || !view.IsAvailable(palOffset, palEnd - palOffset) || !ReadFshPalette(data + palOffset, palEnd - palOffset, palette))
+        {
+            return FshLoadInvalidData; // the image does not have a palette
+        }
+
+        source.palette = palette;
+    }
+
+    GetFshThumbnailSize(imageWidth, imageHeight, maxEdgeLength, &width, &height);
+
+    return FshLoadOk;
+}
+
+int FshThumbnailLoader::GetWidth() const
+{
+    return width;
+}
+
+int FshThumbnailLoader::GetHeight() const
+{
+    return height;
+}
+
+const FshImageSource& FshThumbnailLoader::GetImageSource() const
+{
+    return source;
+}
+
+FshLoadStatus FshThumbnailLoader::Decode(unsigned char* dst, size_t dstStride, int maxThreads) const
+{
+    if (source.data == nullptr)
+    {
+        return FshLoadInvalidData;
+    }
+
+    return DecodeFshImage(source, dst, dstStride, width, height, maxThreads) ? FshLoadOk : FshLoadOutOfMemory;
+}
+
+FshLoadStatus FshThumbnailLoader::Decode(PixelBuffer* buffer) const
+{
+    if (source.data == nullptr)
+    {
+        return FshLoadInvalidData;
+    }
+
+    if (!buffer->Create(width, height))
+    {
+        return FshLoadOutOfMemory;
+    }
+
+    return Decode(buffer->GetData(), buffer->GetStride());
+}
+
+FshLoadStatus FshThumbnailLoader::DecompressEntry(const unsigned char* data, size_t size, const unsigned char** output, size_t* outputSize)
+{
+    QfsDecompressor decompressor(true);
+    size_t inputUsed = 0;
+    size_t outputWritten = 0;
+
+    // The first call reads the header to get the size of the output.
+    QfsStatus status = decompressor.Decompress(data, size, &inputUsed, nullptr, 0, &outputWritten);
+
+    if (!decompressor.HasHeader())
+    {
+        return status == QfsStatusOutOfMemory ? FshLoadOutOfMemory : FshLoadInvalidData;
+    }
+    else if (decompressor.GetDecompressedSize() > static_cast<size_t>(-1))
+    {
+        return FshLoadOutOfMemory;
+    }
+
+    const size_t length = static_cast<size_t>(decompressor.GetDecompressedSize());
+
+    unsigned char* buffer = arena->AllocateArray<unsigned char>(length);
+    if (!buffer)
+    {
+        return FshLoadOutOfMemory;
+    }
+
+    const size_t headerLength = inputUsed;
+
+    status = decompressor.Decompress(data + headerLength, size - headerLength, &inputUsed, buffer, length, &outputWritten);
+
+    if (status != QfsStatusDone)
+    {
+        return status == QfsStatusOutOfMemory ? FshLoadOutOfMemory : FshLoadInvalidData;
+    }
+
+    *output = buffer;
+    *outputSize = length;
+
+    return FshLoadOk;
+}
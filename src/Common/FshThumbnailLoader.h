@@ -0,0 +1,80 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include "FshImageDecoder.h"
+#include "PixelBuffer.h"
+#include "ThumbnailArena.h"
+
+enum FshLoadStatus
+{
+    FshLoadOk,
+    FshLoadInvalidData,  // the file is not valid, truncated or does not have an image
+    FshLoadOutOfMemory,
+    FshLoadReadFailed    // the file could not be read
+};
+
+// Loads the thumbnail of the first image in an FSH file that is in memory.
+// This is the platform independent part of the shell handlers: it parses the file, selects the
+// mip level, decompresses QFS compressed entries and reads the palette, and the image is then
+// decoded and scaled to the thumbnail size in one pass.
+class FshThumbnailLoader
+{
+public:
+    // The decompressed entry data is allocated from the arena, it must stay valid while the
+    // loader is used.
+    explicit FshThumbnailLoader(ThumbnailArena* arena);
+
+    // Finds the first image and the level that is decoded for a thumbnail that fits in a
+    // maxEdgeLength square, a maxEdgeLength of 0 or less keeps the size of the image.
+    // The file data must stay valid while the loader is used.
+    FshLoadStatus Open(const unsigned char* data, size_t size, int maxEdgeLength);
+
+    // Opens a file of fileSize bytes when only the first available bytes are at data, e.g. the
+    // prefix from DecompressFshPrefix. Nothing after them is read, a file that needs more of its
+    // data than that is not valid.
+    FshLoadStatus Open(const unsigned char* data, size_t available, size_t fileSize, int maxEdgeLength);
+
+    // The size of the thumbnail.
+    int GetWidth() const;
+    int GetHeight() const;
+
+    // The image level that is decoded, e.g. for a FshThumbnailLadder.
+    const FshImageSource& GetImageSource() const;
+
+    // Decodes the thumbnail to GetWidth by GetHeight BGRA pixels, large DXT images use up to
+    // maxThreads threads.
+    FshLoadStatus Decode(unsigned char* dst, size_t dstStride, int maxThreads = 1) const;
+    FshLoadStatus Decode(PixelBuffer* buffer) const;
+
+private:
+    FshThumbnailLoader(const FshThumbnailLoader&) = delete;
+    FshThumbnailLoader& operator=(const FshThumbnailLoader&) = delete;
+
+    FshLoadStatus DecompressEntry(const unsigned char* data, size_t size, const unsigned char** output, size_t* outputSize);
+
+    ThumbnailArena* arena;
+    FshImageSource source;
+    unsigned int palette[256];
+    int width;
+    int height;
+};
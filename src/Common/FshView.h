@@ -0,0 +1,242 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+#include "FshHeaders.h"
+
+// A directory entry, the entry data is not copied.
+struct FshViewEntry
+{
+    char name[4];
+    size_t offset;
+    size_t end; // the offset of the entry that follows it in the file, or the file size
+};
+
+// A read-only index of the entries in an FSH file.
+// The header and directory are validated once when the view is opened, after that every
+// entry offset and extent is known to be inside the file. The entry headers are only read
+// when they are requested so the view can be opened before the entry data is available.
+class FshView
+{
+public:
+    FshView() : data(nullptr), size(0), availableSize(0)
+    {
+    }
+
+    // Opens a view over the size bytes at data, which must stay valid while the view is used.
+    // Returns false if the header or directory is not valid.
+    bool Open(const unsigned char* fileData, size_t fileSize)
+    {
+        return Open(fileData, fileSize, fileSize);
+    }
+
+    // Opens a view over a file of fileSize bytes when only the first available bytes are at data,
+    // e.g. the part of a compressed file that was decompressed. The header and directory must be
+    // available, the callers check IsAvailable before they read the other parts of the file.
+    bool Open(const unsigned char* fileData, size_t available, size_t fileSize)
+    {
+        data = fileData;
+        size = fileSize;
+        availableSize = available < fileSize ? available : fileSize;
+        entries.clear();
+        names.clear();
+
+        if (availableSize < sizeof(FshHeader))
+        {
+            return false;
+        }
+
+        FshHeader header;
+        memcpy(&header, data, sizeof(header));
+
+        if (header.numBmps <= 0 || static_cast<size_t>(header.numBmps) > ((size - sizeof(FshHeader)) / sizeof(FshDirEntry)))
+        {
+            return false;
+        }
+
+        const int count = header.numBmps;
+        const size_t directoryEnd = sizeof(FshHeader) + (count * sizeof(FshDirEntry));
+
+        // The directory is in memory so the count is bounded by the data before anything is allocated.
+        if (directoryEnd > availableSize)
+        {
+            return false;
+        }
+
+        try
+        {
+            return ReadDirectory(count, directoryEnd);
+        }
+        catch (const std::bad_alloc&)
+        {
+            entries.clear();
+            names.clear();
+            return false;
+        }
+    }
+
+    // Points the view at a copy of the file data, e.g. after the buffer that it is read into was grown.
+    void SetData(const unsigned char* fileData)
+    {
+        data = fileData;
+    }
+
+    int GetEntryCount() const
+    {
+        return static_cast<int>(entries.size());
+    }
+
+    const FshViewEntry& GetEntry(int index) const
+    {
+        return entries[index];
+    }
+
+    // Returns true if the length bytes at offset are in the part of the file that is at data.
+    bool IsAvailable(size_t offset, size_t length) const
+    {
+        return offset <= availableSize && length <= (availableSize - offset);
+    }
+
+    // The offset must be one that the view returned and the header must be available.
+    FshEntryHeader GetEntryHeader(size_t offset) const
+    {
+        FshEntryHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+
+        return header;
+    }
+
+    // Returns the index of the first entry in directory order with the name, or -1 if there is none.
+    int FindEntry(const char* name) const
+    {
+        NameIndex key;
+        key.name = PackName(name);
+        key.index = -1;
+
+        std::vector<NameIndex>::const_iterator it = std::lower_bound(names.begin(), names.end(), key, CompareNames);
+
+        return it != names.end() && it->name == key.name ? it->index : -1;
+    }
+
+    // Entries can have attachments such as a palette or a text label after their data, the low
+    // byte of the code is the type and the upper 24 bits are the distance to the next attachment.
+    // Returns the offset of the attachment that follows the header at offset, or 0 at the end of the chain.
+    size_t GetNextAttachment(int index, size_t offset) const
+    {
+        const unsigned int distance = static_cast<unsigned int>(GetEntryHeader(offset).code) >> 8;
+        const size_t end = entries[index].end;
+
+        if (distance == 0 || distance > (end - offset) || (end - offset - distance) < sizeof(FshEntryHeader))
+        {
+            return 0;
+        }
+
+        return offset + distance;
+    }
+
+    static bool IsImageCode(int code)
+    {
+        code &= 0x7f;
+
+        return code == 0x7b || code == 0x7d || code == 0x7e || code == 0x7f || code == 0x78 || code == 0x6d || code == 0x60 || code == 0x61;
+    }
+
+    static bool IsPaletteCode(int code)
+    {
+        code &= 0xff;
+
+        return code == 0x22 || code == 0x24 || code == 0x29 || code == 0x2a || code == 0x2d;
+    }
+
+private:
+    struct NameIndex
+    {
+        unsigned int name;
+        int index;
+    };
+
+    // Builds the entry and name indexes, the containers throw std::bad_alloc when they cannot grow.
+    bool ReadDirectory(int count, size_t directoryEnd)
+    {
+        entries.resize(count);
+        names.resize(count);
+
+        std::vector<size_t> sortedOffsets(count);
+
+        for (int i = 0; i < count; i++)
+        {
+            FshDirEntry dir;
+            memcpy(&dir, data + sizeof(FshHeader) + (i * sizeof(FshDirEntry)), sizeof(dir));
+
+            if (dir.offset < 0 || static_cast<size_t>(dir.offset) < directoryEnd || static_cast<size_t>(dir.offset) > (size - sizeof(FshEntryHeader)))
+            {
+                entries.clear();
+                names.clear();
+                return false;
+            }
+
+            memcpy(entries[i].name, dir.name, sizeof(dir.name));
+            entries[i].offset = static_cast<size_t>(dir.offset);
+
+            names[i].name = PackName(dir.name);
+            names[i].index = i;
+            sortedOffsets[i] = entries[i].offset;
+        }
+
+        // The entries do not store their length, an entry ends where the entry with the next larger offset starts.
+        std::sort(sortedOffsets.begin(), sortedOffsets.end());
+
+        for (int i = 0; i < count; i++)
+        {
+            std::vector<size_t>::const_iterator next = std::upper_bound(sortedOffsets.begin(), sortedOffsets.end(), entries[i].offset);
+
+            entries[i].end = next != sortedOffsets.end() ? *next : size;
+        }
+
+        std::stable_sort(names.begin(), names.end(), CompareNames);
+
+        return true;
+    }
+
+    static unsigned int PackName(const char* name)
+    {
+        unsigned int packed;
+        memcpy(&packed, name, sizeof(packed));
+
+        return packed;
+    }
+
+    static bool CompareNames(const NameIndex& a, const NameIndex& b)
+    {
+        return a.name < b.name;
+    }
+
+    const unsigned char* data;
+    size_t size;
+    size_t availableSize;
+    std::vector<FshViewEntry> entries;
+    std::vector<NameIndex> names; // sorted by name, entries with the same name stay in directory order
+};
@@ -0,0 +1,906 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "ImageScaler.h"
+#include "CpuFeatures.h"
+#include <math.h>
+#include <string.h>
+#include <new>
+
+#if FSH_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+// The image is scaled in two separable passes using 16-bit fixed point values, the rows are
+// first scaled horizontally and then the columns of the scaled rows are averaged.
+//
+// The pixels are premultiplied with 15 bits of precision so that a pair of pixels can be
+// multiplied by their weights and added with a single pmaddwd. The color channels hold
+// color * alpha / 2 and the alpha channel holds alpha * 255 / 2, both are 0 to 32513.
+// The weights of each destination pixel add up to 1 << WeightBits.
+
+static const int WeightBits = 14;
+static const int WeightRound = 1 << (WeightBits - 1);
+
+// Pads the weight lists to a multiple of 4 so the kernels can process 2 or 4 source pixels
+// per iteration, the padding has a weight of 0.
+static const int WeightAlignment = 4;
+
+// The premultiplied rows have room for the source pixels read by the padded weight lists.
+static const int RowPadding = WeightAlignment;
+
+// When the image is reduced by a power of two the pixels are averaged in boxes of
+// 1 << shift by 1 << shift pixels without the weights, the box sums must fit in 32 bits.
+static const int MaxBoxShift = 7;
+
+struct ScaleContribution
+{
+    int start;
+    int count;
+};
+
+struct ScaleAxis
+{
+    ScaleContribution* contributions;
+    short* weights;    // weightStride weights for each destination pixel
+    int weightStride;
+};
+
+static int GetMaxContributionCount(int srcSize, int dstSize)
+{
+    return (srcSize / dstSize) + 2;
+}
+
+static int GetWeightStride(int srcSize, int dstSize)
+{
+    return (GetMaxContributionCount(srcSize, dstSize) + (WeightAlignment - 1)) & ~(WeightAlignment - 1);
+}
+
+// Each destination pixel d covers the source interval [d * srcSize, (d + 1) * srcSize) in units
+// of 1 / dstSize source pixels. The weights are rounded from the running total of the covered
+// area so that they always add up to 1 << WeightBits.
+static void BuildContributions(int srcSize, int dstSize, ScaleAxis* axis)
+{
+    const long long scale = 1LL << WeightBits;
+
+    for (int d = 0; d < dstSize; d++)
+    {
+        const long long begin = static_cast<long long>(d) * srcSize;
+        const long long end = begin + srcSize;
+        const int first = static_cast<int>(begin / dstSize);
+        const int last = static_cast<int>((end - 1) / dstSize);
+
+        ScaleContribution* contribution = axis->contributions + d;
+        short* weights = axis->weights + (static_cast<size_t>(d) * axis->weightStride);
+
+        contribution->start = first;
+        contribution->count = (last - first) + 1;
+
+        long long covered = 0;
+        int previous = 0;
+
+        for (int k = first; k <= last; k++)
+        {
+            const long long pixelBegin = static_cast<long long>(k) * dstSize;
+            const long long pixelEnd = pixelBegin + dstSize;
+
+            covered += (pixelEnd < end ? pixelEnd : end) - (pixelBegin > begin ? pixelBegin : begin);
+
+            const int total = static_cast<int>(((covered * scale) + (srcSize / 2)) / srcSize);
+
+            weights[k - first] = static_cast<short>(total - previous);
+            previous = total;
+        }
+    }
+}
+
+// Converts width pixels to the premultiplied 16-bit format.
+typedef void (*PremultiplyRowProc)(const unsigned char* src, short* dst, int width);
+
+// Scales one premultiplied row horizontally.
+typedef void (*ScaleRowProc)(const short* src, short* dst, const ScaleAxis& axis, int dstWidth);
+
+// Averages the count rows into one destination row and converts it back to 8-bit BGRA,
+// count is a multiple of 2 and the padding rows have a weight of 0.
+typedef void (*ScaleColumnsProc)(const short* const* rows, const short* weights, int count, unsigned char* dst, int dstWidth);
+
+// Adds the premultiplied pixels of each group of 1 << shift pixels in the row to the sums.
+typedef void (*SumBoxRowProc)(const unsigned char* src, int* sums, int width, int shift);
+
+// Converts the box sums to the premultiplied 16-bit format or to 8-bit BGRA,
+// each sum holds 1 << (2 * shift) pixels.
+typedef void (*BoxSumsToPremultipliedProc)(const int* sums, short* dst, int width, int shift);
+typedef void (*BoxSumsToBGRAProc)(const int* sums, unsigned char* dst, int width, int shift);
+
+static void PremultiplyRowScalar(const unsigned char* src, short* dst, int width)
+{
+    for (int x = 0; x < width; x++)
+    {
+        const int alpha = src[3];
+
+        dst[0] = static_cast<short>(((src[0] * alpha) + 1) >> 1);
+        dst[1] = static_cast<short>(((src[1] * alpha) + 1) >> 1);
+        dst[2] = static_cast<short>(((src[2] * alpha) + 1) >> 1);
+        dst[3] = static_cast<short>(((alpha * 255) + 1) >> 1);
+
+        src += 4;
+        dst += 4;
+    }
+}
+
+static void ScaleRowScalar(const short* src, short* dst, const ScaleAxis& axis, int dstWidth)
+{
+    for (int x = 0; x < dstWidth; x++)
+    {
+        const ScaleContribution& contribution = axis.contributions[x];
+        const short* weights = axis.weights + (static_cast<size_t>(x) * axis.weightStride);
+        const short* pixel = src + (static_cast<size_t>(contribution.start) * 4);
+
+        int sum[4] = { WeightRound, WeightRound, WeightRound, WeightRound };
+
+        for (int k = 0; k < contribution.count; k++)
+        {
+            sum[0] += pixel[0] * weights[k];
+            sum[1] += pixel[1] * weights[k];
+            sum[2] += pixel[2] * weights[k];
+            sum[3] += pixel[3] * weights[k];
+
+            pixel += 4;
+        }
+
+        dst[0] = static_cast<short>(sum[0] >> WeightBits);
+        dst[1] = static_cast<short>(sum[1] >> WeightBits);
+        dst[2] = static_cast<short>(sum[2] >> WeightBits);
+        dst[3] = static_cast<short>(sum[3] >> WeightBits);
+
+        dst += 4;
+    }
+}
+
+// Converts one premultiplied pixel back to 8-bit BGRA, the SIMD kernels use the same
+// single precision operations so they produce the same output.
+static void UnpremultiplyPixel(const int* sum, unsigned char* dst)
+{
+    const float alpha = static_cast<float>(sum[3]);
+    const float colorScale = 255.0f / (alpha > 1.0f ? alpha : 1.0f);
+    const float alphaScale = 2.0f / 255.0f;
+
+    for (int i = 0; i < 3; i++)
+    {
+        const float value = static_cast<float>(sum[i]) * colorScale;
+
+        dst[i] = static_cast<unsigned char>(lrintf(value < 255.0f ? value : 255.0f));
+    }
+
+    const float value = alpha * alphaScale;
+    dst[3] = static_cast<unsigned char>(lrintf(value < 255.0f ? value : 255.0f));
+}
+
+static void ScaleColumnsScalarRange(const short* const* rows, const short* weights, int count, unsigned char* dst, int firstPixel, int lastPixel)
+{
+    for (int x = firstPixel; x < lastPixel; x++)
+    {
+        int sum[4] = { WeightRound, WeightRound, WeightRound, WeightRound };
+
+        for (int k = 0; k < count; k++)
+        {
+            const short* pixel = rows[k] + (static_cast<size_t>(x) * 4);
+
+            sum[0] += pixel[0] * weights[k];
+            sum[1] += pixel[1] * weights[k];
+            sum[2] += pixel[2] * weights[k];
+            sum[3] += pixel[3] * weights[k];
+        }
+
+        for (int i = 0; i < 4; i++)
+        {
+            sum[i] >>= WeightBits;
+        }
+
+        UnpremultiplyPixel(sum, dst + (static_cast<size_t>(x) * 4));
+    }
+}
+
+static void ScaleColumnsScalar(const short* const* rows, const short* weights, int count, unsigned char* dst, int dstWidth)
+{
+    ScaleColumnsScalarRange(rows, weights, count, dst, 0, dstWidth);
+}
+
+static void SumBoxRowScalar(const unsigned char* src, int* sums, int width, int shift)
+{
+    const int groupSize = 1 << shift;
+
+    for (int x = 0; x < width; x++)
+    {
+        for (int k = 0; k < groupSize; k++)
+        {
+            const int alpha = src[3];
+
+            sums[0] += ((src[0] * alpha) + 1) >> 1;
+            sums[1] += ((src[1] * alpha) + 1) >> 1;
+            sums[2] += ((src[2] * alpha) + 1) >> 1;
+            sums[3] += ((alpha * 255) + 1) >> 1;
+
+            src += 4;
+        }
+
+        sums += 4;
+    }
+}
+
+static void BoxSumsToPremultipliedScalar(const int* sums, short* dst, int width, int shift)
+{
+    const int boxBits = 2 * shift;
+    const int round = 1 << (boxBits - 1);
+
+    for (int i = 0; i < width * 4; i++)
+    {
+        dst[i] = static_cast<short>((sums[i] + round) >> boxBits);
+    }
+}
+
+static void BoxSumsToBGRAScalar(const int* sums, unsigned char* dst, int width, int shift)
+{
+    const int boxBits = 2 * shift;
+    const int round = 1 << (boxBits - 1);
+
+    for (int x = 0; x < width; x++)
+    {
+        int value[4];
+
+        for (int i = 0; i < 4; i++)
+        {
+            value[i] = (sums[i] + round) >> boxBits;
+        }
+
+        UnpremultiplyPixel(value, dst);
+
+        sums += 4;
+        dst += 4;
+    }
+}
+
+#if FSH_X86
+
+static FSH_TARGET_SSE2 __m128i LoadWeightPairSSE2(const short* weights)
+{
+    int pair;
+    memcpy(&pair, weights, sizeof(pair));
+
+    return _mm_set1_epi32(pair);
+}
+
+// The alpha lane of each pixel is multiplied by 255 instead of the pixel alpha.
+static FSH_TARGET_SSE2 __m128i PremultiplyPixelsSSE2(__m128i pixels)
+{
+    const __m128i colorMask = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+    const __m128i alphaLane = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+
+    const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    const __m128i factor = _mm_or_si128(_mm_and_si128(alpha, colorMask), alphaLane);
+
+    // The products fit in an unsigned 16-bit value.
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(pixels, factor), _mm_set1_epi16(1)), 1);
+}
+
+// 4 pixels per iteration
+static FSH_TARGET_SSE2 void PremultiplyRowSSE2(const unsigned char* src, short* dst, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    int x = 0;
+
+    for (; (x + 4) <= width; x += 4)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), PremultiplyPixelsSSE2(_mm_unpacklo_epi8(pixels, zero)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8), PremultiplyPixelsSSE2(_mm_unpackhi_epi8(pixels, zero)));
+
+        src += 16;
+        dst += 16;
+    }
+
+    PremultiplyRowScalar(src, dst, width - x);
+}
+
+// 2 source pixels per iteration, the pixels are interleaved by channel so that one
+// pmaddwd multiplies both of them by their weights and adds the products.
+static FSH_TARGET_SSE2 void ScaleRowSSE2(const short* src, short* dst, const ScaleAxis& axis, int dstWidth)
+{
+    for (int x = 0; x < dstWidth; x++)
+    {
+        const ScaleContribution& contribution = axis.contributions[x];
+        const short* weights = axis.weights + (static_cast<size_t>(x) * axis.weightStride);
+        const short* pixel = src + (static_cast<size_t>(contribution.start) * 4);
+
+        __m128i sum = _mm_set1_epi32(WeightRound);
+
+        for (int k = 0; k < contribution.count; k += 2)
+        {
+            const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixel + (k * 4)));
+            const __m128i interleaved = _mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8));
+
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(interleaved, LoadWeightPairSSE2(weights + k)));
+        }
+
+        const __m128i result = _mm_srai_epi32(sum, WeightBits);
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packs_epi32(result, result));
+
+        dst += 4;
+    }
+}
+
+// Converts the premultiplied values of one pixel to 8-bit BGRA, the result is in the low byte of each 32-bit lane.
+static FSH_TARGET_SSE2 __m128i UnpremultiplyPixelsSSE2(__m128i pixel)
+{
+    const __m128 value = _mm_cvtepi32_ps(pixel);
+    const __m128 alpha = _mm_shuffle_ps(value, value, _MM_SHUFFLE(3, 3, 3, 3));
+    const __m128 colorScale = _mm_div_ps(_mm_set1_ps(255.0f), _mm_max_ps(alpha, _mm_set1_ps(1.0f)));
+    const __m128 scale = _mm_or_ps(_mm_and_ps(colorScale, _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0))), _mm_setr_ps(0.0f, 0.0f, 0.0f, 2.0f / 255.0f));
+
+    return _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(value, scale), _mm_set1_ps(255.0f)));
+}
+
+// 2 destination pixels per iteration, the rows are added in pairs with pmaddwd.
+static FSH_TARGET_SSE2 void ScaleColumnsSSE2Range(const short* const* rows, const short* weights, int count, unsigned char* dst, int firstPixel, int lastPixel)
+{
+    int x = firstPixel;
+
+    for (; (x + 2) <= lastPixel; x += 2)
+    {
+        const size_t offset = static_cast<size_t>(x) * 4;
+
+        __m128i sumLo = _mm_set1_epi32(WeightRound);
+        __m128i sumHi = sumLo;
+
+        for (int k = 0; k < count; k += 2)
+        {
+            const __m128i row0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + offset));
+            const __m128i row1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k + 1] + offset));
+            const __m128i weightPair = LoadWeightPairSSE2(weights + k);
+
+            sumLo = _mm_add_epi32(sumLo, _mm_madd_epi16(_mm_unpacklo_epi16(row0, row1), weightPair));
+            sumHi = _mm_add_epi32(sumHi, _mm_madd_epi16(_mm_unpackhi_epi16(row0, row1), weightPair));
+        }
+
+        const __m128i words = _mm_packs_epi32(UnpremultiplyPixelsSSE2(_mm_srai_epi32(sumLo, WeightBits)), UnpremultiplyPixelsSSE2(_mm_srai_epi32(sumHi, WeightBits)));
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + offset), _mm_packus_epi16(words, words));
+    }
+
+    ScaleColumnsScalarRange(rows, weights, count, dst, x, lastPixel);
+}
+
+static FSH_TARGET_SSE2 void ScaleColumnsSSE2(const short* const* rows, const short* weights, int count, unsigned char* dst, int dstWidth)
+{
+    ScaleColumnsSSE2Range(rows, weights, count, dst, 0, dstWidth);
+}
+
+// Adds the two premultiplied pixels in the register, the channels of the pixels
+// are interleaved and added with pmaddwd.
+static FSH_TARGET_SSE2 __m128i SumPixelPairSSE2(__m128i pixels)
+{
+    return _mm_madd_epi16(_mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8)), _mm_set1_epi16(1));
+}
+
+// 4 source pixels per iteration
+static FSH_TARGET_SSE2 void SumBoxRowSSE2(const unsigned char* src, int* sums, int width, int shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    if (shift == 1)
+    {
+        int x = 0;
+
+        for (; (x + 2) <= width; x += 2)
+        {
+            const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+            const __m128i pair0 = SumPixelPairSSE2(PremultiplyPixelsSSE2(_mm_unpacklo_epi8(pixels, zero)));
+            const __m128i pair1 = SumPixelPairSSE2(PremultiplyPixelsSSE2(_mm_unpackhi_epi8(pixels, zero)));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(sums), _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sums)), pair0));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + 4), _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sums + 4)), pair1));
+
+            src += 16;
+            sums += 8;
+        }
+
+        SumBoxRowScalar(src, sums, width - x, shift);
+    }
+    else
+    {
+        const int groupSize = 1 << shift;
+
+        for (int x = 0; x < width; x++)
+        {
+            __m128i sum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sums));
+
+            for (int k = 0; k < groupSize; k += 4)
+            {
+                const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+                sum = _mm_add_epi32(sum, SumPixelPairSSE2(PremultiplyPixelsSSE2(_mm_unpacklo_epi8(pixels, zero))));
+                sum = _mm_add_epi32(sum, SumPixelPairSSE2(PremultiplyPixelsSSE2(_mm_unpackhi_epi8(pixels, zero))));
+
+                src += 16;
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(sums), sum);
+
+            sums += 4;
+        }
+    }
+}
+
+// 2 pixels per iteration
+static FSH_TARGET_SSE2 void BoxSumsToPremultipliedSSE2(const int* sums, short* dst, int width, int shift)
+{
+    const __m128i boxBits = _mm_cvtsi32_si128(2 * shift);
+    const __m128i round = _mm_set1_epi32(1 << ((2 * shift) - 1));
+
+    int x = 0;
+
+    for (; (x + 2) <= width; x += 2)
+    {
+        const __m128i pixel0 = _mm_sra_epi32(_mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sums)), round), boxBits);
+        const __m128i pixel1 = _mm_sra_epi32(_mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sums + 4)), round), boxBits);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_packs_epi32(pixel0, pixel1));
+
+        sums += 8;
+        dst += 8;
+    }
+
+    BoxSumsToPremultipliedScalar(sums, dst, width - x, shift);
+}
+
+// 2 pixels per iteration
+static FSH_TARGET_SSE2 void BoxSumsToBGRASSE2(const int* sums, unsigned char* dst, int width, int shift)
+{
+    const __m128i boxBits = _mm_cvtsi32_si128(2 * shift);
+    const __m128i round = _mm_set1_epi32(1 << ((2 * shift) - 1));
+
+    int x = 0;
+
+    for (; (x + 2) <= width; x += 2)
+    {
+        const __m128i pixel0 = _mm_sra_epi32(_mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sums)), round), boxBits);
+        const __m128i pixel1 = _mm_sra_epi32(_mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sums + 4)), round), boxBits);
+        const __m128i words = _mm_packs_epi32(UnpremultiplyPixelsSSE2(pixel0), UnpremultiplyPixelsSSE2(pixel1));
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packus_epi16(words, words));
+
+        sums += 8;
+        dst += 8;
+    }
+
+    BoxSumsToBGRAScalar(sums, dst, width - x, shift);
+}
+
+// Premultiplies the 4 pixels at src, the alpha lane of each pixel is multiplied by 255.
+static FSH_TARGET_AVX2 __m256i PremultiplyPixelsAVX2(const unsigned char* src)
+{
+    const __m256i colorMask = _mm256_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0);
+    const __m256i alphaLane = _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255);
+
+    const __m256i pixels = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+
+    const __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    const __m256i factor = _mm256_or_si256(_mm256_and_si256(alpha, colorMask), alphaLane);
+
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(pixels, factor), _mm256_set1_epi16(1)), 1);
+}
+
+// 8 pixels per iteration
+static FSH_TARGET_AVX2 void PremultiplyRowAVX2(const unsigned char* src, short* dst, int width)
+{
+    int x = 0;
+
+    for (; (x + 8) <= width; x += 8)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), PremultiplyPixelsAVX2(src));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 16), PremultiplyPixelsAVX2(src + 16));
+
+        src += 32;
+        dst += 32;
+    }
+
+    PremultiplyRowSSE2(src, dst, width - x);
+}
+
+// 8 source pixels per iteration, the smaller boxes use the SSE2 kernel.
+static FSH_TARGET_AVX2 void SumBoxRowAVX2(const unsigned char* src, int* sums, int width, int shift)
+{
+    if (shift < 3)
+    {
+        SumBoxRowSSE2(src, sums, width, shift);
+        return;
+    }
+
+    const __m256i ones = _mm256_set1_epi16(1);
+    const int groupSize = 1 << shift;
+
+    for (int x = 0; x < width; x++)
+    {
+        __m256i sum = _mm256_setzero_si256();
+
+        for (int k = 0; k < groupSize; k += 8)
+        {
+            // Each 128-bit lane holds a pair of pixels.
+            const __m256i pixels0 = PremultiplyPixelsAVX2(src);
+            const __m256i pixels1 = PremultiplyPixelsAVX2(src + 16);
+
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_unpacklo_epi16(pixels0, _mm256_srli_si256(pixels0, 8)), ones));
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_unpacklo_epi16(pixels1, _mm256_srli_si256(pixels1, 8)), ones));
+
+            src += 32;
+        }
+
+        const __m128i total = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(sums), _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sums)), total));
+
+        sums += 4;
+    }
+}
+
+// 4 source pixels per iteration, each 128-bit lane handles a pair of pixels.
+static FSH_TARGET_AVX2 void ScaleRowAVX2(const short* src, short* dst, const ScaleAxis& axis, int dstWidth)
+{
+    for (int x = 0; x < dstWidth; x++)
+    {
+        const ScaleContribution& contribution = axis.contributions[x];
+        const short* weights = axis.weights + (static_cast<size_t>(x) * axis.weightStride);
+        const short* pixel = src + (static_cast<size_t>(contribution.start) * 4);
+
+        __m256i sum = _mm256_setzero_si256();
+
+        for (int k = 0; k < contribution.count; k += 4)
+        {
+            const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixel + (k * 4)));
+            const __m256i interleaved = _mm256_unpacklo_epi16(pixels, _mm256_srli_si256(pixels, 8));
+            const __m256i weightPairs = _mm256_inserti128_si256(_mm256_castsi128_si256(LoadWeightPairSSE2(weights + k)), LoadWeightPairSSE2(weights + k + 2), 1);
+
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(interleaved, weightPairs));
+        }
+
+        __m128i total = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        total = _mm_srai_epi32(_mm_add_epi32(total, _mm_set1_epi32(WeightRound)), WeightBits);
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packs_epi32(total, total));
+
+        dst += 4;
+    }
+}
+
+static FSH_TARGET_AVX2 __m256i UnpremultiplyPixelsAVX2(__m256i pixels)
+{
+    const __m256 value = _mm256_cvtepi32_ps(pixels);
+    const __m256 alpha = _mm256_shuffle_ps(value, value, _MM_SHUFFLE(3, 3, 3, 3));
+    const __m256 colorScale = _mm256_div_ps(_mm256_set1_ps(255.0f), _mm256_max_ps(alpha, _mm256_set1_ps(1.0f)));
+    const __m256 colorMask = _mm256_castsi256_ps(_mm256_setr_epi32(-1, -1, -1, 0, -1, -1, -1, 0));
+    const __m256 alphaScale = _mm256_setr_ps(0.0f, 0.0f, 0.0f, 2.0f / 255.0f, 0.0f, 0.0f, 0.0f, 2.0f / 255.0f);
+    const __m256 scale = _mm256_or_ps(_mm256_and_ps(colorScale, colorMask), alphaScale);
+
+    return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_mul_ps(value, scale), _mm256_set1_ps(255.0f)));
+}
+
+// 4 destination pixels per iteration
+static FSH_TARGET_AVX2 void ScaleColumnsAVX2(const short* const* rows, const short* weights, int count, unsigned char* dst, int dstWidth)
+{
+    int x = 0;
+
+    for (; (x + 4) <= dstWidth; x += 4)
+    {
+        const size_t offset = static_cast<size_t>(x) * 4;
+
+        __m256i sumLo = _mm256_set1_epi32(WeightRound);
+        __m256i sumHi = sumLo;
+
+        for (int k = 0; k < count; k += 2)
+        {
+            const __m256i row0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k] + offset));
+            const __m256i row1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k + 1] + offset));
+            const __m256i weightPair = _mm256_broadcastsi128_si256(LoadWeightPairSSE2(weights + k));
+
+            sumLo = _mm256_add_epi32(sumLo, _mm256_madd_epi16(_mm256_unpacklo_epi16(row0, row1), weightPair));
+            sumHi = _mm256_add_epi32(sumHi, _mm256_madd_epi16(_mm256_unpackhi_epi16(row0, row1), weightPair));
+        }
+
+        // The unpack instructions work within each 128-bit lane, so sumLo holds pixels 0 and 2
+        // and sumHi holds pixels 1 and 3. The packs restore the pixel order within each lane.
+        const __m256i words = _mm256_packs_epi32(UnpremultiplyPixelsAVX2(_mm256_srai_epi32(sumLo, WeightBits)), UnpremultiplyPixelsAVX2(_mm256_srai_epi32(sumHi, WeightBits)));
+        const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), _MM_SHUFFLE(3, 1, 2, 0));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + offset), _mm256_castsi256_si128(bytes));
+    }
+
+    ScaleColumnsSSE2Range(rows, weights, count, dst, x, dstWidth);
+}
+
+#endif // FSH_X86
+
+// The kernels of one instruction set.
+struct ScaleKernels
+{
+    PremultiplyRowProc premultiplyRow;
+    ScaleRowProc scaleRow;
+    ScaleColumnsProc scaleColumns;
+    SumBoxRowProc sumBoxRow;
+    BoxSumsToPremultipliedProc boxSumsToPremultiplied;
+    BoxSumsToBGRAProc boxSumsToBGRA;
+};
+
+static const ScaleKernels ScalarKernels =
+{
+    PremultiplyRowScalar, ScaleRowScalar, ScaleColumnsScalar, SumBoxRowScalar, BoxSumsToPremultipliedScalar, BoxSumsToBGRAScalar
+};
+
+#if FSH_X86
+static const ScaleKernels SSE2Kernels =
+{
+    PremultiplyRowSSE2, ScaleRowSSE2, ScaleColumnsSSE2, SumBoxRowSSE2, BoxSumsToPremultipliedSSE2, BoxSumsToBGRASSE2
+};
+
+// The box sums are converted with SSE2, they are a small part of the time.
+static const ScaleKernels AVX2Kernels =
+{
+    PremultiplyRowAVX2, ScaleRowAVX2, ScaleColumnsAVX2, SumBoxRowAVX2, BoxSumsToPremultipliedSSE2, BoxSumsToBGRASSE2
+};
+#endif
+
+// The kernels are selected for each image, so SetCpuFeatureLevel applies to the next one.
+static const ScaleKernels* SelectScaleKernels()
+{
+#if FSH_X86
+    if (CpuHasAVX2())
+    {
+        return &AVX2Kernels;
+    }
+    else if (CpuHasSSE2())
+    {
+        return &SSE2Kernels;
+    }
+#endif
+
+    return &ScalarKernels;
+}
+
+// Returns the largest power of two reduction that divides both source dimensions and leaves
+// a whole number of reduced pixels for each destination pixel. The boxes then never cross the
+// edge of a destination pixel, so the result is the same area average as without the box
+// reduction.
+static int GetBoxShift(int srcWidth, int srcHeight, int dstWidth, int dstHeight)
+{
+    int shift = 0;
+
+    while (shift < MaxBoxShift)
+    {
+        const int next = shift + 1;
+        const int mask = (1 << next) - 1;
+
+        if ((srcWidth & mask) != 0 || (srcHeight & mask) != 0 || ((srcWidth >> next) % dstWidth) != 0 || ((srcHeight >> next) % dstHeight) != 0)
+        {
+            break;
+        }
+
+        shift = next;
+    }
+
+    return shift;
+}
+
+ImageScaler::ImageScaler()
+    : srcWidth(0), srcHeight(0), dst(nullptr), dstStride(0), dstWidth(0), dstHeight(0),
+      boxShift(0), reducedWidth(0), reducedHeight(0), boxOnly(false),
+      xContributions(nullptr), yContributions(nullptr), xWeights(nullptr), yWeights(nullptr),
+      xWeightStride(0), yWeightStride(0), sourceRow(nullptr), boxSums(nullptr), ring(nullptr),
+      ringRows(0), rows(nullptr), addedRows(0), reducedRows(0), writtenRows(0), kernels(nullptr)
+{
+}
+
+ImageScaler::~ImageScaler()
+{
+    delete[] rows;
+    delete[] ring;
+    delete[] boxSums;
+    delete[] sourceRow;
+    delete[] yWeights;
+    delete[] xWeights;
+    delete[] yContributions;
+    delete[] xContributions;
+}
+
+bool ImageScaler::Initialize(int srcWidth, int srcHeight, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight)
+{
+    if (srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0 || xContributions != nullptr)
+    {
+        return false;
+    }
+
+    this->srcWidth = srcWidth;
+    this->srcHeight = srcHeight;
+    this->dst = dst;
+    this->dstStride = dstStride;
+    this->dstWidth = dstWidth;
+    this->dstHeight = dstHeight;
+    kernels = SelectScaleKernels();
+
+    // Power of two textures are first reduced with a box filter, the weighted filter
+    // is only used for the remaining integer ratio.
+    boxShift = GetBoxShift(srcWidth, srcHeight, dstWidth, dstHeight);
+    reducedWidth = srcWidth >> boxShift;
+    reducedHeight = srcHeight >> boxShift;
+    boxOnly = boxShift > 0 && reducedWidth == dstWidth && reducedHeight == dstHeight;
+
+    if (boxShift > 0)
+    {
+        boxSums = new (std::nothrow) int[static_cast<size_t>(reducedWidth) * 4]();
+
+        if (boxSums == nullptr)
+        {
+            return false;
+        }
+
+        if (boxOnly)
+        {
+            // The box sums are converted straight to the destination pixels.
+            return true;
+        }
+    }
+
+    const size_t rowLength = static_cast<size_t>(dstWidth) * 4;
+
+    ringRows = GetMaxContributionCount(reducedHeight, dstHeight);
+    xWeightStride = GetWeightStride(reducedWidth, dstWidth);
+    yWeightStride = GetWeightStride(reducedHeight, dstHeight);
+
+    xContributions = new (std::nothrow) ScaleContribution[dstWidth];
+    yContributions = new (std::nothrow) ScaleContribution[dstHeight];
+    xWeights = new (std::nothrow) short[static_cast<size_t>(dstWidth) * xWeightStride]();
+    yWeights = new (std::nothrow) short[static_cast<size_t>(dstHeight) * yWeightStride]();
+    sourceRow = new (std::nothrow) short[(static_cast<size_t>(reducedWidth) + RowPadding) * 4]();
+    ring = new (std::nothrow) short[rowLength * ringRows];
+    rows = new (std::nothrow) const short*[yWeightStride];
+
+    if (!xContributions || !yContributions || !xWeights || !yWeights || !sourceRow || !ring || !rows)
+    {
+        return false;
+    }
+
+    ScaleAxis xAxis = { xContributions, xWeights, xWeightStride };
+    ScaleAxis yAxis = { yContributions, yWeights, yWeightStride };
+
+    BuildContributions(reducedWidth, dstWidth, &xAxis);
+    BuildContributions(reducedHeight, dstHeight, &yAxis);
+
+    return true;
+}
+
+void ImageScaler::AddRows(const unsigned char* src, size_t srcStride, int rowCount)
+{
+    if (rowCount > (srcHeight - addedRows))
+    {
+        rowCount = srcHeight - addedRows;
+    }
+
+    for (int y = 0; y < rowCount; y++)
+    {
+        const unsigned char* row = src + (srcStride * y);
+
+        if (boxShift > 0)
+        {
+            kernels->sumBoxRow(row, boxSums, reducedWidth, boxShift);
+        }
+        else
+        {
+            kernels->premultiplyRow(row, sourceRow, srcWidth);
+        }
+
+        addedRows++;
+
+        if (boxShift == 0 || (addedRows & ((1 << boxShift) - 1)) == 0)
+        {
+            AddReducedRow();
+        }
+    }
+}
+
+// Scales the premultiplied or box reduced row horizontally and writes the destination
+// rows that it completes.
+void ImageScaler::AddReducedRow()
+{
+    if (boxShift > 0)
+    {
+        if (boxOnly)
+        {
+            // Each destination pixel is the average of a box of source pixels.
+            kernels->boxSumsToBGRA(boxSums, dst + (dstStride * reducedRows), dstWidth, boxShift);
+        }
+        else
+        {
+            kernels->boxSumsToPremultiplied(boxSums, sourceRow, reducedWidth, boxShift);
+        }
+
+        memset(boxSums, 0, static_cast<size_t>(reducedWidth) * 4 * sizeof(int));
+    }
+
+    if (!boxOnly)
+    {
+        const ScaleAxis xAxis = { xContributions, xWeights, xWeightStride };
+
+        // The destination rows are written as soon as their last row is added, so the rows that
+        // the next destination row uses are never overwritten by the rows that are added here.
+        kernels->scaleRow(sourceRow, ring + (static_cast<size_t>(dstWidth) * 4 * (reducedRows % ringRows)), xAxis, dstWidth);
+    }
+
+    reducedRows++;
+
+    if (!boxOnly)
+    {
+        WriteCompletedRows();
+    }
+}
+
+void ImageScaler::WriteCompletedRows()
+{
+    const size_t rowLength = static_cast<size_t>(dstWidth) * 4;
+
+    while (writtenRows < dstHeight)
+    {
+        const ScaleContribution& contribution = yContributions[writtenRows];
+
+        if ((contribution.start + contribution.count) > reducedRows)
+        {
+            break;
+        }
+
+        const int count = (contribution.count + 1) & ~1;
+
+        for (int k = 0; k < count; k++)
+        {
+            // The padding row has a weight of 0.
+            const int row = contribution.start + (k < contribution.count ? k : 0);
+
+            rows[k] = ring + (rowLength * (row % ringRows));
+        }
+
+        kernels->scaleColumns(rows, yWeights + (static_cast<size_t>(writtenRows) * yWeightStride), count, dst + (dstStride * writtenRows), dstWidth);
+
+        writtenRows++;
+    }
+}
+
+bool ScaleImageBGRA(const unsigned char* src, size_t srcStride, int srcWidth, int srcHeight, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight)
+{
+    ImageScaler scaler;
+
+    if (!scaler.Initialize(srcWidth, srcHeight, dst, dstStride, dstWidth, dstHeight))
+    {
+        return false;
+    }
+
+    scaler.AddRows(src, srcStride, srcHeight);
+
+    return true;
+}
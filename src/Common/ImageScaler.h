@@ -0,0 +1,84 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+struct ScaleContribution;
+struct ScaleKernels;
+
+// Resizes a 32-bit BGRA image to any size using area averaging, each destination pixel
+// is the average of the source area it covers. The color channels are weighted by alpha
+// so the color of transparent pixels does not bleed into the result, the output is not
+// premultiplied.
+//
+// The source rows are added from top to bottom in any number of calls and each destination
+// row is written as soon as all of the source rows that it covers have been added, so the
+// caller only needs to keep a few source rows in memory.
+class ImageScaler
+{
+public:
+    ImageScaler();
+    ~ImageScaler();
+
+    // Returns false if the sizes are not valid or the buffers could not be allocated.
+    bool Initialize(int srcWidth, int srcHeight, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight);
+
+    // Adds the next rowCount source rows.
+    void AddRows(const unsigned char* src, size_t srcStride, int rowCount);
+
+private:
+    ImageScaler(const ImageScaler&) = delete;
+    ImageScaler& operator=(const ImageScaler&) = delete;
+
+    void AddReducedRow();
+    void WriteCompletedRows();
+
+    int srcWidth;
+    int srcHeight;
+    unsigned char* dst;
+    size_t dstStride;
+    int dstWidth;
+    int dstHeight;
+    int boxShift;      // the power of two box reduction that is done before the weighted filter
+    int reducedWidth;
+    int reducedHeight;
+    bool boxOnly;      // the box reduction produces the destination size
+    ScaleContribution* xContributions;
+    ScaleContribution* yContributions;
+    short* xWeights;
+    short* yWeights;
+    int xWeightStride;
+    int yWeightStride;
+    short* sourceRow;  // the premultiplied source or box reduced row
+    int* boxSums;
+    short* ring;       // the horizontally scaled rows that the next destination rows use
+    int ringRows;
+    const short** rows;
+    int addedRows;     // the source rows that have been added
+    int reducedRows;   // the reduced rows that have been scaled horizontally
+    int writtenRows;   // the destination rows that have been written
+    const ScaleKernels* kernels;
+};
+
+// Scales a whole image, returns false if the sizes are not valid or the temporary
+// buffers could not be allocated.
+bool ScaleImageBGRA(const unsigned char* src, size_t srcStride, int srcWidth, int srcHeight, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight);
@@ -0,0 +1,179 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "MappedFile.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+namespace
+{
+    // PrefetchVirtualMemory is only available on Windows 8 and later.
+    struct PrefetchRange
+    {
+        void* address;
+        SIZE_T size;
+    };
+
+    typedef BOOL (WINAPI *PrefetchVirtualMemoryProc)(HANDLE, ULONG_PTR, PrefetchRange*, ULONG);
+
+    PrefetchVirtualMemoryProc GetPrefetchVirtualMemory()
+    {
+        HMODULE kernel32 = GetModuleHandleW(L"kernel32.dll");
+
+        return kernel32 ? reinterpret_cast<PrefetchVirtualMemoryProc>(GetProcAddress(kernel32, "PrefetchVirtualMemory")) : nullptr;
+    }
+}
+#endif
+
+MappedFile::MappedFile() :
+#if defined(_WIN32)
+    mapping(nullptr),
+#endif
+    data(nullptr),
+    size(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(MappedFileHandle file)
+{
+    Close();
+
+#if defined(_WIN32)
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0 ||
+        static_cast<unsigned long long>(fileSize.QuadPart) > static_cast<SIZE_T>(-1))
+    {
+        return false;
+    }
+
+    mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+    {
+        return false;
+    }
+
+    data = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!data)
+    {
+        Close();
+        return false;
+    }
+
+    size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    struct stat info;
+    if (fstat(file, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0 ||
+        static_cast<unsigned long long>(info.st_size) > static_cast<size_t>(-1))
+    {
+        return false;
+    }
+
+    void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+    if (view == MAP_FAILED)
+    {
+        return false;
+    }
+
+    data = static_cast<unsigned char*>(view);
+    size = static_cast<size_t>(info.st_size);
+
+    // Only a few parts of the file are read, the ranges that are needed are requested with
+    // WillNeed so the default read ahead would mostly load pages that are never used.
+    madvise(view, size, MADV_RANDOM);
+#endif
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+#if defined(_WIN32)
+    if (data)
+    {
+        UnmapViewOfFile(data);
+    }
+
+    if (mapping)
+    {
+        CloseHandle(mapping);
+        mapping = nullptr;
+    }
+#else
+    if (data)
+    {
+        munmap(data, size);
+    }
+#endif
+
+    data = nullptr;
+    size = 0;
+}
+
+const unsigned char* MappedFile::GetData() const
+{
+    return data;
+}
+
+size_t MappedFile::GetSize() const
+{
+    return size;
+}
+
+void MappedFile::WillNeed(size_t offset, size_t count) const
+{
+    if (!data || offset >= size || count == 0)
+    {
+        return;
+    }
+
+    if (count > size - offset)
+    {
+        count = size - offset;
+    }
+
+#if defined(_WIN32)
+    static const PrefetchVirtualMemoryProc prefetchVirtualMemory = GetPrefetchVirtualMemory();
+
+    if (prefetchVirtualMemory)
+    {
+        PrefetchRange range = { data + offset, count };
+
+        prefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+#else
+    // madvise requires a page aligned address.
+    const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t alignedOffset = offset & ~(pageSize - 1);
+
+    madvise(data + alignedOffset, count + (offset - alignedOffset), MADV_WILLNEED);
+#endif
+}
@@ -0,0 +1,61 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+typedef void* MappedFileHandle; // a file HANDLE opened with GENERIC_READ
+#else
+typedef int MappedFileHandle;   // a file descriptor opened with O_RDONLY
+#endif
+
+// A read-only view of a whole file.
+// Parsing the file in place avoids allocating a buffer for it and copying the data, the
+// pages that are never read (e.g. the larger mip levels) are never loaded from the disk.
+// Open fails for empty files and files that do not fit in the address space, the caller
+// then falls back to reading the file.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool Open(MappedFileHandle file);
+    void Close();
+
+    const unsigned char* GetData() const;
+    size_t GetSize() const;
+
+    // Asks the OS to start reading a range of the file that will be used soon, this is
+    // a hint and does nothing if the OS does not support it.
+    void WillNeed(size_t offset, size_t count) const;
+
+private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+#if defined(_WIN32)
+    void* mapping;
+#endif
+    unsigned char* data;
+    size_t size;
+};
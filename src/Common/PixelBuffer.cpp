@@ -0,0 +1,87 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "PixelBuffer.h"
+#include "AlignedMemory.h"
+
+static const size_t RowAlignment = 64;
+
+PixelBuffer::PixelBuffer() : data(nullptr), width(0), height(0), stride(0)
+{
+}
+
+PixelBuffer::~PixelBuffer()
+{
+    AlignedFree(data);
+}
+
+bool PixelBuffer::Create(int width, int height)
+{
+    AlignedFree(data);
+    data = nullptr;
+    this->width = 0;
+    this->height = 0;
+    stride = 0;
+
+    if (width <= 0 || height <= 0)
+    {
+        return false;
+    }
+
+    const size_t rowStride = ((static_cast<size_t>(width) * 4) + (RowAlignment - 1)) & ~(RowAlignment - 1);
+
+    if (static_cast<size_t>(height) > (static_cast<size_t>(-1) / rowStride))
+    {
+        return false;
+    }
+
+    data = static_cast<unsigned char*>(AlignedAlloc(rowStride * height, RowAlignment));
+
+    if (data == nullptr)
+    {
+        return false;
+    }
+
+    this->width = width;
+    this->height = height;
+    stride = rowStride;
+
+    return true;
+}
+
+int PixelBuffer::GetWidth() const
+{
+    return width;
+}
+
+int PixelBuffer::GetHeight() const
+{
+    return height;
+}
+
+size_t PixelBuffer::GetStride() const
+{
+    return stride;
+}
+
+unsigned char* PixelBuffer::GetData() const
+{
+    return data;
+}
@@ -18,23 +18,31 @@
 *
 */
 
-typedef struct FshHeader
-{
-	char SHPI[4];
-	int size;
-	int numBmps;
-	char dirID[4];
-}Fsh_Header;
+#pragma once
 
-typedef struct FshDirEntry
-{
-	char name[4];
-	int offset;
-}FshDir;
-typedef struct FshEntryHeader
+#include <stddef.h>
+
+// A 32-bit BGRA image in memory, each row starts on a 64 byte boundary for the SIMD code.
+class PixelBuffer
 {
-	int code;
-	unsigned short width;
-	unsigned short height;
-	unsigned short misc[4];
-}FshEntry;
\ No newline at end of file
+public:
+    PixelBuffer();
+    ~PixelBuffer();
+
+    // Returns false if the size is not valid or the memory could not be allocated.
+    bool Create(int width, int height);
+
+    int GetWidth() const;
+    int GetHeight() const;
+    size_t GetStride() const;
+    unsigned char* GetData() const;
+
+private:
+    PixelBuffer(const PixelBuffer&) = delete;
+    PixelBuffer& operator=(const PixelBuffer&) = delete;
+
+    unsigned char* data;
+    int width;
+    int height;
+    size_t stride;
+};
@@ -0,0 +1,332 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "PixelConversion.h"
+#include "CpuFeatures.h"
+
+#if FSH_X86
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <immintrin.h>
+#endif
+
+// The channel layout of the 16-bit formats, a channel with 0 bits is always 255.
+struct FormatA1R5G5B5
+{
+    enum { BlueShift = 0, BlueBits = 5, GreenShift = 5, GreenBits = 5, RedShift = 10, RedBits = 5, AlphaShift = 15, AlphaBits = 1 };
+};
+
+struct FormatR5G6B5
+{
+    enum { BlueShift = 0, BlueBits = 5, GreenShift = 5, GreenBits = 6, RedShift = 11, RedBits = 5, AlphaShift = 0, AlphaBits = 0 };
+};
+
+struct FormatA4R4G4B4
+{
+    enum { BlueShift = 0, BlueBits = 4, GreenShift = 4, GreenBits = 4, RedShift = 8, RedBits = 4, AlphaShift = 12, AlphaBits = 4 };
+};
+
+// Converts one row of width pixels.
+typedef void (*ConvertRowProc)(const unsigned char* src, unsigned char* dst, int width);
+
+// The shifts that replicate the high bits of a 4 to 6-bit channel into its low bits.
+template <int Bits>
+struct ChannelExpansion
+{
+    enum
+    {
+        Mask = (1 << Bits) - 1,
+        LeftShift = Bits >= 4 ? 8 - Bits : 0,
+        RightShift = Bits >= 4 ? (2 * Bits) - 8 : 0
+    };
+};
+
+template <int Shift, int Bits>
+static unsigned char ExpandChannel(unsigned int pixel)
+{
+    typedef ChannelExpansion<Bits> Expansion;
+
+    const unsigned int value = (pixel >> Shift) & Expansion::Mask;
+
+    if (Bits == 0)
+    {
+        return 255;
+    }
+    else if (Bits == 1)
+    {
+        return static_cast<unsigned char>(value * 255);
+    }
+
+    return static_cast<unsigned char>((value << Expansion::LeftShift) | (value >> Expansion::RightShift));
+}
+
+template <typename Format>
+static void ConvertRowScalar(const unsigned char* src, unsigned char* dst, int width)
+{
+    for (int x = 0; x < width; x++)
+    {
+        const unsigned int pixel = src[0] | (src[1] << 8);
+
+        dst[0] = ExpandChannel<Format::BlueShift, Format::BlueBits>(pixel);
+        dst[1] = ExpandChannel<Format::GreenShift, Format::GreenBits>(pixel);
+        dst[2] = ExpandChannel<Format::RedShift, Format::RedBits>(pixel);
+        dst[3] = ExpandChannel<Format::AlphaShift, Format::AlphaBits>(pixel);
+
+        src += 2;
+        dst += 4;
+    }
+}
+
+static void ConvertR8G8B8RowScalar(const unsigned char* src, unsigned char* dst, int width)
+{
+    for (int x = 0; x < width; x++)
+    {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 255;
+
+        src += 3;
+        dst += 4;
+    }
+}
+
+#if FSH_X86
+
+// Expands a channel of 8 pixels, each 16-bit lane of the result holds the 8-bit value.
+template <int Shift, int Bits>
+static FSH_TARGET_SSE2 __m128i ExpandChannelSSE2(__m128i pixels)
+{
+    typedef ChannelExpansion<Bits> Expansion;
+
+    const __m128i value = _mm_and_si128(_mm_srli_epi16(pixels, Shift), _mm_set1_epi16(Expansion::Mask));
+
+    if (Bits == 0)
+    {
+        return _mm_set1_epi16(255);
+    }
+    else if (Bits == 1)
+    {
+        return _mm_and_si128(_mm_sub_epi16(_mm_setzero_si128(), value), _mm_set1_epi16(255));
+    }
+
+    return _mm_or_si128(_mm_slli_epi16(value, Expansion::LeftShift), _mm_srli_epi16(value, Expansion::RightShift));
+}
+
+// Packs the channels into the blue and green, and the red and alpha, bytes of each 16-bit lane.
+template <typename Format>
+static FSH_TARGET_SSE2 void ExpandPixelsSSE2(__m128i pixels, __m128i* blueGreen, __m128i* redAlpha)
+{
+    const __m128i blue = ExpandChannelSSE2<Format::BlueShift, Format::BlueBits>(pixels);
+    const __m128i green = ExpandChannelSSE2<Format::GreenShift, Format::GreenBits>(pixels);
+    const __m128i red = ExpandChannelSSE2<Format::RedShift, Format::RedBits>(pixels);
+    const __m128i alpha = ExpandChannelSSE2<Format::AlphaShift, Format::AlphaBits>(pixels);
+
+    *blueGreen = _mm_or_si128(blue, _mm_slli_epi16(green, 8));
+    *redAlpha = _mm_or_si128(red, _mm_slli_epi16(alpha, 8));
+}
+
+// 8 pixels per iteration
+template <typename Format>
+static FSH_TARGET_SSE2 void ConvertRowSSE2(const unsigned char* src, unsigned char* dst, int width)
+{
+    int x = 0;
+
+    for (; (x + 8) <= width; x += 8)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+        __m128i blueGreen;
+        __m128i redAlpha;
+        ExpandPixelsSSE2<Format>(pixels, &blueGreen, &redAlpha);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi16(blueGreen, redAlpha));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16), _mm_unpackhi_epi16(blueGreen, redAlpha));
+
+        src += 16;
+        dst += 32;
+    }
+
+    ConvertRowScalar<Format>(src, dst, width - x);
+}
+
+template <int Shift, int Bits>
+static FSH_TARGET_AVX2 __m256i ExpandChannelAVX2(__m256i pixels)
+{
+    typedef ChannelExpansion<Bits> Expansion;
+
+    const __m256i value = _mm256_and_si256(_mm256_srli_epi16(pixels, Shift), _mm256_set1_epi16(Expansion::Mask));
+
+    if (Bits == 0)
+    {
+        return _mm256_set1_epi16(255);
+    }
+    else if (Bits == 1)
+    {
+        return _mm256_and_si256(_mm256_sub_epi16(_mm256_setzero_si256(), value), _mm256_set1_epi16(255));
+    }
+
+    return _mm256_or_si256(_mm256_slli_epi16(value, Expansion::LeftShift), _mm256_srli_epi16(value, Expansion::RightShift));
+}
+
+// 16 pixels per iteration
+template <typename Format>
+static FSH_TARGET_AVX2 void ConvertRowAVX2(const unsigned char* src, unsigned char* dst, int width)
+{
+    int x = 0;
+
+    for (; (x + 16) <= width; x += 16)
+    {
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+
+        const __m256i blue = ExpandChannelAVX2<Format::BlueShift, Format::BlueBits>(pixels);
+        const __m256i green = ExpandChannelAVX2<Format::GreenShift, Format::GreenBits>(pixels);
+        const __m256i red = ExpandChannelAVX2<Format::RedShift, Format::RedBits>(pixels);
+        const __m256i alpha = ExpandChannelAVX2<Format::AlphaShift, Format::AlphaBits>(pixels);
+
+        const __m256i blueGreen = _mm256_or_si256(blue, _mm256_slli_epi16(green, 8));
+        const __m256i redAlpha = _mm256_or_si256(red, _mm256_slli_epi16(alpha, 8));
+
+        // The unpack instructions work within each 128-bit lane, so the lo result holds
+        // pixels 0-3 and 8-11 and the hi result holds pixels 4-7 and 12-15.
+        const __m256i lo = _mm256_unpacklo_epi16(blueGreen, redAlpha);
+        const __m256i hi = _mm256_unpackhi_epi16(blueGreen, redAlpha);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+
+        src += 32;
+        dst += 64;
+    }
+
+    ConvertRowSSE2<Format>(src, dst, width - x);
+}
+
+// 4 pixels per iteration
+static FSH_TARGET_SSSE3 void ConvertR8G8B8RowSSSE3(const unsigned char* src, unsigned char* dst, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xff000000));
+
+    int x = 0;
+
+    // Each iteration loads 16 bytes and uses 12 of them, the loop stops
+    // while the last load is still inside the row.
+    for (; (x + 6) <= width; x += 4)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha));
+
+        src += 12;
+        dst += 16;
+    }
+
+    ConvertR8G8B8RowScalar(src, dst, width - x);
+}
+
+#endif // FSH_X86
+
+template <typename Format>
+static ConvertRowProc SelectConvertRowProc()
+{
+#if FSH_X86
+    if (CpuHasAVX2())
+    {
+        return ConvertRowAVX2<Format>;
+    }
+    else if (CpuHasSSE2())
+    {
+        return ConvertRowSSE2<Format>;
+    }
+#endif
+
+    return ConvertRowScalar<Format>;
+}
+
+static ConvertRowProc SelectConvertR8G8B8RowProc()
+{
+#if FSH_X86
+    if (CpuHasSSSE3())
+    {
+        return ConvertR8G8B8RowSSSE3;
+    }
+#endif
+
+    return ConvertR8G8B8RowScalar;
+}
+
+static void ConvertImage(ConvertRowProc convertRow, const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height)
+{
+    for (int y = 0; y < height; y++)
+    {
+        convertRow(src + (srcStride * y), dst + (dstStride * y), width);
+    }
+}
+
+// The kernels are selected for each image, so SetCpuFeatureLevel applies to the next one.
+void ConvertA1R5G5B5ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height)
+{
+    const ConvertRowProc convertRow = SelectConvertRowProc<FormatA1R5G5B5>();
+
+    ConvertImage(convertRow, src, srcStride, dst, dstStride, width, height);
+}
+
+void ConvertR5G6B5ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height)
+{
+    const ConvertRowProc convertRow = SelectConvertRowProc<FormatR5G6B5>();
+
+    ConvertImage(convertRow, src, srcStride, dst, dstStride, width, height);
+}
+
+void ConvertA4R4G4B4ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height)
+{
+    const ConvertRowProc convertRow = SelectConvertRowProc<FormatA4R4G4B4>();
+
+    ConvertImage(convertRow, src, srcStride, dst, dstStride, width, height);
+}
+
+void ConvertR8G8B8ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height)
+{
+    const ConvertRowProc convertRow = SelectConvertR8G8B8RowProc();
+
+    ConvertImage(convertRow, src, srcStride, dst, dstStride, width, height);
+}
+
+void ConvertIndexed8ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height, const unsigned int* palette)
+{
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char* srcRow = src + (srcStride * y);
+        unsigned char* dstRow = dst + (dstStride * y);
+
+        for (int x = 0; x < width; x++)
+        {
+            const unsigned int color = palette[srcRow[x]];
+
+            dstRow[0] = static_cast<unsigned char>(color);
+            dstRow[1] = static_cast<unsigned char>(color >> 8);
+            dstRow[2] = static_cast<unsigned char>(color >> 16);
+            dstRow[3] = static_cast<unsigned char>(color >> 24);
+
+            dstRow += 4;
+        }
+    }
+}
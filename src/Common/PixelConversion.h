@@ -0,0 +1,35 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+// Converts the uncompressed FSH pixel formats to 32-bit BGRA.
+// The 4, 5 and 6-bit channels are expanded by replicating their high bits so that the
+// largest channel value becomes 255, the formats without an alpha channel are opaque.
+void ConvertA1R5G5B5ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height);
+void ConvertR5G6B5ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height);
+void ConvertA4R4G4B4ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height);
+void ConvertR8G8B8ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height);
+
+// Converts 8-bit palette indexes to 32-bit BGRA, palette holds 256 colors in the
+// 0xAARRGGBB format.
+void ConvertIndexed8ToBGRA(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height, const unsigned int* palette);
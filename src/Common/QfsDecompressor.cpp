@@ -0,0 +1,641 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "QfsDecompressor.h"
+#include <string.h>
+#include <new>
+
+// The largest back reference offset that the format can encode.
+static const size_t WindowSize = 128 * 1024;
+
+// The window holds the back reference data followed by the same amount of space for new
+// output, when that space is used up the last WindowSize bytes are moved to the start.
+// This keeps every match contiguous in memory so it can be copied without wrapping.
+static const size_t WindowBufferSize = 2 * WindowSize;
+
+// The wide copies move 16 bytes at a time and may write up to this many bytes past the end.
+static const size_t CopySlack = 16;
+
+static const size_t MaxControlCodeLength = 4;
+static const size_t MaxLiteralCount = 112;
+static const size_t MaxTokenOutput = 3 + 1028; // the literal and match of a 4 byte control code
+
+// The space that DecodeTokens needs for one token including the slack of the wide copies.
+static const size_t FastInputMargin = MaxControlCodeLength + MaxLiteralCount + CopySlack;
+static const size_t FastOutputMargin = MaxTokenOutput + CopySlack;
+
+// The low bit of the flags byte marks a compressed size after the signature and the high bit
+// marks 4 byte sizes instead of 3 byte sizes, which is used for data larger than 16 MB.
+static bool HasQfsSignature(const unsigned char* data)
+{
+    return (data[0] & 0x7e) == 0x10 && data[1] == 0xfb;
+}
+
+static int GetSizeFieldLength(unsigned char flags)
+{
+    return (flags & 0x80) != 0 ? 4 : 3;
+}
+
+bool IsQfsCompressed(const unsigned char* data)
+{
+    return HasQfsSignature(data) || HasQfsSignature(data + 4);
+}
+
+// Returns the length of the header, 0 if more data is needed to determine it or -1 if the data is not QFS compressed.
+static int GetHeaderLength(const unsigned char* data, size_t size)
+{
+    if (size < 2)
+    {
+        return 0;
+    }
+
+    int start = 0;
+
+    if (!HasQfsSignature(data))
+    {
+        if (size < 6)
+        {
+            return 0;
+        }
+        else if (!HasQfsSignature(data + 4))
+        {
+            return -1;
+        }
+
+        start = 4; // the signature is preceded by the compressed size
+    }
+
+    // The compressed size comes before the decompressed size when it is present.
+    const bool hasCompressedSize = (data[start] & 0x01) != 0;
+    const int sizeLength = GetSizeFieldLength(data[start]);
+
+    return start + 2 + (hasCompressedSize ? sizeLength : 0) + sizeLength;
+}
+
+enum ControlCodeKind
+{
+    ControlCodeShort,   // 2 bytes, 0x00 - 0x7f
+    ControlCodeMedium,  // 3 bytes, 0x80 - 0xbf
+    ControlCodeLong,    // 4 bytes, 0xc0 - 0xdf
+    ControlCodeLiteral, // 1 byte, 0xe0 - 0xfb
+    ControlCodeEnd      // 1 byte, 0xfc - 0xff
+};
+
+// The parts of a control code that depend only on its first byte.
+struct ControlCodeInfo
+{
+    unsigned char length;
+    unsigned char kind;
+    unsigned char literalCount;
+    unsigned short matchCount;
+    unsigned int matchOffset;
+};
+
+struct ControlCodeTable
+{
+    ControlCodeInfo codes[256];
+};
+
+// The code adapted from http://simswiki.info/wiki.php?title=DBPF_Compression
+static ControlCodeTable BuildControlCodeTable()
+{
+    ControlCodeTable table = {};
+
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        ControlCodeInfo& info = table.codes[i];
+
+        if (i >= 0xfc)
+        {
+            info.length = 1;
+            info.kind = ControlCodeEnd;
+            info.literalCount = i & 3;
+        }
+        else if (i >= 0xe0)
+        {
+            info.length = 1;
+            info.kind = ControlCodeLiteral;
+            info.literalCount = static_cast<unsigned char>(((i & 0x1f) + 1) << 2);
+        }
+        else if (i >= 0xc0)
+        {
+            info.length = 4;
+            info.kind = ControlCodeLong;
+            info.literalCount = i & 3;
+            info.matchCount = static_cast<unsigned short>(((i & 0x0c) << 6) + 5);
+            info.matchOffset = ((i & 0x10) << 12) + 1;
+        }
+        else if (i >= 0x80)
+        {
+            // The literal count and offset are in the following bytes.
+            info.length = 3;
+            info.kind = ControlCodeMedium;
+            info.matchCount = static_cast<unsigned short>((i & 0x3f) + 4);
+            info.matchOffset = 1;
+        }
+        else
+        {
+            info.length = 2;
+            info.kind = ControlCodeShort;
+            info.literalCount = i & 3;
+            info.matchCount = static_cast<unsigned short>(((i & 0x1c) >> 2) + 3);
+            info.matchOffset = ((i & 0x60) << 3) + 1;
+        }
+    }
+
+    return table;
+}
+
+static const ControlCodeInfo* GetControlCodes()
+{
+    static const ControlCodeTable table = BuildControlCodeTable();
+
+    return table.codes;
+}
+
+// Reads the counts and offset of a control code, the code must hold info.length bytes.
+static void DecodeControlCode(const ControlCodeInfo& info, const unsigned char* code, unsigned int* literalCount, unsigned int* matchCount, unsigned int* matchOffset)
+{
+    *literalCount = info.literalCount;
+    *matchCount = info.matchCount;
+    *matchOffset = info.matchOffset;
+
+    switch (info.kind)
+    {
+    case ControlCodeShort:
+        *matchOffset += code[1];
+        break;
+    case ControlCodeMedium:
+        *literalCount = (code[1] >> 6) & 3;
+        *matchOffset += ((code[1] & 0x3f) << 8) + code[2];
+        break;
+    case ControlCodeLong:
+        *matchCount += code[3];
+        *matchOffset += (code[1] << 8) + code[2];
+        break;
+    }
+}
+
+// Returns true if the counts and offset fit in the remaining output and the data that has been written.
+static bool IsValidToken(unsigned int literalCount, unsigned int matchCount, unsigned int matchOffset, unsigned long long totalOutput, unsigned long long decompressedSize)
+{
+    const unsigned long long remaining = decompressedSize - totalOutput;
+
+    if (literalCount > remaining || matchCount > (remaining - literalCount))
+    {
+        return false;
+    }
+    else if (matchCount > 0 && matchOffset > (totalOutput + literalCount))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// Copies count bytes, the wide copy may read and write up to CopySlack - 1 bytes past the end of both buffers.
+static inline void CopyLiteral(unsigned char* dst, const unsigned char* src, size_t count, bool wide)
+{
+    if (wide)
+    {
+        for (size_t i = 0; i < count; i += 16)
+        {
+            memcpy(dst + i, src + i, 16);
+        }
+    }
+    else
+    {
+        memcpy(dst, src, count);
+    }
+}
+
+// Copies count bytes from offset bytes before dst, the source and destination overlap when the offset
+// is less than the count which repeats the last offset bytes.
+// The wide copy may write up to CopySlack - 1 bytes past the end of the destination.
+static inline void CopyMatch(unsigned char* dst, size_t offset, size_t count, bool wide)
+{
+    const unsigned char* src = dst - offset;
+
+    if (offset == 1)
+    {
+        memset(dst, src[0], count);
+    }
+    else if (wide && offset >= 16)
+    {
+        // Each 16 byte block only reads data that was written before it.
+        for (size_t i = 0; i < count; i += 16)
+        {
+            memcpy(dst + i, src + i, 16);
+        }
+    }
+    else if (wide)
+    {
+        // The rest is copied 8 bytes at a time from a whole number of repeats back, when the offset is
+        // less than 8 the first of those repeats is written a byte at a time.
+        size_t period = offset;
+        while (period < 8)
+        {
+            period += offset;
+        }
+
+        size_t i = 0;
+
+        if (period != offset)
+        {
+            for (; i < period && i < count; i++)
+            {
+                dst[i] = src[i];
+            }
+        }
+
+        for (; i < count; i += 8)
+        {
+            memcpy(dst + i, dst + i - period, 8);
+        }
+    }
+    else if (offset >= count)
+    {
+        memcpy(dst, src, count);
+    }
+    else
+    {
+        // Copy the pattern once and then double the copied length, the repeats start at dst
+        // so each copy reads a whole number of them.
+        memcpy(dst, src, offset);
+
+        size_t copied = offset;
+
+        while (copied < count)
+        {
+            const size_t length = copied < (count - copied) ? copied : (count - copied);
+
+            memcpy(dst + copied, dst, length);
+            copied += length;
+        }
+    }
+}
+
+QfsDecompressor::QfsDecompressor(bool contiguousOutput) : state(StateHeader), contiguousOutput(contiguousOutput), window(nullptr),
+    windowPos(0), windowFlushPos(0), pendingSize(0), decompressedSize(0), totalOutput(0), literalCount(0), matchCount(0),
+    matchOffset(0), lastToken(false)
+{
+}
+
+QfsDecompressor::~QfsDecompressor()
+{
+    delete[] window;
+}
+
+bool QfsDecompressor::HasHeader() const
+{
+    return state != StateHeader;
+}
+
+unsigned long long QfsDecompressor::GetDecompressedSize() const
+{
+    return decompressedSize;
+}
+
+unsigned long long QfsDecompressor::GetTotalOutput() const
+{
+    return totalOutput;
+}
+
+// Copies input bytes to the pending buffer until it holds count bytes, returns false if the input ran out first.
+bool QfsDecompressor::FillPending(const unsigned char* input, size_t inputSize, size_t* inputIndex, size_t count)
+{
+    while (pendingSize < count)
+    {
+        if (*inputIndex >= inputSize)
+        {
+            return false;
+        }
+
+        pending[pendingSize++] = input[(*inputIndex)++];
+    }
+
+    return true;
+}
+
+QfsStatus QfsDecompressor::ReadHeader()
+{
+    const int headerLength = GetHeaderLength(pending, pendingSize);
+    const int sizeLength = GetSizeFieldLength(pending[HasQfsSignature(pending) ? 0 : 4]);
+
+    // The sizes are stored in big-endian byte order.
+    decompressedSize = 0;
+
+    for (int i = headerLength - sizeLength; i < headerLength; i++)
+    {
+        decompressedSize = (decompressedSize << 8) | pending[i];
+    }
+
+    if (!contiguousOutput)
+    {
+        window = new (std::nothrow) unsigned char[WindowBufferSize + CopySlack];
+        if (!window)
+        {
+            return QfsStatusOutOfMemory;
+        }
+    }
+
+    pendingSize = 0;
+    state = StateToken;
+
+    return QfsStatusNeedInput;
+}
+
+QfsStatus QfsDecompressor::ReadToken(const unsigned char* code)
+{
+    const ControlCodeInfo& info = GetControlCodes()[code[0]];
+
+    DecodeControlCode(info, code, &literalCount, &matchCount, &matchOffset);
+    lastToken = info.kind == ControlCodeEnd;
+
+    if (!IsValidToken(literalCount, matchCount, matchOffset, totalOutput, decompressedSize))
+    {
+        return QfsStatusInvalidData;
+    }
+
+    state = StateLiteral;
+
+    return QfsStatusNeedInput;
+}
+
+// Decodes whole tokens straight from the input while the input and the output have room for the
+// largest token and the slack of the wide copies, the rest are left to the state machine.
+QfsStatus QfsDecompressor::DecodeTokens(const unsigned char* input, size_t inputSize, size_t* inputIndex, unsigned char* dst, size_t dstSize, size_t* written)
+{
+    const ControlCodeInfo* codes = GetControlCodes();
+
+    size_t inIndex = *inputIndex;
+    size_t outIndex = 0;
+    unsigned long long total = totalOutput;
+    QfsStatus status = QfsStatusNeedInput;
+
+    while ((inputSize - inIndex) >= FastInputMargin && (dstSize - outIndex) >= FastOutputMargin && total != decompressedSize)
+    {
+        const unsigned char* code = input + inIndex;
+        const ControlCodeInfo& info = codes[code[0]];
+
+        if (info.kind == ControlCodeEnd)
+        {
+            break;
+        }
+
+        unsigned int literal;
+        unsigned int match;
+        unsigned int offset;
+        DecodeControlCode(info, code, &literal, &match, &offset);
+
+        if (!IsValidToken(literal, match, offset, total, decompressedSize))
+        {
+            status = QfsStatusInvalidData;
+            break;
+        }
+
+        inIndex += info.length;
+
+        CopyLiteral(dst + outIndex, input + inIndex, literal, true);
+        inIndex += literal;
+        outIndex += literal;
+
+        if (match > 0)
+        {
+            CopyMatch(dst + outIndex, offset, match, true);
+            outIndex += match;
+        }
+
+        total += literal + match;
+    }
+
+    *inputIndex = inIndex;
+    *written = outIndex;
+
+    return status;
+}
+
+// Returns where the next count bytes of output are written.
+// In the window mode this moves the window data when there is not enough space after windowPos,
+// outputEnd is the position in the output that corresponds to windowPos.
+unsigned char* QfsDecompressor::GetWritePointer(unsigned char* outputEnd, size_t count)
+{
+    if (contiguousOutput)
+    {
+        return outputEnd;
+    }
+
+    if ((windowPos + count) > WindowBufferSize)
+    {
+        FlushWindow(outputEnd);
+
+        memmove(window, window + (windowPos - WindowSize), WindowSize);
+        windowPos = WindowSize;
+        windowFlushPos = WindowSize;
+    }
+
+    return window + windowPos;
+}
+
+// Copies the window data that has not been written to the output yet.
+void QfsDecompressor::FlushWindow(unsigned char* outputEnd)
+{
+    const size_t count = windowPos - windowFlushPos;
+
+    if (count > 0)
+    {
+        memcpy(outputEnd - count, window + windowFlushPos, count);
+        windowFlushPos = windowPos;
+    }
+}
+
+void QfsDecompressor::CommitWrite(size_t count)
+{
+    totalOutput += count;
+
+    if (!contiguousOutput)
+    {
+        windowPos += count;
+    }
+}
+
+QfsStatus QfsDecompressor::Decompress(const unsigned char* input, size_t inputSize, size_t* inputUsed, unsigned char* output, size_t outputSize, size_t* outputWritten)
+{
+    size_t inputIndex = 0;
+    size_t outputIndex = 0;
+    QfsStatus status = QfsStatusNeedInput;
+
+    for (;;)
+    {
+        if (state == StateHeader)
+        {
+            int headerLength = GetHeaderLength(pending, pendingSize);
+
+            while (headerLength == 0 || (headerLength > 0 && static_cast<size_t>(headerLength) > pendingSize))
+            {
+                if (!FillPending(input, inputSize, &inputIndex, headerLength > 0 ? headerLength : pendingSize + 1))
+                {
+                    break;
+                }
+
+                headerLength = GetHeaderLength(pending, pendingSize);
+            }
+
+            if (headerLength < 0)
+            {
+                status = QfsStatusInvalidData;
+                break;
+            }
+            else if (headerLength == 0 || static_cast<size_t>(headerLength) > pendingSize)
+            {
+                status = QfsStatusNeedInput;
+                break;
+            }
+
+            status = ReadHeader();
+            if (status != QfsStatusNeedInput)
+            {
+                break;
+            }
+        }
+        else if (state == StateToken)
+        {
+            if (totalOutput == decompressedSize)
+            {
+                // Some writers omit the end of data code.
+                state = StateDone;
+                continue;
+            }
+
+            if (pendingSize == 0 && (outputSize - outputIndex) >= FastOutputMargin)
+            {
+                unsigned char* dst = GetWritePointer(output + outputIndex, FastOutputMargin);
+                size_t dstSize = outputSize - outputIndex;
+
+                if (!contiguousOutput && dstSize > (WindowBufferSize + CopySlack - windowPos))
+                {
+                    dstSize = WindowBufferSize + CopySlack - windowPos;
+                }
+
+                size_t written = 0;
+                status = DecodeTokens(input, inputSize, &inputIndex, dst, dstSize, &written);
+
+                CommitWrite(written);
+                outputIndex += written;
+
+                if (status != QfsStatusNeedInput)
+                {
+                    break;
+                }
+                else if (written > 0)
+                {
+                    continue;
+                }
+            }
+
+            if (!FillPending(input, inputSize, &inputIndex, 1) ||
+                !FillPending(input, inputSize, &inputIndex, GetControlCodes()[pending[0]].length))
+            {
+                status = QfsStatusNeedInput;
+                break;
+            }
+
+            pendingSize = 0;
+
+            status = ReadToken(pending);
+            if (status != QfsStatusNeedInput)
+            {
+                break;
+            }
+        }
+        else if (state == StateLiteral)
+        {
+            size_t count = literalCount;
+
+            if (count > (inputSize - inputIndex))
+            {
+                count = inputSize - inputIndex;
+            }
+            if (count > (outputSize - outputIndex))
+            {
+                count = outputSize - outputIndex;
+            }
+
+            if (count > 0)
+            {
+                CopyLiteral(GetWritePointer(output + outputIndex, count), input + inputIndex, count, false);
+                CommitWrite(count);
+            }
+
+            inputIndex += count;
+            outputIndex += count;
+            literalCount -= static_cast<unsigned int>(count);
+
+            if (literalCount > 0)
+            {
+                status = outputIndex == outputSize ? QfsStatusOutputFull : QfsStatusNeedInput;
+                break;
+            }
+
+            state = lastToken ? StateDone : StateMatch;
+        }
+        else if (state == StateMatch)
+        {
+            size_t count = matchCount;
+
+            if (count > (outputSize - outputIndex))
+            {
+                count = outputSize - outputIndex;
+            }
+
+            if (count > 0)
+            {
+                CopyMatch(GetWritePointer(output + outputIndex, count), matchOffset, count, false);
+                CommitWrite(count);
+            }
+
+            outputIndex += count;
+            matchCount -= static_cast<unsigned int>(count);
+
+            if (matchCount > 0)
+            {
+                status = QfsStatusOutputFull;
+                break;
+            }
+
+            state = StateToken;
+        }
+        else
+        {
+            status = QfsStatusDone;
+            break;
+        }
+    }
+
+    if (!contiguousOutput)
+    {
+        FlushWindow(output + outputIndex);
+    }
+
+    *inputUsed = inputIndex;
+    *outputWritten = outputIndex;
+
+    return status;
+}
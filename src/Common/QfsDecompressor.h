@@ -0,0 +1,98 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+enum QfsStatus
+{
+    QfsStatusNeedInput,   // all of the input was used, call again with more input
+    QfsStatusOutputFull,  // the output buffer is full, call again with more output space
+    QfsStatusDone,
+    QfsStatusInvalidData,
+    QfsStatusOutOfMemory
+};
+
+// Returns true if the data starts with a QFS header, the header may be preceded
+// by a 4 byte compressed size. At least 6 bytes must be available.
+// Both the 3 byte and the 4 byte (large size flag) variants of the header are supported.
+bool IsQfsCompressed(const unsigned char* data);
+
+// A streaming QFS (RefPack) decompressor.
+// The input and output are processed in pieces of any size. By default the last 128 KB of
+// the output is kept in a window for the back references so the caller does not need to
+// keep the output or the compressed data in memory.
+class QfsDecompressor
+{
+public:
+    // When contiguousOutput is true the caller keeps all of the output in one buffer and each
+    // call continues writing where the last one stopped, the back references are then read
+    // from that buffer and no window is allocated.
+    explicit QfsDecompressor(bool contiguousOutput = false);
+    ~QfsDecompressor();
+
+    // Decompresses as much of the input as will fit in the output buffer.
+    // The header is read before any output is written, so a call with an empty output
+    // buffer can be used to get the decompressed size before allocating the output.
+    // The part of the output buffer after outputWritten may be overwritten.
+    QfsStatus Decompress(const unsigned char* input, size_t inputSize, size_t* inputUsed, unsigned char* output, size_t outputSize, size_t* outputWritten);
+
+    bool HasHeader() const;
+
+    // These are valid once HasHeader returns true.
+    unsigned long long GetDecompressedSize() const;
+    unsigned long long GetTotalOutput() const;
+
+private:
+    QfsDecompressor(const QfsDecompressor&) = delete;
+    QfsDecompressor& operator=(const QfsDecompressor&) = delete;
+
+    enum State
+    {
+        StateHeader,
+        StateToken,
+        StateLiteral,
+        StateMatch,
+        StateDone
+    };
+
+    bool FillPending(const unsigned char* input, size_t inputSize, size_t* inputIndex, size_t count);
+    QfsStatus ReadHeader();
+    QfsStatus ReadToken(const unsigned char* code);
+    QfsStatus DecodeTokens(const unsigned char* input, size_t inputSize, size_t* inputIndex, unsigned char* dst, size_t dstSize, size_t* written);
+    unsigned char* GetWritePointer(unsigned char* outputEnd, size_t count);
+    void FlushWindow(unsigned char* outputEnd);
+    void CommitWrite(size_t count);
+
+    State state;
+    bool contiguousOutput;
+    unsigned char* window;
+    size_t windowPos;      // the end of the decompressed data in the window
+    size_t windowFlushPos; // the end of the window data that has been copied to the output
+    unsigned char pending[16]; // the partial header or control code from the end of the last input
+    size_t pendingSize;
+    unsigned long long decompressedSize;
+    unsigned long long totalOutput;
+    unsigned int literalCount;
+    unsigned int matchCount;
+    unsigned int matchOffset;
+    bool lastToken;
+};
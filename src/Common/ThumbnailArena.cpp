@@ -0,0 +1,231 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "ThumbnailArena.h"
+#include "AlignedMemory.h"
+
+namespace
+{
+    // Small allocations share 64 KB chunks, larger ones get a block of their own.
+    const size_t ChunkSize = 64 * 1024;
+    const size_t LargeAllocationSize = ChunkSize / 4;
+    // The block header is padded so the allocations that follow it stay aligned.
+    const size_t BlockHeaderSize = ThumbnailArena::Alignment;
+
+    size_t AlignSize(size_t size)
+    {
+        return (size + (ThumbnailArena::Alignment - 1)) & ~static_cast<size_t>(ThumbnailArena::Alignment - 1);
+    }
+}
+
+// The header at the start of each block, the allocations follow it.
+struct ThumbnailArena::Block
+{
+    Block* next;
+    size_t blockSize; // including the header
+    bool large;
+};
+
+ArenaBlockCache::ArenaBlockCache(size_t maxCachedBytes)
+    : count(0), cachedBytes(0), maxCachedBytes(maxCachedBytes)
+{
+}
+
+ArenaBlockCache::~ArenaBlockCache()
+{
+    for (int i = 0; i < count; i++)
+    {
+        AlignedFree(blocks[i].memory);
+    }
+}
+
+void* ArenaBlockCache::Take(size_t size, size_t* blockSize)
+{
+    int best = -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (blocks[i].size >= size && (best < 0 || blocks[i].size < blocks[best].size))
+        {
+            best = i;
+        }
+    }
+
+    if (best < 0)
+    {
+        return nullptr;
+    }
+
+    void* memory = blocks[best].memory;
+    *blockSize = blocks[best].size;
+
+    cachedBytes -= blocks[best].size;
+    blocks[best] = blocks[--count];
+
+    return memory;
+}
+
+bool ArenaBlockCache::Keep(void* memory, size_t size)
+{
+    if (count == MaxBlocks || size > (maxCachedBytes - cachedBytes))
+    {
+        return false;
+    }
+
+    blocks[count].memory = memory;
+    blocks[count].size = size;
+    count++;
+    cachedBytes += size;
+
+    return true;
+}
+
+ThumbnailArena::ThumbnailArena(ArenaBlockCache* cache)
+    : cache(cache), blocks(nullptr), chunk(nullptr), chunkUsed(0), stats()
+{
+}
+
+ThumbnailArena::~ThumbnailArena()
+{
+    Reset();
+}
+
+void* ThumbnailArena::Allocate(size_t size)
+{
+    if (size == 0)
+    {
+        size = 1;
+    }
+
+    if (size > (static_cast<size_t>(-1) - BlockHeaderSize - Alignment))
+    {
+        return nullptr;
+    }
+
+    size = AlignSize(size);
+
+    unsigned char* memory;
+
+    if (size >= LargeAllocationSize)
+    {
+        Block* block = AddBlock(size, true);
+
+        if (!block)
+        {
+            return nullptr;
+        }
+
+        memory = reinterpret_cast<unsigned char*>(block) + BlockHeaderSize;
+    }
+    else
+    {
+        if (!chunk || (chunk->blockSize - BlockHeaderSize - chunkUsed) < size)
+        {
+            Block* block = AddBlock(ChunkSize - BlockHeaderSize, false);
+
+            if (!block)
+            {
+                return nullptr;
+            }
+
+            chunk = block;
+            chunkUsed = 0;
+        }
+
+        memory = reinterpret_cast<unsigned char*>(chunk) + BlockHeaderSize + chunkUsed;
+        chunkUsed += size;
+    }
+
+    stats.allocationCount++;
+    stats.bytesInUse += size;
+
+    if (stats.bytesInUse > stats.peakBytes)
+    {
+        stats.peakBytes = stats.bytesInUse;
+    }
+
+    return memory;
+}
+
+void ThumbnailArena::Reset()
+{
+    while (blocks)
+    {
+        Block* next = blocks->next;
+        ReleaseBlock(blocks);
+        blocks = next;
+    }
+
+    chunk = nullptr;
+    chunkUsed = 0;
+    stats.bytesInUse = 0;
+}
+
+const ThumbnailArenaStats& ThumbnailArena::GetStats() const
+{
+    return stats;
+}
+
+ThumbnailArena::Block* ThumbnailArena::AddBlock(size_t size, bool large)
+{
+    static_assert(sizeof(Block) <= BlockHeaderSize, "The block header does not fit in BlockHeaderSize");
+
+    size_t blockSize = BlockHeaderSize + size;
+    void* memory = nullptr;
+
+    if (large && cache)
+    {
+        memory = cache->Take(blockSize, &blockSize);
+
+        if (memory)
+        {
+            stats.reusedBlockCount++;
+        }
+    }
+
+    if (!memory)
+    {
+        memory = AlignedAlloc(blockSize, Alignment);
+
+        if (!memory)
+        {
+            return nullptr;
+        }
+
+        stats.heapAllocationCount++;
+    }
+
+    Block* block = static_cast<Block*>(memory);
+    block->next = blocks;
+    block->blockSize = blockSize;
+    block->large = large;
+
+    blocks = block;
+
+    return block;
+}
+
+void ThumbnailArena::ReleaseBlock(Block* block)
+{
+    if (!block->large || !cache || !cache->Keep(block, block->blockSize))
+    {
+        AlignedFree(block);
+    }
+}
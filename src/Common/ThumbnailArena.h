@@ -0,0 +1,112 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+// Keeps the large blocks of ThumbnailArena objects after they are reset so the next arena
+// can use them without going back to the heap, e.g. in a worker thread that creates many
+// thumbnails one after another. A cache must only be used by one thread at a time.
+class ArenaBlockCache
+{
+public:
+    explicit ArenaBlockCache(size_t maxCachedBytes);
+    ~ArenaBlockCache();
+
+private:
+    ArenaBlockCache(const ArenaBlockCache&) = delete;
+    ArenaBlockCache& operator=(const ArenaBlockCache&) = delete;
+
+    friend class ThumbnailArena;
+
+    enum { MaxBlocks = 4 };
+
+    struct CachedBlock
+    {
+        void* memory;
+        size_t size;
+    };
+
+    // Returns the smallest cached block that has at least size bytes.
+    void* Take(size_t size, size_t* blockSize);
+    // Returns false when the block does not fit in the cache, the caller then frees it.
+    bool Keep(void* memory, size_t size);
+
+    CachedBlock blocks[MaxBlocks];
+    int count;
+    size_t cachedBytes;
+    size_t maxCachedBytes;
+};
+
+struct ThumbnailArenaStats
+{
+    size_t allocationCount; // the number of Allocate calls that succeeded
+    size_t heapAllocationCount; // the number of blocks that were allocated from the heap
+    size_t reusedBlockCount; // the number of blocks that were taken from the ArenaBlockCache
+    size_t bytesInUse;
+    size_t peakBytes;
+};
+
+// A bump allocator for the buffers that are used while one thumbnail is created.
+// The memory is not zero filled and every allocation is aligned to 64 bytes for the SIMD code.
+// Nothing is freed until Reset is called or the arena is destroyed, which releases all of the
+// allocations at once. The statistics are kept for the lifetime of the arena.
+class ThumbnailArena
+{
+public:
+    enum { Alignment = 64 };
+
+    explicit ThumbnailArena(ArenaBlockCache* cache = nullptr);
+    ~ThumbnailArena();
+
+    // Returns nullptr when out of memory.
+    void* Allocate(size_t size);
+
+    template <typename T>
+    T* AllocateArray(size_t count)
+    {
+        if (count > (static_cast<size_t>(-1) / sizeof(T)))
+        {
+            return nullptr;
+        }
+
+        return static_cast<T*>(Allocate(count * sizeof(T)));
+    }
+
+    void Reset();
+
+    const ThumbnailArenaStats& GetStats() const;
+
+private:
+    ThumbnailArena(const ThumbnailArena&) = delete;
+    ThumbnailArena& operator=(const ThumbnailArena&) = delete;
+
+    struct Block;
+
+    Block* AddBlock(size_t size, bool large);
+    void ReleaseBlock(Block* block);
+
+    ArenaBlockCache* cache;
+    Block* blocks;     // the blocks in the reverse order of allocation
+    Block* chunk;      // the block that small allocations are taken from
+    size_t chunkUsed;
+    ThumbnailArenaStats stats;
+};
@@ -0,0 +1,105 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "ThumbnailBitmap.h"
+
+#if defined(_WIN32)
+
+HRESULT FshLoadStatusToHResult(FshLoadStatus status)
+{
+    switch (status)
+    {
+    case FshLoadOk:
+        return S_OK;
+    case FshLoadOutOfMemory:
+        return E_OUTOFMEMORY;
+    default:
+        return E_FAIL;
+    }
+}
+
+HRESULT CreateThumbnailBitmap(int width, int height, HBITMAP* phbmp, BYTE** pBits)
+{
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = -height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    *phbmp = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, reinterpret_cast<void**>(pBits), nullptr, 0);
+
+    return *phbmp ? S_OK : E_OUTOFMEMORY;
+}
+
+HRESULT LoadThumbnailFromMemoryCache(ThumbnailCache& cache, const ThumbnailCacheKey& fileKey, int maxEdgeLength, HBITMAP* phbmp)
+{
+    std::shared_ptr<const CachedThumbnail> cached = cache.Find(fileKey);
+    int width = 0;
+    int height = 0;
+
+    if (!cached || !GetCachedThumbnailSize(*cached, maxEdgeLength, &width, &height))
+    {
+        return S_FALSE;
+    }
+
+    HBITMAP hbmp = nullptr;
+    BYTE* pBits = nullptr;
+
+    HRESULT hr = CreateThumbnailBitmap(width, height, &hbmp, &pBits);
+
+    if (SUCCEEDED(hr))
+    {
+        if (CopyCachedThumbnail(*cached, pBits, static_cast<size_t>(width) * 4, width, height))
+        {
+            *phbmp = hbmp;
+        }
+        else
+        {
+            DeleteObject(hbmp);
+            hr = E_OUTOFMEMORY;
+        }
+    }
+
+    return hr;
+}
+
+HRESULT LoadThumbnailFromDiskCache(ThumbnailDiskCache* diskCache, const ThumbnailCacheKey& fileKey, int maxEdgeLength, HBITMAP* phbmp)
+{
+    HBITMAP hbmp = nullptr;
+
+    auto allocate = [&](int width, int height) -> unsigned char*
+    {
+        BYTE* pBits = nullptr;
+
+        return SUCCEEDED(CreateThumbnailBitmap(width, height, &hbmp, &pBits)) ? pBits : nullptr;
+    };
+
+    if (diskCache->Find(fileKey, maxEdgeLength, allocate))
+    {
+        *phbmp = hbmp;
+        return S_OK;
+    }
+
+    return S_FALSE;
+}
+
+#endif // _WIN32
@@ -0,0 +1,46 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#pragma once
+
+#if defined(_WIN32)
+
+#include "FshThumbnailLoader.h"
+#include "ThumbnailCache.h"
+#include "ThumbnailDiskCache.h"
+#include <windows.h>
+
+// The parts of the thumbnail handlers that create the HBITMAP, they are the same for the
+// IThumbnailProvider and the IExtractImage handlers.
+
+HRESULT FshLoadStatusToHResult(FshLoadStatus status);
+
+// Creates a top-down 32bpp DIB section, the rows of a 32bpp DIB are width * 4 bytes apart.
+HRESULT CreateThumbnailBitmap(int width, int height, HBITMAP* phbmp, BYTE** pBits);
+
+// Creates the thumbnail from the memory cache, returns S_FALSE when it is not in the cache or
+// the cached image is too small.
+HRESULT LoadThumbnailFromMemoryCache(ThumbnailCache& cache, const ThumbnailCacheKey& fileKey, int maxEdgeLength, HBITMAP* phbmp);
+
+// Creates the thumbnail from the disk cache, returns S_FALSE when it is not in the cache.
+HRESULT LoadThumbnailFromDiskCache(ThumbnailDiskCache* diskCache, const ThumbnailCacheKey& fileKey, int maxEdgeLength, HBITMAP* phbmp);
+
+#endif // _WIN32
@@ -0,0 +1,354 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "ThumbnailCache.h"
+#include "ContentHash.h"
+#include "FshImageDecoder.h"
+#include "ImageScaler.h"
+#include <mutex>
+#include <new>
+#include <string.h>
+
+namespace
+{
+    // Enough for a few hundred thumbnails at the usual Explorer sizes.
+    const size_t ProcessCacheBytes = 32 * 1024 * 1024;
+
+    size_t GetImageBytes(const CachedThumbnail& image)
+    {
+        return image.pixels.GetStride() * static_cast<size_t>(image.pixels.GetHeight());
+    }
+}
+
+ThumbnailCacheKey GetThumbnailCacheKey(const void* data, size_t size)
+{
+    ContentHasher hasher;
+    hasher.Add(data, size);
+
+    ThumbnailCacheKey key;
+    key.contentHash = hasher.GetHash();
+    key.fileSize = hasher.GetSize();
+
+    return key;
+}
+
+ThumbnailCacheKey GetThumbnailFileKey(const void* header, size_t headerSize, unsigned long long fileSize, unsigned long long modifiedTime)
+{
+    ContentHasher hasher;
+    hasher.Add(header, headerSize < ThumbnailFileKeyHeaderSize ? headerSize : ThumbnailFileKeyHeaderSize);
+    hasher.Add(&modifiedTime, sizeof(modifiedTime));
+
+    ThumbnailCacheKey key;
+    key.contentHash = hasher.GetHash();
+    key.fileSize = fileSize;
+
+    return key;
+}
+
+CachedThumbnail* CreateCachedThumbnail(const unsigned char* src, size_t srcStride, int width, int height, int maxEdgeLength)
+{
+    CachedThumbnail* image = new (std::nothrow) CachedThumbnail();
+
+    if (image != nullptr)
+    {
+        image->maxEdgeLength = maxEdgeLength;
+
+        if (image->pixels.Create(width, height))
+        {
+            const size_t rowBytes = static_cast<size_t>(width) * 4;
+
+            for (int y = 0; y < height; y++)
+            {
+                memcpy(image->pixels.GetData() + y * image->pixels.GetStride(), src + y * srcStride, rowBytes);
+            }
+        }
+        else
+        {
+            delete image;
+            image = nullptr;
+        }
+    }
+
+    return image;
+}
+
+bool GetCachedThumbnailSize(const CachedThumbnail& image, int maxEdgeLength, int* width, int* height)
+{
+    const int cachedWidth = image.pixels.GetWidth();
+    const int cachedHeight = image.pixels.GetHeight();
+    const int cachedEdge = cachedWidth > cachedHeight ? cachedWidth : cachedHeight;
+
+    // A thumbnail that is smaller than the size it was created for is the full size image.
+    const bool fullSize = image.maxEdgeLength <= 0 || cachedEdge < image.maxEdgeLength;
+
+    if (!fullSize && (maxEdgeLength <= 0 || maxEdgeLength > image.maxEdgeLength))
+    {
+        return false;
+    }
+
+    GetFshThumbnailSize(cachedWidth, cachedHeight, maxEdgeLength, width, height);
+
+    return true;
+}
+
+bool CopyCachedThumbnail(const CachedThumbnail& image, unsigned char* dst, size_t dstStride, int width, int height)
+{
+    const PixelBuffer& pixels = image.pixels;
+
+    if (pixels.GetWidth() == width && pixels.GetHeight() == height)
+    {
+        const size_t rowBytes = static_cast<size_t>(width) * 4;
+
+        for (int y = 0; y < height; y++)
+        {
+            memcpy(dst + y * dstStride, pixels.GetData() + y * pixels.GetStride(), rowBytes);
+        }
+
+        return true;
+    }
+
+    return ScaleImageBGRA(pixels.GetData(), pixels.GetStride(), pixels.GetWidth(), pixels.GetHeight(), dst, dstStride, width, height);
+}
+
+ThumbnailCache::ThumbnailCache(size_t maxBytes) : maxBytes(maxBytes), bytesInUse(0), useClock(0), hits(0), misses(0), insertions(0), evictions(0)
+{
+}
+
+ThumbnailCache::~ThumbnailCache()
+{
+    Clear();
+}
+
+ThumbnailCache::Shard& ThumbnailCache::GetShard(const ThumbnailCacheKey& key)
+{
+    // The low bits select the bucket in the shard's map.
+    return shards[(key.contentHash >> 56) % ShardCount];
+}
+
+std::shared_ptr<const CachedThumbnail> ThumbnailCache::Find(const ThumbnailCacheKey& key)
+{
+    Shard& shard = GetShard(key);
+    std::shared_ptr<const CachedThumbnail> image;
+
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end())
+        {
+            Entry* entry = it->second;
+            entry->lastUse.store(++useClock, std::memory_order_relaxed);
+            image = entry->image;
+        }
+    }
+
+    if (image)
+    {
+        hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        misses.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return image;
+}
+
+bool ThumbnailCache::Insert(const ThumbnailCacheKey& key, CachedThumbnail* image)
+{
+    const size_t size = GetImageBytes(*image);
+
+    if (size > maxBytes)
+    {
+        delete image;
+        return false;
+    }
+
+    Entry* entry = new (std::nothrow) Entry();
+    if (entry == nullptr)
+    {
+        delete image;
+        return false;
+    }
+
+    try
+    {
+        entry->image.reset(image);
+    }
+    catch (...)
+    {
+        // shared_ptr deletes the image when its control block cannot be allocated.
+        delete entry;
+        return false;
+    }
+
+    entry->size = size;
+    entry->lastUse.store(++useClock, std::memory_order_relaxed);
+
+    Shard& shard = GetShard(key);
+    Entry* replaced = nullptr;
+    bool added = true;
+
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end())
+        {
+            replaced = it->second;
+            bytesInUse.fetch_sub(replaced->size, std::memory_order_relaxed);
+            shard.entries.erase(it);
+        }
+
+        try
+        {
+            shard.entries.emplace(key, entry);
+            bytesInUse.fetch_add(size, std::memory_order_relaxed);
+        }
+        catch (...)
+        {
+            added = false;
+        }
+    }
+
+    // The images are released outside of the lock.
+    delete replaced;
+
+    if (added)
+    {
+        insertions.fetch_add(1, std::memory_order_relaxed);
+        Trim(entry);
+    }
+    else
+    {
+        delete entry;
+    }
+
+    return added;
+}
+
+std::unordered_map<ThumbnailCacheKey, ThumbnailCache::Entry*, ThumbnailCache::KeyHash>::const_iterator ThumbnailCache::FindOldest(const Shard& shard, const Entry* keep) const
+{
+    // The cache only holds a few hundred thumbnails so a scan is cheaper than keeping a list in
+    // use order, which the readers would have to lock to update.
+    auto oldest = shard.entries.end();
+
+    for (auto it = shard.entries.begin(); it != shard.entries.end(); ++it)
+    {
+        if (it->second != keep && (oldest == shard.entries.end() ||
+            it->second->lastUse.load(std::memory_order_relaxed) < oldest->second->lastUse.load(std::memory_order_relaxed)))
+        {
+            oldest = it;
+        }
+    }
+
+    return oldest;
+}
+
+void ThumbnailCache::Trim(const Entry* keep)
+{
+    while (bytesInUse.load(std::memory_order_relaxed) > maxBytes)
+    {
+        // Only one shard is locked at a time, the oldest entry can change before its shard is
+        // locked for writing so that shard's oldest entry is removed then.
+        int oldestShard = -1;
+        unsigned long long oldestUse = 0;
+
+        for (int i = 0; i < ShardCount; i++)
+        {
+            const Shard& shard = shards[i];
+            std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+            auto it = FindOldest(shard, keep);
+            if (it != shard.entries.end())
+            {
+                const unsigned long long lastUse = it->second->lastUse.load(std::memory_order_relaxed);
+
+                if (oldestShard < 0 || lastUse < oldestUse)
+                {
+                    oldestShard = i;
+                    oldestUse = lastUse;
+                }
+            }
+        }
+
+        if (oldestShard < 0)
+        {
+            break; // only the new entry is left
+        }
+
+        Shard& shard = shards[oldestShard];
+        Entry* removed = nullptr;
+
+        {
+            std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+            auto it = FindOldest(shard, keep);
+            if (it != shard.entries.end())
+            {
+                removed = it->second;
+                bytesInUse.fetch_sub(removed->size, std::memory_order_relaxed);
+                shard.entries.erase(it);
+            }
+        }
+
+        if (removed != nullptr)
+        {
+            delete removed;
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void ThumbnailCache::Clear()
+{
+    for (int i = 0; i < ShardCount; i++)
+    {
+        Shard& shard = shards[i];
+        std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+        for (auto it = shard.entries.begin(); it != shard.entries.end(); ++it)
+        {
+            bytesInUse.fetch_sub(it->second->size, std::memory_order_relaxed);
+            delete it->second;
+        }
+
+        shard.entries.clear();
+    }
+}
+
+ThumbnailCacheStats ThumbnailCache::GetStats() const
+{
+    ThumbnailCacheStats stats;
+    stats.hits = hits.load(std::memory_order_relaxed);
+    stats.misses = misses.load(std::memory_order_relaxed);
+    stats.insertions = insertions.load(std::memory_order_relaxed);
+    stats.evictions = evictions.load(std::memory_order_relaxed);
+    stats.bytesInUse = bytesInUse.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+ThumbnailCache& GetProcessThumbnailCache()
+{
+    static ThumbnailCache cache(ProcessCacheBytes);
+
+    return cache;
+}
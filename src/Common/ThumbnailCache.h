@@ -0,0 +1,157 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include "PixelBuffer.h"
+
+// Identifies a file for the thumbnail caches, either by the ContentHasher hash of all of its
+// raw bytes or by the hash of its first bytes and its modification time. The key is computed
+// before the file is decompressed or parsed so a cached thumbnail skips all of that.
+// The size is added to make collisions between different files even less likely.
+struct ThumbnailCacheKey
+{
+    unsigned long long contentHash;
+    unsigned long long fileSize;
+
+    bool operator==(const ThumbnailCacheKey& other) const
+    {
+        return contentHash == other.contentHash && fileSize == other.fileSize;
+    }
+};
+
+// Returns the key of a file that is in memory.
+ThumbnailCacheKey GetThumbnailCacheKey(const void* data, size_t size);
+
+// The number of bytes at the start of a file that GetThumbnailFileKey hashes.
+const size_t ThumbnailFileKeyHeaderSize = 4096;
+
+// Returns the key of a file from its first ThumbnailFileKeyHeaderSize bytes (or all of them for
+// a smaller file), its size and its modification time, so the key costs one small read that the
+// decoder makes anyway. A file that is changed without changing any of those is not detected and
+// copies of a file get different keys, the disk cache is shared between files and processes so it
+// uses the GetThumbnailCacheKey of all of the bytes.
+ThumbnailCacheKey GetThumbnailFileKey(const void* header, size_t headerSize, unsigned long long fileSize, unsigned long long modifiedTime);
+
+// A decoded image in the cache, it is not changed after it is added so any number of threads
+// can read it. It is the largest thumbnail that was requested for the file.
+struct CachedThumbnail
+{
+    PixelBuffer pixels;
+    int maxEdgeLength; // the thumbnail size that the image was created for, 0 for the full size
+};
+
+// Copies a thumbnail into a new CachedThumbnail, returns nullptr when out of memory.
+CachedThumbnail* CreateCachedThumbnail(const unsigned char* src, size_t srcStride, int width, int height, int maxEdgeLength);
+
+// Gets the size of the thumbnail for maxEdgeLength that is created from the cached image.
+// Returns false when the cached image is smaller than that thumbnail would be.
+bool GetCachedThumbnailSize(const CachedThumbnail& image, int maxEdgeLength, int* width, int* height);
+
+// Writes the cached image to dst at width by height, it is copied when it has that size and
+// scaled down otherwise. Returns false if the temporary buffers could not be allocated.
+bool CopyCachedThumbnail(const CachedThumbnail& image, unsigned char* dst, size_t dstStride, int width, int height);
+
+struct ThumbnailCacheStats
+{
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long insertions;
+    unsigned long long evictions;
+    size_t bytesInUse;
+};
+
+// A size bounded cache of decoded thumbnails that can be used by any number of threads, a
+// repeated request for an image then only costs a copy or a scale of the cached pixels.
+// The entries are split between shards that each have a reader/writer lock, lookups only take
+// the shared lock so readers never wait for each other, only for an insertion into the same
+// shard. The size limit is for the whole cache, so one large thumbnail can use more than the
+// share of a shard. When the cache is over the limit the least recently used entries of any
+// shard are removed, an entry that is removed while a thread uses it stays valid until it is released.
+class ThumbnailCache
+{
+public:
+    explicit ThumbnailCache(size_t maxBytes);
+    ~ThumbnailCache();
+
+    // Returns nullptr when the key is not in the cache.
+    std::shared_ptr<const CachedThumbnail> Find(const ThumbnailCacheKey& key);
+
+    // Adds the image or replaces the image that has the same key, the cache takes ownership of
+    // the image even when it is not added. Returns false when the image is larger than the
+    // cache or out of memory.
+    bool Insert(const ThumbnailCacheKey& key, CachedThumbnail* image);
+
+    void Clear();
+
+    ThumbnailCacheStats GetStats() const;
+
+private:
+    ThumbnailCache(const ThumbnailCache&) = delete;
+    ThumbnailCache& operator=(const ThumbnailCache&) = delete;
+
+    enum { ShardCount = 16 };
+
+    struct KeyHash
+    {
+        size_t operator()(const ThumbnailCacheKey& key) const
+        {
+            return static_cast<size_t>(key.contentHash);
+        }
+    };
+
+    struct Entry
+    {
+        std::shared_ptr<const CachedThumbnail> image;
+        size_t size;
+        std::atomic<unsigned long long> lastUse; // updated by the readers under the shared lock
+    };
+
+    struct Shard
+    {
+        mutable std::shared_timed_mutex mutex;
+        std::unordered_map<ThumbnailCacheKey, Entry*, KeyHash> entries;
+    };
+
+    Shard& GetShard(const ThumbnailCacheKey& key);
+    // Removes the least recently used entries until the cache is within its size limit, the
+    // entry that was just added is kept. No shard may be locked by the caller.
+    void Trim(const Entry* keep);
+    // Returns the least recently used entry of the shard other than keep, or the end of the map.
+    // The shard must be locked.
+    std::unordered_map<ThumbnailCacheKey, Entry*, KeyHash>::const_iterator FindOldest(const Shard& shard, const Entry* keep) const;
+
+    Shard shards[ShardCount];
+    size_t maxBytes;
+    std::atomic<size_t> bytesInUse;
+    std::atomic<unsigned long long> useClock;
+    std::atomic<unsigned long long> hits;
+    std::atomic<unsigned long long> misses;
+    std::atomic<unsigned long long> insertions;
+    std::atomic<unsigned long long> evictions;
+};
+
+// The cache that is shared by all of the thumbnail handlers in the process.
+ThumbnailCache& GetProcessThumbnailCache();
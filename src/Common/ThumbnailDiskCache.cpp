@@ -0,0 +1,537 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "ThumbnailDiskCache.h"
+#include "ContentHash.h"
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    const char Signature[4] = { 'F', 'S', 'H', 'C' };
+    const unsigned int Version = 1;
+
+    // The index is never resized, it is filled up to three quarters so the probe sequences
+    // stay short.
+    const unsigned int SlotCount = 65536;
+    const unsigned int MaxEntryCount = SlotCount / 4 * 3;
+
+    // The file is extended in steps so it is not remapped for every thumbnail.
+    const unsigned long long GrowSize = 4 * 1024 * 1024;
+
+    const unsigned long long ProcessCacheMaxBytes = 1024ULL * 1024 * 1024;
+
+    struct FileHeader
+    {
+        char signature[4];
+        unsigned int version;
+        unsigned int slotCount;
+        unsigned int entryCount;
+        unsigned long long dataEnd; // the offset where the next record is added
+        unsigned char reserved[40];
+    };
+
+    // Each thumbnail in the data region starts with a copy of its key and a checksum.
+    struct RecordHeader
+    {
+        unsigned long long contentHash;
+        unsigned long long fileSize;
+        unsigned long long pixelHash;
+        unsigned int maxEdgeLength;
+        unsigned short width;
+        unsigned short height;
+    };
+
+    // An index entry, a recordOffset of 0 marks an empty slot.
+    struct IndexSlot
+    {
+        unsigned long long contentHash;
+        unsigned long long fileSize;
+        unsigned long long recordOffset;
+        unsigned int maxEdgeLength;
+        unsigned short width;
+        unsigned short height;
+    };
+
+    static_assert(sizeof(FileHeader) == 64, "FileHeader must be 64 bytes");
+    static_assert(sizeof(RecordHeader) == 32, "RecordHeader must be 32 bytes");
+    static_assert(sizeof(IndexSlot) == 32, "IndexSlot must be 32 bytes");
+
+    const unsigned long long IndexOffset = sizeof(FileHeader);
+    const unsigned long long DataOffset = IndexOffset + SlotCount * sizeof(IndexSlot);
+
+#if defined(_WIN32)
+    // The lock is taken on a byte far past the end of the file, a lock on the data would
+    // also block the reads and writes of the other processes.
+    const DWORD LockOffsetHigh = 0x7fffffff;
+#endif
+
+    // Returns the slot that has the key or the empty slot where it would be added, or nullptr
+    // when the key is not found and the index has no empty slot.
+    IndexSlot* FindSlot(unsigned char* data, const ThumbnailCacheKey& fileKey, int maxEdgeLength)
+    {
+        IndexSlot* slots = reinterpret_cast<IndexSlot*>(data + IndexOffset);
+        const unsigned int mask = SlotCount - 1;
+
+        unsigned int index = static_cast<unsigned int>((fileKey.contentHash ^ (maxEdgeLength * 0x9E3779B97F4A7C15ULL)) >> 32) & mask;
+
+        for (unsigned int i = 0; i < SlotCount; i++)
+        {
+            IndexSlot* slot = &slots[index];
+
+            if (slot->recordOffset == 0 ||
+                (slot->contentHash == fileKey.contentHash && slot->fileSize == fileKey.fileSize && slot->maxEdgeLength == static_cast<unsigned int>(maxEdgeLength)))
+            {
+                return slot;
+            }
+
+            index = (index + 1) & mask;
+        }
+
+        return nullptr;
+    }
+
+    bool OpenProcessDiskCache(ThumbnailDiskCache& cache)
+    {
+#if defined(_WIN32)
+        // REG_EXPAND_SZ values are expanded, e.g. %LOCALAPPDATA%\FshThumbnailCache.bin.
+        wchar_t path[MAX_PATH];
+        DWORD pathSize = sizeof(path);
+
+        if (RegGetValueW(HKEY_CURRENT_USER, L"Software\\FshThumbnailHandler", L"DiskCachePath", RRF_RT_REG_SZ, nullptr, path, &pathSize) != ERROR_SUCCESS)
+        {
+            return false;
+        }
+#else
+        const char* path = getenv("FSH_THUMBNAIL_DISK_CACHE");
+
+        if (path == nullptr || path[0] == '\0')
+        {
+            return false;
+        }
+#endif
+
+        return cache.Open(path, ProcessCacheMaxBytes);
+    }
+}
+
+
+ThumbnailDiskCache::ThumbnailDiskCache() :
+#if defined(_WIN32)
+    file(nullptr),
+    mapping(nullptr),
+#else
+    file(-1),
+#endif
+    data(nullptr),
+    mappedSize(0),
+    maxFileSize(0)
+{
+}
+
+ThumbnailDiskCache::~ThumbnailDiskCache()
+{
+    Close();
+}
+
+bool ThumbnailDiskCache::Open(const DiskCachePathChar* path, unsigned long long maxFileSize)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    Close();
+
+#if defined(_WIN32)
+    HANDLE handle = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    file = handle;
+#else
+    file = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (file < 0)
+    {
+        return false;
+    }
+#endif
+
+    this->maxFileSize = maxFileSize < DataOffset + GrowSize ? DataOffset + GrowSize : maxFileSize;
+
+    bool initialized = false;
+
+    if (LockFile(true))
+    {
+        initialized = Initialize();
+        UnlockFile();
+    }
+
+    if (!initialized)
+    {
+        Close();
+    }
+
+    return initialized;
+}
+
+void ThumbnailDiskCache::Close()
+{
+    UnmapFile();
+
+#if defined(_WIN32)
+    if (file)
+    {
+        CloseHandle(file);
+        file = nullptr;
+    }
+#else
+    if (file >= 0)
+    {
+        close(file);
+        file = -1;
+    }
+#endif
+}
+
+bool ThumbnailDiskCache::Initialize()
+{
+    const unsigned long long fileSize = GetFileSize();
+
+    if (fileSize != 0 && fileSize < DataOffset)
+    {
+        return false;
+    }
+
+    if (!MapFile(fileSize != 0 ? fileSize : DataOffset + GrowSize))
+    {
+        return false;
+    }
+
+    FileHeader* header = reinterpret_cast<FileHeader*>(data);
+
+    // The header is all zeros when the file is new or the process that created it stopped
+    // before the header was written, the index is also all zeros then.
+    static const FileHeader emptyHeader = {};
+
+    if (memcmp(header, &emptyHeader, sizeof(FileHeader)) == 0)
+    {
+        memcpy(header->signature, Signature, sizeof(Signature));
+        header->version = Version;
+        header->slotCount = SlotCount;
+        header->entryCount = 0;
+        header->dataEnd = DataOffset;
+        return true;
+    }
+
+    return memcmp(header->signature, Signature, sizeof(Signature)) == 0 &&
+        header->version == Version &&
+        header->slotCount == SlotCount &&
+        header->dataEnd >= DataOffset &&
+        header->dataEnd <= mappedSize;
+}
+
+bool ThumbnailDiskCache::LockFile(bool exclusive)
+{
+#if defined(_WIN32)
+    OVERLAPPED overlapped = {};
+    overlapped.OffsetHigh = LockOffsetHigh;
+
+    return LockFileEx(file, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &overlapped) != FALSE;
+#else
+    int result;
+
+    do
+    {
+        result = flock(file, exclusive ? LOCK_EX : LOCK_SH);
+    } while (result != 0 && errno == EINTR);
+
+    return result == 0;
+#endif
+}
+
+void ThumbnailDiskCache::UnlockFile()
+{
+#if defined(_WIN32)
+    OVERLAPPED overlapped = {};
+    overlapped.OffsetHigh = LockOffsetHigh;
+
+    UnlockFileEx(file, 0, 1, 0, &overlapped);
+#else
+    flock(file, LOCK_UN);
+#endif
+}
+
+unsigned long long ThumbnailDiskCache::GetFileSize() const
+{
+#if defined(_WIN32)
+    LARGE_INTEGER size;
+
+    return GetFileSizeEx(file, &size) && size.QuadPart > 0 ? static_cast<unsigned long long>(size.QuadPart) : 0;
+#else
+    struct stat info;
+
+    return fstat(file, &info) == 0 && info.st_size > 0 ? static_cast<unsigned long long>(info.st_size) : 0;
+#endif
+}
+
+bool ThumbnailDiskCache::MapFile(unsigned long long size)
+{
+    UnmapFile();
+
+    if (size > static_cast<size_t>(-1))
+    {
+        return false;
+    }
+
+#if defined(_WIN32)
+    // The mapping extends the file when it is larger.
+    mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+    if (!mapping)
+    {
+        return false;
+    }
+
+    data = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T>(size)));
+    if (!data)
+    {
+        UnmapFile();
+        return false;
+    }
+#else
+    if (GetFileSize() < size && ftruncate(file, static_cast<off_t>(size)) != 0)
+    {
+        return false;
+    }
+
+    void* view = mmap(nullptr, static_cast<size_t>(size), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (view == MAP_FAILED)
+    {
+        return false;
+    }
+
+    data = static_cast<unsigned char*>(view);
+#endif
+
+    mappedSize = size;
+
+    return true;
+}
+
+void ThumbnailDiskCache::UnmapFile()
+{
+#if defined(_WIN32)
+    if (data)
+    {
+        UnmapViewOfFile(data);
+    }
+
+    if (mapping)
+    {
+        CloseHandle(mapping);
+        mapping = nullptr;
+    }
+#else
+    if (data)
+    {
+        munmap(data, static_cast<size_t>(mappedSize));
+    }
+#endif
+
+    data = nullptr;
+    mappedSize = 0;
+}
+
+bool ThumbnailDiskCache::Refresh()
+{
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(data);
+
+    if (header->dataEnd <= mappedSize)
+    {
+        return true;
+    }
+
+    const unsigned long long fileSize = GetFileSize();
+
+    return header->dataEnd <= fileSize && MapFile(fileSize);
+}
+
+bool ThumbnailDiskCache::Find(const ThumbnailCacheKey& fileKey, int maxEdgeLength, const DiskCacheAllocateProc& allocate)
+{
+    if (maxEdgeLength < 0 || maxEdgeLength > 0xffff)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+
+    if (!data || !LockFile(false))
+    {
+        return false;
+    }
+
+    bool found = false;
+
+    if (Refresh())
+    {
+        const FileHeader* header = reinterpret_cast<const FileHeader*>(data);
+        const IndexSlot* slot = FindSlot(data, fileKey, maxEdgeLength);
+
+        if (slot != nullptr && slot->recordOffset != 0)
+        {
+            const size_t pixelsSize = static_cast<size_t>(slot->width) * slot->height * 4;
+            const unsigned long long offset = slot->recordOffset;
+
+            if (slot->width > 0 && slot->height > 0 && offset >= DataOffset && offset <= header->dataEnd &&
+                header->dataEnd - offset >= sizeof(RecordHeader) + pixelsSize)
+            {
+                RecordHeader record;
+                memcpy(&record, data + offset, sizeof(RecordHeader));
+
+                const unsigned char* pixels = data + offset + sizeof(RecordHeader);
+
+                if (record.contentHash == fileKey.contentHash &&
+                    record.fileSize == fileKey.fileSize &&
+                    record.maxEdgeLength == static_cast<unsigned int>(maxEdgeLength) &&
+                    record.width == slot->width &&
+                    record.height == slot->height &&
+                    record.pixelHash == HashBytes64(pixels, pixelsSize, 0))
+                {
+                    unsigned char* dst = allocate(slot->width, slot->height);
+
+                    if (dst != nullptr)
+                    {
+                        memcpy(dst, pixels, pixelsSize);
+                        found = true;
+                    }
+                }
+            }
+        }
+    }
+
+    UnlockFile();
+
+    return found;
+}
+
+bool ThumbnailDiskCache::Insert(const ThumbnailCacheKey& fileKey, int maxEdgeLength, const unsigned char* pixels, size_t stride, int width, int height)
+{
+    if (maxEdgeLength < 0 || maxEdgeLength > 0xffff || width <= 0 || width > 0xffff || height <= 0 || height > 0xffff)
+    {
+        return false;
+    }
+
+    const size_t rowBytes = static_cast<size_t>(width) * 4;
+    const unsigned long long recordSize = sizeof(RecordHeader) + static_cast<unsigned long long>(rowBytes) * height;
+
+    std::lock_guard<std::mutex> guard(mutex);
+
+    if (!data || !LockFile(true))
+    {
+        return false;
+    }
+
+    bool added = false;
+
+    if (Refresh())
+    {
+        FileHeader* header = reinterpret_cast<FileHeader*>(data);
+        const unsigned long long offset = header->dataEnd;
+        const unsigned long long end = offset + recordSize;
+
+        const IndexSlot* existing = FindSlot(data, fileKey, maxEdgeLength);
+
+        if (existing != nullptr && existing->recordOffset == 0 && header->entryCount < MaxEntryCount && end <= maxFileSize)
+        {
+            bool mapped = true;
+
+            if (end > mappedSize)
+            {
+                unsigned long long newSize = (end + GrowSize - 1) / GrowSize * GrowSize;
+                if (newSize > maxFileSize)
+                {
+                    newSize = end;
+                }
+
+                // The pointers into the old view are not valid after this.
+                mapped = MapFile(newSize);
+            }
+
+            if (mapped)
+            {
+                header = reinterpret_cast<FileHeader*>(data);
+                unsigned char* record = data + offset;
+                unsigned char* dst = record + sizeof(RecordHeader);
+
+                for (int y = 0; y < height; y++)
+                {
+                    memcpy(dst + y * rowBytes, pixels + y * stride, rowBytes);
+                }
+
+                RecordHeader recordHeader;
+                recordHeader.contentHash = fileKey.contentHash;
+                recordHeader.fileSize = fileKey.fileSize;
+                recordHeader.pixelHash = HashBytes64(dst, rowBytes * height, 0);
+                recordHeader.maxEdgeLength = static_cast<unsigned int>(maxEdgeLength);
+                recordHeader.width = static_cast<unsigned short>(width);
+                recordHeader.height = static_cast<unsigned short>(height);
+                memcpy(record, &recordHeader, sizeof(RecordHeader));
+
+                // The data region is updated before the index so a slot never points past
+                // dataEnd, where the next record would overwrite it.
+                header->dataEnd = end;
+
+                IndexSlot* slot = FindSlot(data, fileKey, maxEdgeLength);
+                slot->contentHash = fileKey.contentHash;
+                slot->fileSize = fileKey.fileSize;
+                slot->maxEdgeLength = static_cast<unsigned int>(maxEdgeLength);
+                slot->width = static_cast<unsigned short>(width);
+                slot->height = static_cast<unsigned short>(height);
+                slot->recordOffset = offset;
+
+                header->entryCount++;
+                added = true;
+            }
+        }
+    }
+
+    UnlockFile();
+
+    return added;
+}
+
+ThumbnailDiskCache* GetProcessThumbnailDiskCache()
+{
+    static ThumbnailDiskCache cache;
+    static const bool opened = OpenProcessDiskCache(cache);
+
+    return opened ? &cache : nullptr;
+}
@@ -0,0 +1,100 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <functional>
+#include <mutex>
+#include "ThumbnailCache.h"
+
+#if defined(_WIN32)
+typedef wchar_t DiskCachePathChar;
+#else
+typedef char DiskCachePathChar;
+#endif
+
+// Returns the memory that a thumbnail from the disk cache is copied to, the rows are width * 4
+// bytes apart. Returning nullptr cancels the lookup.
+typedef std::function<unsigned char*(int width, int height)> DiskCacheAllocateProc;
+
+// A cache file that keeps the finished thumbnails between runs and is shared by every process
+// that uses the same path, e.g. Explorer and the batch tools.
+// The thumbnails are found by a hash of the raw file bytes and the requested size, so copies of
+// a file in different folders share their entries and a lookup never parses the FSH file.
+//
+// The file starts with a header and an open addressing hash index of a fixed size, followed by
+// the data region that the thumbnails are appended to. It is memory mapped and grows as
+// thumbnails are added up to the maximum size, after that no more thumbnails are added.
+// Entries are never removed, deleting the file clears the cache.
+//
+// Any number of threads and processes can use the cache at the same time. Lookups take a shared
+// lock on the file and insertions an exclusive one. A thumbnail is written before its index
+// slot, and every record has a checksum that is tested before it is used, so an insertion that
+// was interrupted only wastes space.
+class ThumbnailDiskCache
+{
+public:
+    ThumbnailDiskCache();
+    ~ThumbnailDiskCache();
+
+    // Opens the cache file or creates it. Returns false if the file could not be opened or is
+    // not a cache file, the caller then works without the cache.
+    bool Open(const DiskCachePathChar* path, unsigned long long maxFileSize);
+    void Close();
+
+    // Copies the thumbnail into the memory returned by allocate, which is only called when the
+    // thumbnail is found. Returns false if it is not in the cache.
+    bool Find(const ThumbnailCacheKey& fileKey, int maxEdgeLength, const DiskCacheAllocateProc& allocate);
+
+    // Adds a thumbnail, returns false if the cache is full or the file could not be extended.
+    // A thumbnail that is already in the cache is not added again.
+    bool Insert(const ThumbnailCacheKey& fileKey, int maxEdgeLength, const unsigned char* pixels, size_t stride, int width, int height);
+
+private:
+    ThumbnailDiskCache(const ThumbnailDiskCache&) = delete;
+    ThumbnailDiskCache& operator=(const ThumbnailDiskCache&) = delete;
+
+    bool LockFile(bool exclusive);
+    void UnlockFile();
+    // Maps the first size bytes of the file, the file is extended when it is smaller.
+    bool MapFile(unsigned long long size);
+    void UnmapFile();
+    // Maps the parts of the file that other processes added. The file must be locked.
+    bool Refresh();
+    bool Initialize();
+    unsigned long long GetFileSize() const;
+
+#if defined(_WIN32)
+    void* file;
+    void* mapping;
+#else
+    int file;
+#endif
+    unsigned char* data;
+    unsigned long long mappedSize;
+    unsigned long long maxFileSize;
+    std::mutex mutex; // the file lock does not exclude the other threads of the process
+};
+
+// The disk cache of the process, or nullptr when it is not enabled. The path of the cache file is
+// read from the DiskCachePath value of HKEY_CURRENT_USER\Software\FshThumbnailHandler on Windows
+// and the FSH_THUMBNAIL_DISK_CACHE environment variable on other platforms.
+ThumbnailDiskCache* GetProcessThumbnailDiskCache();
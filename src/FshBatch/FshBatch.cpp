@@ -0,0 +1,735 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// fshbatch creates the thumbnails of FSH files from the command line with the decode core of
+// the shell handlers, for asset pipelines and for benchmarking the decoders on Linux.
+// There is no project file for it, it is built with e.g.
+//     g++ -std=c++14 -O2 -pthread -I../Common *.cpp ../Common/*.cpp -o fshbatch
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "FshHeaders.h"
+#include "FshPrefixReader.h"
+#include "FshThumbnailLadder.h"
+#include "FshThumbnailLoader.h"
+#include "PngWriter.h"
+#include "QfsDecompressor.h"
+#include "ThumbnailArena.h"
+#include "ThumbnailCache.h"
+#include "ThumbnailDiskCache.h"
+#include "WorkStealingPool.h"
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // Each worker keeps up to this much of the arena memory between files.
+    const size_t BlockCacheBytes = 8 * 1024 * 1024;
+    const unsigned long long DiskCacheMaxBytes = 1024ULL * 1024 * 1024;
+
+    struct Options
+    {
+        std::vector<int> sizes;
+        bool png;
+        bool writeOutput;
+        std::string outputDirectory;
+        std::string diskCachePath;
+        int threadCount;
+    };
+
+    struct InputFile
+    {
+        std::string path;
+        std::string relativePath; // the path below the directory that was searched
+        unsigned long long size;
+    };
+
+    enum Stage
+    {
+        StageRead,
+        StageCache,
+        StageDecompress,
+        StageParse,
+        StageDecode,
+        StageWrite,
+        StageCount
+    };
+
+    const char* const StageNames[StageCount] = { "read", "disk cache", "decompress", "parse", "decode", "write" };
+
+    struct BatchTotals
+    {
+        std::atomic<unsigned long long> stageNanoseconds[StageCount];
+        std::atomic<unsigned long long> inputBytes;
+        std::atomic<unsigned long long> thumbnailCount;
+        std::atomic<unsigned long long> cachedFileCount;
+        std::atomic<unsigned long long> failureCount;
+    };
+
+    // Adds the time since the last stage ended to the totals of a stage.
+    class StageTimer
+    {
+    public:
+        explicit StageTimer(BatchTotals& totals) : totals(totals), start(Clock::now())
+        {
+        }
+
+        void End(Stage stage)
+        {
+            const Clock::time_point now = Clock::now();
+
+            totals.stageNanoseconds[stage] += static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count());
+            start = now;
+        }
+
+    private:
+        BatchTotals& totals;
+        Clock::time_point start;
+    };
+
+    // A thumbnail that is ready to be written, from the ladder or the disk cache.
+    struct Thumbnail
+    {
+        int maxEdgeLength;
+        int width;
+        int height;
+        const unsigned char* pixels; // the rows are width * 4 bytes apart
+    };
+
+    void PrintUsage()
+    {
+        fprintf(stderr,
+            "Usage: fshbatch [options] <file | directory | @listfile>...\n"
+            "Creates the thumbnails of FSH files, the directories are searched for *.fsh files.\n"
+            "\n"
+            "  -s <sizes>    thumbnail sizes separated by commas, 0 is the size of the image (default 256)\n"
+            "  -f png|raw    the output format, raw is BGRA pixels without a header (default png)\n"
+            "  -o <dir>      the output directory, by default the thumbnails are written next to the files\n"
+            "  -j <threads>  the number of worker threads (default: one per CPU)\n"
+            "  -c <file>     a thumbnail disk cache file that is used and updated\n"
+            "  -n            decode only, nothing is written\n");
+    }
+
+    bool ParseSizes(const char* text, std::vector<int>* sizes)
+    {
+        sizes->clear();
+
+        while (*text != '\0')
+        {
+            char* end;
+            const long value = strtol(text, &end, 10);
+
+            if (end == text || value < 0 || value > 0xffff || (*end != ',' && *end != '\0'))
+            {
+                return false;
+            }
+
+            sizes->push_back(static_cast<int>(value));
+            text = *end == ',' ? end + 1 : end;
+        }
+
+        return !sizes->empty() && sizes->size() <= FshThumbnailLadder::MaxLevels;
+    }
+
+    bool HasFshExtension(const std::string& name)
+    {
+        return name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".fsh") == 0;
+    }
+
+    std::string GetFileName(const std::string& path)
+    {
+        const size_t slash = path.rfind('/');
+
+        return slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+
+    void AddDirectory(const std::string& directory, const std::string& relativeDirectory, std::vector<InputFile>& files)
+    {
+        DIR* dir = opendir(directory.c_str());
+        if (dir == nullptr)
+        {
+            fprintf(stderr, "%s: %s\n", directory.c_str(), strerror(errno));
+            return;
+        }
+
+        while (const dirent* entry = readdir(dir))
+        {
+            const std::string name = entry->d_name;
+
+            if (name == "." || name == "..")
+            {
+                continue;
+            }
+
+            const std::string path = directory + "/" + name;
+            const std::string relativePath = relativeDirectory.empty() ? name : relativeDirectory + "/" + name;
+            struct stat info;
+
+            // The links to directories are not followed so a loop cannot be searched forever.
+            if (lstat(path.c_str(), &info) != 0)
+            {
+                continue;
+            }
+
+            if (S_ISDIR(info.st_mode))
+            {
+                AddDirectory(path, relativePath, files);
+            }
+            else if (HasFshExtension(name) && (S_ISREG(info.st_mode) || (S_ISLNK(info.st_mode) && stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))))
+            {
+                InputFile file = { path, relativePath, static_cast<unsigned long long>(info.st_size) };
+                files.push_back(file);
+            }
+        }
+
+        closedir(dir);
+    }
+
+    void AddPath(const std::string& path, std::vector<InputFile>& files)
+    {
+        struct stat info;
+
+        if (stat(path.c_str(), &info) != 0)
+        {
+            fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        }
+        else if (S_ISDIR(info.st_mode))
+        {
+            AddDirectory(path, std::string(), files);
+        }
+        else
+        {
+            // A file that is named on the command line is used whatever its extension is.
+            InputFile file = { path, GetFileName(path), static_cast<unsigned long long>(info.st_size) };
+            files.push_back(file);
+        }
+    }
+
+    // A list file has one file or directory on each line.
+    void AddListFile(const std::string& listPath, std::vector<InputFile>& files)
+    {
+        FILE* list = fopen(listPath.c_str(), "r");
+        if (list == nullptr)
+        {
+            fprintf(stderr, "%s: %s\n", listPath.c_str(), strerror(errno));
+            return;
+        }
+
+        char line[4096];
+
+        while (fgets(line, sizeof(line), list) != nullptr)
+        {
+            size_t length = strlen(line);
+
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            {
+                line[--length] = '\0';
+            }
+
+            if (length > 0)
+            {
+                AddPath(line, files);
+            }
+        }
+
+        fclose(list);
+    }
+
+    bool MakeParentDirectories(const std::string& path)
+    {
+        for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+        {
+            const std::string directory = path.substr(0, slash);
+
+            if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool ReadWholeFile(const std::string& path, ThumbnailArena& arena, const unsigned char** data, size_t* size)
+    {
+        const int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file < 0)
+        {
+            return false;
+        }
+
+        struct stat info;
+        unsigned char* buffer = nullptr;
+        size_t length = 0;
+
+        if (fstat(file, &info) == 0 && info.st_size > 0 && static_cast<unsigned long long>(info.st_size) <= static_cast<size_t>(-1))
+        {
+            length = static_cast<size_t>(info.st_size);
+            buffer = arena.AllocateArray<unsigned char>(length);
+        }
+
+        size_t offset = 0;
+
+        while (buffer != nullptr && offset < length)
+        {
+            const ssize_t count = read(file, buffer + offset, length - offset);
+
+            if (count > 0)
+            {
+                offset += static_cast<size_t>(count);
+            }
+            else if (count == 0 || errno != EINTR)
+            {
+                buffer = nullptr;
+            }
+        }
+
+        close(file);
+
+        *data = buffer;
+        *size = length;
+        return buffer != nullptr;
+    }
+
+    const char* GetLoadStatusMessage(FshLoadStatus status)
+    {
+        return status == FshLoadOutOfMemory ? "out of memory" : "not a valid FSH image";
+    }
+
+    std::string GetOutputPath(const InputFile& input, const Options& options, const Thumbnail& thumbnail)
+    {
+        std::string path;
+
+        if (options.outputDirectory.empty())
+        {
+            path = input.path;
+        }
+        else
+        {
+            path = options.outputDirectory + "/" + input.relativePath;
+        }
+
+        const size_t slash = path.rfind('/');
+        const size_t dot = path.rfind('.');
+
+        if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+        {
+            path.erase(dot);
+        }
+
+        char suffix[64];
+
+        if (options.png)
+        {
+            snprintf(suffix, sizeof(suffix), "_%d.png", thumbnail.maxEdgeLength);
+        }
+        else
+        {
+            snprintf(suffix, sizeof(suffix), "_%d_%dx%d.bgra", thumbnail.maxEdgeLength, thumbnail.width, thumbnail.height);
+        }
+
+        return path + suffix;
+    }
+
+    bool WriteThumbnail(const std::string& path, const Options& options, const Thumbnail& thumbnail)
+    {
+        if (!MakeParentDirectories(path))
+        {
+            return false;
+        }
+
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        const size_t stride = static_cast<size_t>(thumbnail.width) * 4;
+        bool written;
+
+        if (options.png)
+        {
+            written = WritePngFile(file, thumbnail.pixels, stride, thumbnail.width, thumbnail.height);
+        }
+        else
+        {
+            const size_t size = stride * thumbnail.height;
+
+            written = fwrite(thumbnail.pixels, 1, size, file) == size;
+        }
+
+        return fclose(file) == 0 && written;
+    }
+
+    // Creates the thumbnails of one file, returns false and sets the error message if it fails.
+    bool ProcessFile(const InputFile& input, const Options& options, ArenaBlockCache& blockCache, ThumbnailDiskCache* diskCache, BatchTotals& totals, std::string* error)
+    {
+        ThumbnailArena arena(&blockCache);
+        StageTimer timer(totals);
+
+        const unsigned char* data;
+        size_t size;
+
+        if (!ReadWholeFile(input.path, arena, &data, &size))
+        {
+            *error = "the file could not be read";
+            return false;
+        }
+
+        totals.inputBytes += size;
+        timer.End(StageRead);
+
+        const int sizeCount = static_cast<int>(options.sizes.size());
+        Thumbnail thumbnails[FshThumbnailLadder::MaxLevels];
+        std::vector<unsigned char> cachedPixels[FshThumbnailLadder::MaxLevels];
+        ThumbnailCacheKey fileKey;
+        bool allCached = false;
+
+        if (diskCache != nullptr)
+        {
+            fileKey = GetThumbnailCacheKey(data, size);
+
+            allCached = true;
+
+            for (int i = 0; i < sizeCount && allCached; i++)
+            {
+                Thumbnail& thumbnail = thumbnails[i];
+                thumbnail.maxEdgeLength = options.sizes[i];
+
+                auto allocate = [&](int width, int height) -> unsigned char*
+                {
+                    cachedPixels[i].resize(static_cast<size_t>(width) * height * 4);
+                    thumbnail.width = width;
+                    thumbnail.height = height;
+                    return cachedPixels[i].data();
+                };
+
+                allCached = diskCache->Find(fileKey, thumbnail.maxEdgeLength, allocate);
+                thumbnail.pixels = cachedPixels[i].data();
+            }
+
+            timer.End(StageCache);
+        }
+
+        // The ladder keeps the decoded thumbnails until they are written.
+        FshThumbnailLadder ladder;
+
+        if (allCached)
+        {
+            totals.cachedFileCount++;
+        }
+        else
+        {
+            // The level is selected for the largest thumbnail and the smaller ones are scaled from it.
+            int maxEdgeLength = 0;
+
+            if (std::find(options.sizes.begin(), options.sizes.end(), 0) == options.sizes.end())
+            {
+                maxEdgeLength = *std::max_element(options.sizes.begin(), options.sizes.end());
+            }
+
+            // Only the first available bytes of a compressed file are decompressed.
+            size_t available = size;
+
+            if (size >= 9 && IsQfsCompressed(data))
+            {
+                // Only the part of the file that the loader uses is decompressed, as the shell handlers do.
+                FshFilePrefix prefix;
+                const FshLoadStatus status = DecompressFshPrefix(data, size, maxEdgeLength, &arena, &prefix);
+
+                if (status != FshLoadOk)
+                {
+                    *error = GetLoadStatusMessage(status);
+                    return false;
+                }
+
+                data = prefix.data;
+                available = prefix.length;
+                size = prefix.size;
+
+                timer.End(StageDecompress);
+            }
+
+            FshThumbnailLoader loader(&arena);
+            const FshLoadStatus status = loader.Open(data, available, size, maxEdgeLength);
+
+            if (status != FshLoadOk)
+            {
+                *error = GetLoadStatusMessage(status);
+                return false;
+            }
+
+            timer.End(StageParse);
+
+            if (!ladder.Create(loader.GetImageSource(), options.sizes.data(), sizeCount))
+            {
+                *error = "the image could not be decoded";
+                return false;
+            }
+
+            timer.End(StageDecode);
+
+            for (int i = 0; i < sizeCount; i++)
+            {
+                const FshThumbnailLevel& level = ladder.GetLevel(i);
+
+                thumbnails[i].maxEdgeLength = level.maxEdgeLength;
+                thumbnails[i].width = level.width;
+                thumbnails[i].height = level.height;
+                thumbnails[i].pixels = level.pixels;
+            }
+
+            if (diskCache != nullptr)
+            {
+                for (int i = 0; i < sizeCount; i++)
+                {
+                    const Thumbnail& thumbnail = thumbnails[i];
+
+                    diskCache->Insert(fileKey, thumbnail.maxEdgeLength, thumbnail.pixels, static_cast<size_t>(thumbnail.width) * 4, thumbnail.width, thumbnail.height);
+                }
+
+                timer.End(StageCache);
+            }
+        }
+
+        totals.thumbnailCount += sizeCount;
+
+        if (options.writeOutput)
+        {
+            for (int i = 0; i < sizeCount; i++)
+            {
+                const std::string path = GetOutputPath(input, options, thumbnails[i]);
+
+                if (!WriteThumbnail(path, options, thumbnails[i]))
+                {
+                    *error = path + " could not be written";
+                    return false;
+                }
+            }
+
+            timer.End(StageWrite);
+        }
+
+        return true;
+    }
+
+    bool ParseOptions(int argc, char** argv, Options* options, std::vector<std::string>* inputs)
+    {
+        options->sizes.assign(1, 256);
+        options->png = true;
+        options->writeOutput = true;
+        options->threadCount = static_cast<int>(std::thread::hardware_concurrency());
+
+        for (int i = 1; i < argc; i++)
+        {
+            const std::string arg = argv[i];
+            const bool hasValue = i + 1 < argc;
+
+            if (arg == "-s" && hasValue)
+            {
+                if (!ParseSizes(argv[++i], &options->sizes))
+                {
+                    fprintf(stderr, "Invalid sizes: %s\n", argv[i]);
+                    return false;
+                }
+            }
+            else if (arg == "-f" && hasValue)
+            {
+                const std::string format = argv[++i];
+
+                if (format != "png" && format != "raw")
+                {
+                    fprintf(stderr, "Unknown format: %s\n", format.c_str());
+                    return false;
+                }
+
+                options->png = format == "png";
+            }
+            else if (arg == "-o" && hasValue)
+            {
+                options->outputDirectory = argv[++i];
+            }
+            else if (arg == "-j" && hasValue)
+            {
+                options->threadCount = atoi(argv[++i]);
+            }
+            else if (arg == "-c" && hasValue)
+            {
+                options->diskCachePath = argv[++i];
+            }
+            else if (arg == "-n")
+            {
+                options->writeOutput = false;
+            }
+            else if (arg.size() > 1 && arg[0] == '-')
+            {
+                fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+                return false;
+            }
+            else
+            {
+                inputs->push_back(arg);
+            }
+        }
+
+        if (options->threadCount < 1)
+        {
+            options->threadCount = 1;
+        }
+
+        return !inputs->empty();
+    }
+
+    void PrintReport(const BatchTotals& totals, size_t fileCount, double seconds, int threadCount)
+    {
+        const unsigned long long failures = totals.failureCount;
+        const double megabytes = totals.inputBytes / 1e6;
+
+        printf("%zu files (%llu failed, %llu from the disk cache), %llu thumbnails, %.1f MB in %.3f s on %d threads\n",
+            fileCount, failures, static_cast<unsigned long long>(totals.cachedFileCount), static_cast<unsigned long long>(totals.thumbnailCount),
+            megabytes, seconds, threadCount);
+        printf("%.1f files/s, %.1f MB/s\n", seconds > 0 ? fileCount / seconds : 0.0, seconds > 0 ? megabytes / seconds : 0.0);
+
+        // The stage times are added up over all of the threads.
+        unsigned long long allStages = 0;
+
+        for (int i = 0; i < StageCount; i++)
+        {
+            allStages += totals.stageNanoseconds[i];
+        }
+
+        printf("Stage totals:\n");
+
+        for (int i = 0; i < StageCount; i++)
+        {
+            const unsigned long long nanoseconds = totals.stageNanoseconds[i];
+
+            printf("  %-10s %10.3f s %6.1f%%\n", StageNames[i], nanoseconds / 1e9, allStages > 0 ? 100.0 * nanoseconds / allStages : 0.0);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    std::vector<std::string> inputs;
+
+    if (!ParseOptions(argc, argv, &options, &inputs))
+    {
+        PrintUsage();
+        return 2;
+    }
+
+    std::vector<InputFile> files;
+
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (inputs[i][0] == '@')
+        {
+            AddListFile(inputs[i].substr(1), files);
+        }
+        else
+        {
+            AddPath(inputs[i], files);
+        }
+    }
+
+    if (files.empty())
+    {
+        fprintf(stderr, "No FSH files were found.\n");
+        return 1;
+    }
+
+    // The pool starts the tasks in this order, largest first.
+    std::stable_sort(files.begin(), files.end(), [](const InputFile& a, const InputFile& b) { return a.size > b.size; });
+
+    ThumbnailDiskCache diskCache;
+    ThumbnailDiskCache* usedDiskCache = nullptr;
+
+    if (!options.diskCachePath.empty())
+    {
+        if (diskCache.Open(options.diskCachePath.c_str(), DiskCacheMaxBytes))
+        {
+            usedDiskCache = &diskCache;
+        }
+        else
+        {
+            fprintf(stderr, "%s: the disk cache could not be opened, it is not used.\n", options.diskCachePath.c_str());
+        }
+    }
+
+    const int threadCount = static_cast<int>(std::min<size_t>(static_cast<size_t>(options.threadCount), files.size()));
+
+    std::vector<std::unique_ptr<ArenaBlockCache>> blockCaches;
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        blockCaches.emplace_back(new ArenaBlockCache(BlockCacheBytes));
+    }
+
+    BatchTotals totals;
+
+    for (int i = 0; i < StageCount; i++)
+    {
+        totals.stageNanoseconds[i] = 0;
+    }
+
+    totals.inputBytes = 0;
+    totals.thumbnailCount = 0;
+    totals.cachedFileCount = 0;
+    totals.failureCount = 0;
+
+    std::mutex errorMutex;
+
+    const Clock::time_point start = Clock::now();
+
+    RunWorkStealingPool(files.size(), threadCount, [&](size_t task, int thread)
+    {
+        std::string error;
+
+        if (!ProcessFile(files[task], options, *blockCaches[thread], usedDiskCache, totals, &error))
+        {
+            totals.failureCount++;
+
+            std::lock_guard<std::mutex> lock(errorMutex);
+            fprintf(stderr, "%s: %s\n", files[task].path.c_str(), error.c_str());
+        }
+    });
+
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    PrintReport(totals, files.size(), seconds, threadCount);
+
+    return totals.failureCount != 0 ? 1 : 0;
+}
@@ -0,0 +1,184 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "PngWriter.h"
+#include <string.h>
+#include <vector>
+
+namespace
+{
+    // The largest data length of a stored deflate block.
+    const size_t MaxStoredBlock = 65535;
+
+    class Crc32
+    {
+    public:
+        Crc32()
+        {
+            for (unsigned int i = 0; i < 256; i++)
+            {
+                unsigned int c = i;
+
+                for (int k = 0; k < 8; k++)
+                {
+                    c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+                }
+
+                table[i] = c;
+            }
+        }
+
+        unsigned int Update(unsigned int crc, const unsigned char* data, size_t size) const
+        {
+            crc = ~crc;
+
+            for (size_t i = 0; i < size; i++)
+            {
+                crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+            }
+
+            return ~crc;
+        }
+
+    private:
+        unsigned int table[256];
+    };
+
+    const Crc32 crc32;
+
+    void PutBigEndian(std::vector<unsigned char>& out, unsigned int value)
+    {
+        out.push_back(static_cast<unsigned char>(value >> 24));
+        out.push_back(static_cast<unsigned char>(value >> 16));
+        out.push_back(static_cast<unsigned char>(value >> 8));
+        out.push_back(static_cast<unsigned char>(value));
+    }
+
+    bool WriteChunk(FILE* file, const char* type, const std::vector<unsigned char>& data)
+    {
+        std::vector<unsigned char> header;
+        PutBigEndian(header, static_cast<unsigned int>(data.size()));
+        header.insert(header.end(), type, type + 4);
+
+        unsigned int crc = crc32.Update(0, reinterpret_cast<const unsigned char*>(type), 4);
+        crc = crc32.Update(crc, data.data(), data.size());
+
+        std::vector<unsigned char> trailer;
+        PutBigEndian(trailer, crc);
+
+        return fwrite(header.data(), 1, header.size(), file) == header.size() &&
+            (data.empty() || fwrite(data.data(), 1, data.size(), file) == data.size()) &&
+            fwrite(trailer.data(), 1, trailer.size(), file) == trailer.size();
+    }
+}
+
+bool WritePngFile(FILE* file, const unsigned char* pixels, size_t stride, int width, int height)
+{
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+    if (width <= 0 || height <= 0 || fwrite(signature, 1, sizeof(signature), file) != sizeof(signature))
+    {
+        return false;
+    }
+
+    std::vector<unsigned char> header;
+    PutBigEndian(header, static_cast<unsigned int>(width));
+    PutBigEndian(header, static_cast<unsigned int>(height));
+    header.push_back(8); // bit depth
+    header.push_back(6); // RGBA
+    header.push_back(0); // deflate
+    header.push_back(0); // adaptive filtering
+    header.push_back(0); // no interlace
+
+    if (!WriteChunk(file, "IHDR", header))
+    {
+        return false;
+    }
+
+    // Each row is a filter type byte of 0 followed by the RGBA pixels.
+    const size_t rowSize = static_cast<size_t>(width) * 4 + 1;
+    std::vector<unsigned char> raw(rowSize * height);
+
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char* src = pixels + y * stride;
+        unsigned char* dst = &raw[y * rowSize];
+
+        dst[0] = 0;
+        dst++;
+
+        for (int x = 0; x < width; x++)
+        {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+            dst[3] = src[3];
+            src += 4;
+            dst += 4;
+        }
+    }
+
+    std::vector<unsigned char> data;
+    data.reserve(raw.size() + (raw.size() / MaxStoredBlock + 1) * 5 + 6);
+
+    data.push_back(0x78); // zlib header, 32 KB window
+    data.push_back(0x01);
+
+    size_t offset = 0;
+
+    do
+    {
+        const size_t count = raw.size() - offset < MaxStoredBlock ? raw.size() - offset : MaxStoredBlock;
+        const bool last = offset + count == raw.size();
+
+        data.push_back(last ? 1 : 0);
+        data.push_back(static_cast<unsigned char>(count));
+        data.push_back(static_cast<unsigned char>(count >> 8));
+        data.push_back(static_cast<unsigned char>(~count));
+        data.push_back(static_cast<unsigned char>(~count >> 8));
+        data.insert(data.end(), raw.begin() + offset, raw.begin() + offset + count);
+
+        offset += count;
+    } while (offset < raw.size());
+
+    // Adler-32 of the uncompressed data, the sums cannot overflow in 5552 bytes so the
+    // modulo is only taken once per run.
+    unsigned int a = 1;
+    unsigned int b = 0;
+    size_t i = 0;
+
+    while (i < raw.size())
+    {
+        const size_t end = raw.size() - i < 5552 ? raw.size() : i + 5552;
+
+        for (; i < end; i++)
+        {
+            a += raw[i];
+            b += a;
+        }
+
+        a %= 65521;
+        b %= 65521;
+    }
+
+    PutBigEndian(data, (b << 16) | a);
+
+    return WriteChunk(file, "IDAT", data) && WriteChunk(file, "IEND", std::vector<unsigned char>());
+}
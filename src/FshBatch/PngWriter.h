@@ -17,7 +17,12 @@
 * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *
 */
-
 #pragma once
 
-void DecompressImage(unsigned char* rgba, int width, int height, const unsigned char* blocks, bool dxt1);
+#include <stddef.h>
+#include <stdio.h>
+
+// Writes a 32-bit BGRA image as an 8-bit RGBA PNG. The image data is stored in uncompressed
+// deflate blocks so no compression library is needed, the files are about the size of the
+// raw pixels. Returns false if the file could not be written.
+bool WritePngFile(FILE* file, const unsigned char* pixels, size_t stride, int width, int height);
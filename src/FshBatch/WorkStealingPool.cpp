@@ -0,0 +1,122 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "WorkStealingPool.h"
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct TaskQueue
+    {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    // The owner takes the most expensive task from the front of its own queue.
+    bool TakeOwnTask(TaskQueue& queue, size_t* task)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (queue.tasks.empty())
+        {
+            return false;
+        }
+
+        *task = queue.tasks.front();
+        queue.tasks.pop_front();
+        return true;
+    }
+
+    bool StealTask(TaskQueue& queue, size_t* task)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (queue.tasks.empty())
+        {
+            return false;
+        }
+
+        *task = queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    void RunWorker(std::vector<TaskQueue>& queues, int thread, const PoolTaskProc& run)
+    {
+        const int threadCount = static_cast<int>(queues.size());
+        size_t task;
+
+        for (;;)
+        {
+            bool found = TakeOwnTask(queues[thread], &task);
+
+            // No tasks are added after the start, so the work is done when every queue is empty.
+            for (int i = 1; !found && i < threadCount; i++)
+            {
+                found = StealTask(queues[(thread + i) % threadCount], &task);
+            }
+
+            if (!found)
+            {
+                break;
+            }
+
+            run(task, thread);
+        }
+    }
+}
+
+void RunWorkStealingPool(size_t taskCount, int threadCount, const PoolTaskProc& run)
+{
+    if (threadCount < 1)
+    {
+        threadCount = 1;
+    }
+
+    if (static_cast<size_t>(threadCount) > taskCount)
+    {
+        threadCount = taskCount > 0 ? static_cast<int>(taskCount) : 1;
+    }
+
+    std::vector<TaskQueue> queues(threadCount);
+
+    for (size_t i = 0; i < taskCount; i++)
+    {
+        queues[i % threadCount].tasks.push_back(i);
+    }
+
+    std::vector<std::thread> threads;
+
+    for (int i = 1; i < threadCount; i++)
+    {
+        threads.emplace_back(RunWorker, std::ref(queues), i, std::cref(run));
+    }
+
+    // The calling thread is the first worker.
+    RunWorker(queues, 0, run);
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+}
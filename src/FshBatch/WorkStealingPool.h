@@ -0,0 +1,33 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+#pragma once
+
+#include <stddef.h>
+#include <functional>
+
+typedef std::function<void(size_t task, int thread)> PoolTaskProc;
+
+// Runs taskCount tasks on threadCount threads, the caller numbers the tasks from the most to
+// the least expensive. The tasks are dealt out to a queue for each thread so every thread
+// starts with one of the largest, and a thread whose queue is empty steals the cheapest task
+// from the end of another queue. The large tasks are started first and the small ones fill
+// the gaps at the end, which keeps one slow file from running alone after the rest are done.
+// Returns when all of the tasks have finished.
+void RunWorkStealingPool(size_t taskCount, int threadCount, const PoolTaskProc& run);
@@ -0,0 +1,1095 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// fshbench measures each stage of the decode pipeline on synthetic images of every FSH code
+// and size, and writes the results as text and optionally as JSON to track them across
+// versions. There is no project file for it, it is built with e.g.
+//     g++ -std=c++14 -O2 -pthread -I../Common *.cpp ../Common/*.cpp -o fshbench
+//
+// The stages are:
+//   qfs        QfsDecompressor on the QFS compressed image data
+//   dxt        the DXT1 and DXT3 block decoders on one thread
+//   convert    the conversions of the uncompressed formats to BGRA
+//   decode     DecodeFshImage at the size of the image
+//   thumbnail  DecodeFshImage to a 256 pixel thumbnail, the decode and scale pass of the handlers
+//   threads    DecodeFshImage of the DXT images from 1024 pixels up with 1, 2, 4 and 8 threads
+//   ladder     a QFS compressed FSH file to the 1024, 256, 96 and 32 pixel thumbnails with one
+//              decode and FshThumbnailLadder, and with the single size path of the handlers once
+//              per size (decompress, open and decode)
+//   pipeline   a QFS compressed 32-bit image from 1024 to 4096 pixels read from a temporary file
+//              at --read-rate, decompressed after the whole file is read and with
+//              RunChunkPipeline while the file is read
+//   scale      ScaleImageBGRA from the image size to a 256 pixel and a 96 pixel thumbnail
+//   palette    ReadFshPalette for every palette code
+//   streams    QfsDecompressor and the byte at a time reference decoder on the QFS streams of
+//              every QfsStreamKind at the size of a 32-bit image, and on the files given with
+//              --qfs-file, the output of both must match
+// --cpu limits the kernels to an instruction set, e.g. --cpu scalar measures the scalar code
+// that the SIMD kernels are compared with.
+// ns/pixel is per source pixel. bytes/s counts the uncompressed FSH image data, the BGRA
+// source pixels for scale and the palette entry for palette. The files of the streams stage
+// are measured per decompressed byte.
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ChunkPipeline.h"
+#include "CpuFeatures.h"
+#include "DXT.h"
+#include "FshHeaders.h"
+#include "FshImageDecoder.h"
+#include "FshMipmaps.h"
+#include "FshThumbnailLadder.h"
+#include "FshThumbnailLoader.h"
+#include "ImageScaler.h"
+#include "PixelConversion.h"
+#include "QfsCompressor.h"
+#include "QfsDecompressor.h"
+#include "QfsStreams.h"
+#include "ThumbnailArena.h"
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const int ThumbnailSize = 256;
+    const int ImageCodes[] = { 0x60, 0x61, 0x6d, 0x78, 0x7b, 0x7d, 0x7e, 0x7f };
+    const int PaletteCodes[] = { 0x22, 0x24, 0x29, 0x2a, 0x2d };
+    const int ThreadCounts[] = { 1, 2, 4, 8 };
+    // The names of the CpuFeatureLevel values for --cpu.
+    const char* const CpuLevelNames[] = { "scalar", "sse2", "ssse3", "avx2" };
+    // The DXT decoder only splits images of at least this size between threads.
+    const int MinThreadedSize = 1024;
+    // The sizes that the Windows thumbnail cache asks for, the ladder is measured on the images
+    // that are at least as large as the largest one.
+    const int LadderSizes[] = { 1024, 256, 96, 32 };
+    const int LadderSizeCount = sizeof(LadderSizes) / sizeof(LadderSizes[0]);
+    // The slow reads of the larger files take seconds per run.
+    const int MinPipelineSize = 1024;
+    const int MaxPipelineSize = 4096;
+
+    struct Options
+    {
+        int minSize;
+        int maxSize;
+        double minTime;
+        double readRate; // the bytes per second of the throttled reader of the pipeline stage
+        CpuFeatureLevel cpuLevel;
+        std::string jsonPath;
+        std::vector<std::string> stages; // empty runs all of the stages
+        std::vector<std::string> qfsFiles;
+    };
+
+    struct Result
+    {
+        std::string stage;
+        int code; // 0 for the stages that do not depend on the format
+        int width;
+        int height;
+        long long iterations;
+        double seconds; // the time of one iteration
+        unsigned long long pixels;
+        unsigned long long bytes;
+        int threads; // the thread limit of the threads stage, 1 for the other stages
+    };
+
+    bool IsStageEnabled(const Options& options, const char* stage)
+    {
+        return options.stages.empty() || std::find(options.stages.begin(), options.stages.end(), stage) != options.stages.end();
+    }
+
+    // Runs the body until it has taken at least minTime and returns the time of one run.
+    // The first run is not measured, it faults in the pages of the output buffers.
+    double Measure(const std::function<void()>& body, double minTime, long long* iterations)
+    {
+        body();
+
+        long long count = 1;
+
+        for (;;)
+        {
+            const Clock::time_point start = Clock::now();
+
+            for (long long i = 0; i < count; i++)
+            {
+                body();
+            }
+
+            const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+            if (elapsed >= minTime || count >= (1LL << 40))
+            {
+                *iterations = count;
+                return elapsed / count;
+            }
+
+            // Aim a little past the minimum time so one more pass is usually enough.
+            long long next = elapsed > 0 ? static_cast<long long>(count * minTime * 1.2 / elapsed) : count * 100;
+            next = std::max(next, count + 1);
+            count = std::min(next, count * 100);
+        }
+    }
+
+    class Noise
+    {
+    public:
+        explicit Noise(unsigned int seed) : state(seed)
+        {
+        }
+
+        unsigned int Next()
+        {
+            state = state * 1664525U + 1013904223U;
+            return state >> 16;
+        }
+
+    private:
+        unsigned int state;
+    };
+
+    unsigned short Pack565(unsigned int r, unsigned int g, unsigned int b)
+    {
+        return static_cast<unsigned short>(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+    }
+
+    // Fills the image data with smooth gradients and a little noise, which compresses and
+    // decodes more like a real texture than random data does.
+    void CreateImageData(int code, int width, int height, std::vector<unsigned char>& data)
+    {
+        data.assign(static_cast<size_t>(GetFshImageDataSize(code, width, height)), 0);
+
+        Noise noise(static_cast<unsigned int>(code * 7919 + width));
+        unsigned char* p = data.data();
+
+        if (code == 0x60 || code == 0x61)
+        {
+            const int blocksWide = (width + 3) / 4;
+            const int blocksHigh = (height + 3) / 4;
+
+            for (int by = 0; by < blocksHigh; by++)
+            {
+                for (int bx = 0; bx < blocksWide; bx++)
+                {
+                    if (code == 0x61)
+                    {
+                        for (int i = 0; i < 8; i++)
+                        {
+                            *p++ = static_cast<unsigned char>(0xff - (noise.Next() & 0x11));
+                        }
+                    }
+
+                    const unsigned int r = bx * 255 / blocksWide;
+                    const unsigned int g = by * 255 / blocksHigh;
+                    const unsigned int b = (bx ^ by) & 0xff;
+                    unsigned short color0 = Pack565(r, g, b);
+                    unsigned short color1 = Pack565(r / 2, g / 2, 255 - b);
+
+                    // Most DXT1 blocks use the four color mode.
+                    if ((color0 < color1) == ((noise.Next() & 15) != 0))
+                    {
+                        std::swap(color0, color1);
+                    }
+
+                    const unsigned int indexes = noise.Next() | (noise.Next() << 16);
+
+                    p[0] = static_cast<unsigned char>(color0);
+                    p[1] = static_cast<unsigned char>(color0 >> 8);
+                    p[2] = static_cast<unsigned char>(color1);
+                    p[3] = static_cast<unsigned char>(color1 >> 8);
+                    memcpy(p + 4, &indexes, 4);
+                    p += 8;
+                }
+            }
+
+            return;
+        }
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                const unsigned int r = x * 255 / width;
+                const unsigned int g = y * 255 / height;
+                const unsigned int b = ((x ^ y) + (noise.Next() & 7)) & 0xff;
+                const unsigned int a = (x + y) & 0xff;
+
+                switch (code)
+                {
+                case 0x7b:
+                    *p++ = static_cast<unsigned char>((x + y + (noise.Next() & 7)) & 0xff);
+                    break;
+                case 0x7d:
+                    p[0] = static_cast<unsigned char>(b);
+                    p[1] = static_cast<unsigned char>(g);
+                    p[2] = static_cast<unsigned char>(r);
+                    p[3] = static_cast<unsigned char>(a);
+                    p += 4;
+                    break;
+                case 0x7f:
+                    p[0] = static_cast<unsigned char>(b);
+                    p[1] = static_cast<unsigned char>(g);
+                    p[2] = static_cast<unsigned char>(r);
+                    p += 3;
+                    break;
+                default:
+                {
+                    unsigned int value;
+
+                    if (code == 0x78)
+                    {
+                        value = Pack565(r, g, b);
+                    }
+                    else if (code == 0x7e)
+                    {
+                        value = ((a >> 7) << 15) | ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+                    }
+                    else
+                    {
+                        value = ((a >> 4) << 12) | ((r >> 4) << 8) | ((g >> 4) << 4) | (b >> 4);
+                    }
+
+                    p[0] = static_cast<unsigned char>(value);
+                    p[1] = static_cast<unsigned char>(value >> 8);
+                    p += 2;
+                    break;
+                }
+                }
+            }
+        }
+    }
+
+    void CreatePalette(unsigned int* palette)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            palette[i] = 0xff000000U | (i << 16) | ((255 - i) << 8) | ((i * 7) & 0xff);
+        }
+    }
+
+    void PrintResult(FILE* file, const Result& result)
+    {
+        char code[8] = "-";
+
+        if (result.code != 0)
+        {
+            snprintf(code, sizeof(code), "0x%02x", result.code);
+        }
+
+        char stage[32];
+        snprintf(stage, sizeof(stage), result.threads > 1 ? "%s/%d" : "%s", result.stage.c_str(), result.threads);
+
+        fprintf(file, "%-10s %-5s %5dx%-5d %10.3f ns/px %10.1f MB/s %12lld iterations\n", stage, code, result.width, result.height,
+            result.seconds * 1e9 / result.pixels, result.bytes / result.seconds / 1e6, result.iterations);
+        fflush(file);
+    }
+
+    class Runner
+    {
+    public:
+        // The results are printed to textOutput as they finish.
+        Runner(const Options& options, FILE* textOutput) : options(options), textOutput(textOutput)
+        {
+        }
+
+        void Run(const char* stage, int code, int width, int height, unsigned long long bytes, const std::function<void()>& body, int threads = 1)
+        {
+            Result result;
+            result.stage = stage;
+            result.threads = threads;
+            result.code = code;
+            result.width = width;
+            result.height = height;
+            result.pixels = static_cast<unsigned long long>(width) * height;
+            result.bytes = bytes;
+            result.seconds = Measure(body, options.minTime, &result.iterations);
+
+            PrintResult(textOutput, result);
+            results.push_back(result);
+        }
+
+        const std::vector<Result>& GetResults() const
+        {
+            return results;
+        }
+
+    private:
+        const Options& options;
+        FILE* textOutput;
+        std::vector<Result> results;
+    };
+
+    void AppendBytes(std::vector<unsigned char>& file, const void* data, size_t size)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        file.insert(file.end(), bytes, bytes + size);
+    }
+
+    // Creates an FSH file with the image entry and, for the 8-bit indexed code, a palette entry.
+    void CreateFshFile(int code, int width, int height, const std::vector<unsigned char>& data, std::vector<unsigned char>& file)
+    {
+        const int entryCount = code == 0x7b ? 2 : 1;
+        const size_t directoryEnd = sizeof(FshHeader) + (entryCount * sizeof(FshDirEntry));
+
+        file.assign(directoryEnd, 0);
+
+        for (int i = 0; i < entryCount; i++)
+        {
+            FshDirEntry dir;
+            memcpy(dir.name, i == 0 ? "0000" : "!pal", 4);
+            dir.offset = static_cast<int>(file.size());
+            memcpy(&file[sizeof(FshHeader) + (i * sizeof(FshDirEntry))], &dir, sizeof(dir));
+
+            FshEntryHeader entry = {};
+
+            if (i == 0)
+            {
+                entry.code = code;
+                entry.width = static_cast<unsigned short>(width);
+                entry.height = static_cast<unsigned short>(height);
+                AppendBytes(file, &entry, sizeof(entry));
+                AppendBytes(file, data.data(), data.size());
+            }
+            else
+            {
+                unsigned int palette[256];
+                CreatePalette(palette);
+
+                entry.code = 0x2a;
+                entry.width = 256;
+                entry.height = 1;
+                AppendBytes(file, &entry, sizeof(entry));
+                AppendBytes(file, palette, sizeof(palette));
+            }
+        }
+
+        FshHeader header;
+        memcpy(header.SHPI, "SHPI", 4);
+        header.size = static_cast<int>(file.size());
+        header.numBmps = entryCount;
+        memcpy(header.dirID, "G264", 4);
+        memcpy(&file[0], &header, sizeof(header));
+    }
+
+    bool RunLadderStage(const Options& options, Runner& runner, int code, const std::vector<unsigned char>& data, int size)
+    {
+        if (!IsStageEnabled(options, "ladder") || size < LadderSizes[0])
+        {
+            return true;
+        }
+
+        std::vector<unsigned char> file;
+        CreateFshFile(code, size, size, data, file);
+
+        std::vector<unsigned char> compressed;
+        QfsCompress(file.data(), file.size(), compressed);
+
+        std::vector<unsigned char> decompressed(file.size());
+        bool succeeded = true;
+
+        auto decompress = [&]()
+        {
+            QfsDecompressor decompressor(true);
+            size_t inputUsed;
+            size_t outputWritten;
+
+            succeeded &= decompressor.Decompress(compressed.data(), compressed.size(), &inputUsed, decompressed.data(), decompressed.size(), &outputWritten) == QfsStatusDone;
+        };
+
+        runner.Run("ladder", code, size, size, data.size(), [&]()
+        {
+            decompress();
+
+            ThumbnailArena arena;
+            FshThumbnailLoader loader(&arena);
+            FshThumbnailLadder ladder;
+
+            const bool opened = loader.Open(decompressed.data(), decompressed.size(), LadderSizes[0]) == FshLoadOk;
+            succeeded &= opened && ladder.Create(loader.GetImageSource(), LadderSizes, LadderSizeCount);
+        });
+
+        // The handlers read, decompress and decode the file again for each size.
+        runner.Run("single", code, size, size, data.size(), [&]()
+        {
+            for (int maxEdgeLength : LadderSizes)
+            {
+                decompress();
+
+                ThumbnailArena arena;
+                FshThumbnailLoader loader(&arena);
+                PixelBuffer pixels;
+
+                const bool opened = loader.Open(decompressed.data(), decompressed.size(), maxEdgeLength) == FshLoadOk;
+                succeeded &= opened && loader.Decode(&pixels) == FshLoadOk;
+            }
+        });
+
+        if (!succeeded || decompressed != file)
+        {
+            fprintf(stderr, "The ladder of code 0x%02x at %d pixels could not be created.\n", code, size);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool RunImageStages(const Options& options, Runner& runner, int code, int size)
+    {
+        const int width = size;
+        const int height = size;
+
+        std::vector<unsigned char> data;
+        CreateImageData(code, width, height, data);
+
+        unsigned int palette[256];
+        CreatePalette(palette);
+
+        const unsigned long long bytes = data.size();
+        const size_t stride = static_cast<size_t>(width) * 4;
+        std::vector<unsigned char> pixels(stride * height);
+
+        if (IsStageEnabled(options, "qfs"))
+        {
+            std::vector<unsigned char> compressed;
+            QfsCompress(data.data(), data.size(), compressed);
+
+            std::vector<unsigned char> output(data.size());
+            QfsStatus status = QfsStatusInvalidData;
+
+            auto body = [&]()
+            {
+                QfsDecompressor decompressor(true);
+                size_t inputUsed;
+                size_t outputWritten;
+
+                status = decompressor.Decompress(compressed.data(), compressed.size(), &inputUsed, output.data(), output.size(), &outputWritten);
+            };
+
+            runner.Run("qfs", code, width, height, bytes, body);
+
+            if (status != QfsStatusDone || output != data)
+            {
+                fprintf(stderr, "The QFS data of code 0x%02x at %d pixels did not decompress correctly.\n", code, size);
+                return false;
+            }
+        }
+
+        if (IsStageEnabled(options, "dxt") && (code == 0x60 || code == 0x61))
+        {
+            runner.Run("dxt", code, width, height, bytes, [&]()
+            {
+                DecompressImage(pixels.data(), stride, width, height, data.data(), code == 0x60, ChannelOrderBGRA, 1);
+            });
+        }
+
+        if (IsStageEnabled(options, "convert") && code != 0x60 && code != 0x61 && code != 0x7d)
+        {
+            runner.Run("convert", code, width, height, bytes, [&]()
+            {
+                switch (code)
+                {
+                case 0x7b:
+                    ConvertIndexed8ToBGRA(data.data(), width, pixels.data(), stride, width, height, palette);
+                    break;
+                case 0x7e:
+                    ConvertA1R5G5B5ToBGRA(data.data(), width * 2, pixels.data(), stride, width, height);
+                    break;
+                case 0x78:
+                    ConvertR5G6B5ToBGRA(data.data(), width * 2, pixels.data(), stride, width, height);
+                    break;
+                case 0x6d:
+                    ConvertA4R4G4B4ToBGRA(data.data(), width * 2, pixels.data(), stride, width, height);
+                    break;
+                case 0x7f:
+                    ConvertR8G8B8ToBGRA(data.data(), width * 3, pixels.data(), stride, width, height);
+                    break;
+                }
+            });
+        }
+
+        FshImageSource source;
+        source.code = code;
+        source.width = width;
+        source.height = height;
+        source.data = data.data();
+        source.palette = code == 0x7b ? palette : nullptr;
+
+        if (IsStageEnabled(options, "decode"))
+        {
+            bool decoded = false;
+
+            runner.Run("decode", code, width, height, bytes, [&]()
+            {
+                decoded = DecodeFshImage(source, pixels.data(), stride, width, height);
+            });
+
+            if (!decoded)
+            {
+                fprintf(stderr, "Code 0x%02x at %d pixels could not be decoded.\n", code, size);
+                return false;
+            }
+        }
+
+        if (IsStageEnabled(options, "thumbnail"))
+        {
+            int thumbWidth;
+            int thumbHeight;
+            GetFshThumbnailSize(width, height, ThumbnailSize, &thumbWidth, &thumbHeight);
+
+            runner.Run("thumbnail", code, width, height, bytes, [&]()
+            {
+                DecodeFshImage(source, pixels.data(), static_cast<size_t>(thumbWidth) * 4, thumbWidth, thumbHeight);
+            });
+        }
+
+        if (IsStageEnabled(options, "threads") && (code == 0x60 || code == 0x61) && size >= MinThreadedSize)
+        {
+            // The hardware thread count also limits the decoder, the JSON context records it.
+            for (int threads : ThreadCounts)
+            {
+                runner.Run("threads", code, width, height, bytes, [&]()
+                {
+                    DecodeFshImage(source, pixels.data(), stride, width, height, threads);
+                }, threads);
+            }
+        }
+
+        if (!RunLadderStage(options, runner, code, data, size))
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    // Stands in for slow storage, the reads return no faster than bytesPerSecond since the
+    // first read.
+    ChunkReadProc CreateThrottledReadProc(const ChunkReadProc& read, double bytesPerSecond)
+    {
+        Clock::time_point start;
+        unsigned long long total = 0;
+
+        return [=](unsigned char* buffer, size_t size, size_t* bytesRead) mutable -> bool
+        {
+            if (total == 0)
+            {
+                start = Clock::now();
+            }
+
+            if (!read(buffer, size, bytesRead))
+            {
+                return false;
+            }
+
+            total += *bytesRead;
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(total / bytesPerSecond)));
+
+            return true;
+        };
+    }
+
+    bool RunPipelineStage(const Options& options, Runner& runner, int size)
+    {
+        if (!IsStageEnabled(options, "pipeline") || size < MinPipelineSize || size > MaxPipelineSize)
+        {
+            return true;
+        }
+
+        std::vector<unsigned char> data;
+        CreateImageData(0x7d, size, size, data);
+
+        std::vector<unsigned char> compressed;
+        QfsCompress(data.data(), data.size(), compressed);
+
+        char path[] = "/tmp/fshbenchXXXXXX";
+        const int fd = mkstemp(path);
+
+        if (fd < 0)
+        {
+            fprintf(stderr, "The temporary file of the pipeline stage could not be created.\n");
+            return false;
+        }
+
+        unlink(path);
+
+        if (write(fd, compressed.data(), compressed.size()) != static_cast<ssize_t>(compressed.size()))
+        {
+            fprintf(stderr, "The temporary file of the pipeline stage could not be written.\n");
+            close(fd);
+            return false;
+        }
+
+        std::vector<unsigned char> fileData(compressed.size());
+        std::vector<unsigned char> output(data.size());
+        bool succeeded = true;
+
+        // The whole file is read before it is decompressed.
+        runner.Run("readall", 0x7d, size, size, data.size(), [&]()
+        {
+            const ChunkReadProc read = CreateThrottledReadProc(CreateFileDescriptorReadProc(fd), options.readRate);
+            size_t offset = 0;
+            size_t bytesRead = 1;
+
+            succeeded &= lseek(fd, 0, SEEK_SET) == 0;
+
+            while (succeeded && bytesRead > 0)
+            {
+                succeeded &= read(fileData.data() + offset, std::min<size_t>(64 * 1024, fileData.size() - offset), &bytesRead);
+                offset += bytesRead;
+            }
+
+            QfsDecompressor decompressor(true);
+            size_t inputUsed;
+            size_t outputWritten;
+
+            succeeded &= decompressor.Decompress(fileData.data(), offset, &inputUsed, output.data(), output.size(), &outputWritten) == QfsStatusDone;
+        });
+
+        // The chunks are decompressed on the pipeline's worker thread while the next ones are read.
+        runner.Run("pipeline", 0x7d, size, size, data.size(), [&]()
+        {
+            QfsDecompressor decompressor(true);
+            QfsStatus status = QfsStatusNeedInput;
+
+            auto consume = [&](const unsigned char* chunk, size_t chunkSize) -> bool
+            {
+                size_t inputUsed = 0;
+                size_t outputWritten = 0;
+                const size_t total = static_cast<size_t>(decompressor.GetTotalOutput());
+
+                status = decompressor.Decompress(chunk, chunkSize, &inputUsed, output.data() + total, output.size() - total, &outputWritten);
+
+                return status == QfsStatusNeedInput;
+            };
+
+            succeeded &= lseek(fd, 0, SEEK_SET) == 0;
+            succeeded &= RunChunkPipeline(CreateThrottledReadProc(CreateFileDescriptorReadProc(fd), options.readRate), consume);
+            succeeded &= status == QfsStatusDone;
+        });
+
+        close(fd);
+
+        if (!succeeded || output != data)
+        {
+            fprintf(stderr, "The pipeline stage at %d pixels did not decompress correctly.\n", size);
+            return false;
+        }
+
+        return true;
+    }
+
+    void RunScaleStage(const Options& options, Runner& runner, int size)
+    {
+        if (!IsStageEnabled(options, "scale"))
+        {
+            return;
+        }
+
+        // The source is the decoded 32-bit image, which has an alpha channel to weight.
+        std::vector<unsigned char> data;
+        CreateImageData(0x7d, size, size, data);
+
+        // A 256 pixel thumbnail of a power of two texture is mostly box filtered, the 96 pixel
+        // Explorer icon size needs the weighted filter.
+        const struct
+        {
+            const char* stage;
+            int size;
+        } thumbnailSizes[] = { { "scale", ThumbnailSize }, { "scale96", 96 } };
+
+        for (const auto& thumbnailSize : thumbnailSizes)
+        {
+            int thumbWidth;
+            int thumbHeight;
+            GetFshThumbnailSize(size, size, thumbnailSize.size, &thumbWidth, &thumbHeight);
+
+            std::vector<unsigned char> thumbnail(static_cast<size_t>(thumbWidth) * thumbHeight * 4);
+
+            runner.Run(thumbnailSize.stage, 0, size, size, data.size(), [&]()
+            {
+                ScaleImageBGRA(data.data(), static_cast<size_t>(size) * 4, size, size, thumbnail.data(), static_cast<size_t>(thumbWidth) * 4, thumbWidth, thumbHeight);
+            });
+        }
+    }
+
+    void RunPaletteStage(const Options& options, Runner& runner)
+    {
+        if (!IsStageEnabled(options, "palette"))
+        {
+            return;
+        }
+
+        for (int code : PaletteCodes)
+        {
+            const size_t bytesPerColor = code == 0x2a ? 4 : (code == 0x22 || code == 0x24) ? 3 : 2;
+            std::vector<unsigned char> entry(sizeof(FshEntryHeader) + 256 * bytesPerColor);
+
+            FshEntryHeader header = {};
+            header.code = code;
+            header.width = 256;
+            header.height = 1;
+            memcpy(entry.data(), &header, sizeof(header));
+
+            Noise noise(static_cast<unsigned int>(code));
+            for (size_t i = sizeof(FshEntryHeader); i < entry.size(); i++)
+            {
+                entry[i] = static_cast<unsigned char>(noise.Next());
+            }
+
+            unsigned int colors[256];
+
+            runner.Run("palette", code, 256, 1, entry.size(), [&]()
+            {
+                ReadFshPalette(entry.data(), entry.size(), colors);
+            });
+        }
+    }
+
+    // Measures the decompressor and the reference decoder on one stream and checks that both
+    // produce the expected output, an empty expected vector only compares the two decoders.
+    bool RunStream(Runner& runner, const char* name, int width, int height, const std::vector<unsigned char>& compressed, const std::vector<unsigned char>& expected)
+    {
+        std::vector<unsigned char> reference;
+
+        if (!QfsDecompressReference(compressed.data(), compressed.size(), reference))
+        {
+            fprintf(stderr, "The %s stream is not valid QFS data.\n", name);
+            return false;
+        }
+
+        std::vector<unsigned char> output(reference.size());
+        QfsStatus status = QfsStatusInvalidData;
+
+        runner.Run(name, 0, width, height, reference.size(), [&]()
+        {
+            QfsDecompressor decompressor(true);
+            size_t inputUsed;
+            size_t outputWritten;
+
+            status = decompressor.Decompress(compressed.data(), compressed.size(), &inputUsed, output.data(), output.size(), &outputWritten);
+        });
+
+        const std::string referenceName = std::string(name) + "-ref";
+
+        runner.Run(referenceName.c_str(), 0, width, height, reference.size(), [&]()
+        {
+            QfsDecompressReference(compressed.data(), compressed.size(), reference);
+        });
+
+        if (status != QfsStatusDone || output != reference || (!expected.empty() && reference != expected))
+        {
+            fprintf(stderr, "The %s stream did not decompress to the same data as the reference decoder.\n", name);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool RunStreamStage(const Options& options, Runner& runner, int size)
+    {
+        if (!IsStageEnabled(options, "streams"))
+        {
+            return true;
+        }
+
+        for (int kind = 0; kind < QfsStreamKindCount; kind++)
+        {
+            std::vector<unsigned char> data;
+            CreateQfsStreamData(static_cast<QfsStreamKind>(kind), static_cast<size_t>(size) * size * 4, data);
+
+            std::vector<unsigned char> compressed;
+            QfsCompress(data.data(), data.size(), compressed);
+
+            if (!RunStream(runner, QfsStreamNames[kind], size, size, compressed, data))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // The files are measured once, they are not scaled with the image size.
+    bool RunFileStreams(const Options& options, Runner& runner)
+    {
+        if (!IsStageEnabled(options, "streams"))
+        {
+            return true;
+        }
+
+        for (const std::string& path : options.qfsFiles)
+        {
+            FILE* file = fopen(path.c_str(), "rb");
+            std::vector<unsigned char> compressed;
+
+            if (file != nullptr)
+            {
+                unsigned char buffer[65536];
+                size_t count;
+
+                while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+                {
+                    compressed.insert(compressed.end(), buffer, buffer + count);
+                }
+
+                fclose(file);
+            }
+
+            if (compressed.size() < 6 || !IsQfsCompressed(compressed.data()))
+            {
+                fprintf(stderr, "%s is not a QFS compressed file.\n", path.c_str());
+                return false;
+            }
+
+            std::vector<unsigned char> reference;
+            const int width = QfsDecompressReference(compressed.data(), compressed.size(), reference) ? static_cast<int>(reference.size()) : 0;
+
+            if (!RunStream(runner, "file", width, 1, compressed, std::vector<unsigned char>()))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void WriteJson(FILE* file, const Options& options, const std::vector<Result>& results)
+    {
+        char date[32];
+        const time_t now = time(nullptr);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+        fprintf(file, "{\n");
+        fprintf(file, "  \"context\": {\n");
+        fprintf(file, "    \"date\": \"%s\",\n", date);
+        fprintf(file, "    \"hardware_threads\": %u,\n", std::thread::hardware_concurrency());
+        fprintf(file, "    \"sse2\": %s,\n", CpuHasSSE2() ? "true" : "false");
+        fprintf(file, "    \"ssse3\": %s,\n", CpuHasSSSE3() ? "true" : "false");
+        fprintf(file, "    \"avx2\": %s,\n", CpuHasAVX2() ? "true" : "false");
+        fprintf(file, "    \"cpu_level\": \"%s\",\n", CpuLevelNames[options.cpuLevel]);
+        fprintf(file, "    \"read_rate\": %.0f,\n", options.readRate);
+        fprintf(file, "    \"min_time\": %g\n", options.minTime);
+        fprintf(file, "  },\n");
+        fprintf(file, "  \"benchmarks\": [\n");
+
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const Result& result = results[i];
+            char name[80];
+            char stage[32];
+            char code[8] = "null";
+
+            snprintf(stage, sizeof(stage), result.threads > 1 ? "%s/%d" : "%s", result.stage.c_str(), result.threads);
+
+            if (result.code != 0)
+            {
+                snprintf(name, sizeof(name), "%s/0x%02x/%dx%d", stage, result.code, result.width, result.height);
+                snprintf(code, sizeof(code), "\"0x%02x\"", result.code);
+            }
+            else
+            {
+                snprintf(name, sizeof(name), "%s/%dx%d", stage, result.width, result.height);
+            }
+
+            fprintf(file, "    {\"name\": \"%s\", \"stage\": \"%s\", \"code\": %s, \"width\": %d, \"height\": %d, "
+                "\"threads\": %d, \"iterations\": %lld, \"ns_per_iteration\": %.1f, \"ns_per_pixel\": %.4f, \"bytes_per_second\": %.0f}%s\n",
+                name, result.stage.c_str(), code, result.width, result.height,
+                result.threads, result.iterations, result.seconds * 1e9, result.seconds * 1e9 / result.pixels, result.bytes / result.seconds,
+                i + 1 < results.size() ? "," : "");
+        }
+
+        fprintf(file, "  ]\n");
+        fprintf(file, "}\n");
+    }
+
+    void PrintUsage()
+    {
+        fprintf(stderr,
+            "Usage: fshbench [options]\n"
+            "Measures the stages of the FSH decode pipeline on synthetic images.\n"
+            "\n"
+            "  --json <file>        also write the results as JSON, - writes them to stdout\n"
+            "  --stages <list>      the stages to run separated by commas (default: all)\n"
+            "                       qfs, dxt, convert, decode, thumbnail, threads, ladder, pipeline,\n"
+            "                       scale, palette, streams\n"
+            "  --min-size <pixels>  the smallest image size (default 64)\n"
+            "  --max-size <pixels>  the largest image size (default 8192)\n"
+            "  --min-time <seconds> the minimum time of each benchmark (default 0.1)\n"
+            "  --read-rate <MB/s>   the speed of the slow storage of the pipeline stage (default 100)\n"
+            "  --qfs-file <file>    a QFS compressed file for the streams stage, it may be repeated\n"
+            "  --cpu <level>        the largest instruction set that the kernels use, to compare them\n"
+            "                       with the scalar code: scalar, sse2, ssse3 or avx2 (default avx2)\n");
+    }
+
+    bool ParseOptions(int argc, char** argv, Options* options)
+    {
+        options->minSize = 64;
+        options->maxSize = 8192;
+        options->minTime = 0.1;
+        options->readRate = 100e6;
+        options->cpuLevel = CpuFeatureLevelAVX2;
+
+        for (int i = 1; i < argc; i++)
+        {
+            const std::string arg = argv[i];
+
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+
+            const char* value = argv[++i];
+
+            if (arg == "--json")
+            {
+                options->jsonPath = value;
+            }
+            else if (arg == "--stages")
+            {
+                std::string list = value;
+                size_t start = 0;
+
+                while (start <= list.size())
+                {
+                    const size_t comma = std::min(list.find(',', start), list.size());
+                    options->stages.push_back(list.substr(start, comma - start));
+                    start = comma + 1;
+                }
+            }
+            else if (arg == "--min-size")
+            {
+                options->minSize = atoi(value);
+            }
+            else if (arg == "--max-size")
+            {
+                options->maxSize = atoi(value);
+            }
+            else if (arg == "--qfs-file")
+            {
+                options->qfsFiles.push_back(value);
+            }
+            else if (arg == "--read-rate")
+            {
+                options->readRate = atof(value) * 1e6;
+            }
+            else if (arg == "--min-time")
+            {
+                options->minTime = atof(value);
+            }
+            else if (arg == "--cpu")
+            {
+                int level = 0;
+
+                while (level <= CpuFeatureLevelAVX2 && strcmp(CpuLevelNames[level], value) != 0)
+                {
+                    level++;
+                }
+
+                if (level > CpuFeatureLevelAVX2)
+                {
+                    return false;
+                }
+
+                options->cpuLevel = static_cast<CpuFeatureLevel>(level);
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        return options->minSize >= 4 && options->maxSize >= options->minSize && options->maxSize <= 16384 && options->minTime > 0 && options->readRate > 0;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!ParseOptions(argc, argv, &options))
+    {
+        PrintUsage();
+        return 2;
+    }
+
+    SetCpuFeatureLevel(options.cpuLevel);
+
+    // The text output goes to stderr when the JSON is written to stdout.
+    const bool jsonToStdout = options.jsonPath == "-";
+
+    Runner runner(options, jsonToStdout ? stderr : stdout);
+
+    for (int size = options.minSize; size <= options.maxSize; size *= 2)
+    {
+        for (int code : ImageCodes)
+        {
+            if (!RunImageStages(options, runner, code, size))
+            {
+                return 1;
+            }
+        }
+
+        if (!RunPipelineStage(options, runner, size))
+        {
+            return 1;
+        }
+
+        RunScaleStage(options, runner, size);
+
+        if (!RunStreamStage(options, runner, size))
+        {
+            return 1;
+        }
+    }
+
+    RunPaletteStage(options, runner);
+
+    if (!RunFileStreams(options, runner))
+    {
+        return 1;
+    }
+
+    if (!options.jsonPath.empty())
+    {
+        FILE* file = jsonToStdout ? stdout : fopen(options.jsonPath.c_str(), "w");
+
+        if (file == nullptr)
+        {
+            fprintf(stderr, "%s could not be written.\n", options.jsonPath.c_str());
+            return 1;
+        }
+
+        WriteJson(file, options, runner.GetResults());
+
+        if (file != stdout)
+        {
+            fclose(file);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "QfsCompressor.h"
+
+namespace
+{
+    const size_t MaxOffset = 131072;
+    const size_t MaxMatch = 1028;
+    const size_t MaxLiteralRun = 112;
+    const int HashBits = 16;
+
+    unsigned int Hash(const unsigned char* p)
+    {
+        const unsigned int value = p[0] | (p[1] << 8) | (p[2] << 16);
+
+        return (value * 2654435761U) >> (32 - HashBits);
+    }
+
+    // Writes the literals that come before a match in runs of 4, the last 0 to 3 are left for
+    // the match or end code.
+    void WriteLiteralRuns(const unsigned char* data, size_t* literalStart, size_t end, std::vector<unsigned char>& output)
+    {
+        while (end - *literalStart >= 4)
+        {
+            size_t count = end - *literalStart;
+            count = (count > MaxLiteralRun ? MaxLiteralRun : count) & ~static_cast<size_t>(3);
+
+            output.push_back(static_cast<unsigned char>(0xe0 + (count / 4) - 1));
+            output.insert(output.end(), data + *literalStart, data + *literalStart + count);
+            *literalStart += count;
+        }
+    }
+
+    void WriteMatch(size_t literalCount, size_t length, size_t offset, std::vector<unsigned char>& output)
+    {
+        const size_t o = offset - 1;
+
+        if (length <= 10 && offset <= 1024)
+        {
+            output.push_back(static_cast<unsigned char>(((o >> 3) & 0x60) | ((length - 3) << 2) | literalCount));
+            output.push_back(static_cast<unsigned char>(o));
+        }
+        else if (length <= 67 && offset <= 16384)
+        {
+            output.push_back(static_cast<unsigned char>(0x80 | (length - 4)));
+            output.push_back(static_cast<unsigned char>((literalCount << 6) | (o >> 8)));
+            output.push_back(static_cast<unsigned char>(o));
+        }
+        else
+        {
+            output.push_back(static_cast<unsigned char>(0xc0 | ((o >> 12) & 0x10) | (((length - 5) >> 6) & 0x0c) | literalCount));
+            output.push_back(static_cast<unsigned char>(o >> 8));
+            output.push_back(static_cast<unsigned char>(o));
+            output.push_back(static_cast<unsigned char>(length - 5));
+        }
+    }
+
+    // The shortest match that each token can encode depends on the offset.
+    bool IsEncodable(size_t length, size_t offset)
+    {
+        return (length >= 3 && offset <= 1024) || (length >= 4 && offset <= 16384) || length >= 5;
+    }
+}
+
+void QfsCompress(const unsigned char* data, size_t size, std::vector<unsigned char>& output)
+{
+    output.clear();
+    output.reserve(size / 2 + 16);
+
+    if (size > 0xffffff)
+    {
+        output.push_back(0x90);
+        output.push_back(0xfb);
+        output.push_back(static_cast<unsigned char>(size >> 24));
+    }
+    else
+    {
+        output.push_back(0x10);
+        output.push_back(0xfb);
+    }
+
+    output.push_back(static_cast<unsigned char>(size >> 16));
+    output.push_back(static_cast<unsigned char>(size >> 8));
+    output.push_back(static_cast<unsigned char>(size));
+
+    std::vector<size_t> table(static_cast<size_t>(1) << HashBits, static_cast<size_t>(-1));
+    size_t position = 0;
+    size_t literalStart = 0;
+
+    while (position + 3 <= size)
+    {
+        const unsigned int hash = Hash(data + position);
+        const size_t candidate = table[hash];
+        table[hash] = position;
+
+        size_t length = 0;
+        const size_t offset = position - candidate;
+
+        if (candidate != static_cast<size_t>(-1) && offset <= MaxOffset)
+        {
+            const size_t limit = size - position < MaxMatch ? size - position : MaxMatch;
+
+            while (length < limit && data[candidate + length] == data[position + length])
+            {
+                length++;
+            }
+        }
+
+        if (IsEncodable(length, offset))
+        {
+            WriteLiteralRuns(data, &literalStart, position, output);
+
+            const size_t literalCount = position - literalStart;
+            WriteMatch(literalCount, length, offset, output);
+            output.insert(output.end(), data + literalStart, data + position);
+
+            position += length;
+            literalStart = position;
+        }
+        else
+        {
+            position++;
+        }
+    }
+
+    WriteLiteralRuns(data, &literalStart, size, output);
+
+    output.push_back(static_cast<unsigned char>(0xfc | (size - literalStart)));
+    output.insert(output.end(), data + literalStart, data + size);
+}
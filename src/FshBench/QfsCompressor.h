@@ -17,7 +17,13 @@
 * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *
 */
-
 #pragma once
 
-void DecompressImage(unsigned char* rgba, int width, int height, const unsigned char* blocks, bool dxt1);
+#include <stddef.h>
+#include <vector>
+
+// A simple greedy QFS (RefPack) compressor that creates the input of the decompression
+// benchmark. It finds matches with a single entry hash table, so it is fast enough for the
+// largest images but it does not compress as well as the game tools.
+// Data that is larger than 16 MB gets the 4 byte size header.
+void QfsCompress(const unsigned char* data, size_t size, std::vector<unsigned char>& output);
@@ -0,0 +1,224 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "QfsStreams.h"
+
+const char* const QfsStreamNames[QfsStreamKindCount] = { "literal", "run", "overlap", "short", "image" };
+
+namespace
+{
+    class StreamNoise
+    {
+    public:
+        explicit StreamNoise(unsigned int seed) : state(seed)
+        {
+        }
+
+        unsigned int Next()
+        {
+            state = state * 1664525U + 1013904223U;
+            return state >> 16;
+        }
+
+    private:
+        unsigned int state;
+    };
+
+    // Appends count bytes that repeat a random pattern of the given length.
+    void AppendPattern(StreamNoise& noise, size_t patternLength, size_t count, std::vector<unsigned char>& data)
+    {
+        unsigned char pattern[16];
+
+        for (size_t i = 0; i < patternLength; i++)
+        {
+            pattern[i] = static_cast<unsigned char>(noise.Next());
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            data.push_back(pattern[i % patternLength]);
+        }
+    }
+}
+
+void CreateQfsStreamData(QfsStreamKind kind, size_t size, std::vector<unsigned char>& data)
+{
+    StreamNoise noise(static_cast<unsigned int>(kind) * 7919 + 1);
+
+    data.clear();
+    data.reserve(size + 4096);
+
+    while (data.size() < size)
+    {
+        switch (kind)
+        {
+        case QfsStreamLiteral:
+            data.push_back(static_cast<unsigned char>(noise.Next()));
+            break;
+        case QfsStreamRun:
+            AppendPattern(noise, 1, 64 + noise.Next() % 2048, data);
+            break;
+        case QfsStreamOverlap:
+            AppendPattern(noise, 2 + noise.Next() % 14, 256 + noise.Next() % 2048, data);
+            break;
+        case QfsStreamShort:
+            // The random byte after each repeat ends the match.
+            AppendPattern(noise, 1 + noise.Next() % 4, 4 + noise.Next() % 8, data);
+            data.push_back(static_cast<unsigned char>(noise.Next()));
+            break;
+        default:
+        {
+            const size_t x = (data.size() / 4) % 1024;
+            const size_t y = data.size() / 4096;
+
+            data.push_back(static_cast<unsigned char>((x ^ y) + (noise.Next() & 7)));
+            data.push_back(static_cast<unsigned char>(y * 255 / 1024));
+            data.push_back(static_cast<unsigned char>(x * 255 / 1024));
+            data.push_back(static_cast<unsigned char>(x + y));
+            break;
+        }
+        }
+    }
+
+    data.resize(size);
+}
+
+bool QfsDecompressReference(const unsigned char* input, size_t inputSize, std::vector<unsigned char>& output)
+{
+    size_t start = 0;
+
+    if (inputSize >= 6 && !((input[0] & 0x7e) == 0x10 && input[1] == 0xfb))
+    {
+        start = 4;
+    }
+
+    if (inputSize < start + 5 || (input[start] & 0x7e) != 0x10 || input[start + 1] != 0xfb)
+    {
+        return false;
+    }
+
+    const size_t sizeLength = (input[start] & 0x80) != 0 ? 4 : 3;
+    size_t index = start + 2 + ((input[start] & 0x01) != 0 ? sizeLength : 0);
+    size_t outLength = 0;
+
+    if (index + sizeLength > inputSize)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeLength; i++)
+    {
+        outLength = (outLength << 8) | input[index++];
+    }
+
+    output.assign(outLength, 0);
+
+    size_t outIndex = 0;
+
+    for (;;)
+    {
+        if (index >= inputSize)
+        {
+            return false;
+        }
+
+        const unsigned int ccbyte0 = input[index++];
+        unsigned int ccbyte1 = 0;
+        unsigned int ccbyte2 = 0;
+        unsigned int ccbyte3 = 0;
+        size_t plainCount;
+        size_t copyCount = 0;
+        size_t copyOffset = 0;
+        bool end = false;
+
+        if (ccbyte0 >= 0xfc)
+        {
+            plainCount = ccbyte0 & 3;
+            end = true;
+        }
+        else if (ccbyte0 >= 0xe0)
+        {
+            plainCount = (ccbyte0 - 0xdf) << 2;
+        }
+        else if (ccbyte0 >= 0xc0)
+        {
+            if (index + 3 > inputSize)
+            {
+                return false;
+            }
+
+            ccbyte1 = input[index++];
+            ccbyte2 = input[index++];
+            ccbyte3 = input[index++];
+
+            plainCount = ccbyte0 & 3;
+            copyCount = (((ccbyte0 >> 2) & 0x03) << 8) + ccbyte3 + 5;
+            copyOffset = ((ccbyte0 & 0x10) << 12) + (ccbyte1 << 8) + ccbyte2 + 1;
+        }
+        else if (ccbyte0 >= 0x80)
+        {
+            if (index + 2 > inputSize)
+            {
+                return false;
+            }
+
+            ccbyte1 = input[index++];
+            ccbyte2 = input[index++];
+
+            plainCount = (ccbyte1 >> 6) & 3;
+            copyCount = (ccbyte0 & 0x3f) + 4;
+            copyOffset = ((ccbyte1 & 0x3f) << 8) + ccbyte2 + 1;
+        }
+        else
+        {
+            if (index + 1 > inputSize)
+            {
+                return false;
+            }
+
+            ccbyte1 = input[index++];
+
+            plainCount = ccbyte0 & 3;
+            copyCount = ((ccbyte0 & 0x1c) >> 2) + 3;
+            copyOffset = ((ccbyte0 >> 5) << 8) + ccbyte1 + 1;
+        }
+
+        if (plainCount > inputSize - index || plainCount + copyCount > outLength - outIndex || copyOffset > outIndex + plainCount)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < plainCount; i++)
+        {
+            output[outIndex++] = input[index++];
+        }
+
+        for (size_t i = 0; i < copyCount; i++)
+        {
+            output[outIndex] = output[outIndex - copyOffset];
+            outIndex++;
+        }
+
+        if (end)
+        {
+            return outIndex == outLength;
+        }
+    }
+}
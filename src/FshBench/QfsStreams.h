@@ -0,0 +1,46 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// The data of the QFS streams that the match copies of the decompressor are tested and
+// measured with. Each kind is compressed with QfsCompress into a stream of mostly one token
+// type, the worst cases of the wide copies.
+enum QfsStreamKind
+{
+    QfsStreamLiteral, // random data, only literal runs
+    QfsStreamRun,     // runs of one byte, long matches at offset 1
+    QfsStreamOverlap, // repeats of 2 to 15 byte patterns, long matches that overlap themselves
+    QfsStreamShort,   // short repeats, 3 to 10 byte matches with a few literals in between
+    QfsStreamImage,   // a 32-bit image with gradients and noise, like a real texture
+    QfsStreamKindCount
+};
+
+extern const char* const QfsStreamNames[QfsStreamKindCount];
+
+void CreateQfsStreamData(QfsStreamKind kind, size_t size, std::vector<unsigned char>& data);
+
+// The decompressor that the optimized one is compared with, it classifies the control codes
+// with an if/else cascade and copies one byte at a time like the original QFSDecompress.
+// Returns false if the data is not valid QFS data.
+bool QfsDecompressReference(const unsigned char* input, size_t inputSize, std::vector<unsigned char>& output);
@@ -0,0 +1,131 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <stdint.h>
+#include <vector>
+#include "FshTest.h"
+#include "FshThumbnailLoader.h"
+#include "PixelBuffer.h"
+#include "QfsCompressor.h"
+#include "TestFiles.h"
+#include "ThumbnailArena.h"
+
+namespace
+{
+    bool IsAligned(const void* memory)
+    {
+        return (reinterpret_cast<uintptr_t>(memory) % ThumbnailArena::Alignment) == 0;
+    }
+
+    // An image entry with QFS compressed data, the loader decompresses it into the arena.
+    std::vector<unsigned char> CreateCompressedFile(int size, unsigned int color)
+    {
+        const std::vector<unsigned char> pixels = CreateSolidImage(size, size, color);
+        std::vector<unsigned char> compressed;
+        QfsCompress(pixels.data(), pixels.size(), compressed);
+
+        TestFshFile file;
+        file.AddEntry("abcd", 0x80 | 0x7d, size, size, compressed);
+
+        return file.GetData();
+    }
+}
+
+FSH_TEST(ArenaAllocationsAreAligned)
+{
+    ThumbnailArena arena;
+    const size_t sizes[] = { 1, 63, 64, 100, 16 * 1024, 16 * 1024 + 1, 1024 * 1024 };
+
+    for (size_t size : sizes)
+    {
+        FSH_CHECK(IsAligned(arena.Allocate(size)));
+    }
+
+    const ThumbnailArenaStats& stats = arena.GetStats();
+    FSH_CHECK(stats.allocationCount == sizeof(sizes) / sizeof(sizes[0]));
+    FSH_CHECK(stats.bytesInUse >= 1024 * 1024 + 16 * 1024 * 2);
+    FSH_CHECK(stats.peakBytes == stats.bytesInUse);
+}
+
+FSH_TEST(ArenaResetKeepsPeakBytes)
+{
+    ThumbnailArena arena;
+
+    arena.Allocate(100 * 1024);
+    arena.Allocate(200);
+
+    const size_t peakBytes = arena.GetStats().peakBytes;
+    arena.Reset();
+
+    FSH_CHECK(arena.GetStats().bytesInUse == 0);
+    FSH_CHECK(arena.GetStats().peakBytes == peakBytes);
+
+    arena.Allocate(50 * 1024);
+    FSH_CHECK(arena.GetStats().peakBytes == peakBytes);
+    FSH_CHECK(arena.GetStats().allocationCount == 3);
+}
+
+// A worker thread that loads one file after another only goes to the heap for the first one.
+FSH_TEST(ArenaBlockCacheReusesBlocks)
+{
+    ArenaBlockCache cache(64 * 1024 * 1024);
+    const std::vector<unsigned char> data = CreateCompressedFile(256, 0xff336699);
+
+    for (int i = 0; i < 4; i++)
+    {
+        ThumbnailArena arena(&cache);
+        FshThumbnailLoader loader(&arena);
+        PixelBuffer pixels;
+
+        FSH_CHECK(loader.Open(data.data(), data.size(), 64) == FshLoadOk);
+        FSH_CHECK(loader.Decode(&pixels) == FshLoadOk);
+
+        const ThumbnailArenaStats& stats = arena.GetStats();
+        FSH_CHECK(stats.allocationCount > 0);
+        FSH_CHECK(stats.peakBytes >= 256 * 256 * 4);
+
+        if (i == 0)
+        {
+            FSH_CHECK(stats.heapAllocationCount > 0);
+            FSH_CHECK(stats.reusedBlockCount == 0);
+        }
+        else
+        {
+            FSH_CHECK(stats.heapAllocationCount == 0);
+            FSH_CHECK(stats.reusedBlockCount > 0);
+        }
+    }
+}
+
+// Without a cache every arena allocates its blocks from the heap.
+FSH_TEST(ArenaWithoutCacheUsesHeap)
+{
+    const std::vector<unsigned char> data = CreateCompressedFile(128, 0xff000000);
+
+    for (int i = 0; i < 2; i++)
+    {
+        ThumbnailArena arena;
+        FshThumbnailLoader loader(&arena);
+
+        FSH_CHECK(loader.Open(data.data(), data.size(), 0) == FshLoadOk);
+        FSH_CHECK(arena.GetStats().heapAllocationCount > 0);
+        FSH_CHECK(arena.GetStats().reusedBlockCount == 0);
+    }
+}
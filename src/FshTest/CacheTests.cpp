@@ -0,0 +1,232 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "ContentHash.h"
+#include "FshTest.h"
+#include "ThumbnailCache.h"
+
+namespace
+{
+    const int HammerThreads = 8;
+    const int HammerKeys = 64;
+    const int HammerIterations = 4000;
+
+    ThumbnailCacheKey CreateKey(int index)
+    {
+        ThumbnailCacheKey key;
+        key.contentHash = HashBytes64(&index, sizeof(index), 0);
+        key.fileSize = static_cast<unsigned long long>(index) + 1;
+
+        return key;
+    }
+
+    // Every pixel of the image is the index of its key, so a reader can tell when it gets the
+    // image of another key or one that was freed.
+    CachedThumbnail* CreateImage(int index, int size)
+    {
+        std::vector<unsigned char> pixels(static_cast<size_t>(size) * size * 4, static_cast<unsigned char>(index));
+
+        return CreateCachedThumbnail(pixels.data(), static_cast<size_t>(size) * 4, size, size, size);
+    }
+
+    bool HasPixels(const CachedThumbnail& image, int index)
+    {
+        const PixelBuffer& pixels = image.pixels;
+
+        for (int y = 0; y < pixels.GetHeight(); y++)
+        {
+            const unsigned char* row = pixels.GetData() + y * pixels.GetStride();
+
+            for (int x = 0; x < pixels.GetWidth() * 4; x++)
+            {
+                if (row[x] != static_cast<unsigned char>(index))
+                {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+}
+
+FSH_TEST(CacheKeyIsTheFileHash)
+{
+    std::vector<unsigned char> data(10000);
+
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = static_cast<unsigned char>(i * 7);
+    }
+
+    // A stream that is hashed in pieces gets the same key as the whole file.
+    ContentHasher hasher;
+    hasher.Add(data.data(), 1000);
+    hasher.Add(data.data() + 1000, data.size() - 1000);
+
+    const ThumbnailCacheKey key = GetThumbnailCacheKey(data.data(), data.size());
+    FSH_CHECK(key.contentHash == hasher.GetHash());
+    FSH_CHECK(key.fileSize == data.size());
+
+    data[5000]++;
+    FSH_CHECK(!(GetThumbnailCacheKey(data.data(), data.size()) == key));
+}
+
+FSH_TEST(CacheFileKeyUsesTheHeaderAndTime)
+{
+    std::vector<unsigned char> data(10000, 1);
+    const ThumbnailCacheKey key = GetThumbnailFileKey(data.data(), data.size(), data.size(), 1234);
+
+    FSH_CHECK(key.fileSize == data.size());
+    FSH_CHECK(GetThumbnailFileKey(data.data(), ThumbnailFileKeyHeaderSize, data.size(), 1234) == key);
+    FSH_CHECK(!(GetThumbnailFileKey(data.data(), data.size(), data.size(), 1235) == key));
+    FSH_CHECK(!(GetThumbnailFileKey(data.data(), data.size(), data.size() + 1, 1234) == key));
+
+    // Only the header is hashed.
+    data[5000]++;
+    FSH_CHECK(GetThumbnailFileKey(data.data(), data.size(), data.size(), 1234) == key);
+
+    data[100]++;
+    FSH_CHECK(!(GetThumbnailFileKey(data.data(), data.size(), data.size(), 1234) == key));
+}
+
+FSH_TEST(CacheThumbnailSize)
+{
+    std::vector<unsigned char> pixels(256 * 128 * 4);
+    std::unique_ptr<CachedThumbnail> image(CreateCachedThumbnail(pixels.data(), 256 * 4, 256, 128, 256));
+    int width = 0;
+    int height = 0;
+
+    FSH_CHECK(GetCachedThumbnailSize(*image, 256, &width, &height) && width == 256 && height == 128);
+    FSH_CHECK(GetCachedThumbnailSize(*image, 96, &width, &height) && width == 96 && height == 48);
+    FSH_CHECK(!GetCachedThumbnailSize(*image, 512, &width, &height));
+    FSH_CHECK(!GetCachedThumbnailSize(*image, 0, &width, &height));
+
+    // An image that is smaller than its requested size is the whole image and fits every request.
+    std::unique_ptr<CachedThumbnail> fullSize(CreateCachedThumbnail(pixels.data(), 256 * 4, 256, 128, 1024));
+
+    FSH_CHECK(GetCachedThumbnailSize(*fullSize, 512, &width, &height) && width == 256 && height == 128);
+    FSH_CHECK(GetCachedThumbnailSize(*fullSize, 0, &width, &height) && width == 256 && height == 128);
+}
+
+FSH_TEST(CacheFindAfterInsert)
+{
+    ThumbnailCache cache(1024 * 1024);
+
+    FSH_CHECK(cache.Find(CreateKey(1)) == nullptr);
+    FSH_CHECK(cache.Insert(CreateKey(1), CreateImage(1, 16)));
+
+    std::shared_ptr<const CachedThumbnail> image = cache.Find(CreateKey(1));
+    FSH_CHECK(image != nullptr && HasPixels(*image, 1));
+
+    // The image stays valid while it is used after the cache drops it.
+    cache.Clear();
+    FSH_CHECK(cache.Find(CreateKey(1)) == nullptr);
+    FSH_CHECK(image != nullptr && HasPixels(*image, 1));
+
+    const ThumbnailCacheStats stats = cache.GetStats();
+    FSH_CHECK(stats.hits == 1 && stats.misses == 2 && stats.insertions == 1 && stats.bytesInUse == 0);
+}
+
+// A 1024 x 1024 thumbnail is larger than an even share of each shard, the size limit is for the
+// whole cache so the oldest entries of the other shards are removed to make room for it.
+FSH_TEST(CacheLargeThumbnail)
+{
+    const int LargeSize = 1024;
+    const size_t LargeBytes = static_cast<size_t>(LargeSize) * LargeSize * 4;
+    ThumbnailCache cache(32 * 1024 * 1024);
+
+    for (int i = 0; i < 8; i++)
+    {
+        FSH_CHECK(cache.Insert(CreateKey(i), CreateImage(i, LargeSize)));
+    }
+
+    std::shared_ptr<const CachedThumbnail> image = cache.Find(CreateKey(0));
+    FSH_CHECK(image != nullptr && image->pixels.GetWidth() == LargeSize && HasPixels(*image, 0));
+    FSH_CHECK(cache.GetStats().bytesInUse == 8 * LargeBytes);
+
+    // Key 0 was used last so key 1 is the least recently used entry.
+    FSH_CHECK(cache.Insert(CreateKey(8), CreateImage(8, LargeSize)));
+    FSH_CHECK(cache.Find(CreateKey(1)) == nullptr);
+    FSH_CHECK(cache.Find(CreateKey(0)) != nullptr);
+
+    image = cache.Find(CreateKey(8));
+    FSH_CHECK(image != nullptr && HasPixels(*image, 8));
+
+    const ThumbnailCacheStats stats = cache.GetStats();
+    FSH_CHECK(stats.evictions == 1 && stats.bytesInUse == 8 * LargeBytes);
+
+    // An image that is larger than the whole cache is not added.
+    ThumbnailCache small(LargeBytes - 1);
+    FSH_CHECK(!small.Insert(CreateKey(0), CreateImage(0, LargeSize)));
+}
+
+// Many threads find and insert images of the same keys in a cache that is too small for all of
+// them, build with -fsanitize=thread to check the locking.
+FSH_TEST(CacheHammer)
+{
+    ThumbnailCache cache(HammerKeys * 32 * 32 * 4 / 2);
+    std::atomic<int> badImages(0);
+    std::atomic<unsigned long long> lookups(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < HammerThreads; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            unsigned int state = 1234567u * (t + 1);
+
+            for (int i = 0; i < HammerIterations; i++)
+            {
+                state = state * 1664525u + 1013904223u;
+                const int index = static_cast<int>((state >> 16) % HammerKeys);
+
+                std::shared_ptr<const CachedThumbnail> image = cache.Find(CreateKey(index));
+                lookups++;
+
+                if (image == nullptr)
+                {
+                    cache.Insert(CreateKey(index), CreateImage(index, 32));
+                }
+                else if (!HasPixels(*image, index))
+                {
+                    badImages++;
+                }
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const ThumbnailCacheStats stats = cache.GetStats();
+
+    FSH_CHECK(badImages == 0);
+    FSH_CHECK(stats.hits + stats.misses == lookups);
+    FSH_CHECK(stats.insertions == stats.misses);
+    FSH_CHECK(stats.evictions > 0);
+    FSH_CHECK(stats.bytesInUse <= HammerKeys * 32 * 32 * 4 / 2);
+}
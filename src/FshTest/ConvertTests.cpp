@@ -0,0 +1,138 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <vector>
+#include <stdio.h>
+#include "FshTest.h"
+#include "PixelConversion.h"
+#include "TestFiles.h"
+
+namespace
+{
+    typedef void (*ConvertProc)(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int width, int height);
+
+    struct ConvertFormat
+    {
+        const char* name;
+        ConvertProc convert;
+        int bytesPerPixel;
+        int bits[4]; // blue, green, red and alpha from the low bits up, 0 is opaque
+    };
+
+    const ConvertFormat Formats[] =
+    {
+        { "A1R5G5B5", ConvertA1R5G5B5ToBGRA, 2, { 5, 5, 5, 1 } },
+        { "R5G6B5", ConvertR5G6B5ToBGRA, 2, { 5, 6, 5, 0 } },
+        { "A4R4G4B4", ConvertA4R4G4B4ToBGRA, 2, { 4, 4, 4, 4 } },
+        { "R8G8B8", ConvertR8G8B8ToBGRA, 3, { 8, 8, 8, 0 } },
+    };
+
+    // Repeats the bits of the channel from the top of the byte down until all 8 bits are filled.
+    unsigned char ExpandReference(unsigned int value, int bits)
+    {
+        if (bits == 0)
+        {
+            return 255;
+        }
+
+        unsigned int expanded = 0;
+
+        for (int filled = 0; filled < 8; filled += bits)
+        {
+            expanded |= (value << (8 - bits)) >> filled;
+        }
+
+        return static_cast<unsigned char>(expanded);
+    }
+
+    std::vector<unsigned char> ConvertReference(const ConvertFormat& format, const std::vector<unsigned char>& src, int width, int height)
+    {
+        std::vector<unsigned char> dst(static_cast<size_t>(width) * height * 4);
+
+        for (size_t i = 0; i < static_cast<size_t>(width) * height; i++)
+        {
+            unsigned int pixel = 0;
+            for (int b = 0; b < format.bytesPerPixel; b++)
+            {
+                pixel |= static_cast<unsigned int>(src[i * format.bytesPerPixel + b]) << (8 * b);
+            }
+
+            int shift = 0;
+            for (int c = 0; c < 4; c++)
+            {
+                const int bits = format.bits[c];
+
+                dst[i * 4 + c] = ExpandReference((pixel >> shift) & ((1u << bits) - 1), bits);
+                shift += bits;
+            }
+        }
+
+        return dst;
+    }
+
+    std::vector<unsigned char> CreatePixels(int bytesPerPixel, int width, int height)
+    {
+        std::vector<unsigned char> src(static_cast<size_t>(width) * height * bytesPerPixel);
+        unsigned int state = static_cast<unsigned int>(width * 7 + bytesPerPixel);
+
+        for (size_t i = 0; i < src.size(); i++)
+        {
+            state = state * 1664525u + 1013904223u;
+            src[i] = static_cast<unsigned char>(state >> 24);
+        }
+
+        return src;
+    }
+}
+
+// Every kernel expands the channels by replicating their high bits, e.g. 5-bit 31 is 255 and
+// 5-bit 16 is 132, for widths that cover the SIMD loops and their remainders.
+FSH_TEST(ConvertKernelsMatchReference)
+{
+    const int widths[] = { 1, 7, 8, 15, 16, 33, 100 };
+    const std::vector<CpuFeatureLevel> levels = GetSupportedCpuFeatureLevels();
+
+    for (const ConvertFormat& format : Formats)
+    {
+        for (int width : widths)
+        {
+            const int height = 3;
+            const std::vector<unsigned char> src = CreatePixels(format.bytesPerPixel, width, height);
+            const std::vector<unsigned char> expected = ConvertReference(format, src, width, height);
+
+            for (CpuFeatureLevel level : levels)
+            {
+                SetCpuFeatureLevel(level);
+
+                std::vector<unsigned char> dst(static_cast<size_t>(width) * height * 4, 0xcd);
+                format.convert(src.data(), static_cast<size_t>(width) * format.bytesPerPixel, dst.data(), static_cast<size_t>(width) * 4, width, height);
+
+                if (dst != expected)
+                {
+                    fprintf(stderr, "%s at width %d with CPU level %d\n", format.name, width, static_cast<int>(level));
+                }
+
+                FSH_CHECK(dst == expected);
+            }
+        }
+    }
+
+    SetCpuFeatureLevel(CpuFeatureLevelAVX2);
+}
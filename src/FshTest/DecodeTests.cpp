@@ -0,0 +1,86 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <vector>
+#include "FshImageDecoder.h"
+#include "FshMipmaps.h"
+#include "FshTest.h"
+
+namespace
+{
+    std::vector<unsigned char> CreateDxtData(int code, int width, int height)
+    {
+        std::vector<unsigned char> data(static_cast<size_t>(GetFshImageDataSize(code, width, height)));
+        unsigned int state = static_cast<unsigned int>(code * 31 + width);
+
+        for (size_t i = 0; i < data.size(); i++)
+        {
+            state = state * 1664525u + 1013904223u;
+            data[i] = static_cast<unsigned char>(state >> 24);
+        }
+
+        return data;
+    }
+
+    std::vector<unsigned char> Decode(const FshImageSource& source, int width, int height, int maxThreads)
+    {
+        std::vector<unsigned char> pixels(static_cast<size_t>(width) * height * 4);
+
+        FSH_CHECK(DecodeFshImage(source, pixels.data(), static_cast<size_t>(width) * 4, width, height, maxThreads));
+
+        return pixels;
+    }
+}
+
+// The strips of a large DXT image that are split between threads give the same pixels as the
+// strips that are decoded on one thread, at the image size and at thumbnail sizes.
+FSH_TEST(DecodeThreadsMatchOneThread)
+{
+    const int codes[] = { 0x60, 0x61 };
+    const int sizes[][2] = { { 1536, 1100 }, { 1024, 1024 }, { 4100, 300 } };
+    const int thumbnailSizes[] = { 0, 256, 96 };
+
+    for (int code : codes)
+    {
+        for (const int* size : sizes)
+        {
+            const std::vector<unsigned char> data = CreateDxtData(code, size[0], size[1]);
+
+            FshImageSource source;
+            source.code = code;
+            source.width = size[0];
+            source.height = size[1];
+            source.data = data.data();
+            source.palette = nullptr;
+
+            for (int maxEdgeLength : thumbnailSizes)
+            {
+                int width;
+                int height;
+                GetFshThumbnailSize(size[0], size[1], maxEdgeLength, &width, &height);
+
+                const std::vector<unsigned char> expected = Decode(source, width, height, 1);
+
+                FSH_CHECK(Decode(source, width, height, 4) == expected);
+                FSH_CHECK(Decode(source, width, height, 8) == expected);
+            }
+        }
+    }
+}
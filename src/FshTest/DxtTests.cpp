@@ -0,0 +1,247 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <vector>
+#include "DXT.h"
+#include "FshMipmaps.h"
+#include "FshTest.h"
+#include "TestFiles.h"
+
+namespace
+{
+    // Random DXT blocks, the DXT3 alpha is a mix of opaque, transparent and translucent pixels.
+    std::vector<unsigned char> CreateBlocks(bool dxt1, int width, int height, unsigned int seed)
+    {
+        std::vector<unsigned char> data(static_cast<size_t>(GetFshImageDataSize(dxt1 ? 0x60 : 0x61, width, height)));
+        unsigned int state = seed;
+
+        for (size_t i = 0; i < data.size(); i++)
+        {
+            state = state * 1664525u + 1013904223u;
+            data[i] = static_cast<unsigned char>(state >> 24);
+
+            // Every third block is opaque so the opaque fast paths are covered as well.
+            if (!dxt1 && (i % 16) < 8 && ((i / 16) % 3) == 0)
+            {
+                data[i] = 0xff;
+            }
+        }
+
+        // Some blocks have two equal colors, which selects the 3 color mode of DXT1.
+        const size_t blockSize = dxt1 ? 8 : 16;
+        const size_t colorOffset = dxt1 ? 0 : 8;
+
+        for (size_t i = 0; i + blockSize <= data.size(); i += blockSize * 5)
+        {
+            data[i + colorOffset + 2] = data[i + colorOffset];
+            data[i + colorOffset + 3] = data[i + colorOffset + 1];
+        }
+
+        return data;
+    }
+
+    // The alpha weighted average of the full size pixels that each reduced pixel covers.
+    std::vector<unsigned char> ReduceReference(const std::vector<unsigned char>& pixels, int width, int height, int scaleShift)
+    {
+        const int scale = 1 << scaleShift;
+        const int reducedWidth = GetReducedDecodeSize(width, scaleShift);
+        const int reducedHeight = GetReducedDecodeSize(height, scaleShift);
+        std::vector<unsigned char> reduced(static_cast<size_t>(reducedWidth) * reducedHeight * 4);
+
+        for (int ry = 0; ry < reducedHeight; ry++)
+        {
+            for (int rx = 0; rx < reducedWidth; rx++)
+            {
+                unsigned int colorSums[3] = { 0, 0, 0 };
+                unsigned int alphaSum = 0;
+                unsigned int count = 0;
+
+                for (int y = ry * scale; y < (ry + 1) * scale && y < height; y++)
+                {
+                    for (int x = rx * scale; x < (rx + 1) * scale && x < width; x++)
+                    {
+                        const unsigned char* pixel = &pixels[(static_cast<size_t>(y) * width + x) * 4];
+
+                        for (int c = 0; c < 3; c++)
+                        {
+                            colorSums[c] += pixel[c] * pixel[3];
+                        }
+
+                        alphaSum += pixel[3];
+                        count++;
+                    }
+                }
+
+                unsigned char* dst = &reduced[(static_cast<size_t>(ry) * reducedWidth + rx) * 4];
+
+                for (int c = 0; c < 3; c++)
+                {
+                    dst[c] = static_cast<unsigned char>(alphaSum > 0 ? (colorSums[c] + alphaSum / 2) / alphaSum : 0);
+                }
+
+                dst[3] = static_cast<unsigned char>((alphaSum + count / 2) / count);
+            }
+        }
+
+        return reduced;
+    }
+}
+
+FSH_TEST(DxtReducedMatchesWeightedAverage)
+{
+    const int sizes[][2] = { { 64, 64 }, { 132, 70 }, { 250, 37 }, { 9, 300 } };
+
+    for (int dxt1 = 0; dxt1 < 2; dxt1++)
+    {
+        for (const int* size : sizes)
+        {
+            const int width = size[0];
+            const int height = size[1];
+            const std::vector<unsigned char> blocks = CreateBlocks(dxt1 != 0, width, height, static_cast<unsigned int>(width * 131 + height));
+
+            std::vector<unsigned char> pixels(static_cast<size_t>(width) * height * 4);
+            DecompressImage(pixels.data(), static_cast<size_t>(width) * 4, width, height, blocks.data(), dxt1 != 0, ChannelOrderBGRA, 1);
+
+            for (int scaleShift = 1; scaleShift <= 3; scaleShift++)
+            {
+                const int reducedWidth = GetReducedDecodeSize(width, scaleShift);
+                const int reducedHeight = GetReducedDecodeSize(height, scaleShift);
+                std::vector<unsigned char> reduced(static_cast<size_t>(reducedWidth) * reducedHeight * 4);
+
+                DecompressImageReduced(reduced.data(), static_cast<size_t>(reducedWidth) * 4, width, height, blocks.data(), dxt1 != 0, scaleShift,
+                    ChannelOrderBGRA, 1);
+
+                FSH_CHECK(reduced == ReduceReference(pixels, width, height, scaleShift));
+            }
+        }
+    }
+}
+
+// A transparent pixel does not change the color of the reduced pixel.
+FSH_TEST(DxtReducedIgnoresTransparentColor)
+{
+    // DXT3 block: the left two columns are transparent, color0 is red and color1 is blue, the
+    // left two columns use color0 and the right two use color1.
+    std::vector<unsigned char> block(16, 0);
+    for (int row = 0; row < 4; row++)
+    {
+        block[row * 2] = 0x00;
+        block[row * 2 + 1] = 0xff;
+    }
+
+    block[8] = 0x00; // red 565
+    block[9] = 0xf8;
+    block[10] = 0x1f; // blue 565
+    block[11] = 0x00;
+    for (int row = 0; row < 4; row++)
+    {
+        block[12 + row] = 0x50; // 0, 0, 1, 1
+    }
+
+    unsigned char pixel[4];
+    DecompressImageReduced(pixel, 4, 4, 4, block.data(), false, 2, ChannelOrderBGRA, 1);
+
+    FSH_CHECK(pixel[0] == 255 && pixel[1] == 0 && pixel[2] == 0);
+    FSH_CHECK(pixel[3] == 128);
+}
+
+// Every SIMD kernel that the processor supports gives the same pixels as the scalar code, for
+// block counts that cover the multi-block loops and their remainders and for both channel orders.
+FSH_TEST(DxtKernelsMatchScalar)
+{
+    const int sizes[][2] = { { 4, 4 }, { 12, 8 }, { 260, 36 }, { 129, 33 }, { 1000, 9 } };
+    const std::vector<CpuFeatureLevel> levels = GetSupportedCpuFeatureLevels();
+
+    for (int dxt1 = 0; dxt1 < 2; dxt1++)
+    {
+        for (const int* size : sizes)
+        {
+            const int width = size[0];
+            const int height = size[1];
+            const std::vector<unsigned char> blocks = CreateBlocks(dxt1 != 0, width, height, static_cast<unsigned int>(width + height * 977));
+            const size_t stride = (static_cast<size_t>(width) * 4) + 12;
+
+            for (int order = ChannelOrderRGBA; order <= ChannelOrderBGRA; order++)
+            {
+                std::vector<unsigned char> expected;
+                std::vector<unsigned char> expectedReduced;
+
+                for (CpuFeatureLevel level : levels)
+                {
+                    SetCpuFeatureLevel(level);
+
+                    std::vector<unsigned char> pixels(stride * height, 0xcd);
+                    DecompressImage(pixels.data(), stride, width, height, blocks.data(), dxt1 != 0, static_cast<ChannelOrder>(order), 1);
+
+                    const int reducedWidth = GetReducedDecodeSize(width, 1);
+                    const int reducedHeight = GetReducedDecodeSize(height, 1);
+                    std::vector<unsigned char> reduced(static_cast<size_t>(reducedWidth) * reducedHeight * 4);
+                    DecompressImageReduced(reduced.data(), static_cast<size_t>(reducedWidth) * 4, width, height, blocks.data(), dxt1 != 0, 1,
+                        static_cast<ChannelOrder>(order), 1);
+
+                    if (level == CpuFeatureLevelScalar)
+                    {
+                        expected = pixels;
+                        expectedReduced = reduced;
+                    }
+                    else
+                    {
+                        FSH_CHECK(pixels == expected);
+                        FSH_CHECK(reduced == expectedReduced);
+                    }
+                }
+            }
+        }
+    }
+
+    SetCpuFeatureLevel(CpuFeatureLevelAVX2);
+}
+
+// The strips of an image that are decoded with the same threads give the same pixels as the
+// whole image decoded on one thread.
+FSH_TEST(DxtThreadsAreReusedByStrips)
+{
+    const int width = 1024;
+    const int height = 1040;
+    const int stripRows = 16;
+
+    for (int dxt1 = 0; dxt1 < 2; dxt1++)
+    {
+        const std::vector<unsigned char> blocks = CreateBlocks(dxt1 != 0, width, height, 12345);
+        const size_t blockRowSize = static_cast<size_t>(width / 4) * (dxt1 ? 8 : 16);
+        const size_t stride = static_cast<size_t>(width) * 4;
+
+        std::vector<unsigned char> expected(stride * height);
+        DecompressImage(expected.data(), stride, width, height, blocks.data(), dxt1 != 0, ChannelOrderBGRA, 1);
+
+        DxtDecodeThreads threads(width, height, 4);
+        FSH_CHECK(threads.GetThreadCount() >= 1 && threads.GetThreadCount() <= 4);
+
+        std::vector<unsigned char> pixels(stride * height, 0xcd);
+
+        for (int y = 0; y < height; y += stripRows)
+        {
+            DecompressImageReduced(pixels.data() + (stride * y), stride, width, stripRows, blocks.data() + (blockRowSize * (y / 4)), dxt1 != 0, 0,
+                ChannelOrderBGRA, &threads);
+        }
+
+        FSH_CHECK(pixels == expected);
+    }
+}
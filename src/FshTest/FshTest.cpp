@@ -0,0 +1,118 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// fshtest runs the regression tests of the common decoder code on Linux. There is no project
+// file for it, it is built with e.g.
+//     g++ -std=c++14 -O2 -pthread -I../Common -I../FshBench *.cpp ../Common/*.cpp ../FshBench/QfsCompressor.cpp ../FshBench/QfsStreams.cpp -o fshtest
+//
+// Run it without arguments for all of the tests, or with the names of the tests to run.
+// It returns 1 when a test fails.
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include "FshTest.h"
+
+namespace
+{
+    struct TestCase
+    {
+        const char* name;
+        FshTestProc proc;
+    };
+
+    // The registrations run before main, the list is created on first use.
+    std::vector<TestCase>& GetTestCases()
+    {
+        static std::vector<TestCase> testCases;
+
+        return testCases;
+    }
+
+    int failureCount = 0;
+
+    bool IsSelected(const char* name, int argc, char** argv)
+    {
+        if (argc < 2)
+        {
+            return true;
+        }
+
+        for (int i = 1; i < argc; i++)
+        {
+            if (strcmp(argv[i], name) == 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+}
+
+FshTestRegistration::FshTestRegistration(const char* name, FshTestProc proc)
+{
+    const TestCase testCase = { name, proc };
+
+    GetTestCases().push_back(testCase);
+}
+
+void CheckCondition(bool condition, const char* text, const char* file, int line)
+{
+    if (!condition)
+    {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, text);
+        failureCount++;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int failedTests = 0;
+    int testCount = 0;
+
+    for (const TestCase& testCase : GetTestCases())
+    {
+        if (!IsSelected(testCase.name, argc, argv))
+        {
+            continue;
+        }
+
+        const int previousFailures = failureCount;
+
+        testCase.proc();
+        testCount++;
+
+        if (failureCount != previousFailures)
+        {
+            printf("FAIL %s\n", testCase.name);
+            failedTests++;
+        }
+        else
+        {
+            printf("ok   %s\n", testCase.name);
+        }
+    }
+
+    printf("%d of %d tests passed\n", testCount - failedTests, testCount);
+
+    return failedTests == 0 ? 0 : 1;
+}
@@ -0,0 +1,40 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+// The test cases of fshtest register themselves with FSH_TEST and report failures with FSH_CHECK,
+// a failed check is reported and the test continues so that every failure in it is listed.
+
+typedef void (*FshTestProc)();
+
+struct FshTestRegistration
+{
+    FshTestRegistration(const char* name, FshTestProc proc);
+};
+
+void CheckCondition(bool condition, const char* text, const char* file, int line);
+
+#define FSH_TEST(name) \
+    static void name(); \
+    static FshTestRegistration name##Registration(#name, name); \
+    static void name()
+
+#define FSH_CHECK(condition) CheckCondition((condition), #condition, __FILE__, __LINE__)
@@ -0,0 +1,106 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <stdlib.h>
+#include <vector>
+#include "FshTest.h"
+#include "FshThumbnailLadder.h"
+#include "FshThumbnailLoader.h"
+#include "TestFiles.h"
+
+namespace
+{
+    // A 32-bit image with gradients and alpha, which the scaled levels average smoothly.
+    std::vector<unsigned char> CreateGradientImage(int width, int height)
+    {
+        std::vector<unsigned char> data(static_cast<size_t>(width) * height * 4);
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                unsigned char* p = &data[(static_cast<size_t>(y) * width + x) * 4];
+
+                p[0] = static_cast<unsigned char>(x * 255 / width);
+                p[1] = static_cast<unsigned char>(y * 255 / height);
+                p[2] = static_cast<unsigned char>(((x / 64) ^ (y / 64)) * 40);
+                p[3] = static_cast<unsigned char>(128 + (x + y) * 127 / (width + height));
+            }
+        }
+
+        return data;
+    }
+}
+
+// Each level of the ladder has the size of the single size path and is close to the thumbnail
+// that is decoded for that size alone, the smaller levels are scaled from the larger ones.
+FSH_TEST(LadderMatchesSingleSize)
+{
+    const int width = 2048;
+    const int height = 1024;
+    const int sizes[] = { 1024, 256, 96, 32 };
+
+    TestFshFile file;
+    file.AddEntry("0000", 0x7d, width, height, CreateGradientImage(width, height));
+    const std::vector<unsigned char> data = file.GetData();
+
+    ThumbnailArena arena;
+    FshThumbnailLoader loader(&arena);
+    FSH_CHECK(loader.Open(data.data(), data.size(), sizes[0]) == FshLoadOk);
+
+    FshThumbnailLadder ladder;
+    FSH_CHECK(ladder.Create(loader.GetImageSource(), sizes, 4));
+    FSH_CHECK(ladder.GetCount() == 4);
+
+    for (int i = 0; i < ladder.GetCount(); i++)
+    {
+        const FshThumbnailLevel& level = ladder.GetLevel(i);
+
+        FshThumbnailLoader single(&arena);
+        FSH_CHECK(single.Open(data.data(), data.size(), sizes[i]) == FshLoadOk);
+
+        PixelBuffer pixels;
+        FSH_CHECK(single.Decode(&pixels) == FshLoadOk);
+        FSH_CHECK(level.maxEdgeLength == sizes[i]);
+        FSH_CHECK(level.width == pixels.GetWidth() && level.height == pixels.GetHeight());
+
+        if (level.width != pixels.GetWidth() || level.height != pixels.GetHeight())
+        {
+            continue;
+        }
+
+        int maxDifference = 0;
+
+        for (int y = 0; y < level.height; y++)
+        {
+            const unsigned char* expected = pixels.GetData() + (pixels.GetStride() * y);
+            const unsigned char* actual = level.pixels + (static_cast<size_t>(level.width) * 4 * y);
+
+            for (int x = 0; x < level.width * 4; x++)
+            {
+                const int difference = abs(expected[x] - actual[x]);
+                maxDifference = difference > maxDifference ? difference : maxDifference;
+            }
+        }
+
+        // The scaled levels are rounded once more than the single size.
+        FSH_CHECK(maxDifference <= 2);
+    }
+}
@@ -0,0 +1,199 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include "FshHeaders.h"
+#include "FshPrefix.h"
+#include "FshPrefixReader.h"
+#include "FshTest.h"
+#include "FshThumbnailLoader.h"
+#include "FshView.h"
+#include "PixelBuffer.h"
+#include "QfsCompressor.h"
+#include "TestFiles.h"
+#include "ThumbnailArena.h"
+
+namespace
+{
+    const unsigned int Red = 0xffff0000;
+    const unsigned int Green = 0xff00ff00;
+    const unsigned int Blue = 0xff0000ff;
+
+    // A 64 pixel image and a 32 pixel entry with the same name, the loader uses the smaller
+    // entry for a 32 pixel thumbnail.
+    TestFshFile CreateSiblingFile(unsigned int largeColor, unsigned int smallColor)
+    {
+        TestFshFile file;
+        file.AddEntry("abcd", 0x7d, 64, 64, CreateSolidImage(64, 64, largeColor));
+        file.AddEntry("abcd", 0x7d, 32, 32, CreateSolidImage(32, 32, smallColor));
+
+        return file;
+    }
+
+    // Loads the first pixel of the thumbnail from the first available bytes of the file,
+    // returns 0 when the file cannot be loaded.
+    unsigned int LoadFirstPixel(const std::vector<unsigned char>& data, size_t available, int maxEdgeLength, int* width)
+    {
+        ThumbnailArena arena;
+        FshThumbnailLoader loader(&arena);
+        PixelBuffer pixels;
+
+        if (loader.Open(data.data(), available, data.size(), maxEdgeLength) != FshLoadOk || loader.Decode(&pixels) != FshLoadOk)
+        {
+            return 0;
+        }
+
+        *width = loader.GetImageSource().width;
+
+        const unsigned char* pixel = pixels.GetData();
+
+        return pixel[0] | (pixel[1] << 8) | (pixel[2] << 16) | (static_cast<unsigned int>(pixel[3]) << 24);
+    }
+}
+
+FSH_TEST(PrefixCoversSiblingHeaders)
+{
+    const std::vector<unsigned char> data = CreateSiblingFile(Green, Blue).GetData();
+    const size_t siblingOffset = sizeof(FshHeader) + (2 * sizeof(FshDirEntry)) + sizeof(FshEntryHeader) + (64 * 64 * 4);
+    const size_t siblingHeaderEnd = siblingOffset + sizeof(FshEntryHeader);
+
+    // The sibling header is needed to select the level even when the full size image is used.
+    FSH_CHECK(GetFshPrefixLength(data.data(), siblingOffset, data.size(), 64) == siblingHeaderEnd);
+    FSH_CHECK(GetFshPrefixLength(data.data(), data.size(), data.size(), 64) == siblingHeaderEnd);
+    FSH_CHECK(GetFshPrefixLength(data.data(), data.size(), data.size(), 32) == data.size());
+}
+
+FSH_TEST(PrefixQfsSiblingIsSelected)
+{
+    // The buffer of the previous file is reused, its 32 pixel entry is red.
+    const std::vector<unsigned char> previous = CreateSiblingFile(Red, Red).GetData();
+    const std::vector<unsigned char> file = CreateSiblingFile(Green, Blue).GetQfsData();
+
+    std::vector<unsigned char> data;
+    size_t length = 0;
+    FSH_CHECK(DecompressQfsPrefix(file, 32, previous, &data, &length));
+    FSH_CHECK(length == data.size());
+
+    int width = 0;
+    FSH_CHECK(LoadFirstPixel(data, length, 32, &width) == Blue);
+    FSH_CHECK(width == 32);
+
+    FSH_CHECK(DecompressQfsPrefix(file, 64, previous, &data, &length));
+    FSH_CHECK(length < data.size());
+    FSH_CHECK(LoadFirstPixel(data, length, 64, &width) == Green);
+    FSH_CHECK(width == 64);
+
+    // The 32 pixel entry is after the prefix, the stale data there is never read.
+    FSH_CHECK(LoadFirstPixel(data, length, 32, &width) == 0);
+}
+
+FSH_TEST(PrefixInvalidDirectoryIsNotBounded)
+{
+    std::vector<unsigned char> data = CreateSiblingFile(Green, Blue).GetData();
+
+    FshHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    header.numBmps = 0x7fffffff;
+    memcpy(data.data(), &header, sizeof(header));
+
+    FSH_CHECK(GetFshPrefixLength(data.data(), data.size(), data.size(), 64) == 0);
+
+    // A large file size does not let the count past the directory that is in memory.
+    FshView view;
+    FSH_CHECK(!view.Open(data.data(), data.size(), static_cast<size_t>(0x7fffffff) * sizeof(FshDirEntry) * 2));
+
+    std::vector<unsigned char> compressed;
+    QfsCompress(data.data(), data.size(), compressed);
+
+    ThumbnailArena arena;
+    FshFilePrefix prefix;
+    FSH_CHECK(DecompressFshPrefix(compressed.data(), compressed.size(), 64, &arena, &prefix) == FshLoadInvalidData);
+
+    // Only the probe of the header is read.
+    size_t readEnd = 0;
+
+    auto read = [&](size_t offset, unsigned char* buffer, size_t size) -> bool
+    {
+        memcpy(buffer, data.data() + offset, size);
+        readEnd = std::max(readEnd, offset + size);
+        return true;
+    };
+
+    FSH_CHECK(ReadFshPrefix(read, data.size(), 64, &arena, &prefix) == FshLoadInvalidData);
+    FSH_CHECK(readEnd <= 4096);
+}
+
+FSH_TEST(PrefixRangesOnlyCoverTheSelectedLevel)
+{
+    // A large image that is followed by a 32 pixel entry with the same name and a large entry
+    // that is never used, the buffer ends with the small entry.
+    TestFshFile file;
+    file.AddEntry("abcd", 0x7d, 256, 256, CreateSolidImage(256, 256, Green));
+    file.AddEntry("abcd", 0x7d, 32, 32, CreateSolidImage(32, 32, Blue));
+    file.AddEntry("efgh", 0x7d, 256, 256, CreateSolidImage(256, 256, Red));
+
+    const std::vector<unsigned char> data = file.GetData();
+    const size_t smallEnd = sizeof(FshHeader) + (3 * sizeof(FshDirEntry)) + (2 * sizeof(FshEntryHeader)) + (256 * 256 * 4) + (32 * 32 * 4);
+    size_t bytesRead = 0;
+
+    auto read = [&](size_t offset, unsigned char* buffer, size_t size) -> bool
+    {
+        memcpy(buffer, data.data() + offset, size);
+        bytesRead += size;
+        return true;
+    };
+
+    ThumbnailArena arena;
+    FshFilePrefix prefix;
+    FSH_CHECK(ReadFshPrefix(read, data.size(), 32, &arena, &prefix) == FshLoadOk);
+    FSH_CHECK(prefix.length == smallEnd);
+    FSH_CHECK(prefix.size == data.size());
+    FSH_CHECK(bytesRead < 16 * 1024);
+
+    FshThumbnailLoader loader(&arena);
+    PixelBuffer pixels;
+    FSH_CHECK(loader.Open(prefix.data, prefix.length, prefix.size, 32) == FshLoadOk);
+    FSH_CHECK(loader.Decode(&pixels) == FshLoadOk);
+    FSH_CHECK(loader.GetImageSource().width == 32);
+    FSH_CHECK(memcmp(pixels.GetData(), &Blue, 4) == 0);
+}
+
+FSH_TEST(PrefixQfsBufferCoversOnlyThePrefix)
+{
+    // The large entry after the image is never decompressed or allocated.
+    TestFshFile file;
+    file.AddEntry("abcd", 0x7d, 64, 64, CreateSolidImage(64, 64, Green));
+    file.AddEntry("efgh", 0x7d, 512, 512, CreateSolidImage(512, 512, Red));
+
+    const std::vector<unsigned char> compressed = file.GetQfsData();
+    const size_t fileSize = file.GetData().size();
+
+    ThumbnailArena arena;
+    FshFilePrefix prefix;
+    FSH_CHECK(DecompressFshPrefix(compressed.data(), compressed.size(), 64, &arena, &prefix) == FshLoadOk);
+    FSH_CHECK(prefix.size == fileSize);
+    FSH_CHECK(prefix.length < 64 * 1024);
+    FSH_CHECK(arena.GetStats().peakBytes < fileSize / 4);
+
+    FshThumbnailLoader loader(&arena);
+    FSH_CHECK(loader.Open(prefix.data, prefix.length, prefix.size, 64) == FshLoadOk);
+}
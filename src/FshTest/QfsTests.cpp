@@ -0,0 +1,307 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "ChunkPipeline.h"
+#include "FshTest.h"
+#include "QfsCompressor.h"
+#include "QfsDecompressor.h"
+#include "QfsStreams.h"
+
+namespace
+{
+    // Random data that repeats its first 100 KB after a gap, so the compressed data has back
+    // references close to the 128 KB limit of the window.
+    std::vector<unsigned char> CreateRepeatingData()
+    {
+        std::vector<unsigned char> data(100 * 1024);
+        unsigned int state = 12345;
+
+        for (size_t i = 0; i < data.size(); i++)
+        {
+            state = state * 1664525u + 1013904223u;
+            data[i] = static_cast<unsigned char>((i % 1000) < 700 ? (state >> 24) : (i & 7));
+        }
+
+        std::vector<unsigned char> gap(20 * 1024, 0x55);
+        const std::vector<unsigned char> first(data);
+
+        data.insert(data.end(), gap.begin(), gap.end());
+        data.insert(data.end(), first.begin(), first.end());
+
+        return data;
+    }
+
+    // Appends a token that copies count bytes from offset bytes back with no literals.
+    void AppendMatch(size_t offset, size_t count, std::vector<unsigned char>& compressed)
+    {
+        const size_t o = offset - 1;
+
+        compressed.push_back(static_cast<unsigned char>(0xc0 | ((o >> 12) & 0x10) | (((count - 5) >> 6) & 0x0c)));
+        compressed.push_back(static_cast<unsigned char>(o >> 8));
+        compressed.push_back(static_cast<unsigned char>(o));
+        compressed.push_back(static_cast<unsigned char>(count - 5));
+    }
+
+    // Writes the data to a temporary file and returns its descriptor, positioned at the start.
+    int CreateTemporaryFile(const std::vector<unsigned char>& data)
+    {
+        char path[] = "/tmp/fshtestXXXXXX";
+        const int fd = mkstemp(path);
+
+        if (fd >= 0)
+        {
+            unlink(path);
+
+            if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()) || lseek(fd, 0, SEEK_SET) != 0)
+            {
+                close(fd);
+                return -1;
+            }
+        }
+
+        return fd;
+    }
+
+    // Reads the file in inputChunk pieces and decompresses it into outputChunk pieces with the
+    // 128 KB window, the output is appended to a vector as it would be passed to a consumer.
+    bool DecompressFromFile(int fd, size_t inputChunk, size_t outputChunk, std::vector<unsigned char>* output)
+    {
+        QfsDecompressor decompressor;
+        std::vector<unsigned char> input(inputChunk);
+        std::vector<unsigned char> buffer(outputChunk);
+        QfsStatus status = QfsStatusNeedInput;
+
+        while (status != QfsStatusDone)
+        {
+            const ssize_t bytesRead = read(fd, input.data(), input.size());
+
+            if (bytesRead <= 0)
+            {
+                return false;
+            }
+
+            size_t inputIndex = 0;
+
+            do
+            {
+                size_t inputUsed = 0;
+                size_t outputWritten = 0;
+
+                status = decompressor.Decompress(input.data() + inputIndex, static_cast<size_t>(bytesRead) - inputIndex, &inputUsed, buffer.data(), buffer.size(), &outputWritten);
+                inputIndex += inputUsed;
+                output->insert(output->end(), buffer.begin(), buffer.begin() + outputWritten);
+            }
+            while (status == QfsStatusOutputFull);
+
+            if (status == QfsStatusInvalidData || status == QfsStatusOutOfMemory)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+// The streaming decompressor reads a QFS file from a file descriptor in pieces of any size,
+// the result does not depend on how the input and output are split.
+FSH_TEST(QfsStreamFromFileDescriptor)
+{
+    const std::vector<unsigned char> data = CreateRepeatingData();
+    std::vector<unsigned char> compressed;
+    QfsCompress(data.data(), data.size(), compressed);
+
+    FSH_CHECK(compressed.size() < data.size() * 3 / 4);
+
+    const int fd = CreateTemporaryFile(compressed);
+    FSH_CHECK(fd >= 0);
+
+    if (fd < 0)
+    {
+        return;
+    }
+
+    const size_t chunkSizes[][2] = { { 64 * 1024, 64 * 1024 }, { 4093, 1000 }, { 1, 7 }, { 100000, 1 << 20 } };
+
+    for (const size_t* chunks : chunkSizes)
+    {
+        FSH_CHECK(lseek(fd, 0, SEEK_SET) == 0);
+
+        std::vector<unsigned char> output;
+        FSH_CHECK(DecompressFromFile(fd, chunks[0], chunks[1], &output));
+        FSH_CHECK(output == data);
+    }
+
+    close(fd);
+}
+
+// A file that ends before the end of the compressed data is reported instead of waiting for
+// more input.
+FSH_TEST(QfsStreamTruncatedFile)
+{
+    const std::vector<unsigned char> data = CreateRepeatingData();
+    std::vector<unsigned char> compressed;
+    QfsCompress(data.data(), data.size(), compressed);
+
+    compressed.resize(compressed.size() / 2);
+
+    const int fd = CreateTemporaryFile(compressed);
+    FSH_CHECK(fd >= 0);
+
+    if (fd >= 0)
+    {
+        std::vector<unsigned char> output;
+        FSH_CHECK(!DecompressFromFile(fd, 4096, 4096, &output));
+        FSH_CHECK(output.size() < data.size());
+
+        close(fd);
+    }
+}
+
+// The wide literal and match copies produce the same bytes as the byte at a time reference
+// decoder on the worst case streams, with and without the window.
+FSH_TEST(QfsStreamsMatchReference)
+{
+    for (int kind = 0; kind < QfsStreamKindCount; kind++)
+    {
+        std::vector<unsigned char> data;
+        CreateQfsStreamData(static_cast<QfsStreamKind>(kind), 300 * 1024 + 3, data);
+
+        std::vector<unsigned char> compressed;
+        QfsCompress(data.data(), data.size(), compressed);
+
+        std::vector<unsigned char> reference;
+        FSH_CHECK(QfsDecompressReference(compressed.data(), compressed.size(), reference));
+        FSH_CHECK(reference == data);
+
+        std::vector<unsigned char> output(data.size());
+        QfsDecompressor decompressor(true);
+        size_t inputUsed;
+        size_t outputWritten;
+
+        FSH_CHECK(decompressor.Decompress(compressed.data(), compressed.size(), &inputUsed, output.data(), output.size(), &outputWritten) == QfsStatusDone);
+        FSH_CHECK(outputWritten == data.size() && output == reference);
+
+        const int fd = CreateTemporaryFile(compressed);
+        FSH_CHECK(fd >= 0);
+
+        if (fd >= 0)
+        {
+            std::vector<unsigned char> windowed;
+            FSH_CHECK(DecompressFromFile(fd, 997, 1531, &windowed));
+            FSH_CHECK(windowed == reference);
+
+            close(fd);
+        }
+    }
+}
+
+// Every match offset from 1 to 32 with lengths around the widths of the copies, each stream
+// ends with the match so the copies reach the end of an exactly sized output buffer.
+FSH_TEST(QfsOverlappingMatchesMatchReference)
+{
+    const size_t lengths[] = { 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 64, 100, 1028 };
+
+    for (size_t offset = 1; offset <= 32; offset++)
+    {
+        for (size_t length : lengths)
+        {
+            const size_t size = 32 + length;
+            std::vector<unsigned char> compressed = { 0x10, 0xfb, 0, static_cast<unsigned char>(size >> 8), static_cast<unsigned char>(size) };
+
+            // 32 literals that the match copies from.
+            compressed.push_back(0xe7);
+            for (int i = 0; i < 32; i++)
+            {
+                compressed.push_back(static_cast<unsigned char>(i * 37 + 11));
+            }
+
+            AppendMatch(offset, length, compressed);
+            compressed.push_back(0xfc);
+
+            std::vector<unsigned char> reference;
+            FSH_CHECK(QfsDecompressReference(compressed.data(), compressed.size(), reference));
+
+            std::vector<unsigned char> output(size);
+            QfsDecompressor decompressor(true);
+            size_t inputUsed;
+            size_t outputWritten;
+
+            FSH_CHECK(decompressor.Decompress(compressed.data(), compressed.size(), &inputUsed, output.data(), output.size(), &outputWritten) == QfsStatusDone);
+            FSH_CHECK(output == reference);
+        }
+    }
+}
+
+// The chunk pipeline reads a file with the file descriptor backend and passes every byte to
+// the consumer in order, the end of the file is passed as an empty chunk.
+FSH_TEST(ChunkPipelineFromFileDescriptor)
+{
+    const std::vector<unsigned char> data = CreateRepeatingData();
+    std::vector<unsigned char> compressed;
+    QfsCompress(data.data(), data.size(), compressed);
+
+    const int fd = CreateTemporaryFile(compressed);
+    FSH_CHECK(fd >= 0);
+
+    if (fd < 0)
+    {
+        return;
+    }
+
+    QfsDecompressor decompressor;
+    std::vector<unsigned char> output;
+    std::vector<unsigned char> buffer(4096);
+    QfsStatus status = QfsStatusNeedInput;
+    bool ended = false;
+
+    auto consume = [&](const unsigned char* chunk, size_t size) -> bool
+    {
+        ended = size == 0;
+        size_t index = 0;
+
+        while (index < size && status != QfsStatusDone && status != QfsStatusInvalidData)
+        {
+            size_t inputUsed = 0;
+            size_t outputWritten = 0;
+
+            status = decompressor.Decompress(chunk + index, size - index, &inputUsed, buffer.data(), buffer.size(), &outputWritten);
+            index += inputUsed;
+            output.insert(output.end(), buffer.begin(), buffer.begin() + outputWritten);
+        }
+
+        return true;
+    };
+
+    FSH_CHECK(RunChunkPipeline(CreateFileDescriptorReadProc(fd), consume));
+    FSH_CHECK(ended && status == QfsStatusDone && output == data);
+
+    close(fd);
+
+    // A read from the closed descriptor fails the pipeline.
+    ended = false;
+    FSH_CHECK(!RunChunkPipeline(CreateFileDescriptorReadProc(fd), consume));
+    FSH_CHECK(!ended);
+}
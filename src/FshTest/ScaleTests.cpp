@@ -0,0 +1,200 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <algorithm>
+#include <vector>
+#include <math.h>
+#include "FshTest.h"
+#include "ImageScaler.h"
+#include "TestFiles.h"
+
+namespace
+{
+    struct ScaleSize
+    {
+        int srcWidth;
+        int srcHeight;
+        int dstWidth;
+        int dstHeight;
+    };
+
+    // Power of two reductions that use only the box filter, ones that combine it with the
+    // weighted filter, arbitrary ratios and enlargements.
+    const ScaleSize Sizes[] =
+    {
+        { 512, 512, 256, 256 },
+        { 1024, 512, 256, 128 },
+        { 256, 256, 96, 96 },
+        { 300, 200, 97, 65 },
+        { 17, 1000, 3, 171 },
+        { 640, 480, 256, 192 },
+        { 33, 31, 32, 30 },
+        { 5, 3, 8, 7 },
+    };
+
+    // Smooth gradients with noise and alpha from transparent to opaque, with random colors in
+    // the transparent pixels that must not bleed into the result.
+    std::vector<unsigned char> CreateScaleSource(int width, int height)
+    {
+        std::vector<unsigned char> pixels(static_cast<size_t>(width) * height * 4);
+        unsigned int state = static_cast<unsigned int>(width * 31 + height);
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                unsigned char* p = &pixels[(static_cast<size_t>(y) * width + x) * 4];
+                state = state * 1664525u + 1013904223u;
+
+                const unsigned int alpha = (x * 7 + y * 3) % 320;
+                p[3] = static_cast<unsigned char>(alpha < 64 ? 0 : std::min(alpha - 64, 255u));
+
+                if (p[3] == 0)
+                {
+                    p[0] = static_cast<unsigned char>(state >> 8);
+                    p[1] = static_cast<unsigned char>(state >> 16);
+                    p[2] = static_cast<unsigned char>(state >> 24);
+                }
+                else
+                {
+                    p[0] = static_cast<unsigned char>(x * 255 / width);
+                    p[1] = static_cast<unsigned char>(y * 255 / height);
+                    p[2] = static_cast<unsigned char>(((x ^ y) + (state >> 29)) & 0xff);
+                }
+            }
+        }
+
+        return pixels;
+    }
+
+    // The part of the source pixel i that the destination pixel covers, in source pixels.
+    double GetCoverage(int i, int dst, int srcSize, int dstSize)
+    {
+        const double start = static_cast<double>(dst) * srcSize / dstSize;
+        const double end = static_cast<double>(dst + 1) * srcSize / dstSize;
+
+        if (end - start < 1.0)
+        {
+            // An enlarged pixel takes the source pixel under its center.
+            const double center = (start + end) / 2;
+            return i == static_cast<int>(center) ? 1.0 : 0.0;
+        }
+
+        return std::max(0.0, std::min(end, i + 1.0) - std::max(start, static_cast<double>(i)));
+    }
+
+    // Returns the premultiplied area average of every destination pixel as B, G, R and A in
+    // the range 0 to 255.
+    std::vector<double> ScaleReference(const std::vector<unsigned char>& src, const ScaleSize& size)
+    {
+        std::vector<double> dst(static_cast<size_t>(size.dstWidth) * size.dstHeight * 4);
+
+        for (int dy = 0; dy < size.dstHeight; dy++)
+        {
+            for (int dx = 0; dx < size.dstWidth; dx++)
+            {
+                double sums[4] = {};
+                double area = 0;
+
+                for (int sy = 0; sy < size.srcHeight; sy++)
+                {
+                    const double wy = GetCoverage(sy, dy, size.srcHeight, size.dstHeight);
+
+                    for (int sx = 0; sx < size.srcWidth && wy > 0; sx++)
+                    {
+                        const double w = wy * GetCoverage(sx, dx, size.srcWidth, size.dstWidth);
+
+                        if (w > 0)
+                        {
+                            const unsigned char* p = &src[(static_cast<size_t>(sy) * size.srcWidth + sx) * 4];
+                            const double alpha = p[3] / 255.0;
+
+                            sums[0] += w * p[0] * alpha;
+                            sums[1] += w * p[1] * alpha;
+                            sums[2] += w * p[2] * alpha;
+                            sums[3] += w * p[3];
+                            area += w;
+                        }
+                    }
+                }
+
+                for (int c = 0; c < 4; c++)
+                {
+                    dst[(static_cast<size_t>(dy) * size.dstWidth + dx) * 4 + c] = sums[c] / area;
+                }
+            }
+        }
+
+        return dst;
+    }
+}
+
+// The fixed point scaler stays close to the double precision premultiplied area average at
+// every instruction set. The colors are compared premultiplied, the color of an almost
+// transparent pixel has few significant bits.
+FSH_TEST(ScaleMatchesReference)
+{
+    for (const ScaleSize& size : Sizes)
+    {
+        const std::vector<unsigned char> src = CreateScaleSource(size.srcWidth, size.srcHeight);
+        const std::vector<double> reference = ScaleReference(src, size);
+        std::vector<unsigned char> scalar;
+
+        for (CpuFeatureLevel level : GetSupportedCpuFeatureLevels())
+        {
+            SetCpuFeatureLevel(level);
+
+            std::vector<unsigned char> dst(static_cast<size_t>(size.dstWidth) * size.dstHeight * 4);
+            FSH_CHECK(ScaleImageBGRA(src.data(), static_cast<size_t>(size.srcWidth) * 4, size.srcWidth, size.srcHeight, dst.data(), static_cast<size_t>(size.dstWidth) * 4, size.dstWidth, size.dstHeight));
+
+            double maxError = 0;
+            double totalError = 0;
+
+            for (size_t i = 0; i < dst.size(); i += 4)
+            {
+                const double alpha = dst[i + 3] / 255.0;
+
+                for (int c = 0; c < 4; c++)
+                {
+                    const double value = c == 3 ? dst[i + 3] : dst[i + c] * alpha;
+                    const double error = fabs(value - reference[i + c]);
+
+                    maxError = std::max(maxError, error);
+                    totalError += error;
+                }
+            }
+
+            // Each value is within one step of the reference and the rounding is not biased.
+            FSH_CHECK(maxError < 1.0);
+            FSH_CHECK(totalError / dst.size() < 0.25);
+
+            if (level == CpuFeatureLevelScalar)
+            {
+                scalar = dst;
+            }
+            else
+            {
+                FSH_CHECK(dst == scalar);
+            }
+        }
+    }
+
+    SetCpuFeatureLevel(CpuFeatureLevelAVX2);
+}
@@ -0,0 +1,163 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include "TestFiles.h"
+#include <algorithm>
+#include <string.h>
+#include "FshHeaders.h"
+#include "FshPrefixReader.h"
+#include "QfsCompressor.h"
+#include "QfsDecompressor.h"
+
+namespace
+{
+    void Append(std::vector<unsigned char>& file, const void* data, size_t size)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+        file.insert(file.end(), bytes, bytes + size);
+    }
+}
+
+void TestFshFile::AddEntry(const char* name, int code, int width, int height, const std::vector<unsigned char>& data, unsigned short misc3)
+{
+    Entry entry;
+    memcpy(entry.name, name, sizeof(entry.name));
+    entry.code = code;
+    entry.width = width;
+    entry.height = height;
+    entry.misc3 = misc3;
+    entry.data = data;
+
+    entries.push_back(entry);
+}
+
+std::vector<unsigned char> TestFshFile::GetData() const
+{
+    const size_t directoryEnd = sizeof(FshHeader) + (entries.size() * sizeof(FshDirEntry));
+    std::vector<unsigned char> file(directoryEnd);
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const Entry& entry = entries[i];
+
+        FshDirEntry dir;
+        memcpy(dir.name, entry.name, sizeof(dir.name));
+        dir.offset = static_cast<int>(file.size());
+        memcpy(&file[sizeof(FshHeader) + (i * sizeof(FshDirEntry))], &dir, sizeof(dir));
+
+        FshEntryHeader header;
+        memset(&header, 0, sizeof(header));
+        header.code = entry.code;
+        header.width = static_cast<unsigned short>(entry.width);
+        header.height = static_cast<unsigned short>(entry.height);
+        header.misc[3] = entry.misc3;
+
+        Append(file, &header, sizeof(header));
+        Append(file, entry.data.data(), entry.data.size());
+    }
+
+    FshHeader header;
+    memcpy(header.SHPI, "SHPI", 4);
+    header.size = static_cast<int>(file.size());
+    header.numBmps = static_cast<int>(entries.size());
+    memcpy(header.dirID, "G264", 4);
+    memcpy(&file[0], &header, sizeof(header));
+
+    return file;
+}
+
+std::vector<unsigned char> TestFshFile::GetQfsData() const
+{
+    const std::vector<unsigned char> data = GetData();
+    std::vector<unsigned char> output;
+
+    QfsCompress(data.data(), data.size(), output);
+
+    return output;
+}
+
+std::vector<unsigned char> CreateSolidImage(int width, int height, unsigned int bgra)
+{
+    std::vector<unsigned char> data(static_cast<size_t>(width) * height * 4);
+
+    for (size_t i = 0; i < data.size(); i += 4)
+    {
+        data[i] = static_cast<unsigned char>(bgra);
+        data[i + 1] = static_cast<unsigned char>(bgra >> 8);
+        data[i + 2] = static_cast<unsigned char>(bgra >> 16);
+        data[i + 3] = static_cast<unsigned char>(bgra >> 24);
+    }
+
+    return data;
+}
+
+bool DecompressQfsPrefix(const std::vector<unsigned char>& file, int maxEdgeLength, const std::vector<unsigned char>& stale, std::vector<unsigned char>* output, size_t* length)
+{
+    // The block of the stale data is reused for the decompressed file.
+    ArenaBlockCache blockCache(1024 * 1024);
+    ThumbnailArena arena(&blockCache);
+
+    unsigned char* block = arena.AllocateArray<unsigned char>(stale.size());
+
+    if (block == nullptr)
+    {
+        return false;
+    }
+
+    std::copy(stale.begin(), stale.end(), block);
+    arena.Reset();
+
+    FshFilePrefix prefix;
+
+    if (DecompressFshPrefix(file.data(), file.size(), maxEdgeLength, &arena, &prefix) != FshLoadOk)
+    {
+        return false;
+    }
+
+    output->assign(prefix.data, prefix.data + prefix.size);
+    *length = prefix.length;
+
+    return true;
+}
+
+std::vector<CpuFeatureLevel> GetSupportedCpuFeatureLevels()
+{
+    SetCpuFeatureLevel(CpuFeatureLevelAVX2);
+
+    std::vector<CpuFeatureLevel> levels(1, CpuFeatureLevelScalar);
+
+    if (CpuHasSSE2())
+    {
+        levels.push_back(CpuFeatureLevelSSE2);
+    }
+
+    if (CpuHasSSSE3())
+    {
+        levels.push_back(CpuFeatureLevelSSSE3);
+    }
+
+    if (CpuHasAVX2())
+    {
+        levels.push_back(CpuFeatureLevelAVX2);
+    }
+
+    return levels;
+}
@@ -0,0 +1,63 @@
+/*
+* This file is part of FshThumbnailHandler, a Windows thumbnail handler for FSH images.
+*
+* Copyright (c) 2009, 2010, 2012, 2013, 2023 Nicholas Hayes
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include "CpuFeatures.h"
+
+// Creates FSH files in memory for the tests. The entries are stored in the order that they are
+// added, the directory ID is G264.
+class TestFshFile
+{
+public:
+    // Adds an entry with the data after its header, misc3 is the mipmap count in the high 4 bits.
+    void AddEntry(const char* name, int code, int width, int height, const std::vector<unsigned char>& data, unsigned short misc3 = 0);
+
+    std::vector<unsigned char> GetData() const;
+    // Returns the whole file compressed with QFS, as the games store some of them.
+    std::vector<unsigned char> GetQfsData() const;
+
+private:
+    struct Entry
+    {
+        char name[4];
+        int code;
+        int width;
+        int height;
+        unsigned short misc3;
+        std::vector<unsigned char> data;
+    };
+
+    std::vector<Entry> entries;
+};
+
+// Returns the 32-bit A8R8G8B8 data of an image where every pixel is the BGRA color.
+std::vector<unsigned char> CreateSolidImage(int width, int height, unsigned int bgra);
+
+// Decompresses the part of a QFS compressed FSH file that GetFshPrefixLength asks for with
+// DecompressFshPrefix, into an arena block that held the stale data as the handlers reuse them.
+// The output is the size of the decompressed file, the stale data is left after the first
+// length bytes.
+bool DecompressQfsPrefix(const std::vector<unsigned char>& file, int maxEdgeLength, const std::vector<unsigned char>& stale, std::vector<unsigned char>* output, size_t* length);
+
+// Returns the feature levels that the processor supports, starting with CpuFeatureLevelScalar.
+std::vector<CpuFeatureLevel> GetSupportedCpuFeatureLevels();
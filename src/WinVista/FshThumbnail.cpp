@@ -27,14 +27,24 @@
 
 #include <shlwapi.h>
 #include <thumbcache.h> // For IThumbnailProvider.
-#include <wincodec.h>   // Windows Imaging Codecs
 #include <new>
+#include <stdint.h>
 #include "Tracing.h"
 #include "FshHeaders.h"
-#include "DXT.h"
+#include "QfsDecompressor.h"
+#include "FshPrefixReader.h"
+#include "FshThumbnailLoader.h"
+#include "ThumbnailCache.h"
+#include "ThumbnailDiskCache.h"
+#include "ContentHash.h"
+#include "ThumbnailArena.h"
+#include "ThumbnailBitmap.h"
 
 #pragma comment(lib, "shlwapi.lib")
-#pragma comment(lib, "windowscodecs.lib")
+
+// The shell extracts several thumbnails at once, a large DXT image only uses a few of the
+// processors so the other extractions are not held up.
+static const int MaxDecodeThreads = 4;
 
 // this thumbnail provider implements IInitializeWithStream to enable being hosted
 // in an isolated process for robustness
@@ -43,7 +53,7 @@ class CFshThumbProvider : public IInitializeWithStream,
 							 public IThumbnailProvider
 {
 public:
-	CFshThumbProvider() : _cRef(1), _pStream(nullptr), image(nullptr), fshBytes(nullptr)
+	CFshThumbProvider() : _cRef(1), _pStream(nullptr), fshBytes(nullptr), fshLength(0), fshFileSize(0)
 	{
 	}
 
@@ -53,17 +63,6 @@ public:
 		{
 			_pStream->Release();
 		}
-
-		if (image)
-		{
-			image->Release();
-		}
-
-		if (fshBytes)
-		{
-			LocalFree(fshBytes);
-			fshBytes = nullptr;
-		}
 	}
 
 	// IUnknown
@@ -100,16 +99,18 @@ public:
 	IFACEMETHODIMP GetThumbnail(UINT cx, HBITMAP *phbmp, WTS_ALPHATYPE *pdwAlpha);
 
 private:
-	HRESULT ReadStreamComplete(LPVOID lpBuffer, DWORD nNumberOfBytesToRead);
-	HRESULT CheckQFS();
-	HRESULT QFSDecompress(BYTE* inData, BYTE** outData, DWORD length);
-	HRESULT LoadFSH(IWICImagingFactory* factory);
-	HRESULT CreatePalette(int offset, IWICImagingFactory *factory, IWICPalette** palette);
+	HRESULT ReadStreamComplete(LPVOID lpBuffer, size_t nNumberOfBytesToRead);
+	HRESULT CheckQFS(int maxEdgeLength);
+	HRESULT QFSDecompressStream(int maxEdgeLength);
+	HRESULT GetStreamCacheKey(bool hashContent, ThumbnailCacheKey* key);
+	HRESULT LoadFSH(UINT cx, HBITMAP* phbmp);
 
 	long _cRef;
 	IStream *_pStream;     // provided during initialization.
 	BYTE* fshBytes;
-	IWICBitmap* image;
+	size_t fshLength;      // the bytes at fshBytes that were read
+	size_t fshFileSize;    // the size of the FSH file after it is decompressed
+	ThumbnailArena arena;  // the buffers used by one GetThumbnail call
 };
 
 HRESULT CFshThumbProvider_CreateInstance(REFIID riid, void **ppv)
@@ -143,15 +144,21 @@ IFACEMETHODIMP CFshThumbProvider::Initialize(IStream *pStream, DWORD mode)
 // are read, or there was an error, or the end of file was reached. EOF is
 // considered an error condition; when you ask for N bytes with this function
 // you either get all N bytes, or an error.
-HRESULT CFshThumbProvider::ReadStreamComplete(LPVOID lpBuffer, DWORD nNumberOfBytesToRead)
+HRESULT CFshThumbProvider::ReadStreamComplete(LPVOID lpBuffer, size_t nNumberOfBytesToRead)
 {
 	HRESULT hr = S_OK;
 
 	while (SUCCEEDED(hr) && nNumberOfBytesToRead > 0)
 	{
-		DWORD dwBytesRead = 0;
+		ULONG dwBytesRead = 0;
+		const ULONG dwBytesToRead = static_cast<ULONG>(min(nNumberOfBytesToRead, static_cast<size_t>(MAXDWORD)));
+
+		hr = _pStream->Read(lpBuffer, dwBytesToRead, &dwBytesRead);
 
-		hr = _pStream->Read(lpBuffer, nNumberOfBytesToRead, &dwBytesRead);
+		if (SUCCEEDED(hr) && dwBytesRead == 0)
+		{
+			hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+		}
 
 		lpBuffer = reinterpret_cast<BYTE*>(lpBuffer) + dwBytesRead;
 		nNumberOfBytesToRead -= dwBytesRead;
@@ -161,38 +168,6 @@ HRESULT CFshThumbProvider::ReadStreamComplete(LPVOID lpBuffer, DWORD nNumberOfBy
 }
 
 
-static SIZE ComputeThumbnailSize(int originalWidth, int originalHeight, int maxEdgeLength)
-{
-	SIZE thumbSize;
-	ZeroMemory(&thumbSize, sizeof(thumbSize));
-
-	if (originalWidth <= 0 || originalHeight <= 0)
-	{
-		thumbSize.cx = 1;
-		thumbSize.cy = 1;
-	}
-	else if (originalWidth > originalHeight)
-	{
-		int longSide = min(originalWidth, maxEdgeLength);
-		thumbSize.cx = longSide;
-		thumbSize.cy = max(1, (originalHeight * longSide) / originalWidth);
-	}
-	else if (originalHeight > originalWidth)
-	{
-		int longSide = min(originalHeight, maxEdgeLength);
-		thumbSize.cx = max(1, (originalWidth * longSide) / originalHeight);
-		thumbSize.cy = longSide;
-	}
-	else
-	{
-		int longSide = min(originalWidth, maxEdgeLength);
-		thumbSize.cx = longSide;
-		thumbSize.cy = longSide;
-	}
-
-	return thumbSize;
-}
-
 static HRESULT GetStreamLength(IStream * stream, ULARGE_INTEGER * length)
 {
 	STATSTG stat;
@@ -207,15 +182,20 @@ static HRESULT GetStreamLength(IStream * stream, ULARGE_INTEGER * length)
 	return hr;
 }
 
-HRESULT CFshThumbProvider::CheckQFS()
+HRESULT CFshThumbProvider::CheckQFS(int maxEdgeLength)
 {
 	TraceEnter();
 	ULARGE_INTEGER sLength;
 	HRESULT hr = GetStreamLength(_pStream, &sLength);
 
+	if (SUCCEEDED(hr) && sLength.QuadPart > SIZE_MAX)
+	{
+		hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE); // the file does not fit in the address space
+	}
+
 	if (SUCCEEDED(hr))
 	{
-		DWORD length = sLength.LowPart;
+		const size_t length = static_cast<size_t>(sLength.QuadPart);
 
 		LARGE_INTEGER ofs = {0};
 		_pStream->Seek(ofs, STREAM_SEEK_SET, nullptr);
@@ -228,36 +208,41 @@ HRESULT CFshThumbProvider::CheckQFS()
 		{
 			_pStream->Seek(ofs, STREAM_SEEK_SET, nullptr);
 
-			if ((bytes[0] & 0xfe) != 0x10 || bytes[1] != 0xfb)
+			if (!IsQfsCompressed(bytes))
 			{
-				if ((bytes[4] & 0xfe) != 0x10 || bytes[5] != 0xfb)
+				// Only the parts of the file that LoadFSH uses are read.
+				auto read = [&](size_t offset, unsigned char* buffer, size_t size) -> bool
 				{
-					fshBytes = reinterpret_cast<BYTE*>(LocalAlloc(LPTR, length));
-					if (!fshBytes)
-						return E_OUTOFMEMORY;
+					LARGE_INTEGER position;
+					position.QuadPart = static_cast<LONGLONG>(offset);
 
-					hr = ReadStreamComplete(fshBytes, length);
+					hr = _pStream->Seek(position, STREAM_SEEK_SET, nullptr);
+					if (SUCCEEDED(hr))
+					{
+						hr = ReadStreamComplete(buffer, size);
+					}
 
-					return hr;
-				}
-			}
-			// begin QFS decompression
+					return SUCCEEDED(hr);
+				};
 
-			BYTE* qfsBytes = reinterpret_cast<BYTE*>(LocalAlloc(LPTR, length));
-			if (!qfsBytes)
-				return E_OUTOFMEMORY;
+				FshFilePrefix prefix;
+				const FshLoadStatus status = ReadFshPrefix(read, length, maxEdgeLength, &arena, &prefix);
 
-			hr = ReadStreamComplete(qfsBytes, length);
+				if (status == FshLoadReadFailed)
+				{
+					return hr;
+				}
+				else if (status == FshLoadOk)
+				{
+					fshBytes = const_cast<BYTE*>(prefix.data);
+					fshLength = prefix.length;
+					fshFileSize = prefix.size;
+				}
 
-			if (SUCCEEDED(hr))
-			{
-				hr = QFSDecompress(qfsBytes, &fshBytes, length);
+				return FshLoadStatusToHResult(status);
 			}
 
-			if (qfsBytes)
-			{
-				LocalFree(qfsBytes);
-			}
+			hr = QFSDecompressStream(maxEdgeLength);
 		}
 
 	}
@@ -266,543 +251,208 @@ HRESULT CFshThumbProvider::CheckQFS()
 	return hr;
 }
 
-HRESULT CFshThumbProvider::QFSDecompress(BYTE* inData, BYTE** outData, DWORD length)
+// Decompresses the file in pieces as it is read, the next chunks of the file are read while
+// the current one is decompressed.
+// The decompression stops once the part of the file that LoadFSH uses is available.
+HRESULT CFshThumbProvider::QFSDecompressStream(int maxEdgeLength)
 {
-	UINT32 startOffset = 0;
+	HRESULT readHr = S_OK;
 
-	if ((inData[0] & 0xfe) != 0x10 && inData[1] != 0xfb)
+	auto read = [&](unsigned char* buffer, size_t size, size_t* bytesRead) -> bool
 	{
-		if ((inData[4] & 0xfe) == 0x10 && inData[5] == 0xfb)
-		{
-			startOffset = 4;
-		}
-		else
-		{
-			return E_FAIL;
-		}
-	}
+		ULONG cbRead = 0;
 
-	UINT32 outLength = (inData[startOffset + 2] << 16) | (inData[startOffset + 3] << 8) | inData[startOffset + 4];
+		readHr = _pStream->Read(buffer, static_cast<ULONG>(size), &cbRead);
 
-	*outData = reinterpret_cast<BYTE*>(LocalAlloc(LPTR, outLength));
-	if (!*outData)
-		return E_OUTOFMEMORY;
+		*bytesRead = cbRead;
+		return SUCCEEDED(readHr);
+	};
+
+	FshFilePrefix prefix;
+	const FshLoadStatus status = DecompressFshPrefix(read, maxEdgeLength, &arena, &prefix);
 
-	UINT32 index = startOffset + 5;
-	if ((inData[startOffset] & 1) > 0)
+	if (status == FshLoadReadFailed)
 	{
-		index = 8;
+		return readHr;
+	}
+	else if (status == FshLoadOk)
+	{
+		fshBytes = const_cast<BYTE*>(prefix.data);
+		fshLength = prefix.length;
+		fshFileSize = prefix.size;
 	}
 
-	BYTE ccbyte0 = 0; // control char 0
-	BYTE ccbyte1 = 0; // control char 1
-	BYTE ccbyte2 = 0; // control char 2
-	BYTE ccbyte3 = 0; // control char 3
-
-	UINT32 plainCount = 0;
-	UINT32 copyCount = 0;
-	UINT32 copyOffset = 0;
+	return FshLoadStatusToHResult(status);
+}
 
-	UINT32 srcIndex = 0;
-	UINT32 outIndex = 0;
+// Gets the key of the stream for the thumbnail caches and moves back to the start of it.
+// The whole stream is only hashed when hashContent is true, for the disk cache, otherwise the
+// key is made from the first bytes of the stream, its size and its modification time.
+HRESULT CFshThumbProvider::GetStreamCacheKey(bool hashContent, ThumbnailCacheKey* key)
+{
+	LARGE_INTEGER position;
+	position.QuadPart = 0;
 
-	BYTE* compData = inData + index;
+	HRESULT hr = S_OK;
 
-	while (index < length && outIndex < outLength) // code adapted from http://simswiki.info/wiki.php?title=DBPF_Compression
+	if (!hashContent)
 	{
-		ccbyte0 = compData[index++];
-
-		if (ccbyte0 >= 0xFC)
-		{
-			plainCount = (ccbyte0 & 3);
+		STATSTG stat;
+		memset(&stat, 0, sizeof(STATSTG));
 
-			if ((index + plainCount) > length)
-			{
-				plainCount = length - index;
-			}
+		BYTE header[ThumbnailFileKeyHeaderSize];
+		size_t headerSize = 0;
 
-			copyCount = 0;
-			copyOffset = 0;
-		}
-		else if (ccbyte0 >= 0xE0)
-		{
-			plainCount = (ccbyte0 - 0xDF) << 2;
+		hr = _pStream->Stat(&stat, STATFLAG_NONAME);
 
-			copyCount = 0;
-			copyOffset = 0;
-		}
-		else if (ccbyte0 >= 0xC0)
+		if (SUCCEEDED(hr))
 		{
-			ccbyte1 = compData[index++];
-			ccbyte2 = compData[index++];
-			ccbyte3 = compData[index++];
+			headerSize = static_cast<size_t>(min(stat.cbSize.QuadPart, static_cast<ULONGLONG>(sizeof(header))));
 
-			plainCount = (ccbyte0 & 3);
-
-			copyCount = (((ccbyte0 >> 2) & 0x03) << 8) + ccbyte3 + 5;
-			copyOffset = (((ccbyte0 & 16) << 12) + (ccbyte1 << 8)) + ccbyte2 + 1;
+			hr = _pStream->Seek(position, STREAM_SEEK_SET, nullptr);
 		}
-		else if (ccbyte0 >= 0x80)
-		{
-			ccbyte1 = compData[index++];
-			ccbyte2 = compData[index++];
-
-			plainCount = (ccbyte1 >> 6) & 0x03;
 
-			copyCount = (ccbyte0 & 0x3F) + 4;
-			copyOffset = ((ccbyte1 & 0x3F) << 8) + ccbyte2 + 1;
-		}
-		else
+		if (SUCCEEDED(hr))
 		{
-			ccbyte1 = compData[index++];
-
-			plainCount = (ccbyte0 & 3);
-
-			copyCount = ((ccbyte0 & 0x1c) >> 2) + 3;
-			copyOffset = ((ccbyte0 >> 5) << 8) + ccbyte1 + 1;
+			hr = ReadStreamComplete(header, headerSize);
 		}
 
-		for (UINT32 i = 0; i < plainCount; i++)
+		if (SUCCEEDED(hr))
 		{
-			compData[index] = *outData[outIndex];
-			index++;
-			outIndex++;
+			hr = _pStream->Seek(position, STREAM_SEEK_SET, nullptr);
 		}
 
-		srcIndex = outIndex - copyOffset;
-
-		for (UINT32 i = 0; i < copyCount; i++)
+		if (SUCCEEDED(hr))
 		{
-			*outData[srcIndex] = *outData[outIndex];
-			srcIndex++;
-			outIndex++;
-		}
-	}
+			const ULONGLONG modifiedTime = (static_cast<ULONGLONG>(stat.mtime.dwHighDateTime) << 32) | stat.mtime.dwLowDateTime;
 
-	return S_OK;
-}
+			*key = GetThumbnailFileKey(header, headerSize, stat.cbSize.QuadPart, modifiedTime);
+		}
 
-HRESULT CFshThumbProvider::CreatePalette(int offset, IWICImagingFactory *factory, IWICPalette** palette)
-{
-	FshEntryHeader * palHdr = reinterpret_cast<FshEntryHeader*>(fshBytes + offset);
+		return hr;
+	}
 
-	int code = palHdr->code & 255;
-	WICColor* colors = reinterpret_cast<WICColor*>(LocalAlloc(LPTR, (palHdr->width * sizeof(WICColor))));
+	const ULONG bufferSize = 64 * 1024;
+	BYTE* buffer = arena.AllocateArray<BYTE>(bufferSize);
 
-	if (colors == nullptr)
+	if (buffer == nullptr)
+	{
 		return E_OUTOFMEMORY;
+	}
 
-	BYTE* p = fshBytes + (offset + 16);
-	USHORT* sPtr = reinterpret_cast<USHORT*>(p);
-	UINT32* iPtr = reinterpret_cast<UINT32*>(p);
+	ContentHasher hasher;
 
-	const UINT32 OpaqueAlphaMask = 0xFF000000;
+	hr = _pStream->Seek(position, STREAM_SEEK_SET, nullptr);
 
-	switch (code) // WIC palettes appear to be BGRA order
+	while (SUCCEEDED(hr))
 	{
-	case 0x22: // 24-bit DOS palette RGB (8:8:8)
-		for (int i = 0; i < palHdr->width; i++)
-		{
-			colors[i] = (((p[0] << 16) + (p[1] << 8) + p[2]) << 2) | OpaqueAlphaMask;
-			p += 3;
-		}
-		break;
-	case 0x24: // 24-bit palette RGB (8:8:8)
-		for (int i = 0; i < palHdr->width; i++)
-		{
-			colors[i] = ((p[0] << 16) + (p[1] << 8) + p[2]) | OpaqueAlphaMask;
-			p += 3;
-		}
-		break;
-	case 0x29: // 16-bit NFS5 palette RGAB (5:5:1:5)
-		for (int i = 0; i < palHdr->width; i++)
-		{
-			colors[i] = (((*sPtr & 0x1f) + (((*sPtr >> 5) & 0x3f) << 7) + (((*sPtr >> 11) & 0x1f) << 16)) << 3);
+		ULONG cbRead = 0;
 
-			if ((*sPtr & 0x20) > 0)
-			{
-				colors[i] |= OpaqueAlphaMask;
-			}
+		hr = _pStream->Read(buffer, bufferSize, &cbRead);
 
-			sPtr++;
-		}
-		break;
-	case 0x2a: // 32-bit palette ARGB (8:8:8:8)
-		for (int i = 0; i < palHdr->width; i++)
+		if (cbRead == 0)
 		{
-			colors[i] = *iPtr;
-			iPtr++;
+			break;
 		}
-		break;
-	case 0x2d: // 16-bit palette ARGB (1:5:5:5)
-		for (int i = 0; i < palHdr->width; i++)
-		{
-			colors[i] = (((*sPtr & 0x1f) + (((*sPtr >> 5) & 0x3f) << 8) + (((*sPtr >> 10) & 0x1f) << 16)) << 3);
 
-			if ((*sPtr & 0x8000) > 0)
-			{
-				colors[i] |= OpaqueAlphaMask;
-			}
-
-			sPtr++;
-		}
-		break;
+		hasher.Add(buffer, cbRead);
 	}
 
-	HRESULT hr = factory->CreatePalette(palette);
 	if (SUCCEEDED(hr))
 	{
-		IWICPalette *tmp = *palette;
-		hr = tmp->InitializeCustom(colors, static_cast<UINT32>(palHdr->width));
+		hr = _pStream->Seek(position, STREAM_SEEK_SET, nullptr);
 	}
 
-	if (colors)
+	if (SUCCEEDED(hr))
 	{
-		LocalFree(colors);
+		key->contentHash = hasher.GetHash();
+		key->fileSize = hasher.GetSize();
 	}
 
 	return hr;
 }
 
-static bool CheckFshSig (char identifier[])
+HRESULT CFshThumbProvider::LoadFSH(UINT cx, HBITMAP* phbmp)
 {
-	return identifier[0] == 'S' &&
-		   identifier[1] == 'H' &&
-		   identifier[2] == 'P' &&
-		   identifier[3] == 'I';
+	*phbmp = nullptr;
 
-}
+	TraceEnter();
 
-static UINT GetImageDataSize(int width, int height, int code)
-{
-	UINT size = 0U;
-	switch (code)
-	{
-		case 0x7d:
-		case 0x60:
-		case 0x61:
-		case 0x6d:
-		case 0x7e:
-			size = (width * height) * 4;
-			break;
-		case 0x7f:
-		case 0x78:
-			size = (width * height) * 3;
-			break;
-		case 0x7b:
-			size = (width * height);
-			break;
-	}
+	const int maxEdgeLength = static_cast<int>(cx);
 
-	return size;
-}
+	// The caches are found by a key of the raw file bytes, so the file is not decompressed or parsed
+	// when it has a thumbnail. The disk cache is shared by every copy of a file so its key is a hash
+	// of the whole file, which is only read for it when the disk cache is enabled.
+	ThumbnailCache& cache = GetProcessThumbnailCache();
+	ThumbnailDiskCache* diskCache = GetProcessThumbnailDiskCache();
+	ThumbnailCacheKey fileKey;
+	const bool hasFileKey = SUCCEEDED(GetStreamCacheKey(diskCache != nullptr, &fileKey));
 
-static HRESULT LockBitmap(IWICBitmap* image, IWICBitmapLock** lock, BYTE** scan0, UINT32* stride)
-{
-	UINT width, height;
-	HRESULT hr = image->GetSize(&width, &height);
-
-	if (SUCCEEDED(hr))
+	if (hasFileKey)
 	{
-		WICRect rect = {0 , 0, static_cast<INT>(width), static_cast<INT>(height) };
-		hr = image->Lock(&rect, WICBitmapLockWrite, lock);
-		if (SUCCEEDED(hr))
+		if (LoadThumbnailFromMemoryCache(cache, fileKey, maxEdgeLength, phbmp) == S_OK)
 		{
-			UINT32 bufferSize;
-			IWICBitmapLock* tmp = *lock;
+			TraceOut("Loaded from the memory cache");
+			TraceLeaveHr(S_OK);
+			return S_OK;
+		}
 
-			hr = tmp->GetStride(stride);
-			if (SUCCEEDED(hr))
-			{
-				hr = tmp->GetDataPointer(&bufferSize, reinterpret_cast<WICInProcPointer*>(*scan0));
-			}
+		if (diskCache != nullptr && LoadThumbnailFromDiskCache(diskCache, fileKey, maxEdgeLength, phbmp) == S_OK)
+		{
+			TraceOut("Loaded from the disk cache");
+			TraceLeaveHr(S_OK);
+			return S_OK;
 		}
 	}
 
-	return hr;
-}
-
-HRESULT CFshThumbProvider::LoadFSH(IWICImagingFactory * factory)
-{
-	image = nullptr;
-
-	TraceEnter();
-
-	HRESULT hr = CheckQFS();
+	HRESULT hr = CheckQFS(maxEdgeLength);
 	if (SUCCEEDED(hr))
 	{
-		FshHeader* head = reinterpret_cast<FshHeader*>(fshBytes);
-
-		if (!CheckFshSig(head->SHPI))
-		{
-			return E_FAIL;
-		}
-
-		FshDirEntry* dirs = reinterpret_cast<FshDirEntry*>(fshBytes + 16);
-
-		int size = head->size;
-		int nBmps = head->numBmps;
-
-		int palIndex = -1;
-		int palOffset = -1;
-		bool hasGlobalPal = false;
-
-		for (int i = 0; i < nBmps; i++)
-		{
-			if (!hasGlobalPal)
-			{
-				FshEntryHeader* hdr = reinterpret_cast<FshEntryHeader*>(fshBytes + dirs[i].offset);
-
-				hasGlobalPal = strncmp(dirs[i].name, "!pal", 4) == 0;
-				int code = hdr->code & 255;
-				if (hasGlobalPal && (code == 0x22 || code == 0x24 || code== 0x29 || code == 0x2a || code == 0x2d))
-				{
-					palIndex = i;
-					palOffset = dirs[i].offset;
-				}
-			}
-		}
-
-		int nextOffset = size;
+		FshThumbnailLoader loader(&arena);
 
-		for (int j = 0; j < nBmps; j++)
-		{
-			if (dirs[j].offset < nextOffset && dirs[j].offset > nextOffset)
-			{
-				nextOffset = dirs[j].offset;
-			}
-		}
+		hr = FshLoadStatusToHResult(loader.Open(fshBytes, fshLength, fshFileSize, maxEdgeLength));
 
-		for (int i = 0; i < nBmps; i++)
+		if (SUCCEEDED(hr))
 		{
-			FshEntryHeader* entry = reinterpret_cast<FshEntryHeader*>(fshBytes + dirs[i].offset); // only extract the first image
-
-			const bool compressed = (entry->code & 0x80) != 0;
-
-			const int code = entry->code & 0x7f;
-			const int width = entry->width;
-			const int height = entry->height;
-
-			const bool isImage = code == 0x7b || code == 0x7d || code == 0x7e || code == 0x7f || code == 0x78 || code == 0x6d || code == 0x60 || code == 0x61;
-
-			if (!isImage)
-			{
-				continue;
-			}
-
-			FshEntryHeader* aux = entry;
-			int auxOffset = dirs[i].offset;
-			while ((aux->code >> 8) > 0)
-			{
-				auxOffset += (aux->code >> 8);
-
-				if (auxOffset >= size)
-				{
-					break;
-				}
-
-				aux = reinterpret_cast<FshEntryHeader*>(fshBytes + auxOffset);
-
-				if (code == 0x7b)
-				{
-					int paletteCode = aux->code & 255;
-					if (paletteCode == 0x22 || paletteCode == 0x24 || paletteCode == 0x29 || paletteCode == 0x2a || paletteCode == 0x2d)
-					{
-						palOffset = auxOffset; // use the local palette if found
-					}
-				}
-			}
-
-			DWORD bmpStart = dirs[i].offset + 16;
-			BYTE* bmpStartPtr = fshBytes + bmpStart;
-			BYTE* bmpDataPtr = nullptr;
-			if (compressed)
-			{
-				DWORD compSize = 0;
-
-				DWORD sectionLength = entry->code >> 8;
-				if (sectionLength > 0)
-				{
-					compSize = sectionLength;
-				}
-				else
-				{
-					compSize = nextOffset - bmpStart;
-				}
-
-				if ((bmpStartPtr[0] & 0xfe) != 0x10 && bmpStartPtr[1] == 0xfb)
-				{
-					return E_FAIL; // EaGraph and FshEd allow 16-bit and 32-bit data to be compressed with DXTn compression abort in that case.
-				}
-
-				hr = QFSDecompress(bmpStartPtr, &bmpDataPtr, compSize);
-
-				if (FAILED(hr))
-				{
-					return hr;
-				}
-			}
-			else
-			{
-				bmpDataPtr = bmpStartPtr;
-			}
-
-			BYTE* scan0 = nullptr;
-			UINT imageSize = GetImageDataSize(width, height, code);
-
-			if (code == 0x60 || code == 0x61)
-			{
-				scan0 = reinterpret_cast<BYTE*>(LocalAlloc(LPTR, imageSize));
-				if (!scan0)
-					return E_OUTOFMEMORY;
+			HBITMAP hbmp = nullptr;
+			BYTE* pBits = nullptr;
 
-				DecompressImage(scan0, width, height, bmpDataPtr, code == 0x60);
-				hr = factory->CreateBitmapFromMemory(width, height, GUID_WICPixelFormat32bppRGBA, width * 4, imageSize, scan0, &image);
+			hr = CreateThumbnailBitmap(loader.GetWidth(), loader.GetHeight(), &hbmp, &pBits);
 
-				LocalFree(scan0);
-			}
-			else if (code == 0x7b)
+			if (SUCCEEDED(hr))
 			{
-				hr = factory->CreateBitmapFromMemory(width, height, GUID_WICPixelFormat8bppIndexed, width, imageSize, bmpDataPtr, &image);
-				if (SUCCEEDED(hr))
-				{
-					IWICPalette* palette = nullptr;
-					hr = CreatePalette(palOffset, factory, &palette);
+				const int width = loader.GetWidth();
+				const int height = loader.GetHeight();
+				const size_t stride = static_cast<size_t>(width) * 4;
 
-					if (SUCCEEDED(hr))
-					{
-						image->SetPalette(palette);
-						palette->Release();
-					}
-				}
-			}
-			else if (code == 0x7d) // 32-bit A8R8G8B8
-			{
-				hr = factory->CreateBitmapFromMemory(width, height, GUID_WICPixelFormat32bppBGRA, width * 4, imageSize, bmpDataPtr, &image);
-			}
-			else if (code == 0x7f) // 24-bit A0R8G8B8
-			{
-				hr = factory->CreateBitmapFromMemory(width, height, GUID_WICPixelFormat24bppBGR, width * 3, imageSize, bmpDataPtr, &image);
-			}
-			else if (code == 0x7e) // 16-bit A1R5G5B5
-			{
-				hr = factory->CreateBitmap(width, height, GUID_WICPixelFormat32bppBGRA, WICBitmapCacheOnDemand, &image);
+				// The image is decoded and scaled straight into the DIB in one pass.
+				hr = FshLoadStatusToHResult(loader.Decode(pBits, stride, MaxDecodeThreads));
 
 				if (SUCCEEDED(hr))
 				{
-					IWICBitmapLock* lock = nullptr;
-					UINT32 stride;
-					hr = LockBitmap(image, &lock, &scan0, &stride);
-
-					if (SUCCEEDED(hr))
+					if (hasFileKey)
 					{
-						USHORT* sPtr = reinterpret_cast<USHORT*>(bmpDataPtr);
-						for (int y = 0; y < height; y++)
+						// The thumbnail is still returned when it could not be added to the caches.
+						CachedThumbnail* image = CreateCachedThumbnail(pBits, stride, width, height, maxEdgeLength);
+						if (image != nullptr)
 						{
-							USHORT* src = sPtr + (y * width);
-							BYTE* dst = scan0 + (y * stride);
-
-							for (int x = 0; x < width; x++)
-							{
-								dst[0] = static_cast<BYTE>((src[0] & 0x1f) << 3);
-								dst[1] = static_cast<BYTE>(((src[0] >> 5) & 0x1f) << 3);
-								dst[2] = static_cast<BYTE>(((src[0] >> 10) & 0x1f) << 3);
-								if ((src[0] & 0x8000) > 0)
-								{
-									dst[3] = 255;
-								}
-								else
-								{
-									dst[3] = 0;
-								}
-
-								src++;
-								dst += 4;
-							}
+							cache.Insert(fileKey, image);
 						}
 
-						lock->Release();
-					}
-				}
-			}
-			else if (code == 0x78)// 16-bit A0R5G5B5
-			{
-				hr = factory->CreateBitmap(width, height, GUID_WICPixelFormat24bppBGR, WICBitmapCacheOnDemand, &image);
-
-				if (SUCCEEDED(hr))
-				{
-					IWICBitmapLock* lock = nullptr;
-					UINT32 stride;
-					hr = LockBitmap(image, &lock, &scan0, &stride);
-
-					if (SUCCEEDED(hr))
-					{
-						USHORT* sPtr = reinterpret_cast<USHORT*>(bmpDataPtr);
-						for (int y = 0; y < height; y++)
+						if (diskCache != nullptr)
 						{
-							USHORT* src = sPtr + (y * width);
-							BYTE* dst = scan0 + (y * stride);
-
-							for (int x = 0; x < width; x++)
-							{
-								dst[0] = static_cast<BYTE>((src[0] & 0x1f) << 3);
-								dst[1] = static_cast<BYTE>(((src[0] >> 5) & 0x3f) << 2);
-								dst[2] = static_cast<BYTE>(((src[0] >> 11) & 0x1f) << 3);
-
-								src++;
-								dst += 3;
-							}
+							diskCache->Insert(fileKey, maxEdgeLength, pBits, stride, width, height);
 						}
-
-						lock->Release();
 					}
-				}
 
-			}
-			else if (code == 0x6d) // 16-bit (4:4:4:4)
-			{
-				hr = factory->CreateBitmap(width, height, GUID_WICPixelFormat32bppBGRA, WICBitmapCacheOnDemand, &image);
-
-				if (SUCCEEDED(hr))
+					*phbmp = hbmp;
+				}
+				else
 				{
-					IWICBitmapLock* lock = nullptr;
-					UINT32 stride;
-					hr = LockBitmap(image, &lock, &scan0, &stride);
-
-					if (SUCCEEDED(hr))
-					{
-						int srcStride = width * 2;
-
-						for (int y = 0; y < height; y++)
-						{
-							BYTE* src = bmpDataPtr + (y * srcStride);
-							BYTE* dst = scan0 + (y * stride);
-
-							for (int x = 0; x < width; x++)
-							{
-								dst[0] = static_cast<BYTE>((src[0] & 15) * 0x11);
-								dst[1] = static_cast<BYTE>((src[0] >> 4) * 0x11);
-								dst[2] = static_cast<BYTE>((src[1] & 15) * 0x11);
-								dst[3] = static_cast<BYTE>((src[1] >> 4) * 0x11);
-
-								src += 2;
-								dst += 4;
-							}
-						}
-
-						lock->Release();
-					}
+					DeleteObject(hbmp);
 				}
 			}
-
-			if (compressed)
-			{
-				LocalFree(bmpDataPtr);
-			}
-
-			break; // we only want the first image in the file
 		}
-
 	}
 
 	TraceLeaveHr(hr);
@@ -810,144 +460,41 @@ HRESULT CFshThumbProvider::LoadFSH(IWICImagingFactory * factory)
 	return hr;
 }
 
-HRESULT ConvertBitmapSourceTo32BPPHBITMAP(IWICBitmapSource *pBitmapSource,
-										  IWICImagingFactory *pImagingFactory,
-										  HBITMAP *phbmp,
-									      UINT cx)
+// IThumbnailProvider
+IFACEMETHODIMP CFshThumbProvider::GetThumbnail(UINT cx, HBITMAP *phbmp, WTS_ALPHATYPE *pdwAlpha)
 {
 	TraceEnter();
-	*phbmp = nullptr;
 
-	IWICBitmapSource *pBitmapSourceConverted = nullptr;
-	WICPixelFormatGUID guidPixelFormatSource;
-	HRESULT hr = pBitmapSource->GetPixelFormat(&guidPixelFormatSource);
-	if (SUCCEEDED(hr) && (guidPixelFormatSource != GUID_WICPixelFormat32bppBGRA))
+	HRESULT hr = S_OK;
+
+	// The decoder uses the standard library containers and threads, an exception must not
+	// unwind into the shell.
+	try
 	{
-		IWICFormatConverter *pFormatConverter;
-		hr = pImagingFactory->CreateFormatConverter(&pFormatConverter);
-		if (SUCCEEDED(hr))
-		{
-			// Create the appropriate pixel format converter
-			hr = pFormatConverter->Initialize(pBitmapSource, GUID_WICPixelFormat32bppBGRA, WICBitmapDitherTypeNone, nullptr, 0, WICBitmapPaletteTypeCustom);
-			if (SUCCEEDED(hr))
-			{
-				hr = pFormatConverter->QueryInterface(&pBitmapSourceConverted);
-			}
-			pFormatConverter->Release();
-		}
+		hr = LoadFSH(cx, phbmp);
 	}
-	else
+	catch (const std::bad_alloc&)
 	{
-		hr = pBitmapSource->QueryInterface(&pBitmapSourceConverted);  // No conversion necessary
+		hr = E_OUTOFMEMORY;
 	}
-
-	IWICBitmapSource *pBitmapSourceScaled = nullptr;
-
-	if (SUCCEEDED(hr))
+	catch (...)
 	{
-
-		UINT width, height;
-		hr = pBitmapSourceConverted->GetSize(&width, &height);
-
-		if (SUCCEEDED(hr))
-		{
-			SIZE size = ComputeThumbnailSize(width, height, cx);
-			UINT newWidth = static_cast<UINT>(size.cx);
-			UINT newHeight = static_cast<UINT>(size.cy);
-
-			if (newWidth < width || newHeight < height)
-			{
-				IWICBitmapScaler *scaler = nullptr;
-				hr = pImagingFactory->CreateBitmapScaler(&scaler);
-
-				if (SUCCEEDED(hr))
-				{
-					hr = scaler->Initialize(pBitmapSourceConverted, newWidth, newHeight, WICBitmapInterpolationModeFant);
-					if (SUCCEEDED(hr))
-					{
-						scaler->QueryInterface(&pBitmapSourceScaled);
-					}
-					scaler->Release();
-				}
-			}
-			else
-			{
-				hr = pBitmapSourceConverted->QueryInterface(&pBitmapSourceScaled);
-			}
-		}
-
-		pBitmapSourceConverted->Release();
+		hr = E_FAIL;
 	}
+
 	if (SUCCEEDED(hr))
 	{
-
-		UINT nWidth, nHeight;
-		hr = pBitmapSourceScaled->GetSize(&nWidth, &nHeight);
-
-		if (SUCCEEDED(hr))
-		{
-			BITMAPINFO bmi = {};
-			bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
-			bmi.bmiHeader.biWidth = nWidth;
-			bmi.bmiHeader.biHeight = -static_cast<LONG>(nHeight);
-			bmi.bmiHeader.biPlanes = 1;
-			bmi.bmiHeader.biBitCount = 32;
-			bmi.bmiHeader.biCompression = BI_RGB;
-
-			BYTE* pBits = nullptr;
-			HBITMAP hbmp = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, reinterpret_cast<void**>(&pBits), nullptr, 0);
-			hr = hbmp ? S_OK : E_OUTOFMEMORY;
-			if (SUCCEEDED(hr))
-			{
-				WICRect rect = {0, 0, static_cast<INT>(nWidth), static_cast<INT>(nHeight)};
-
-				// Convert the pixels and store them in the HBITMAP.  Note: the name of the function is a little
-				// misleading - we're not doing any extraneous copying here.  CopyPixels is actually converting the
-				// image into the given buffer.
-				hr = pBitmapSourceScaled->CopyPixels(&rect, nWidth * 4, nWidth * nHeight * 4, pBits);
-				if (SUCCEEDED(hr))
-				{
-					*phbmp = hbmp;
-				}
-				else
-				{
-					DeleteObject(hbmp);
-				}
-			}
-		}
-
-		pBitmapSourceScaled->Release();
+		*pdwAlpha = WTSAT_ARGB;
 	}
-	TraceLeaveHr(hr);
 
-	return hr;
-}
-
-
-// IThumbnailProvider
-IFACEMETHODIMP CFshThumbProvider::GetThumbnail(UINT cx, HBITMAP *phbmp, WTS_ALPHATYPE *pdwAlpha)
-{
-	IWICImagingFactory *pImagingFactory;
-	HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&pImagingFactory));
-	TraceEnter();
-
-	if (SUCCEEDED(hr))
-	{
-		hr = LoadFSH(pImagingFactory);
+	const ThumbnailArenaStats& arenaStats = arena.GetStats();
+	TraceOut("Arena: %Iu allocations, %Iu heap blocks, %Iu peak bytes", arenaStats.allocationCount, arenaStats.heapAllocationCount, arenaStats.peakBytes);
 
-		if (SUCCEEDED(hr))
-		{
-			hr = ConvertBitmapSourceTo32BPPHBITMAP(image, pImagingFactory, phbmp, cx);
-			if (SUCCEEDED(hr))
-			{
-				*pdwAlpha = WTSAT_ARGB;
-			}
-			image->Release();
-			image = nullptr;
-		}
+	const ThumbnailCacheStats cacheStats = GetProcessThumbnailCache().GetStats();
+	TraceOut("Cache: %I64u hits, %I64u misses, %I64u evictions, %Iu bytes", cacheStats.hits, cacheStats.misses, cacheStats.evictions, cacheStats.bytesInUse);
 
-		pImagingFactory->Release();
-	}
+	fshBytes = nullptr;
+	arena.Reset();
 
 	TraceLeaveHr(hr);
 
@@ -19,4 +19,3 @@
 */
 
 #include <thumbcache.h>     // For IThumbnailProvider
-#include <wincodec.h>       // Windows Imaging Codecs
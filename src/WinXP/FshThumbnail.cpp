@@ -31,19 +31,32 @@
 #include "FshThumbnail.h"
 #include <shlwapi.h>
 #pragma comment(lib, "shlwapi.lib")
-#pragma comment(lib, "windowscodecs.lib")
 
 #include <atlenc.h>
 #include "FshGuid.h"
 #include "FshShell.h"
 #include "FshHeaders.h"
-#include "DXT.h"
+#include "QfsDecompressor.h"
+#include "FshPrefixReader.h"
+#include "FshRangeReader.h"
+#include "FshThumbnailLoader.h"
+#include "ThumbnailCache.h"
+#include "ThumbnailDiskCache.h"
+#include "ThumbnailBitmap.h"
 #include <windows.h>
+#include <stdint.h>
+#include <new>
 
+// The shell extracts several thumbnails at once, a large DXT image only uses a few of the
+// processors so the other extractions are not held up.
+static const int MaxDecodeThreads = 4;
 
 CFshThumbnailHandler::CFshThumbnailHandler()
 	: m_lRefCount(1),
-	  m_bstrFileName(nullptr)
+	  m_bstrFileName(nullptr),
+	  fshBytes(nullptr),
+	  fshLength(0),
+	  fshFileSize(0)
 {
 	m_size.cx = -1;
 	m_size.cy = -1;
@@ -210,15 +223,16 @@ STDMETHODIMP CFshThumbnailHandler::SaveCompleted(LPCOLESTR pszFileName)
 // are read, or there was an error, or the end of file was reached. EOF is
 // considered an error condition; when you ask for N bytes with this function
 // you either get all N bytes, or an error.
-static HRESULT ReadFileComplete(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead)
+static HRESULT ReadFileComplete(HANDLE hFile, LPVOID lpBuffer, size_t nNumberOfBytesToRead)
 {
 	HRESULT hr = S_OK;
 
 	while (SUCCEEDED(hr) && nNumberOfBytesToRead > 0)
 	{
 		DWORD dwBytesRead = 0;
+		const DWORD dwBytesToRead = static_cast<DWORD>(min(nNumberOfBytesToRead, static_cast<size_t>(MAXDWORD)));
 
-		BOOL bResult = ReadFile(hFile, lpBuffer, nNumberOfBytesToRead, &dwBytesRead, nullptr);
+		BOOL bResult = ReadFile(hFile, lpBuffer, dwBytesToRead, &dwBytesRead, nullptr);
 
 		if (!bResult)
 		{
@@ -240,34 +254,7 @@ static HRESULT ReadFileComplete(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBy
 }
 
 
-static SIZE ComputeThumbnailSize(int originalWidth, int originalHeight, int maxEdgeLength)
-{
-	SIZE thumbSize;
-	ZeroMemory(&thumbSize, sizeof(thumbSize));
-
-	if (originalWidth > originalHeight)
-	{
-		int longSide = min(originalWidth, maxEdgeLength);
-		thumbSize.cx = longSide;
-		thumbSize.cy = max(1, (originalHeight * longSide) / originalWidth);
-	}
-	else if (originalHeight > originalWidth)
-	{
-		int longSide = min(originalHeight, maxEdgeLength);
-		thumbSize.cx = max(1, (originalWidth * longSide) / originalHeight);
-		thumbSize.cy = longSide;
-	}
-	else // if (docSize.Width == docSize.Height)
-	{
-		int longSide = min(originalWidth, maxEdgeLength);
-		thumbSize.cx = longSide;
-		thumbSize.cy = longSide;
-	}
-
-	return thumbSize;
-}
-
-HRESULT CFshThumbnailHandler::CheckQFS()
+HRESULT CFshThumbnailHandler::CheckQFS(int maxEdgeLength)
 {
 	TraceEnter();
 	LARGE_INTEGER sLength;
@@ -276,9 +263,14 @@ HRESULT CFshThumbnailHandler::CheckQFS()
 
 	GetFileSizeEx(hFile, &sLength);
 
+	if (static_cast<ULONGLONG>(sLength.QuadPart) > SIZE_MAX)
+	{
+		hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE); // the file does not fit in the address space
+	}
+
 	if (SUCCEEDED(hr))
 	{
-		DWORD length = sLength.LowPart;
+		const size_t length = static_cast<size_t>(sLength.QuadPart);
 
 		LARGE_INTEGER ofs = {0};
 		SetFilePointerEx(hFile, ofs, nullptr, FILE_BEGIN);
@@ -292,37 +284,63 @@ HRESULT CFshThumbnailHandler::CheckQFS()
 
 			SetFilePointerEx(hFile, ofs, nullptr, FILE_BEGIN);
 
-			if ((bytes[0] & 0xfe) != 0x10 || bytes[1] != 0xfb)
+			if (!IsQfsCompressed(bytes))
 			{
-				if ((bytes[4] & 0xfe) != 0x10 || bytes[5] != 0xfb)
+				// The file is parsed in place when it can be mapped, LoadFSH only reads fshBytes.
+				if (mappedFile.Open(hFile))
 				{
-					fshBytes = reinterpret_cast<BYTE*>(LocalAlloc(LPTR, length));
-					if (!fshBytes)
-						return E_OUTOFMEMORY;
+					fshBytes = const_cast<BYTE*>(mappedFile.GetData());
+					fshLength = length;
+					fshFileSize = length;
 
-					hr = ReadFileComplete(hFile, fshBytes, length);
+					FshRangeReader reader(fshBytes, length, maxEdgeLength);
+					size_t offset;
+					size_t count;
 
-					return hr;
+					while (reader.GetNextRange(&offset, &count))
+					{
+						mappedFile.WillNeed(offset, count);
+					}
+
+					return S_OK;
 				}
-			}
-			// begin QFS decompression
 
-			BYTE* qfsBytes = reinterpret_cast<BYTE*>(LocalAlloc(LPTR, length));
+				// Only the parts of the file that LoadFSH uses are read.
+				auto read = [&](size_t offset, unsigned char* buffer, size_t size) -> bool
+				{
+					LARGE_INTEGER position;
+					position.QuadPart = static_cast<LONGLONG>(offset);
+
+					if (!SetFilePointerEx(hFile, position, nullptr, FILE_BEGIN))
+					{
+						hr = HRESULT_FROM_WIN32(GetLastError());
+					}
+					else
+					{
+						hr = ReadFileComplete(hFile, buffer, size);
+					}
 
-			if (!qfsBytes)
-				return E_OUTOFMEMORY;
+					return SUCCEEDED(hr);
+				};
 
-			hr = ReadFileComplete(hFile, qfsBytes, length);
+				FshFilePrefix prefix;
+				const FshLoadStatus status = ReadFshPrefix(read, length, maxEdgeLength, &arena, &prefix);
 
-			if (SUCCEEDED(hr))
-			{
-				hr = QFSDecompress(qfsBytes, &fshBytes, length);
-			}
+				if (status == FshLoadReadFailed)
+				{
+					return hr;
+				}
+				else if (status == FshLoadOk)
+				{
+					fshBytes = const_cast<BYTE*>(prefix.data);
+					fshLength = prefix.length;
+					fshFileSize = prefix.size;
+				}
 
-			if (qfsBytes)
-			{
-				LocalFree(qfsBytes);
+				return FshLoadStatusToHResult(status);
 			}
+
+			hr = QFSDecompressStream(maxEdgeLength);
 		}
 	}
 
@@ -330,659 +348,167 @@ HRESULT CFshThumbnailHandler::CheckQFS()
 	return hr;
 }
 
-HRESULT CFshThumbnailHandler::QFSDecompress(BYTE* inData, BYTE** outData, DWORD length)
+// Decompresses the file in pieces as it is read.
+// The decompression stops once the part of the file that LoadFSH uses is available.
+HRESULT CFshThumbnailHandler::QFSDecompressStream(int maxEdgeLength)
 {
-	int startOffset = 0;
+	HRESULT readHr = S_OK;
 
-	if ((inData[0] & 0xfe) != 0x10 && inData[1] != 0xfb)
+	auto read = [&](unsigned char* buffer, size_t size, size_t* bytesRead) -> bool
 	{
-		if ((inData[4] & 0xfe) == 0x10 && inData[5] == 0xfb)
+		DWORD dwBytesRead = 0;
+
+		if (!ReadFile(hFile, buffer, static_cast<DWORD>(size), &dwBytesRead, nullptr))
 		{
-			startOffset = 4;
+			readHr = HRESULT_FROM_WIN32(GetLastError());
+			return false;
 		}
-		else
-		{
-			return E_FAIL;
-		}
-	}
 
-	UINT32 outLength = ((inData[startOffset + 2] << 16) | (inData[startOffset + 3] << 8) | inData[startOffset + 4]);
+		*bytesRead = dwBytesRead;
+		return true;
+	};
 
-	*outData = reinterpret_cast<BYTE*>(LocalAlloc(LPTR, outLength));
-	if (!*outData)
-		return E_OUTOFMEMORY;
+	FshFilePrefix prefix;
+	const FshLoadStatus status = DecompressFshPrefix(read, maxEdgeLength, &arena, &prefix);
 
-	UINT32 index = startOffset + 5;
-	if ((inData[startOffset] & 1) > 0)
+	if (status == FshLoadReadFailed)
 	{
-		index = 8;
+		return readHr;
 	}
-
-	BYTE ccbyte0 = 0; // control char 0
-	BYTE ccbyte1 = 0; // control char 1
-	BYTE ccbyte2 = 0; // control char 2
-	BYTE ccbyte3 = 0; // control char 3
-
-	UINT32 plainCount = 0;
-	UINT32 copyCount = 0;
-	UINT32 copyOffset = 0;
-
-	UINT32 srcIndex = 0;
-	UINT32 outIndex = 0;
-
-	BYTE* compData = inData + index;
-
-	while (index < length && outIndex < outLength) // code adapted from http://simswiki.info/wiki.php?title=DBPF_Compression
+	else if (status == FshLoadOk)
 	{
-		ccbyte0 = compData[index++];
-
-		if (ccbyte0 >= 0xFC)
-		{
-			plainCount = (ccbyte0 & 3);
-
-			if ((index + plainCount) > length)
-			{
-				plainCount = length - index;
-			}
-
-			copyCount = 0;
-			copyOffset = 0;
-		}
-		else if (ccbyte0 >= 0xE0)
-		{
-			plainCount = (ccbyte0 - 0xDF) << 2;
-
-			copyCount = 0;
-			copyOffset = 0;
-		}
-		else if (ccbyte0 >= 0xC0)
-		{
-			ccbyte1 = compData[index++];
-			ccbyte2 = compData[index++];
-			ccbyte3 = compData[index++];
-
-			plainCount = (ccbyte0 & 3);
-
-			copyCount = (((ccbyte0 >> 2) & 0x03) << 8) + ccbyte3 + 5;
-			copyOffset = (((ccbyte0 & 16) << 12) + (ccbyte1 << 8)) + ccbyte2 + 1;
-		}
-		else if (ccbyte0 >= 0x80)
-		{
-			ccbyte1 = compData[index++];
-			ccbyte2 = compData[index++];
-
-			plainCount = (ccbyte1 >> 6) & 0x03;
-
-			copyCount = (ccbyte0 & 0x3F) + 4;
-			copyOffset = ((ccbyte1 & 0x3F) << 8) + ccbyte2 + 1;
-		}
-		else
-		{
-			ccbyte1 = compData[index++];
-
-			plainCount = (ccbyte0 & 3);
-
-			copyCount = ((ccbyte0 & 0x1c) >> 2) + 3;
-			copyOffset = ((ccbyte0 >> 5) << 8) + ccbyte1 + 1;
-		}
-
-		for (UINT32 i = 0; i < plainCount; i++)
-		{
-			compData[index] = *outData[outIndex];
-			index++;
-			outIndex++;
-		}
-
-		srcIndex = outIndex - copyOffset;
-
-		for (UINT32 i = 0; i < copyCount; i++)
-		{
-			*outData[srcIndex] = *outData[outIndex];
-			srcIndex++;
-			outIndex++;
-		}
+		fshBytes = const_cast<BYTE*>(prefix.data);
+		fshLength = prefix.length;
+		fshFileSize = prefix.size;
 	}
 
-	return S_OK;
+	return FshLoadStatusToHResult(status);
 }
 
-HRESULT CFshThumbnailHandler::CreatePalette(int offset, IWICImagingFactory *factory, IWICPalette** palette)
+// Gets the key of the file for the thumbnail caches and moves back to the start of it.
+// The whole file is only hashed when hashContent is true, for the disk cache, otherwise the
+// key is made from the first bytes of the file, its size and its modification time.
+HRESULT CFshThumbnailHandler::GetFileCacheKey(bool hashContent, ThumbnailCacheKey* key)
 {
-	FshEntryHeader * palHdr = (FshEntryHeader*)(fshBytes + offset);
-
-	int code = palHdr->code & 255;
-	WICColor* colors = reinterpret_cast<WICColor*>(LocalAlloc(LPTR, (palHdr->width * sizeof(WICColor))));
-
-	if (colors == nullptr)
-		return E_OUTOFMEMORY;
-
-	BYTE* p = (fshBytes + (offset + 16));
-	USHORT* sPtr = reinterpret_cast<USHORT*>(p);
-	UINT32* iPtr = reinterpret_cast<UINT32*>(p);
-
-	const UINT32 OpaqueAlphaMask = 0xFF000000;
-
-	switch (code) // WIC palettes appear to be BGRA order
+	if (hashContent)
 	{
-		case 0x22: // 24-bit DOS palette RGB (8:8:8)
-			for (int i = 0; i < palHdr->width; i++)
-			{
-				colors[i] = (((p[0] << 16) + (p[1] << 8) + p[2]) << 2) | OpaqueAlphaMask;
-				p += 3;
-			}
-			break;
-		case 0x24: // 24-bit palette RGB (8:8:8)
-			for (int i = 0; i < palHdr->width; i++)
-			{
-				colors[i] = ((p[0] << 16) + (p[1] << 8) + p[2]) | OpaqueAlphaMask;
-				p += 3;
-			}
-			break;
-		case 0x29: // 16-bit NFS5 palette RGAB (5:5:1:5)
-			for (int i = 0; i < palHdr->width; i++)
-			{
-				colors[i] = (((*sPtr & 0x1f) + (((*sPtr >> 5) & 0x3f) << 7) + (((*sPtr >> 11) & 0x1f) << 16)) << 3);
-
-				if ((*sPtr & 0x20) > 0)
-				{
-					colors[i] |= OpaqueAlphaMask;
-				}
+		MappedFile file;
 
-				sPtr++;
-			}
-			break;
-		case 0x2a: // 32-bit palette ARGB (8:8:8:8)
-			for (int i = 0; i < palHdr->width; i++)
-			{
-				colors[i] = *iPtr;
-				iPtr++;
-			}
-			break;
-		case 0x2d: // 16-bit palette ARGB (1:5:5:5)
-			for (int i = 0; i < palHdr->width; i++)
-			{
-				colors[i] = (((*sPtr & 0x1f) + (((*sPtr >> 5) & 0x3f) << 8) + (((*sPtr >> 10) & 0x1f) << 16)) << 3);
+		if (!file.Open(hFile))
+		{
+			return E_FAIL;
+		}
 
-				if ((*sPtr & 0x8000) > 0)
-				{
-					colors[i] |= OpaqueAlphaMask;
-				}
+		*key = GetThumbnailCacheKey(file.GetData(), file.GetSize());
 
-				sPtr++;
-			}
-			break;
+		return S_OK;
 	}
 
-	HRESULT hr = factory->CreatePalette(palette);
-	if (SUCCEEDED(hr))
-	{
-		IWICPalette *tmp = *palette;
-		hr = tmp->InitializeCustom(colors, static_cast<UINT32>(palHdr->width));
-	}
+	LARGE_INTEGER sLength;
+	FILETIME lastWriteTime;
 
-	if (colors)
+	if (!GetFileSizeEx(hFile, &sLength) || !GetFileTime(hFile, nullptr, nullptr, &lastWriteTime))
 	{
-		LocalFree(colors);
+		return HRESULT_FROM_WIN32(GetLastError());
 	}
 
+	BYTE header[ThumbnailFileKeyHeaderSize];
+	const size_t headerSize = static_cast<size_t>(min(static_cast<ULONGLONG>(sLength.QuadPart), static_cast<ULONGLONG>(sizeof(header))));
 
-	return hr;
-}
-
-static bool CheckFshSig (char identifier[])
-{
-	return identifier[0] == 'S' &&
-		   identifier[1] == 'H' &&
-		   identifier[2] == 'P' &&
-		   identifier[3] == 'I';
-}
-
-static UINT GetImageDataSize(int width, int height, int code)
-{
-	UINT size = 0;
-	switch (code)
-	{
-		case 0x7d:
-		case 0x60:
-		case 0x61:
-		case 0x6d:
-		case 0x7e:
-			size = (width * height) * 4;
-			break;
-		case 0x7f:
-		case 0x78:
-			size = (width * height) * 3;
-			break;
-		case 0x7b:
-			size = (width * height);
-			break;
-	}
+	LARGE_INTEGER ofs = {0};
+	SetFilePointerEx(hFile, ofs, nullptr, FILE_BEGIN);
 
-	return size;
-}
+	HRESULT hr = ReadFileComplete(hFile, header, headerSize);
 
-static HRESULT LockBitmap(IWICBitmap* image, IWICBitmapLock** lock, BYTE** scan0, UINT32* stride)
-{
-	UINT width, height;
-	HRESULT hr = image->GetSize(&width, &height);
+	SetFilePointerEx(hFile, ofs, nullptr, FILE_BEGIN);
 
 	if (SUCCEEDED(hr))
 	{
-		WICRect rect = {0 , 0, width, height };
-		hr = image->Lock(&rect, WICBitmapLockWrite, lock);
-		if (SUCCEEDED(hr))
-		{
-			UINT32 bufferSize;
-			IWICBitmapLock* tmp = *lock;
+		const ULONGLONG modifiedTime = (static_cast<ULONGLONG>(lastWriteTime.dwHighDateTime) << 32) | lastWriteTime.dwLowDateTime;
 
-			hr = tmp->GetStride(stride);
-			if (SUCCEEDED(hr))
-			{
-				hr = tmp->GetDataPointer(&bufferSize, reinterpret_cast<WICInProcPointer*>(*scan0));
-			}
-		}
+		*key = GetThumbnailFileKey(header, headerSize, sLength.QuadPart, modifiedTime);
 	}
 
 	return hr;
 }
 
-HRESULT CFshThumbnailHandler::LoadFSH(IWICImagingFactory *factory, IWICBitmap **image)
+HRESULT CFshThumbnailHandler::LoadFSH(HBITMAP* phbmp)
 {
-	image = nullptr;
+	*phbmp = nullptr;
 
 	TraceEnter();
 
-	HRESULT hr = CheckQFS();
-	if (SUCCEEDED(hr))
+	int maxEdgeLength = 0;
+	if (m_size.cx > 0 && m_size.cy > 0)
 	{
-		FshHeader *head = reinterpret_cast<FshHeader*>(fshBytes);
-
-		if (!CheckFshSig(head->SHPI))
-		{
-			return E_FAIL;
-		}
-
-		FshDirEntry *dirs = reinterpret_cast<FshDirEntry*>(fshBytes + 16);
-
-		int size = head->size;
-		int nBmps = head->numBmps;
-
-		int palIndex = -1;
-		int palOffset = -1;
-		bool hasGlobalPal = false;
+		maxEdgeLength = min(m_size.cx, m_size.cy);
+	}
 
+	// The caches are found by a key of the raw file bytes, so the file is not decompressed or parsed
+	// when it has a thumbnail. The disk cache is shared by every copy of a file so its key is a hash
+	// of the whole file, which is only read for it when the disk cache is enabled.
+	ThumbnailCache& cache = GetProcessThumbnailCache();
+	ThumbnailDiskCache* diskCache = GetProcessThumbnailDiskCache();
+	ThumbnailCacheKey fileKey;
+	const bool hasFileKey = SUCCEEDED(GetFileCacheKey(diskCache != nullptr, &fileKey));
 
-		for (int i = 0; i < nBmps; i++)
+	if (hasFileKey)
+	{
+		if (LoadThumbnailFromMemoryCache(cache, fileKey, maxEdgeLength, phbmp) == S_OK)
 		{
-			if (!hasGlobalPal)
-			{
-				FshEntryHeader *hdr = reinterpret_cast<FshEntryHeader*>(fshBytes + dirs[i].offset);
-
-				hasGlobalPal = (strncmp(dirs[i].name, "!pal", 4) == 0);
-				int k = hdr->code & 255;
-				if (hasGlobalPal && (k == 0x22 || k == 0x24 || k== 0x29 || k == 0x2a || k == 0x2d))
-				{
-					palIndex = i;
-					palOffset = dirs[i].offset;
-				}
-			}
+			TraceOut("Loaded from the memory cache");
+			TraceLeaveHr(S_OK);
+			return S_OK;
 		}
 
-		int nextOffset = size;
-
-		for (int j = 0; j < nBmps; j++)
+		if (diskCache != nullptr && LoadThumbnailFromDiskCache(diskCache, fileKey, maxEdgeLength, phbmp) == S_OK)
 		{
-			if (dirs[j].offset < nextOffset && dirs[j].offset > nextOffset)
-			{
-				nextOffset = dirs[j].offset;
-			}
+			TraceOut("Loaded from the disk cache");
+			TraceLeaveHr(S_OK);
+			return S_OK;
 		}
+	}
 
-		for (int i = 0; i < nBmps; i++)
-		{
-			FshEntryHeader* entry = reinterpret_cast<FshEntryHeader*>(fshBytes + dirs[i].offset); // only extract the first image
-
-			bool compressed = (entry->code & 0x80) > 0;
-
-			const int code = (entry->code & 0x7f);
-			const int width = (int)entry->width;
-			const int height = (int)entry->height;
-
-			bool isImage = code == 0x7b || code == 0x7d || code == 0x7e || code == 0x7f || code == 0x78 || code == 0x6d || code == 0x60 || code == 0x61;
-
-			if (!isImage)
-			{
-				continue;
-			}
-
-			FshEntryHeader* aux = entry;
-			int auxOffset = dirs[i].offset;
-			while ((aux->code >> 8) > 0)
-			{
-				auxOffset += (aux->code >> 8);
-
-				if (auxOffset >= size)
-				{
-					break;
-				}
-
-				aux = reinterpret_cast<FshEntryHeader*>(fshBytes + auxOffset);
-
-				if (code == 0x7b)
-				{
-					int paletteCode = aux->code & 255;
-					if (paletteCode == 0x22 || paletteCode == 0x24 || paletteCode == 0x29 || paletteCode == 0x2a || paletteCode == 0x2d)
-					{
-						palOffset = auxOffset; // use the local palette if found
-					}
-				}
-			}
-
-			DWORD bmpStart = dirs[i].offset + 16;
-			BYTE* bmpStartPtr = (fshBytes + bmpStart);
-			BYTE* bmpDataPtr = nullptr;
-
-			if (compressed)
-			{
-				DWORD compSize = 0;
-
-				int sectionLength = entry->code >> 8;
-				if (sectionLength > 0)
-				{
-					compSize = sectionLength;
-				}
-				else
-				{
-					compSize = nextOffset - bmpStart;
-				}
-
-				if ((bmpStartPtr[0] & 0xfe) != 0x10 && bmpStartPtr[1] == 0xfb)
-				{
-					return E_FAIL; // EaGraph and FshEd allow 16-bit and 32-bit data to be compressed with DXTn compression abort in that case.
-				}
-
-				hr = QFSDecompress(bmpStartPtr, &bmpDataPtr, compSize);
-
-				if (FAILED(hr))
-				{
-					return hr;
-				}
-			}
-			else
-			{
-				bmpDataPtr = bmpStartPtr;
-			}
-
-			BYTE* scan0 = nullptr;
-			UINT imageSize = GetImageDataSize(width, height, code);
-
-			if (code == 0x60 || code == 0x61)
-			{
-				scan0 = (BYTE*)LocalAlloc(LPTR, (SIZE_T)imageSize);
-				if (!scan0)
-					return E_OUTOFMEMORY;
+	HRESULT hr = CheckQFS(maxEdgeLength);
+	if (SUCCEEDED(hr))
+	{
+		FshThumbnailLoader loader(&arena);
 
-				DecompressImage(scan0, width, height, bmpDataPtr, code == 0x60);
-				hr = factory->CreateBitmapFromMemory(width, height, GUID_WICPixelFormat32bppRGBA, width * 4, imageSize, scan0, image);
+		hr = FshLoadStatusToHResult(loader.Open(fshBytes, fshLength, fshFileSize, maxEdgeLength));
 
-				LocalFree(scan0);
-			}
-			else if (code == 0x7b)
-			{
-				hr = factory->CreateBitmapFromMemory(width, height, GUID_WICPixelFormat8bppIndexed, width, imageSize, bmpDataPtr, image);
-				if (SUCCEEDED(hr))
-				{
-					IWICPalette* palette = nullptr;
-					hr = CreatePalette(palOffset, factory, &palette);
+		if (SUCCEEDED(hr))
+		{
+			HBITMAP hbmp = nullptr;
+			BYTE* pBits = nullptr;
 
-					if (SUCCEEDED(hr))
-					{
-						(*image)->SetPalette(palette);
-						palette->Release();
-					}
+			hr = CreateThumbnailBitmap(loader.GetWidth(), loader.GetHeight(), &hbmp, &pBits);
 
-				}
-			}
-			else if (code == 0x7d) // 32-bit A8R8G8B8
-			{
-				hr = factory->CreateBitmapFromMemory(width, height, GUID_WICPixelFormat32bppBGRA, width * 4, imageSize, bmpDataPtr, image);
-			}
-			else if (code == 0x7f) // 24-bit A0R8G8B8
-			{
-				hr = factory->CreateBitmapFromMemory(width, height, GUID_WICPixelFormat24bppBGR, width * 3, imageSize, bmpDataPtr, image);
-			}
-			else if (code == 0x7e) // 16-bit A1R5G5B5
+			if (SUCCEEDED(hr))
 			{
-				hr = factory->CreateBitmap(width, height, GUID_WICPixelFormat32bppBGRA, WICBitmapCacheOnDemand, image);
-
-				if (SUCCEEDED(hr))
-				{
-					IWICBitmapLock* lock = nullptr;
-					UINT32 stride;
-					hr = LockBitmap(*image, &lock, &scan0, &stride);
+				const int width = loader.GetWidth();
+				const int height = loader.GetHeight();
+				const size_t stride = static_cast<size_t>(width) * 4;
 
-					if (SUCCEEDED(hr))
-					{
-						USHORT* sPtr = (USHORT*)bmpDataPtr;
-						for (int y = 0; y < height; y++)
-						{
-							USHORT* src = sPtr + (y * width);
-							BYTE* dst = scan0 + (y * stride);
-
-							for (int x = 0; x < width; x++)
-							{
-								dst[0] = (BYTE)((src[0] & 0x1f) << 3);
-								dst[1] = (BYTE)(((src[0] >> 5) & 0x1f) << 3);
-								dst[2] = (BYTE)(((src[0] >> 10) & 0x1f) << 3);
-								if ((src[0] & 0x8000) > 0)
-								{
-									dst[3] = 255;
-								}
-								else
-								{
-									dst[3] = 0;
-								}
-
-								src++;
-								dst += 4;
-							}
-						}
-
-						lock->Release();
-					}
-				}
-			}
-			else if (code == 0x78)// 16-bit A0R5G5B5
-			{
-				hr = factory->CreateBitmap(width, height, GUID_WICPixelFormat24bppBGR, WICBitmapCacheOnDemand, image);
+				// The image is decoded and scaled straight into the DIB in one pass.
+				hr = FshLoadStatusToHResult(loader.Decode(pBits, stride, MaxDecodeThreads));
 
 				if (SUCCEEDED(hr))
 				{
-					IWICBitmapLock* lock = nullptr;
-					UINT32 stride;
-					hr = LockBitmap(*image, &lock, &scan0, &stride);
-
-					if (SUCCEEDED(hr))
+					if (hasFileKey)
 					{
-						USHORT* sPtr = (USHORT*)bmpDataPtr;
-						for (int y = 0; y < height; y++)
+						// The thumbnail is still returned when it could not be added to the caches.
+						CachedThumbnail* image = CreateCachedThumbnail(pBits, stride, width, height, maxEdgeLength);
+						if (image != nullptr)
 						{
-							USHORT* src = sPtr + (y * width);
-							BYTE* dst = scan0 + (y * stride);
-
-							for (int x = 0; x < width; x++)
-							{
-								dst[0] = (BYTE)((src[0] & 0x1f) << 3);
-								dst[1] = (BYTE)(((src[0] >> 5) & 0x3f) << 2);
-								dst[2] = (BYTE)(((src[0] >> 11) & 0x1f) << 3);
-
-								src++;
-								dst += 3;
-							}
+							cache.Insert(fileKey, image);
 						}
 
-						lock->Release();
-					}
-				}
-
-			}
-			else if (code == 0x6d) // 16-bit (4:4:4:4)
-			{
-				hr = factory->CreateBitmap(width, height, GUID_WICPixelFormat32bppBGRA, WICBitmapCacheOnDemand, image);
-
-				if (SUCCEEDED(hr))
-				{
-					IWICBitmapLock* lock = nullptr;
-					UINT32 stride;
-					hr = LockBitmap(*image, &lock, &scan0, &stride);
-
-					if (SUCCEEDED(hr))
-					{
-						int srcStride = width * 2;
-
-						for (int y = 0; y < height; y++)
+						if (diskCache != nullptr)
 						{
-							BYTE* src = bmpDataPtr + (y * srcStride);
-							BYTE* dst = scan0 + (y * stride);
-
-							for (int x = 0; x < width; x++)
-							{
-
-								dst[0] = (BYTE)((src[0] & 15) * 0x11);
-								dst[1] = (BYTE)((src[0] >> 4) * 0x11);
-								dst[2] = (BYTE)((src[1] & 15) * 0x11);
-								dst[3] = (BYTE)((src[1] >> 4) * 0x11);
-
-								src += 2;
-								dst += 4;
-							}
+							diskCache->Insert(fileKey, maxEdgeLength, pBits, stride, width, height);
 						}
-
-						lock->Release();
 					}
-				}
-			}
-
-			if (compressed)
-			{
-				LocalFree(bmpDataPtr);
-			}
-
-			break; // we only want the first image in the file
-		}
-	}
-
-	TraceLeaveHr(hr);
 
-	return hr;
-}
-
-HRESULT ConvertBitmapSourceTo32BPPHBITMAP(IWICBitmapSource *pBitmapSource,
-										  IWICImagingFactory *pImagingFactory,
-										  HBITMAP *phbmp,
-										  SIZE requestedSize)
-{
-	TraceEnter();
-	*phbmp = nullptr;
-
-	IWICBitmapSource *pBitmapSourceConverted = nullptr;
-	WICPixelFormatGUID guidPixelFormatSource;
-	HRESULT hr = pBitmapSource->GetPixelFormat(&guidPixelFormatSource);
-	if (SUCCEEDED(hr) && (guidPixelFormatSource != GUID_WICPixelFormat32bppBGRA))
-	{
-		IWICFormatConverter *pFormatConverter;
-		hr = pImagingFactory->CreateFormatConverter(&pFormatConverter);
-		if (SUCCEEDED(hr))
-		{
-			// Create the appropriate pixel format converter
-			hr = pFormatConverter->Initialize(pBitmapSource, GUID_WICPixelFormat32bppBGRA, WICBitmapDitherTypeNone, nullptr, 0, WICBitmapPaletteTypeCustom);
-			if (SUCCEEDED(hr))
-			{
-				hr = pFormatConverter->QueryInterface(&pBitmapSourceConverted);
-			}
-			pFormatConverter->Release();
-		}
-	}
-	else
-	{
-		hr = pBitmapSource->QueryInterface(&pBitmapSourceConverted);  // No conversion necessary
-	}
-
-	IWICBitmapSource *pBitmapSourceScaled = nullptr;
-
-	if (SUCCEEDED(hr))
-	{
-
-		UINT width, height;
-		hr = pBitmapSourceConverted->GetSize(&width, &height);
-
-		if (SUCCEEDED(hr))
-		{
-			if (requestedSize.cx > 0 && requestedSize.cy > 0)
-			{
-				UINT cx = min(requestedSize.cx, requestedSize.cy);
-				SIZE size = ComputeThumbnailSize(width, height, cx);
-				UINT newWidth = (UINT)size.cx;
-				UINT newHeight = (UINT)size.cy;
-
-				if (newWidth < width || newHeight < height)
-				{
-					IWICBitmapScaler *scaler = nullptr;
-					hr = pImagingFactory->CreateBitmapScaler(&scaler);
-
-					if (SUCCEEDED(hr))
-					{
-						hr = scaler->Initialize(pBitmapSourceConverted, newWidth, newHeight, WICBitmapInterpolationModeFant);
-						if (SUCCEEDED(hr))
-						{
-							scaler->QueryInterface(&pBitmapSourceScaled);
-						}
-						scaler->Release();
-					}
-				}
-				else
-				{
-					hr = pBitmapSourceConverted->QueryInterface(&pBitmapSourceScaled);
-				}
-			}
-			else
-			{
-				hr = pBitmapSourceConverted->QueryInterface(&pBitmapSourceScaled);
-			}
-		}
-
-		pBitmapSourceConverted->Release();
-	}
-
-	if (SUCCEEDED(hr))
-	{
-
-		UINT nWidth, nHeight;
-		hr = pBitmapSourceScaled->GetSize(&nWidth, &nHeight);
-
-		if (SUCCEEDED(hr))
-		{
-			BITMAPINFO bmi = {};
-			bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
-			bmi.bmiHeader.biWidth = nWidth;
-			bmi.bmiHeader.biHeight = -static_cast<LONG>(nHeight);
-			bmi.bmiHeader.biPlanes = 1;
-			bmi.bmiHeader.biBitCount = 32;
-			bmi.bmiHeader.biCompression = BI_RGB;
-
-			BYTE *pBits;
-			HBITMAP hbmp = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, reinterpret_cast<void **>(&pBits), nullptr, 0);
-			hr = hbmp ? S_OK : E_OUTOFMEMORY;
-			if (SUCCEEDED(hr))
-			{
-				WICRect rect = {0, 0, nWidth, nHeight};
-
-				// Convert the pixels and store them in the HBITMAP.  Note: the name of the function is a little
-				// misleading - we're not doing any extraneous copying here.  CopyPixels is actually converting the
-				// image into the given buffer.
-				hr = pBitmapSourceScaled->CopyPixels(&rect, nWidth * 4, nWidth * nHeight * 4, pBits);
-				if (SUCCEEDED(hr))
-				{
 					*phbmp = hbmp;
 				}
 				else
@@ -991,15 +517,13 @@ HRESULT ConvertBitmapSourceTo32BPPHBITMAP(IWICBitmapSource *pBitmapSource,
 				}
 			}
 		}
-
-		pBitmapSourceScaled->Release();
 	}
+
 	TraceLeaveHr(hr);
 
 	return hr;
 }
 
-
 STDMETHODIMP CFshThumbnailHandler::Extract(HBITMAP *phBmpImage)
 {
 	HRESULT hr = S_OK;
@@ -1039,29 +563,22 @@ STDMETHODIMP CFshThumbnailHandler::Extract(HBITMAP *phBmpImage)
 	if (SUCCEEDED(hr))
 	{
 		TraceOut("File open");
-		IWICImagingFactory *pImagingFactory;
-		hr = CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&pImagingFactory));
 
-		if (SUCCEEDED(hr))
+		// The decoder uses the standard library containers and threads, an exception must not
+		// unwind into the shell.
+		try
 		{
-			IWICBitmap *image = nullptr;
-
-			hr = LoadFSH(pImagingFactory, &image);
-			TraceOut("Loading fsh, hr = 0x%x", hr);
-
-			if (SUCCEEDED(hr))
-			{
-				hr = ConvertBitmapSourceTo32BPPHBITMAP(image, pImagingFactory, phBmpImage, m_size);
-
-				TraceOut("Creating thumbnail, hr = 0x%x", hr);
-
-
-				image->Release();
-				image = nullptr;
-			}
-
-			pImagingFactory->Release();
+			hr = LoadFSH(phBmpImage);
 		}
+		catch (const std::bad_alloc&)
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		catch (...)
+		{
+			hr = E_FAIL;
+		}
+		TraceOut("Loading fsh, hr = 0x%x", hr);
 	}
 
 
@@ -1072,11 +589,16 @@ STDMETHODIMP CFshThumbnailHandler::Extract(HBITMAP *phBmpImage)
 		hFile = INVALID_HANDLE_VALUE;
 	}
 
-	if (nullptr != fshBytes)
-	{
-		LocalFree(fshBytes);
-		fshBytes = nullptr;
-	}
+	fshBytes = nullptr;
+	mappedFile.Close();
+
+	const ThumbnailArenaStats& arenaStats = arena.GetStats();
+	TraceOut("Arena: %Iu allocations, %Iu heap blocks, %Iu peak bytes", arenaStats.allocationCount, arenaStats.heapAllocationCount, arenaStats.peakBytes);
+
+	const ThumbnailCacheStats cacheStats = GetProcessThumbnailCache().GetStats();
+	TraceOut("Cache: %I64u hits, %I64u misses, %I64u evictions, %Iu bytes", cacheStats.hits, cacheStats.misses, cacheStats.evictions, cacheStats.bytesInUse);
+
+	arena.Reset();
 
 	TraceLeaveHr(hr);
 	return hr;
@@ -30,7 +30,9 @@
 #pragma once
 
 #include <Shlobj.h>
-#include <wincodec.h>
+#include "MappedFile.h"
+#include "ThumbnailArena.h"
+#include "ThumbnailCache.h"
 
 class CFshThumbnailHandler 
 	: IPersistFile,
@@ -76,12 +78,16 @@ protected:
 private:
 	BSTR m_bstrFileName;
 	SIZE m_size;
-	HRESULT CheckQFS();
-	HRESULT QFSDecompress(BYTE* inData, BYTE** outData, DWORD length);
-	HRESULT LoadFSH(IWICImagingFactory* factory, IWICBitmap **image);
-	HRESULT CreatePalette(int offset, IWICImagingFactory *factory, IWICPalette** palette);
-
-	BYTE* fshBytes;	
+	HRESULT CheckQFS(int maxEdgeLength);
+	HRESULT QFSDecompressStream(int maxEdgeLength);
+	HRESULT GetFileCacheKey(bool hashContent, ThumbnailCacheKey* key);
+	HRESULT LoadFSH(HBITMAP* phbmp);
+
+	BYTE* fshBytes;
+	size_t fshLength;      // the bytes at fshBytes that were read
+	size_t fshFileSize;    // the size of the FSH file after it is decompressed
 	HANDLE hFile;
+	MappedFile mappedFile;
+	ThumbnailArena arena;  // the buffers used by one Extract call
 
 };